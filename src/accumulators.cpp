@@ -269,12 +269,12 @@ bool CalculateAccumulatorCheckpoint(int nHeight, uint256& nCheckpoint, Accumulat
         }
 
         //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
+        CBlockConstRef pblock;
+        if(!ReadBlockFromDisk(pblock, pindex))
             return error("%s: failed to read block from disk", __func__);
 
         std::list<PublicCoin> listPubcoins;
-        if (!BlockToPubcoinList(block, listPubcoins, fFilterInvalid))
+        if (!BlockToPubcoinList(*pblock, listPubcoins, fFilterInvalid))
             return error("%s: failed to get zerocoin mintlist from block %d", __func__, pindex->nHeight);
 
         nTotalMintsFound += listPubcoins.size();
@@ -365,12 +365,12 @@ int AddBlockMintsToAccumulator(const libzerocoin::PublicCoin& coin, const int nH
     int nMintsAdded = 0;
     if (pindex->MintedDenomination(coin.getDenomination())) {
         //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
+        CBlockConstRef pblock;
+        if(!ReadBlockFromDisk(pblock, pindex))
             return error("%s: failed to read block from disk while adding pubcoins to witness", __func__);
 
         list<PublicCoin> listPubcoins;
-        if(!BlockToPubcoinList(block, listPubcoins, true))
+        if(!BlockToPubcoinList(*pblock, listPubcoins, true))
             return error("%s: failed to get zerocoin mintlist from block %n\n", __func__, pindex->nHeight);
 
         //add the mints to the witness
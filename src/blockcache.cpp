@@ -0,0 +1,95 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "clientversion.h"
+#include "serialize.h"
+
+CBlockCache blockcache;
+
+CBlockCache::CBlockCache(size_t nMaxBytesIn) : nBytes(0), nMaxBytes(nMaxBytesIn), nHits(0), nMisses(0)
+{
+}
+
+void CBlockCache::Trim()
+{
+    AssertLockHeld(cs_blockcache);
+    while (nBytes > nMaxBytes && !listLru.empty()) {
+        const CBlockCacheEntry& entry = listLru.back();
+        nBytes -= entry.nSize;
+        mapBlocks.erase(entry.hash);
+        listLru.pop_back();
+    }
+}
+
+CBlockConstRef CBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs_blockcache);
+    CacheMap::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end()) {
+        nMisses++;
+        return CBlockConstRef();
+    }
+    nHits++;
+    listLru.splice(listLru.begin(), listLru, it->second);
+    return it->second->pblock;
+}
+
+void CBlockCache::Insert(const uint256& hash, const CBlockConstRef& pblock)
+{
+    if (!pblock)
+        return;
+
+    // Populate the memory-only merkle tree now, while we still hold the only
+    // reference, so GetMerkleBranch() never rebuilds it on a shared block.
+    if (pblock->vMerkleTree.empty())
+        pblock->BuildMerkleTree();
+
+    // Account for the deserialized transactions plus the merkle tree
+    size_t nSize = ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION) + pblock->vMerkleTree.size() * sizeof(uint256);
+
+    LOCK(cs_blockcache);
+    CacheMap::iterator it = mapBlocks.find(hash);
+    if (it != mapBlocks.end()) {
+        listLru.splice(listLru.begin(), listLru, it->second);
+        return;
+    }
+    if (nSize > nMaxBytes)
+        return;
+
+    CBlockCacheEntry entry;
+    entry.hash = hash;
+    entry.pblock = pblock;
+    entry.nSize = nSize;
+    listLru.push_front(entry);
+    mapBlocks.insert(std::make_pair(hash, listLru.begin()));
+    nBytes += nSize;
+    Trim();
+}
+
+void CBlockCache::SetMaxSize(size_t nMaxBytesIn)
+{
+    LOCK(cs_blockcache);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+void CBlockCache::Clear()
+{
+    LOCK(cs_blockcache);
+    mapBlocks.clear();
+    listLru.clear();
+    nBytes = 0;
+}
+
+void CBlockCache::GetStats(CBlockCacheStats& stats) const
+{
+    LOCK(cs_blockcache);
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nEntries = mapBlocks.size();
+    stats.nBytes = nBytes;
+    stats.nMaxBytes = nMaxBytes;
+}
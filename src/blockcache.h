@@ -0,0 +1,80 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FASTNODE_BLOCKCACHE_H
+#define FASTNODE_BLOCKCACHE_H
+
+#include "primitives/block.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <memory>
+#include <stdint.h>
+
+#include <boost/unordered_map.hpp>
+
+/** Shared, immutable reference to a fully deserialized block */
+typedef std::shared_ptr<const CBlock> CBlockConstRef;
+
+/** Default for -blockcachesize, maximum memory used by recently read blocks (MiB) */
+static const int64_t DEFAULT_BLOCK_CACHE_SIZE = 32;
+
+struct CBlockCacheStats {
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEntries;
+    uint64_t nBytes;
+    uint64_t nMaxBytes;
+
+    CBlockCacheStats() : nHits(0), nMisses(0), nEntries(0), nBytes(0), nMaxBytes(0) {}
+};
+
+/**
+ * Size-bounded LRU cache of deserialized blocks, keyed by block hash.
+ *
+ * Blocks are immutable once stored: the merkle tree is built before a block
+ * is published so that concurrent readers never touch its mutable members.
+ */
+class CBlockCache
+{
+private:
+    struct CBlockCacheEntry {
+        uint256 hash;
+        CBlockConstRef pblock;
+        size_t nSize;
+    };
+
+    struct CBlockCacheHasher {
+        size_t operator()(const uint256& hash) const { return hash.GetLow64(); }
+    };
+
+    typedef std::list<CBlockCacheEntry> LruList;
+    typedef boost::unordered_map<uint256, LruList::iterator, CBlockCacheHasher> CacheMap;
+
+    mutable CCriticalSection cs_blockcache;
+    LruList listLru; //! most recently used first
+    CacheMap mapBlocks;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void Trim();
+
+public:
+    CBlockCache(size_t nMaxBytesIn = DEFAULT_BLOCK_CACHE_SIZE << 20);
+
+    /** Look up a block, returning an empty reference (and counting a miss) if it is not cached */
+    CBlockConstRef Get(const uint256& hash);
+    /** Store a block, evicting the least recently used ones when over the size limit */
+    void Insert(const uint256& hash, const CBlockConstRef& pblock);
+    void SetMaxSize(size_t nMaxBytesIn);
+    void Clear();
+    void GetStats(CBlockCacheStats& stats) const;
+};
+
+extern CBlockCache blockcache;
+
+#endif // FASTNODE_BLOCKCACHE_H
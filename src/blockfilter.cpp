@@ -0,0 +1,271 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+/** Writes values of up to 64 bits to a byte vector, most significant bit first */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    unsigned char chBuffer;
+    int nOffset; //!< bits used in chBuffer
+
+public:
+    CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), chBuffer(0), nOffset(0) {}
+
+    void Write(uint64_t nData, int nBits)
+    {
+        while (nBits > 0) {
+            int nFree = 8 - nOffset;
+            int n = std::min(nFree, nBits);
+            unsigned char chBits = (nData >> (nBits - n)) & ((1 << n) - 1);
+            chBuffer |= chBits << (nFree - n);
+            nOffset += n;
+            nBits -= n;
+            if (nOffset == 8) {
+                vch.push_back(chBuffer);
+                chBuffer = 0;
+                nOffset = 0;
+            }
+        }
+    }
+
+    void Flush()
+    {
+        if (nOffset != 0)
+            vch.push_back(chBuffer);
+        chBuffer = 0;
+        nOffset = 0;
+    }
+};
+
+/** Reads back what CBitWriter wrote */
+class CBitReader
+{
+private:
+    const std::vector<unsigned char>& vch;
+    size_t nPos;
+    unsigned char chBuffer;
+    int nOffset; //!< bits consumed from chBuffer
+
+public:
+    CBitReader(const std::vector<unsigned char>& vchIn, size_t nPosIn) : vch(vchIn), nPos(nPosIn), chBuffer(0), nOffset(8) {}
+
+    uint64_t Read(int nBits)
+    {
+        uint64_t nData = 0;
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                if (nPos >= vch.size())
+                    throw std::ios_base::failure("CBitReader::Read() : end of data");
+                chBuffer = vch[nPos++];
+                nOffset = 0;
+            }
+            int nAvail = 8 - nOffset;
+            int n = std::min(nAvail, nBits);
+            nData <<= n;
+            nData |= (chBuffer >> (nAvail - n)) & ((1 << n) - 1);
+            nOffset += n;
+            nBits -= n;
+        }
+        return nData;
+    }
+};
+
+void GolombRiceEncode(CBitWriter& writer, uint8_t nP, uint64_t x)
+{
+    // Quotient in unary, then the P low bits
+    uint64_t q = x >> nP;
+    while (q > 0) {
+        int nBits = q <= 64 ? (int)q : 64;
+        writer.Write(~0ULL, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, nP);
+}
+
+uint64_t GolombRiceDecode(CBitReader& reader, uint8_t nP)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    uint64_t r = reader.Read(nP);
+    return (q << nP) + r;
+}
+
+/** Map x uniformly into [0, n), as (x * n) >> 64 */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)x * n) >> 64);
+#else
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+} // anonymous namespace
+
+CGolombCodedSet::CGolombCodedSet(const Params& paramsIn) : params(paramsIn), nN(0), nF(0), vEncoded(1, 0)
+{
+}
+
+CGolombCodedSet::CGolombCodedSet(const Params& paramsIn, const std::vector<unsigned char>& vEncodedIn) : params(paramsIn), vEncoded(vEncodedIn)
+{
+    CDataStream ss(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nElements = ReadCompactSize(ss);
+    if (nElements > std::numeric_limits<uint32_t>::max())
+        throw std::ios_base::failure("CGolombCodedSet : N must be less than 2^32");
+    nN = nElements;
+    nF = (uint64_t)nN * params.nM;
+
+    // Decode all the elements to check the set is well formed
+    CBitReader reader(vEncoded, vEncoded.size() - ss.size());
+    for (uint32_t i = 0; i < nN; i++)
+        GolombRiceDecode(reader, params.nP);
+}
+
+CGolombCodedSet::CGolombCodedSet(const Params& paramsIn, const ElementSet& elements) : params(paramsIn)
+{
+    if (elements.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("CGolombCodedSet : N must be less than 2^32");
+    nN = elements.size();
+    nF = (uint64_t)nN * params.nM;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nN);
+    vEncoded.assign(ss.begin(), ss.end());
+
+    CBitWriter writer(vEncoded);
+    uint64_t nLast = 0;
+    std::vector<uint64_t> vHashed = BuildHashedSet(elements);
+    for (unsigned int i = 0; i < vHashed.size(); i++) {
+        GolombRiceEncode(writer, params.nP, vHashed[i] - nLast);
+        nLast = vHashed[i];
+    }
+    writer.Flush();
+}
+
+uint64_t CGolombCodedSet::HashToRange(const std::vector<unsigned char>& element) const
+{
+    uint64_t nHash = CSipHasher(params.nSipHashK0, params.nSipHashK1).Write(element.data(), element.size()).Finalize();
+    return MapIntoRange(nHash, nF);
+}
+
+std::vector<uint64_t> CGolombCodedSet::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vHashed;
+    vHashed.reserve(elements.size());
+    for (ElementSet::const_iterator it = elements.begin(); it != elements.end(); ++it)
+        vHashed.push_back(HashToRange(*it));
+    std::sort(vHashed.begin(), vHashed.end());
+    return vHashed;
+}
+
+bool CGolombCodedSet::MatchInternal(const uint64_t* pQuery, size_t nQuery) const
+{
+    CDataStream ss(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    ReadCompactSize(ss);
+    CBitReader reader(vEncoded, vEncoded.size() - ss.size());
+
+    // Walk the sorted set and the sorted queries side by side
+    uint64_t nValue = 0;
+    size_t nQueryPos = 0;
+    for (uint32_t i = 0; i < nN; i++) {
+        nValue += GolombRiceDecode(reader, params.nP);
+
+        while (true) {
+            if (nQueryPos == nQuery)
+                return false;
+            if (pQuery[nQueryPos] == nValue)
+                return true;
+            if (pQuery[nQueryPos] > nValue)
+                break;
+            nQueryPos++;
+        }
+    }
+    return false;
+}
+
+bool CGolombCodedSet::Match(const std::vector<unsigned char>& element) const
+{
+    uint64_t nQuery = HashToRange(element);
+    return MatchInternal(&nQuery, 1);
+}
+
+bool CGolombCodedSet::MatchAny(const ElementSet& elements) const
+{
+    if (elements.empty())
+        return false;
+    std::vector<uint64_t> vQueries = BuildHashedSet(elements);
+    return MatchInternal(&vQueries[0], vQueries.size());
+}
+
+CGolombCodedSet::Params CBlockFilter::GetParams() const
+{
+    // The SipHash key is the first 16 bytes of the block hash
+    return CGolombCodedSet::Params(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8), BASIC_FILTER_P, BASIC_FILTER_M);
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vEncoded) : hashBlock(hashBlockIn),
+                                                                                                     filter(GetParams(), vEncoded)
+{
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const CBlock& block, const CBlockUndo& blockundo) : hashBlock(hashBlockIn)
+{
+    CGolombCodedSet::ElementSet elements;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(std::vector<unsigned char>(script.begin(), script.end()));
+        }
+    }
+
+    // Zerocoin spends have no undo entries, every other spent output does
+    BOOST_FOREACH (const CTxUndo& txundo, blockundo.vtxundo) {
+        BOOST_FOREACH (const CTxInUndo& txinundo, txundo.vprevout) {
+            const CScript& script = txinundo.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(std::vector<unsigned char>(script.begin(), script.end()));
+        }
+    }
+
+    filter = CGolombCodedSet(GetParams(), elements);
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vEncoded = filter.GetEncoded();
+    return Hash(vEncoded.begin(), vEncoded.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
@@ -0,0 +1,124 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FASTNODE_BLOCKFILTER_H
+#define FASTNODE_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+//! Golomb-Rice parameter of the basic block filter (BIP158)
+static const uint8_t BASIC_FILTER_P = 19;
+//! Inverse false positive rate of the basic block filter (BIP158)
+static const uint32_t BASIC_FILTER_M = 784931;
+
+//! Filter types, as used by the getcfilters/getcfheaders messages
+enum BlockFilterType {
+    BLOCK_FILTER_BASIC = 0,
+};
+
+/**
+ * Golomb-coded set: a compact probabilistic set of byte strings. The
+ * elements are hashed with SipHash into [0, N * M), sorted, and the gaps
+ * between them are Golomb-Rice coded with parameter P. A query matches all
+ * elements of the set and, with probability 1/M, any other element.
+ */
+class CGolombCodedSet
+{
+public:
+    typedef std::set<std::vector<unsigned char> > ElementSet;
+
+    struct Params {
+        uint64_t nSipHashK0;
+        uint64_t nSipHashK1;
+        uint8_t nP;
+        uint32_t nM;
+
+        Params(uint64_t nSipHashK0In = 0, uint64_t nSipHashK1In = 0, uint8_t nPIn = 0, uint32_t nMIn = 1) : nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn) {}
+    };
+
+private:
+    Params params;
+    uint32_t nN; //!< number of elements
+    uint64_t nF; //!< range of the hashed elements, N * M
+    std::vector<unsigned char> vEncoded;
+
+    uint64_t HashToRange(const std::vector<unsigned char>& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+    bool MatchInternal(const uint64_t* pQuery, size_t nQuery) const;
+
+public:
+    CGolombCodedSet(const Params& paramsIn = Params());
+
+    /** Decode an encoded set; throws std::ios_base::failure if it is malformed */
+    CGolombCodedSet(const Params& paramsIn, const std::vector<unsigned char>& vEncodedIn);
+
+    CGolombCodedSet(const Params& paramsIn, const ElementSet& elements);
+
+    uint32_t GetN() const { return nN; }
+    const Params& GetParams() const { return params; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    bool Match(const std::vector<unsigned char>& element) const;
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+/**
+ * Basic block filter of BIP158: a Golomb-coded set of the output scripts of
+ * a block and of the scripts of the outputs it spends, keyed by the block
+ * hash. A wallet probing it with its own scripts learns whether the block
+ * may hold one of its transactions without reading the block.
+ */
+class CBlockFilter
+{
+private:
+    uint256 hashBlock;
+    CGolombCodedSet filter;
+
+    CGolombCodedSet::Params GetParams() const;
+
+public:
+    CBlockFilter() {}
+
+    /** Decode a stored filter; throws std::ios_base::failure if it is malformed */
+    CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vEncoded);
+
+    /** Build the filter of a block from its transactions and undo data */
+    CBlockFilter(const uint256& hashBlockIn, const CBlock& block, const CBlockUndo& blockundo);
+
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const CGolombCodedSet& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    /** Hash of the encoded filter */
+    uint256 GetHash() const;
+
+    /** Header committing to this filter and, through the previous header, to all filters before it */
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hashBlock);
+        if (ser_action.ForRead()) {
+            std::vector<unsigned char> vEncoded;
+            READWRITE(vEncoded);
+            filter = CGolombCodedSet(GetParams(), vEncoded);
+        } else {
+            std::vector<unsigned char> vEncoded(filter.GetEncoded());
+            READWRITE(vEncoded);
+        }
+    }
+};
+
+#endif // FASTNODE_BLOCKFILTER_H
@@ -0,0 +1,229 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilterdb.h"
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+CBlockFilterDB* pblockfilterdb = NULL;
+
+//! Set once the build thread reached the tip; from then on ConnectBlock indexes each block
+static bool fBlockFilterIndexSynced = false;
+
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blockfilter", nCacheSize, fMemory, fWipe) {}
+
+bool CBlockFilterDB::WriteFilter(const CBlockFilter& filter, const uint256& hashHeader)
+{
+    CLevelDBBatch batch;
+    batch.Write(std::make_pair('f', filter.GetBlockHash()), filter.GetEncodedFilter());
+    batch.Write(std::make_pair('h', filter.GetBlockHash()), std::make_pair(filter.GetHash(), hashHeader));
+    batch.Write('B', filter.GetBlockHash());
+    return WriteBatch(batch);
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256& hashBlock, CBlockFilter& filter)
+{
+    std::vector<unsigned char> vEncoded;
+    if (!Read(std::make_pair('f', hashBlock), vEncoded))
+        return false;
+    try {
+        filter = CBlockFilter(hashBlock, vEncoded);
+    } catch (const std::exception& e) {
+        return error("%s : malformed filter for block %s - %s", __func__, hashBlock.ToString(), e.what());
+    }
+    return true;
+}
+
+bool CBlockFilterDB::ReadFilterHashes(const uint256& hashBlock, uint256& hashFilter, uint256& hashHeader)
+{
+    std::pair<uint256, uint256> hashes;
+    if (!Read(std::make_pair('h', hashBlock), hashes))
+        return false;
+    hashFilter = hashes.first;
+    hashHeader = hashes.second;
+    return true;
+}
+
+bool CBlockFilterDB::HaveFilter(const uint256& hashBlock)
+{
+    return Exists(std::make_pair('h', hashBlock));
+}
+
+bool CBlockFilterDB::WriteBestBlock(const uint256& hashBlock)
+{
+    return Write('B', hashBlock);
+}
+
+bool CBlockFilterDB::ReadBestBlock(uint256& hashBlock)
+{
+    return Read('B', hashBlock);
+}
+
+bool IsBlockFilterIndexSynced()
+{
+    AssertLockHeld(cs_main);
+    return pblockfilterdb && fBlockFilterIndexSynced;
+}
+
+/** Build and store the filter of a block whose parent's filter is indexed */
+static bool IndexBlockFilter(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    uint256 hashPrevFilter, hashPrevHeader;
+    if (pindex->pprev && !pblockfilterdb->ReadFilterHashes(pindex->pprev->GetBlockHash(), hashPrevFilter, hashPrevHeader))
+        return error("%s : no filter header for block %s", __func__, pindex->pprev->GetBlockHash().ToString());
+
+    CBlockFilter filter(pindex->GetBlockHash(), block, blockundo);
+    if (!pblockfilterdb->WriteFilter(filter, filter.ComputeHeader(hashPrevHeader)))
+        return error("%s : failed to write filter for block %s", __func__, pindex->GetBlockHash().ToString());
+    return true;
+}
+
+bool BlockFilterIndexConnect(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    if (!IsBlockFilterIndexSynced())
+        return true; // the build thread will get to this block
+    return IndexBlockFilter(block, blockundo, pindex);
+}
+
+void ThreadBuildBlockFilterIndex()
+{
+    RenameThread("fastnode-filterindex");
+
+    CBlockIndex* pindex = NULL;
+    {
+        LOCK(cs_main);
+        uint256 hashBest;
+        if (pblockfilterdb->ReadBestBlock(hashBest)) {
+            BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+            if (mi != mapBlockIndex.end())
+                pindex = const_cast<CBlockIndex*>(chainActive.FindFork(mi->second));
+        }
+        LogPrintf("Block filter index: building from height %d\n", pindex ? pindex->nHeight : -1);
+    }
+
+    int64_t nLastLog = GetTime();
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            CBlockIndex* pindexNext;
+            CDiskBlockPos posUndo;
+            {
+                LOCK(cs_main);
+                if (pindex && !chainActive.Contains(pindex))
+                    pindex = const_cast<CBlockIndex*>(chainActive.FindFork(pindex));
+                pindexNext = pindex ? chainActive.Next(pindex) : chainActive.Genesis();
+                if (!pindexNext) {
+                    // Caught up, ConnectBlock indexes the blocks from now on
+                    fBlockFilterIndexSynced = true;
+                    LogPrintf("Block filter index: synced to height %d\n", pindex ? pindex->nHeight : -1);
+                    return;
+                }
+                posUndo = pindexNext->GetUndoPos();
+            }
+
+            if (!pblockfilterdb->HaveFilter(pindexNext->GetBlockHash())) {
+                CBlock block;
+                CBlockUndo blockundo;
+                // Around the block cache, so the build does not evict the recent blocks
+                if (!ReadBlockFromDisk(block, pindexNext->GetBlockPos()) || block.GetHash() != pindexNext->GetBlockHash()) {
+                    LogPrintf("Block filter index: failed to read block %s, stopping\n", pindexNext->GetBlockHash().ToString());
+                    return;
+                }
+                if (pindexNext->pprev && !blockundo.ReadFromDisk(posUndo, pindexNext->pprev->GetBlockHash())) {
+                    LogPrintf("Block filter index: failed to read undo data of block %s, stopping\n", pindexNext->GetBlockHash().ToString());
+                    return;
+                }
+                if (!IndexBlockFilter(block, blockundo, pindexNext))
+                    return;
+            }
+            pindex = pindexNext;
+
+            if (GetTime() >= nLastLog + 60) {
+                nLastLog = GetTime();
+                LogPrintf("Block filter index: at height %d\n", pindex->nHeight);
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        LogPrintf("Block filter index building interrupted\n");
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadBuildBlockFilterIndex()");
+    }
+}
+
+/** Blocks of the active chain from nStartHeight up to hashStop, or false if the range is not served */
+static bool GetFilterRange(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop, int nMaxSize, std::vector<const CBlockIndex*>& vBlocks)
+{
+    LOCK(cs_main);
+    if (nFilterType != BLOCK_FILTER_BASIC)
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) {
+        LogPrint("net", "%s : unknown stop block %s peer=%d\n", __func__, hashStop.ToString(), pfrom->id);
+        return false;
+    }
+    const CBlockIndex* pindexStop = mi->second;
+    if (nStartHeight > (uint32_t)pindexStop->nHeight || pindexStop->nHeight - nStartHeight >= (uint32_t)nMaxSize) {
+        LogPrint("net", "%s : bad range %u-%d peer=%d\n", __func__, nStartHeight, pindexStop->nHeight, pfrom->id);
+        Misbehaving(pfrom->GetId(), 10);
+        return false;
+    }
+    for (int nHeight = nStartHeight; nHeight <= pindexStop->nHeight; nHeight++)
+        vBlocks.push_back(chainActive[nHeight]);
+    return true;
+}
+
+static void ProcessBlockFilterMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    uint8_t nFilterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+    vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+    if (strCommand == "getcfilters") {
+        std::vector<const CBlockIndex*> vBlocks;
+        if (!GetFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, vBlocks))
+            return;
+        for (unsigned int i = 0; i < vBlocks.size(); i++) {
+            CBlockFilter filter;
+            if (!pblockfilterdb->ReadFilter(vBlocks[i]->GetBlockHash(), filter)) {
+                LogPrint("net", "%s : no filter for block %s peer=%d\n", __func__, vBlocks[i]->GetBlockHash().ToString(), pfrom->id);
+                return;
+            }
+            pfrom->PushMessage("cfilter", nFilterType, filter.GetBlockHash(), filter.GetEncodedFilter());
+        }
+    } else if (strCommand == "getcfheaders") {
+        std::vector<const CBlockIndex*> vBlocks;
+        if (!GetFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, vBlocks))
+            return;
+
+        // The header before the range, then the filter hashes the peer chains onto it
+        uint256 hashFilter, hashHeader, hashPrevHeader;
+        if (vBlocks[0]->pprev && !pblockfilterdb->ReadFilterHashes(vBlocks[0]->pprev->GetBlockHash(), hashFilter, hashPrevHeader)) {
+            LogPrint("net", "%s : no filter header for block %s peer=%d\n", __func__, vBlocks[0]->pprev->GetBlockHash().ToString(), pfrom->id);
+            return;
+        }
+        std::vector<uint256> vFilterHashes;
+        vFilterHashes.reserve(vBlocks.size());
+        for (unsigned int i = 0; i < vBlocks.size(); i++) {
+            if (!pblockfilterdb->ReadFilterHashes(vBlocks[i]->GetBlockHash(), hashFilter, hashHeader)) {
+                LogPrint("net", "%s : no filter header for block %s peer=%d\n", __func__, vBlocks[i]->GetBlockHash().ToString(), pfrom->id);
+                return;
+            }
+            vFilterHashes.push_back(hashFilter);
+        }
+        pfrom->PushMessage("cfheaders", nFilterType, hashStop, hashPrevHeader, vFilterHashes);
+    }
+}
+
+void RegisterBlockFilterMessageHandlers()
+{
+    RegisterMessageHandler("getcfilters", &ProcessBlockFilterMessage);
+    RegisterMessageHandler("getcfheaders", &ProcessBlockFilterMessage);
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FASTNODE_BLOCKFILTERDB_H
+#define FASTNODE_BLOCKFILTERDB_H
+
+#include "blockfilter.h"
+#include "leveldbwrapper.h"
+
+class CBlockIndex;
+
+//! -blockfilterindex default
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+//! -peerblockfilters default
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
+//! Most filters sent for one getcfilters request
+static const int MAX_GETCFILTERS_SIZE = 1000;
+//! Most filter hashes sent for one getcfheaders request
+static const int MAX_GETCFHEADERS_SIZE = 2000;
+
+/**
+ * Index of the basic block filters, keyed by block hash. Along with each
+ * filter it keeps the filter hash and the filter header, so header chains
+ * can be served without decoding filters. Filters of blocks that were
+ * disconnected stay valid and are kept.
+ */
+class CBlockFilterDB : public CLevelDBWrapper
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+
+public:
+    bool WriteFilter(const CBlockFilter& filter, const uint256& hashHeader);
+    bool ReadFilter(const uint256& hashBlock, CBlockFilter& filter);
+    bool ReadFilterHashes(const uint256& hashBlock, uint256& hashFilter, uint256& hashHeader);
+    bool HaveFilter(const uint256& hashBlock);
+    bool WriteBestBlock(const uint256& hashBlock);
+    bool ReadBestBlock(uint256& hashBlock);
+};
+
+extern CBlockFilterDB* pblockfilterdb;
+
+/** Whether the filter of every block in the active chain is indexed; requires cs_main */
+bool IsBlockFilterIndexSynced();
+
+/** Index the filter of a block being connected to the active chain; requires cs_main */
+bool BlockFilterIndexConnect(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex);
+
+/** Build the filters of the blocks connected before the index was enabled */
+void ThreadBuildBlockFilterIndex();
+
+/** Serve getcfilters and getcfheaders (BIP157) to peers */
+void RegisterBlockFilterMessageHandlers();
+
+#endif // FASTNODE_BLOCKFILTERDB_H
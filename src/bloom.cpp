@@ -6,7 +6,9 @@
 
 #include "bloom.h"
 
+#include "crypto/common.h"
 #include "hash.h"
+#include "memusage.h"
 #include "primitives/transaction.h"
 #include "script/script.h"
 #include "script/standard.h"
@@ -14,6 +16,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <boost/foreach.hpp>
 
@@ -42,36 +45,80 @@ CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+/** Serialize an outpoint the way the network does: txid followed by the little-endian index */
+static void SerializeOutPoint(const uint256& hash, uint32_t n, unsigned char* pOut)
 {
-    // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    memcpy(pOut, hash.begin(), 32);
+    WriteLE32(pOut + 32, n);
+}
+
+static const size_t OUTPOINT_SIZE = 36;
+
+void CBloomFilter::insert(const unsigned char* pData, size_t nLen)
+{
+    const unsigned int nBits = vData.size() * 8;
+    unsigned int vSeeds[MURMURHASH3_LANES];
+    unsigned int vHashes[MURMURHASH3_LANES];
+    for (unsigned int i = 0; i < nHashFuncs; i += MURMURHASH3_LANES) {
+        // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
+        for (unsigned int j = 0; j < MURMURHASH3_LANES; j++)
+            vSeeds[j] = (i + j) * 0xFBA4C795 + nTweak;
+        MurmurHash3Lanes(vSeeds, pData, nLen, vHashes);
+
+        unsigned int nLanes = std::min(MURMURHASH3_LANES, nHashFuncs - i);
+        for (unsigned int j = 0; j < nLanes; j++) {
+            unsigned int nIndex = vHashes[j] % nBits;
+            // Sets bit nIndex of vData
+            vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        }
+    }
+}
+
+bool CBloomFilter::contains(const unsigned char* pData, size_t nLen) const
+{
+    const unsigned int nBits = vData.size() * 8;
+    unsigned int vSeeds[MURMURHASH3_LANES];
+    unsigned int vHashes[MURMURHASH3_LANES];
+    for (unsigned int i = 0; i < nHashFuncs; i += MURMURHASH3_LANES) {
+        for (unsigned int j = 0; j < MURMURHASH3_LANES; j++)
+            vSeeds[j] = (i + j) * 0xFBA4C795 + nTweak;
+        MurmurHash3Lanes(vSeeds, pData, nLen, vHashes);
+
+        unsigned int nLanes = std::min(MURMURHASH3_LANES, nHashFuncs - i);
+        for (unsigned int j = 0; j < nLanes; j++) {
+            unsigned int nIndex = vHashes[j] % nBits;
+            // Checks bit nIndex of vData
+            if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
+                return false;
+        }
+    }
+    return true;
 }
 
 void CBloomFilter::insert(const vector<unsigned char>& vKey)
 {
     if (isFull)
         return;
-    for (unsigned int i = 0; i < nHashFuncs; i++) {
-        unsigned int nIndex = Hash(i, vKey);
-        // Sets bit nIndex of vData
-        vData[nIndex >> 3] |= (1 << (7 & nIndex));
-    }
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
     isEmpty = false;
 }
 
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    insert(data);
+    if (isFull)
+        return;
+    unsigned char data[OUTPOINT_SIZE];
+    SerializeOutPoint(outpoint.hash, outpoint.n, data);
+    insert(data, sizeof(data));
+    isEmpty = false;
 }
 
 void CBloomFilter::insert(const uint256& hash)
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    if (isFull)
+        return;
+    insert(hash.begin(), hash.size());
+    isEmpty = false;
 }
 
 bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
@@ -80,27 +127,27 @@ bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
         return true;
     if (isEmpty)
         return false;
-    for (unsigned int i = 0; i < nHashFuncs; i++) {
-        unsigned int nIndex = Hash(i, vKey);
-        // Checks bit nIndex of vData
-        if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
-            return false;
-    }
-    return true;
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
 }
 
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    return contains(data);
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    unsigned char data[OUTPOINT_SIZE];
+    SerializeOutPoint(outpoint.hash, outpoint.n, data);
+    return contains(data, sizeof(data));
 }
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return contains(hash.begin(), hash.size());
 }
 
 void CBloomFilter::clear()
@@ -116,6 +163,15 @@ bool CBloomFilter::IsWithinSizeConstraints() const
 }
 
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -124,33 +180,24 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         return true;
     if (isEmpty)
         return false;
-    const uint256& hash = tx.GetHash();
-    if (contains(hash))
+    if (contains(elements.hash))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++) {
-        const CTxOut& txout = tx.vout[i];
+    const unsigned char* pData = elements.vchData.empty() ? NULL : &elements.vchData[0];
+    unsigned int nOutputs = elements.vOutputIsPubKey.size();
+    for (unsigned int i = 0; i < nOutputs; i++) {
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end()) {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data)) {
+        for (unsigned int n = elements.vOutputBegin[i]; n < elements.vOutputBegin[i + 1]; n++) {
+            const std::pair<unsigned int, unsigned int>& element = elements.vElements[n];
+            if (contains(pData + element.first, element.second)) {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY) {
-                    txnouttype type;
-                    vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                        (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
+                    insert(COutPoint(elements.hash, i));
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && elements.vOutputIsPubKey[i])
+                    insert(COutPoint(elements.hash, i));
                 break;
             }
         }
@@ -159,21 +206,12 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (fFound)
         return true;
 
-    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+    // Match if the filter contains an outpoint tx spends, or any arbitrary
+    // script data element in any scriptSig in tx
+    for (unsigned int n = elements.vOutputBegin[nOutputs]; n < elements.vElements.size(); n++) {
+        const std::pair<unsigned int, unsigned int>& element = elements.vElements[n];
+        if (contains(pData + element.first, element.second))
             return true;
-
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end()) {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-                return true;
-        }
     }
 
     return false;
@@ -190,3 +228,51 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CBloomTxElements::CBloomTxElements(const CTransaction& tx) : hash(tx.GetHash())
+{
+    vOutputBegin.reserve(tx.vout.size() + 1);
+    vOutputIsPubKey.reserve(tx.vout.size());
+    BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+        vOutputBegin.push_back(vElements.size());
+        AddScriptPushes(txout.scriptPubKey);
+
+        txnouttype type;
+        vector<vector<unsigned char> > vSolutions;
+        vOutputIsPubKey.push_back(Solver(txout.scriptPubKey, type, vSolutions) && (type == TX_PUBKEY || type == TX_MULTISIG));
+    }
+    vOutputBegin.push_back(vElements.size());
+
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        unsigned char data[OUTPOINT_SIZE];
+        SerializeOutPoint(txin.prevout.hash, txin.prevout.n, data);
+        AddElement(data, data + sizeof(data));
+        AddScriptPushes(txin.scriptSig);
+    }
+}
+
+void CBloomTxElements::AddElement(const unsigned char* pbegin, const unsigned char* pend)
+{
+    vElements.push_back(std::make_pair((unsigned int)vchData.size(), (unsigned int)(pend - pbegin)));
+    vchData.insert(vchData.end(), pbegin, pend);
+}
+
+void CBloomTxElements::AddScriptPushes(const CScript& script)
+{
+    // Parsing stops at the first invalid opcode, as matching always has
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> data;
+    while (pc < script.end()) {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            AddElement(&data[0], &data[0] + data.size());
+    }
+}
+
+size_t CBloomTxElements::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(vchData) + memusage::DynamicUsage(vElements) +
+           memusage::DynamicUsage(vOutputBegin) + memusage::DynamicUsage(vOutputIsPubKey);
+}
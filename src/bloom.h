@@ -8,12 +8,13 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
 #include <vector>
 
 class COutPoint;
+class CScript;
 class CTransaction;
-class uint256;
 
 //! 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -31,6 +32,37 @@ enum bloomflags {
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that BIP37 filters are matched against:
+ * its txid, the data pushes of every scriptPubKey and scriptSig and the
+ * serialized outpoints it spends. Extracting them means parsing every script,
+ * so it is done once per transaction and the result is tested against each
+ * filtered peer's filter.
+ */
+class CBloomTxElements
+{
+private:
+    //! All elements back to back; vElements holds (offset, size) pairs into it
+    std::vector<unsigned char> vchData;
+    std::vector<std::pair<unsigned int, unsigned int> > vElements;
+    //! Output i's scriptPubKey pushes are vElements[vOutputBegin[i]..vOutputBegin[i+1])
+    std::vector<unsigned int> vOutputBegin;
+    //! Whether output i pays to a pubkey or multisig, for BLOOM_UPDATE_P2PUBKEY_ONLY
+    std::vector<unsigned char> vOutputIsPubKey;
+
+    void AddElement(const unsigned char* pbegin, const unsigned char* pend);
+    void AddScriptPushes(const CScript& script);
+
+    friend class CBloomFilter;
+
+public:
+    uint256 hash;
+
+    explicit CBloomTxElements(const CTransaction& tx);
+
+    size_t DynamicMemoryUsage() const;
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we sends them.
@@ -52,7 +84,9 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    //! Set or test the bits of one element; every hash function's seed goes through MurmurHash3Lanes
+    void insert(const unsigned char* pData, size_t nLen);
+    bool contains(const unsigned char* pData, size_t nLen) const;
 
 public:
     /**
@@ -94,6 +128,7 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
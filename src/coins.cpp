@@ -77,7 +77,7 @@ bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0), cacheCoins(0, CCoinsKeyHasher(), std::equal_to<uint256>(), CCoinsMap::allocator_type(&cacheCoinsPool)), cachedCoinsUsage(0) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -87,8 +87,10 @@ CCoinsViewCache::~CCoinsViewCache()
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
 {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.flags |= CCoinsCacheEntry::ACCESSED;
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
@@ -99,6 +101,9 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    // A fresh fetch is a read too, so it survives the first eviction pass
+    ret->second.flags |= CCoinsCacheEntry::ACCESSED;
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     return ret;
 }
 
@@ -116,6 +121,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
 {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
@@ -125,10 +131,16 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+    } else {
+        cachedCoinUsage = ret.first->second.DynamicMemoryUsage();
+    }
+    if (!(ret.first->second.flags & (CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH))) {
+        // First modification of an entry the parent has: remember its outputs
+        ret.first->second.SetBase();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    ret.first->second.flags |= CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::ACCESSED;
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
@@ -178,6 +190,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
+                    cachedCoinsUsage += entry.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
                 }
             } else {
@@ -185,10 +198,15 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
+                    if (!(itUs->second.flags & (CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH)))
+                        itUs->second.SetBase();
                     itUs->second.coins.swap(it->second.coins);
+                    cachedCoinsUsage += itUs->second.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
                 }
             }
@@ -204,6 +222,53 @@ bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cacheCoinsPool.Release();
+    cachedCoinsUsage = 0;
+    return fOk;
+}
+
+bool CCoinsViewCache::FlushDirty(size_t nMaxUsage)
+{
+    assert(!hasModifier);
+    CCoinsMap mapDirty;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            it++;
+            continue;
+        }
+        CCoinsCacheEntry& entry = mapDirty[it->first];
+        entry.flags = it->second.flags & (CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+        entry.nBaseHeight = it->second.nBaseHeight;
+        cachedCoinsUsage -= memusage::DynamicUsage(it->second.vBaseUnspent);
+        entry.vBaseUnspent.swap(it->second.vBaseUnspent);
+        if (it->second.coins.IsPruned()) {
+            // Nothing left to keep once the parent has seen the spend
+            cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+            entry.coins.swap(it->second.coins);
+            cacheCoins.erase(it++);
+            continue;
+        }
+        // The parent will hold this version, so our copy becomes clean
+        entry.coins = it->second.coins;
+        it->second.flags &= CCoinsCacheEntry::ACCESSED;
+        it++;
+    }
+    bool fOk = base->BatchWrite(mapDirty, hashBlock);
+
+    // Evict clean entries in two passes: first those not read since the last
+    // partial flush, then anything else, until the cache fits in nMaxUsage.
+    for (int nPass = 0; nPass < 2 && DynamicMemoryUsage() > nMaxUsage; nPass++) {
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end() && DynamicMemoryUsage() > nMaxUsage;) {
+            if (nPass == 0 && (it->second.flags & CCoinsCacheEntry::ACCESSED)) {
+                it++;
+                continue;
+            }
+            cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        }
+    }
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+        it->second.flags &= ~CCoinsCacheEntry::ACCESSED;
     return fOk;
 }
 
@@ -212,6 +277,11 @@ unsigned int CCoinsViewCache::GetCacheSize() const
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
 const CTxOut& CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
     const CCoins* coins = AccessCoins(input.prevout.hash);
@@ -265,7 +335,7 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage)
 {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
@@ -276,7 +346,11 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.DynamicMemoryUsage();
     }
 }
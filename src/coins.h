@@ -9,6 +9,8 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "memusage.h"
+#include "poolalloc.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -285,6 +287,15 @@ public:
                 return false;
         return true;
     }
+
+    //! heap memory owned by this object: the output vector and every output script
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout)
+            ret += memusage::DynamicUsage(*static_cast<const std::vector<unsigned char>*>(&out.scriptPubKey));
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -310,15 +321,42 @@ struct CCoinsCacheEntry {
     CCoins coins; // The actual cached data.
     unsigned char flags;
 
+    //! For a dirty entry the parent view has too: which outputs are unspent in
+    //! the parent, and at which height. This lets the change be written out
+    //! per output without reading the parent's version back.
+    std::vector<bool> vBaseUnspent;
+    int nBaseHeight;
+
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        ACCESSED = (1 << 2), // Read since the last partial flush; clean entries with this set are evicted last.
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nBaseHeight(0) {}
+
+    //! Record the current coins as the parent's version
+    void SetBase()
+    {
+        vBaseUnspent.resize(coins.vout.size());
+        for (unsigned int i = 0; i < coins.vout.size(); i++)
+            vBaseUnspent[i] = !coins.vout[i].IsNull();
+        nBaseHeight = coins.nHeight;
+    }
+
+    //! Whether the parent's version is known; the parent has nothing for fresh entries
+    bool HasBase() const
+    {
+        return (flags & FRESH) || !vBaseUnspent.empty();
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return coins.DynamicMemoryUsage() + memusage::DynamicUsage(vBaseUnspent);
+    }
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>, pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
 
 struct CCoinsStats {
     int nHeight;
@@ -328,8 +366,10 @@ struct CCoinsStats {
     uint64_t nSerializedSize;
     uint256 hashSerialized;
     CAmount nTotalAmount;
+    //! Hash the set with an order-independent MuHash, which allows scanning it on several threads
+    bool fMuHash;
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0), fMuHash(false) {}
 };
 
 
@@ -400,7 +440,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -421,8 +462,13 @@ protected:
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    //! Memory for the nodes of cacheCoins; declared first so it outlives the map
+    CPoolResource cacheCoinsPool;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -455,9 +501,21 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push only the dirty entries to the base and keep the rest of the cache
+     * warm. Afterwards clean entries are evicted until DynamicMemoryUsage()
+     * is at most nMaxUsage, starting with those not read since the previous
+     * partial flush.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool FlushDirty(size_t nMaxUsage);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of fastnode coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
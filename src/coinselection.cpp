@@ -0,0 +1,151 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+
+#include "random.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+
+namespace
+{
+struct CompareValueDescending {
+    bool operator()(const CSelectionCoin& a, const CSelectionCoin& b) const
+    {
+        return a.first > b.first;
+    }
+};
+} // anonymous namespace
+
+bool SelectCoinsBnB(std::vector<CSelectionCoin> vCoins, const CAmount& nTarget, const CAmount& nCostOfChange, const CAmount& nInputCost, CSelectionSet& setCoinsRet, CAmount& nValueRet)
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    // Largest first, so the search reaches the target in few inputs early
+    std::sort(vCoins.begin(), vCoins.end(), CompareValueDescending());
+
+    // Value still available from each position on
+    std::vector<CAmount> vRemaining(vCoins.size() + 1, 0);
+    for (unsigned int i = vCoins.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vCoins[i - 1].first;
+    if (vRemaining[0] < nTarget)
+        return false;
+
+    // Depth first, including each coin before excluding it. vSelected holds
+    // the positions of the coins included on the current branch.
+    std::vector<unsigned int> vSelected, vBest;
+    CAmount nBestWaste = std::numeric_limits<CAmount>::max();
+    CAmount nValue = 0;
+    unsigned int nNext = 0;
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++) {
+        bool fBacktrack = false;
+        CAmount nInputsWaste = vSelected.size() * nInputCost;
+        if (nValue + vRemaining[nNext] < nTarget || nValue > nTarget + nCostOfChange || nInputsWaste > nBestWaste) {
+            fBacktrack = true;
+        } else if (nValue >= nTarget) {
+            CAmount nWaste = nInputsWaste + (nValue - nTarget);
+            if (nWaste <= nBestWaste) {
+                nBestWaste = nWaste;
+                vBest = vSelected;
+                if (nWaste == 0)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack) {
+            if (vSelected.empty())
+                break; // the whole tree is explored
+            // Exclude the last coin included, and the coins of equal value
+            // after it, which would only lead to the same sets again
+            unsigned int nLast = vSelected.back();
+            vSelected.pop_back();
+            nValue -= vCoins[nLast].first;
+            nNext = nLast + 1;
+            while (nNext < vCoins.size() && vCoins[nNext].first == vCoins[nLast].first)
+                nNext++;
+        } else {
+            vSelected.push_back(nNext);
+            nValue += vCoins[nNext].first;
+            nNext++;
+        }
+    }
+
+    if (vBest.empty())
+        return false;
+    for (unsigned int i = 0; i < vBest.size(); i++) {
+        setCoinsRet.insert(vCoins[vBest[i]].second);
+        nValueRet += vCoins[vBest[i]].first;
+    }
+    return true;
+}
+
+void ApproximateBestSubset(const std::vector<CSelectionCoin>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, std::vector<char>& vfBest, CAmount& nBest, int iterations)
+{
+    std::vector<char> vfIncluded;
+
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
+
+    seed_insecure_rand();
+
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
+        vfIncluded.assign(vValue.size(), false);
+        CAmount nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++) {
+            for (unsigned int i = 0; i < vValue.size(); i++) {
+                //The solver here uses a randomized algorithm,
+                //the randomness serves no real security purpose but is just
+                //needed to prevent degenerate behavior and it is important
+                //that the rng is fast. We do not use a constant random sequence,
+                //because there may be some privacy improvement by making
+                //the selection random.
+                if (nPass == 0 ? insecure_rand() & 1 : !vfIncluded[i]) {
+                    nTotal += vValue[i].first;
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue) {
+                        fReachedTarget = true;
+                        if (nTotal < nBest) {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i].first;
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void GroupCoinsByValueBucket(const std::vector<CSelectionCoin>& vCoins, const CAmount& nTarget, std::vector<CSelectionCoin>& vGrouped)
+{
+    std::vector<CSelectionCoin> vSorted(vCoins);
+    std::sort(vSorted.begin(), vSorted.end(), CompareValueDescending());
+
+    vGrouped.clear();
+    std::map<int, CAmount> mapBucketCount;
+    for (unsigned int i = 0; i < vSorted.size(); i++) {
+        CAmount nValue = vSorted[i].first;
+        if (nValue <= 0)
+            continue;
+        int nBucket = 0;
+        while (nBucket < 62 && (nValue >> (nBucket + 1)) > 0)
+            nBucket++;
+        CAmount nBucketValue = (CAmount)1 << nBucket;
+        CAmount nMaxCoins = nTarget / nBucketValue + (nTarget % nBucketValue != 0);
+        if (mapBucketCount[nBucket]++ < nMaxCoins)
+            vGrouped.push_back(vSorted[i]);
+    }
+}
+
+CAmount GetSelectionWaste(unsigned int nInputs, const CAmount& nSelected, const CAmount& nTarget, const CAmount& nCostOfChange, const CAmount& nInputCost)
+{
+    CAmount nExcess = nSelected - nTarget;
+    return nInputs * nInputCost + std::min(nExcess, nCostOfChange);
+}
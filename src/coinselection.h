@@ -0,0 +1,56 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FASTNODE_COINSELECTION_H
+#define FASTNODE_COINSELECTION_H
+
+#include "amount.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+class CWalletTx;
+
+//! A candidate input: its value and the wallet output it spends
+typedef std::pair<CAmount, std::pair<const CWalletTx*, unsigned int> > CSelectionCoin;
+typedef std::set<std::pair<const CWalletTx*, unsigned int> > CSelectionSet;
+
+//! -coinselectbnb default
+static const bool DEFAULT_COINSELECT_BNB = true;
+//! Branches the exact match solver explores before giving up
+static const int BNB_MAX_TRIES = 100000;
+//! Candidate pools this large are thinned by value bucket before the knapsack solver runs
+static const unsigned int COIN_GROUPING_MIN_COINS = 1000;
+//! Size of a signed pay-to-pubkey-hash input, used to price inputs
+static const unsigned int COIN_SELECTION_INPUT_SIZE = 148;
+
+/**
+ * Branch and bound search for a set of coins whose value lies within
+ * [nTarget, nTarget + nCostOfChange], so that the transaction needs no
+ * change output. Of the sets found it returns the one with the least
+ * waste. Returns false if there is none, or none was found within
+ * BNB_MAX_TRIES branches.
+ */
+bool SelectCoinsBnB(std::vector<CSelectionCoin> vCoins, const CAmount& nTarget, const CAmount& nCostOfChange, const CAmount& nInputCost, CSelectionSet& setCoinsRet, CAmount& nValueRet);
+
+/**
+ * Randomized knapsack: the subset of vValue (sorted by decreasing value)
+ * closest to nTargetValue from above, found in up to 'iterations' passes.
+ */
+void ApproximateBestSubset(const std::vector<CSelectionCoin>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, std::vector<char>& vfBest, CAmount& nBest, int iterations = 1000);
+
+/**
+ * Thin a large pool for the knapsack solver. Coins are bucketed by the
+ * largest power of two 2^b not above their value. A set reaching nTarget
+ * from which no coin can be dropped holds at most ceil(nTarget / 2^b) coins
+ * of bucket b, so only that many of each bucket, the largest, are kept.
+ * The result is sorted by decreasing value.
+ */
+void GroupCoinsByValueBucket(const std::vector<CSelectionCoin>& vCoins, const CAmount& nTarget, std::vector<CSelectionCoin>& vGrouped);
+
+/** Cost of a selection beyond the payment: the fee of its inputs, plus the cost of change or the excess left to the fee */
+CAmount GetSelectionWaste(unsigned int nInputs, const CAmount& nSelected, const CAmount& nTarget, const CAmount& nCostOfChange, const CAmount& nInputCost);
+
+#endif // FASTNODE_COINSELECTION_H
@@ -94,9 +94,14 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+// Linux waits for socket events with epoll, which has no FD_SETSIZE limit
+#if defined(__linux__)
+#define USE_EPOLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s)
 {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_EPOLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -11,6 +11,7 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -53,6 +54,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    nWriteBehindMillis = 0;
 }
 
 CDBEnv::~CDBEnv()
@@ -217,13 +219,51 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
+bool CDBEnv::HasPendingWrites(const std::string& strFile) const
+{
+    LOCK(cs_pending);
+    std::map<std::string, PendingWrites>::const_iterator mi = mapPendingWrites.find(strFile);
+    return mi != mapPendingWrites.end() && (mi->second.fFlushing || !mi->second.mapRecords.empty());
+}
+
+int64_t CDBEnv::GetPendingWriteTime(const std::string& strFile) const
+{
+    LOCK(cs_pending);
+    std::map<std::string, PendingWrites>::const_iterator mi = mapPendingWrites.find(strFile);
+    if (mi == mapPendingWrites.end() || mi->second.mapRecords.empty())
+        return 0;
+    return mi->second.nTimeFirst;
+}
+
+unsigned int CDBEnv::GetPendingWriteCount() const
+{
+    LOCK(cs_pending);
+    unsigned int nCount = 0;
+    for (std::map<std::string, PendingWrites>::const_iterator mi = mapPendingWrites.begin(); mi != mapPendingWrites.end(); ++mi)
+        nCount += mi->second.mapRecords.size();
+    return nCount;
+}
+
+CDBWriteStats CDBEnv::GetWriteStats() const
+{
+    LOCK(cs_pending);
+    return writeStats;
+}
+
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fWriteBehindIn) : pdb(NULL), activeTxn(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+    fWriteBehind = fWriteBehindIn && bitdb.nWriteBehindMillis > 0 && !fReadOnly && !strFilename.empty();
     if (strFilename.empty())
         return;
+    if (fWriteBehind) {
+        strFile = strFilename;
+        return;
+    }
+    if (bitdb.HasPendingWrites(strFilename))
+        FlushPendingWrites(strFilename);
 
     bool fCreate = strchr(pszMode, 'c') != NULL;
     unsigned int nFlags = DB_THREAD;
@@ -289,6 +329,90 @@ void CDB::Flush()
     bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100) * 1024 : 0, nMinutes, 0);
 }
 
+bool CDB::QueueWrite(const CDataStream& ssKey, const CDataStream* pssValue)
+{
+    unsigned int nPending;
+    {
+        LOCK(bitdb.cs_pending);
+        CDBEnv::PendingWrites& pending = bitdb.mapPendingWrites[strFile];
+        if (pending.mapRecords.empty())
+            pending.nTimeFirst = GetTimeMillis();
+        std::pair<bool, CSerializeData>& record = pending.mapRecords[CSerializeData(ssKey.begin(), ssKey.end())];
+        record.first = (pssValue != NULL);
+        if (pssValue)
+            record.second.assign(pssValue->begin(), pssValue->end());
+        else
+            record.second.clear();
+        nPending = pending.mapRecords.size();
+    }
+    if (nPending >= MAX_PENDING_WRITES)
+        return FlushPendingWrites(strFile);
+    return true;
+}
+
+bool CDB::FlushPendingWrites(const std::string& strFile, bool fSync)
+{
+    LOCK(bitdb.cs_flush);
+    std::map<CSerializeData, std::pair<bool, CSerializeData> > mapRecords;
+    {
+        // A nested call, from the handle opened below, finds the records taken
+        LOCK(bitdb.cs_pending);
+        std::map<std::string, CDBEnv::PendingWrites>::iterator mi = bitdb.mapPendingWrites.find(strFile);
+        if (mi != bitdb.mapPendingWrites.end() && !mi->second.fFlushing && !mi->second.mapRecords.empty()) {
+            mapRecords.swap(mi->second.mapRecords);
+            mi->second.fFlushing = true;
+        }
+    }
+
+    bool fSuccess = true;
+    if (!mapRecords.empty()) {
+        int64_t nStart = GetTimeMicros();
+        {
+            CDB db(strFile, "r+");
+            fSuccess = db.TxnBegin();
+            std::map<CSerializeData, std::pair<bool, CSerializeData> >::iterator it;
+            for (it = mapRecords.begin(); fSuccess && it != mapRecords.end(); ++it) {
+                Dbt datKey((void*)&it->first[0], it->first.size());
+                if (it->second.first) {
+                    Dbt datValue((void*)&it->second.second[0], it->second.second.size());
+                    fSuccess = db.pdb->put(db.activeTxn, &datKey, &datValue, 0) == 0;
+                } else {
+                    int ret = db.pdb->del(db.activeTxn, &datKey, 0);
+                    fSuccess = (ret == 0 || ret == DB_NOTFOUND);
+                }
+            }
+            if (fSuccess)
+                fSuccess = db.TxnCommit();
+            else
+                db.TxnAbort();
+        }
+        int64_t nElapsed = GetTimeMicros() - nStart;
+
+        LOCK(bitdb.cs_pending);
+        CDBEnv::PendingWrites& pending = bitdb.mapPendingWrites[strFile];
+        if (fSuccess) {
+            CDBWriteStats& stats = bitdb.writeStats;
+            stats.nBatches++;
+            stats.nRecords += mapRecords.size();
+            stats.nMaxBatch = std::max(stats.nMaxBatch, (unsigned int)mapRecords.size());
+            stats.nTotalMicros += nElapsed;
+            stats.nMaxMicros = std::max(stats.nMaxMicros, nElapsed);
+            LogPrint("db", "CDB::FlushPendingWrites : committed %u records to %s in %.2fms\n", mapRecords.size(), strFile, nElapsed * 0.001);
+        } else {
+            // Requeue the records not written again since, the next flush retries them
+            LogPrintf("CDB::FlushPendingWrites : failed to commit %u records to %s\n", mapRecords.size(), strFile);
+            if (pending.mapRecords.empty())
+                pending.nTimeFirst = GetTimeMillis();
+            pending.mapRecords.insert(mapRecords.begin(), mapRecords.end());
+        }
+        pending.fFlushing = false;
+    }
+
+    if (fSuccess && fSync && !bitdb.IsMock())
+        fSuccess = bitdb.dbenv.log_flush(NULL) == 0;
+    return fSuccess;
+}
+
 void CDB::Close()
 {
     if (!pdb)
@@ -331,6 +455,8 @@ bool CDBEnv::RemoveDb(const string& strFile)
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    if (!FlushPendingWrites(strFile))
+        return false;
     while (true) {
         {
             LOCK(bitdb.cs_db);
@@ -420,6 +546,17 @@ void CDBEnv::Flush(bool fShutdown)
     LogPrint("db", "CDBEnv::Flush : Flush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " database not started");
     if (!fDbEnvInit)
         return;
+    {
+        // Commit what the write-behind queue holds before the files are closed
+        std::vector<std::string> vFiles;
+        {
+            LOCK(cs_pending);
+            for (std::map<std::string, PendingWrites>::iterator mi = mapPendingWrites.begin(); mi != mapPendingWrites.end(); ++mi)
+                vFiles.push_back(mi->first);
+        }
+        for (unsigned int i = 0; i < vFiles.size(); i++)
+            CDB::FlushPendingWrites(vFiles[i]);
+    }
     {
         LOCK(cs_db);
         map<string, int>::iterator mi = mapFileUseCount.begin();
@@ -27,9 +27,25 @@ struct CBlockLocator;
 
 extern unsigned int nWalletDBUpdated;
 
+//! -walletflushinterval default, in milliseconds
+static const int64_t DEFAULT_WALLET_FLUSH_INTERVAL = 1000;
+//! Queued records at which the write-behind queue of a file is committed right away
+static const unsigned int MAX_PENDING_WRITES = 10000;
+
 void ThreadFlushWalletDB(const std::string& strWalletFile);
 
 
+/** Statistics of the write-behind queue, for getwalletinfo */
+struct CDBWriteStats {
+    uint64_t nBatches;
+    uint64_t nRecords;
+    unsigned int nMaxBatch;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+
+    CDBWriteStats() : nBatches(0), nRecords(0), nMaxBatch(0), nTotalMicros(0), nMaxMicros(0) {}
+};
+
 class CDBEnv
 {
 private:
@@ -47,6 +63,26 @@ public:
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
 
+    /**
+     * Records queued by write-behind handles for one file, keyed by their
+     * serialized key. Later writes of a key replace earlier ones; an erase
+     * is queued without a value.
+     */
+    struct PendingWrites {
+        std::map<CSerializeData, std::pair<bool, CSerializeData> > mapRecords;
+        int64_t nTimeFirst; //! when the oldest queued record was queued, in ms
+        bool fFlushing;     //! records taken off the queue are being committed
+
+        PendingWrites() : nTimeFirst(0), fFlushing(false) {}
+    };
+    //! Held while queued records are committed, so no handle reads around them
+    CCriticalSection cs_flush;
+    mutable CCriticalSection cs_pending;
+    std::map<std::string, PendingWrites> mapPendingWrites;
+    CDBWriteStats writeStats;
+    //! How long records may wait in the queue, in ms; 0 writes them through
+    int64_t nWriteBehindMillis;
+
     CDBEnv();
     ~CDBEnv();
     void MakeMock();
@@ -80,6 +116,14 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /** Whether records of strFile are queued or being committed */
+    bool HasPendingWrites(const std::string& strFile) const;
+    /** When the oldest record queued for strFile was queued, in ms, or 0 */
+    int64_t GetPendingWriteTime(const std::string& strFile) const;
+    /** Number of records queued for all files */
+    unsigned int GetPendingWriteCount() const;
+    CDBWriteStats GetWriteStats() const;
+
     DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -101,8 +145,14 @@ protected:
     std::string strFile;
     DbTxn* activeTxn;
     bool fReadOnly;
+    bool fWriteBehind;
 
-    explicit CDB(const std::string& strFilename, const char* pszMode = "r+");
+    /**
+     * With fWriteBehindIn the handle only queues writes and erases, to be
+     * committed in batches by FlushPendingWrites; it cannot read. Opening a
+     * handle otherwise commits the records queued for the file first.
+     */
+    explicit CDB(const std::string& strFilename, const char* pszMode = "r+", bool fWriteBehindIn = false);
     ~CDB() { Close(); }
 
 public:
@@ -148,10 +198,12 @@ protected:
         return (ret == 0);
     }
 
+    bool QueueWrite(const CDataStream& ssKey, const CDataStream* pssValue);
+
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !fWriteBehind)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -166,6 +218,8 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+        if (fWriteBehind)
+            return QueueWrite(ssKey, &ssValue);
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -180,7 +234,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !fWriteBehind)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -189,6 +243,8 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (fWriteBehind)
+            return QueueWrite(ssKey, NULL);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -309,6 +365,13 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+
+    /**
+     * Commit the records queued for strFile in one transaction. With fSync
+     * the log is forced to disk as well, for callers that promise the
+     * records persist.
+     */
+    bool static FlushPendingWrites(const std::string& strFile, bool fSync = false);
 };
 
 #endif // BITCOIN_DB_H
@@ -313,8 +313,37 @@ uint256 SerializeHash(const T& obj, int nType = SER_GETHASH, int nVersion = PROT
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** Number of seeds MurmurHash3Lanes hashes side by side */
+static const unsigned int MURMURHASH3_LANES = 8;
+
+/**
+ * MurmurHash3 of one buffer under MURMURHASH3_LANES seeds at once. Each
+ * 32-bit block is read once and mixed into every lane with the same sequence
+ * of operations, so the lane loops compile to SIMD instructions.
+ */
+void MurmurHash3Lanes(const unsigned int* pSeeds, const unsigned char* pData, size_t nLen, unsigned int* pHashes);
+
 void BIP32Hash(const ChainCode chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
+/** SipHash-2-4, a keyed hash for data chosen by others, e.g. the elements of a block filter */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    uint64_t tmp;
+    int count;
+
+public:
+    /** Construct a SipHash calculator initialized with 128-bit key (k0, k1) */
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /** Hash a 64-bit integer worth of data. It is treated as if this was the little-endian interpretation of 8 bytes. */
+    CSipHasher& Write(uint64_t data);
+    /** Hash arbitrary bytes. */
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    /** Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched. */
+    uint64_t Finalize() const;
+};
+
 //int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 //int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 //int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
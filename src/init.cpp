@@ -17,6 +17,7 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilterdb.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "httpserver.h"
@@ -26,7 +27,10 @@
 #include "main.h"
 #include "masternode-budget.h"
 #include "masternode-payments.h"
+#include "masternode-sigcheck.h"
+#include "masternode-sync.h"
 #include "masternodeconfig.h"
+#include "masternodedb.h"
 #include "masternodeman.h"
 #include "miner.h"
 #include "net.h"
@@ -35,6 +39,7 @@
 #include "scheduler.h"
 #include "spork.h"
 #include "sporkdb.h"
+#include "swifttx.h"
 #include "txdb.h"
 #include "torcontrol.h"
 #include "ui_interface.h"
@@ -212,6 +217,12 @@ void PrepareShutdown()
     DumpMasternodes();
     DumpBudgets();
     DumpMasternodePayments();
+    delete pMasternodeDB;
+    pMasternodeDB = NULL;
+    delete pMasternodePaymentDB;
+    pMasternodePaymentDB = NULL;
+    delete pBudgetDB;
+    pBudgetDB = NULL;
     UnregisterNodeSignals(GetNodeSignals());
 
     if (fFeeEstimatesInitialized) {
@@ -244,6 +255,8 @@ void PrepareShutdown()
         zerocoinDB = NULL;
         delete pSporkDB;
         pSporkDB = NULL;
+        delete pblockfilterdb;
+        pblockfilterdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -363,6 +376,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
+    strUsage += HelpMessageOpt("-blockcachesize=<n>", strprintf(_("Keep at most <n> megabytes of recently read blocks in memory (default: %u)"), DEFAULT_BLOCK_CACHE_SIZE));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-blocksizenotify=<cmd>", _("Execute command when the best block changes and its size is over (%s in cmd is replaced by block hash, %d with the block size)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 500));
@@ -389,6 +403,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Maintain an index of compact block filters, used to speed up wallet rescans and to serve light clients (default: %u)"), DEFAULT_BLOCKFILTERINDEX));
     strUsage += HelpMessageOpt("-forcestart", _("Attempt to force blockchain corruption recovery") + " " + _("on startup"));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
@@ -406,11 +421,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-listenonion", strprintf(_("Automatically create Tor hidden service (default: %d)"), DEFAULT_LISTEN_ONION));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
+    strUsage += HelpMessageOpt("-maxrelaymemory=<n>", strprintf(_("Keep at most <n> MB of recently relayed transactions for serving peers (default: %u)"), DEFAULT_MAX_RELAY_MEMORY));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-msghandthreads=<n>", strprintf(_("Number of threads processing peer messages (1 to %d, default: %d)"), MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
     strUsage += HelpMessageOpt("-peerbloomfilters", strprintf(_("Support filtering of blocks and transaction with bloom filters (default: %u)"), DEFAULT_PEERBLOOMFILTERS));
+    strUsage += HelpMessageOpt("-peerblockfilters", strprintf(_("Serve compact block filters to peers, requires -blockfilterindex (default: %u)"), DEFAULT_PEERBLOCKFILTERS));
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), 47352, 47353));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), 1));
@@ -433,6 +451,7 @@ std::string HelpMessage(HelpMessageMode mode)
 #ifdef ENABLE_WALLET
     strUsage += HelpMessageGroup(_("Wallet options:"));
     strUsage += HelpMessageOpt("-backuppath=<dir|file>", _("Specify custom backup path to add a copy of any wallet backup. If set as dir, every backup generates a timestamped file. If set as file, will rewrite to that file every backup."));
+    strUsage += HelpMessageOpt("-coinselectbnb", strprintf(_("Look for an input set that needs no change output before falling back to the knapsack coin selection (default: %u)"), DEFAULT_COINSELECT_BNB));
     strUsage += HelpMessageOpt("-createwalletbackups=<n>", _("Number of automatic wallet backups (default: 10)"));
     strUsage += HelpMessageOpt("-custombackupthreshold=<n>", strprintf(_("Number of custom location backups to retain (default: %d)"), DEFAULT_CUSTOMBACKUPTHRESHOLD));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
@@ -473,12 +492,18 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkpoints", strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1));
+#ifdef ENABLE_WALLET
+        strUsage += HelpMessageOpt("-checkwalletbalances", strprintf("Check the running wallet balance totals against a full recomputation on every balance query (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+#endif
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0));
         strUsage += HelpMessageOpt("-testsafemode", strprintf(_("Force safe mode (default: %u)"), 0));
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", _("Randomly drop 1 of every <n> network messages"));
         strUsage += HelpMessageOpt("-fuzzmessagestest=<n>", _("Randomly fuzz 1 of every <n> network messages"));
         strUsage += HelpMessageOpt("-flushwallet", strprintf(_("Run a thread to flush wallet periodically (default: %u)"), 1));
+#ifdef ENABLE_WALLET
+        strUsage += HelpMessageOpt("-walletflushinterval=<n>", strprintf("Queue wallet database writes for up to <n> milliseconds and commit them in batches, 0 to write them through (default: %u)", DEFAULT_WALLET_FLUSH_INTERVAL));
+#endif
         strUsage += HelpMessageOpt("-maxreorg", strprintf(_("Use a custom max chain reorganization depth (default: %u)"), 100));
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf(_("Stop running after importing blocks from disk (default: %u)"), 0));
         strUsage += HelpMessageOpt("-sporkkey=<privkey>", _("Enable spork administration functionality with the appropriate private key."));
@@ -972,8 +997,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     nTxConfirmTarget = GetArg("-txconfirmtarget", 1);
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", false);
+    fCheckWalletBalances = GetBoolArg("-checkwalletbalances", Params().DefaultConsistencyChecks());
     bdisableSystemnotifications = GetBoolArg("-disablesystemnotifications", false);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", false);
+    fCoinSelectBnB = GetBoolArg("-coinselectbnb", DEFAULT_COINSELECT_BNB);
+    // Queued records are committed by the flush thread, so queue only when it runs
+    bitdb.nWriteBehindMillis = GetBoolArg("-flushwallet", true) ? std::max(GetArg("-walletflushinterval", DEFAULT_WALLET_FLUSH_INTERVAL), (int64_t)0) : 0;
 
     std::string strWalletFile = GetArg("-wallet", "wallet.dat");
 #endif // ENABLE_WALLET
@@ -987,6 +1016,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices |= NODE_BLOOM;
 
+    if (GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS)) {
+        if (!GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+            return InitError(_("Cannot set -peerblockfilters without -blockfilterindex."));
+        nLocalServices |= NODE_COMPACT_FILTERS;
+    }
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     // Initialize elliptic curve code
@@ -1032,10 +1067,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    LogPrintf("Using %u threads for script and masternode signature verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
         for (int i = 0; i < nScriptCheckThreads - 1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadMessageSigCheck);
     }
 
     if (mapArgs.count("-sporkkey")) // spork priv key
@@ -1215,6 +1252,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     RegisterNodeSignals(GetNodeSignals());
 
+    // Route the masternode, budget, SwiftX and spork commands to their subsystems
+    mnodeman.RegisterMessageHandlers();
+    budget.RegisterMessageHandlers();
+    masternodePayments.RegisterMessageHandlers();
+    masternodeSync.RegisterMessageHandlers();
+    RegisterSwiftTXMessageHandlers();
+    RegisterSporkMessageHandlers();
+    if (nLocalServices & NODE_COMPACT_FILTERS)
+        RegisterBlockFilterMessageHandlers();
+
     if (mapArgs.count("-onlynet")) {
         std::set<enum Network> nets;
         BOOST_FOREACH (std::string snet, mapMultiArgs["-onlynet"]) {
@@ -1379,7 +1426,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the coins cache accounts for its own heap usage
+    blockcache.SetMaxSize(std::max((int64_t)0, GetArg("-blockcachesize", DEFAULT_BLOCK_CACHE_SIZE)) << 20);
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1398,10 +1446,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pblocktree;
                 delete zerocoinDB;
                 delete pSporkDB;
+                delete pblockfilterdb;
 
                 //FASTNODE specific: zerocoin and spork DB's
                 zerocoinDB = new CZerocoinDB(0, false, fReindex);
                 pSporkDB = new CSporkDB(0, false, false);
+                pblockfilterdb = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX) ? new CBlockFilterDB(0, false, fReindex) : NULL;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
@@ -1637,12 +1687,26 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 pindexRescan = FindForkInGlobalIndex(chainActive, locator);
             else
                 pindexRescan = chainActive.Genesis();
+
+            // Resume a rescan that was cut short by a shutdown
+            if (walletdb.ReadRescanProgress(locator)) {
+                CBlockIndex* pindexResume = FindForkInGlobalIndex(chainActive, locator);
+                if (pindexResume && pindexRescan && pindexResume->nHeight < pindexRescan->nHeight) {
+                    LogPrintf("Resuming interrupted rescan from block %i\n", pindexResume->nHeight);
+                    pindexRescan = pindexResume;
+                }
+            }
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan) {
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            {
+                CWalletRescanReserver reserver(pwalletMain);
+                if (!reserver.Reserve())
+                    return InitError(_("Wallet is currently rescanning"));
+                pwalletMain->ScanForWalletTransactions(pindexRescan, reserver, true);
+            }
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
             pwalletMain->SetBestChain(chainActive.GetLocator());
             nWalletDBUpdated++;
@@ -1702,62 +1766,28 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+
+    // Convert a chainstate written by an older version to per-output records
+    if (pcoinsdbview->HaveLegacyCoins())
+        threadGroup.create_thread(boost::bind(&ThreadMigrateCoinsDB, pcoinsdbview));
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
             MilliSleep(10);
     }
 
+    // Index the filters of the blocks connected before -blockfilterindex was set
+    if (pblockfilterdb)
+        threadGroup.create_thread(&ThreadBuildBlockFilterIndex);
+
     // ********************************************************* Step 10: setup ObfuScation
 
+    // The caches load in the background; entries arriving from peers meanwhile are kept
     uiInterface.InitMessage(_("Loading masternode cache..."));
-
-    CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrintf("Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
-
-    uiInterface.InitMessage(_("Loading budget cache..."));
-
-    CBudgetDB budgetdb;
-    CBudgetDB::ReadResult readResult2 = budgetdb.Read(budget);
-
-    if (readResult2 == CBudgetDB::FileError)
-        LogPrintf("Missing budget cache - budget.dat, will try to recreate\n");
-    else if (readResult2 != CBudgetDB::Ok) {
-        LogPrintf("Error reading budget.dat: ");
-        if (readResult2 == CBudgetDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
-
-    //flag our cached items so we send them to our peers
-    budget.ResetSync();
-    budget.ClearSeen();
-
-
-    uiInterface.InitMessage(_("Loading masternode payment cache..."));
-
-    CMasternodePaymentDB mnpayments;
-    CMasternodePaymentDB::ReadResult readResult3 = mnpayments.Read(masternodePayments);
-
-    if (readResult3 == CMasternodePaymentDB::FileError)
-        LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
-    else if (readResult3 != CMasternodePaymentDB::Ok) {
-        LogPrintf("Error reading mnpayments.dat: ");
-        if (readResult3 == CMasternodePaymentDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
+    pMasternodeDB = new CMasternodeDB(0);
+    pMasternodePaymentDB = new CMasternodePaymentDB(0);
+    pBudgetDB = new CBudgetDB(0);
+    threadGroup.create_thread(&ThreadLoadMasternodeCaches);
 
     fMasterNode = GetBoolArg("-masternode", false);
 
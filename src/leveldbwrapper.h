@@ -168,6 +168,31 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    //! Iterator for short lookups; unlike scans, the blocks it reads are kept in the block cache
+    leveldb::Iterator* NewLookupIterator() const
+    {
+        return pdb->NewIterator(readoptions);
+    }
+
+    //! Iterate over the database as it was when snapshot was taken
+    leveldb::Iterator* NewIterator(const leveldb::Snapshot* snapshot)
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        return pdb->NewIterator(options);
+    }
+
+    //! Consistent read-only view of the database; release with ReleaseSnapshot()
+    const leveldb::Snapshot* GetSnapshot()
+    {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot* snapshot)
+    {
+        pdb->ReleaseSnapshot(snapshot);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
@@ -12,6 +12,8 @@
 #include "accumulatormap.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockcache.h"
+#include "blockfilterdb.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -20,6 +22,7 @@
 #include "kernel.h"
 #include "masternode-budget.h"
 #include "masternode-payments.h"
+#include "masternode-sigcheck.h"
 #include "masternodeman.h"
 #include "merkleblock.h"
 #include "net.h"
@@ -79,7 +82,7 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 1 * 60;
@@ -94,7 +97,7 @@ CFeeRate minRelayTxFee = CFeeRate(10000);
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
@@ -544,8 +547,9 @@ CSporkDB* pSporkDB = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer)
+bool AddOrphanTx(const CTransactionRef& ptx, NodeId peer)
 {
+    const CTransaction& tx = *ptx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -563,7 +567,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
+    mapOrphanTransactions[hash].tx = ptx;
     mapOrphanTransactions[hash].fromPeer = peer;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
@@ -578,7 +582,7 @@ void static EraseOrphanTx(uint256 hash)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
+    BOOST_FOREACH (const CTxIn& txin, it->second.tx->vin) {
         map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
@@ -596,7 +600,7 @@ void EraseOrphansFor(NodeId peer)
     while (iter != mapOrphanTransactions.end()) {
         map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
         if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
+            EraseOrphanTx(maybeErase->second.tx->GetHash());
             ++nErased;
         }
     }
@@ -1112,7 +1116,7 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
 
         if (tx.IsZerocoinSpend()) {
             //require that a zerocoinspend only has inputs that are zerocoins
-            for (const CTxIn in : tx.vin) {
+            for (const CTxIn& in : tx.vin) {
                 if (!in.scriptSig.IsZerocoinSpend())
                     return state.DoS(100,
                                      error("CheckTransaction() : zerocoinspend contains inputs that are not zerocoins"));
@@ -1214,7 +1218,11 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+/**
+ * ptx, when set, is a shared reference to tx that the mempool entry adopts
+ * instead of taking its own copy of the transaction.
+ */
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1379,7 +1387,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         if (!tx.IsZerocoinSpend())
             view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(ptx ? ptx : MakeTransactionRef(tx), nFees, GetTime(), dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1462,6 +1470,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWorker(pool, state, tx, CTransactionRef(), fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWorker(pool, state, *ptx, ptx, fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees);
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -1778,14 +1796,33 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
+bool ReadBlockFromDisk(CBlockConstRef& pblock, const CBlockIndex* pindex)
+{
+    const uint256 hashBlock = pindex->GetBlockHash();
+    pblock = blockcache.Get(hashBlock);
+    if (pblock)
+        return true;
+
+    std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+    if (!ReadBlockFromDisk(*pblockRead, pindex->GetBlockPos()))
+        return false;
+    if (pblockRead->GetHash() != hashBlock) {
+        LogPrintf("%s : block=%s index=%s\n", __func__, pblockRead->GetHash().ToString().c_str(), hashBlock.ToString().c_str());
+        return error("ReadBlockFromDisk(CBlockConstRef&, CBlockIndex*) : GetHash() doesn't match index");
+    }
+    blockcache.Insert(hashBlock, pblockRead);
+    pblock = pblockRead;
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    CBlockConstRef pblock;
+    if (!ReadBlockFromDisk(pblock, pindex)) {
+        block.SetNull();
         return false;
-    if (block.GetHash() != pindex->GetBlockHash()) {
-        LogPrintf("%s : block=%s index=%s\n", __func__, block.GetHash().ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
     }
+    block = *pblock;
     return true;
 }
 
@@ -2046,12 +2083,12 @@ map<COutPoint, COutPoint> mapInvalidOutPoints;
 map<CBigNum, CAmount> mapInvalidSerials;
 void AddInvalidSpendsToMap(const CBlock& block)
 {
-    for (const CTransaction tx : block.vtx) {
+    for (const CTransaction& tx : block.vtx) {
         if (!tx.ContainsZerocoins())
             continue;
 
         //Check all zerocoinspends for bad serials
-        for (const CTxIn in : tx.vin) {
+        for (const CTxIn& in : tx.vin) {
             if (in.scriptSig.IsZerocoinSpend()) {
                 CoinSpend spend = TxInToZerocoinSpend(in);
 
@@ -2470,7 +2507,7 @@ bool RecalculateFNSSupply(int nHeightStart)
 
         CAmount nValueIn = 0;
         CAmount nValueOut = 0;
-        for (const CTransaction tx : block.vtx) {
+        for (const CTransaction& tx : block.vtx) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 if (tx.IsCoinBase())
                     break;
@@ -2772,7 +2809,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     REJECT_INVALID, "bad-txns-inputs-missingorspent");
 
             // Check that the inputs are not marked as invalid/fraudulent
-            for (CTxIn in : tx.vin) {
+            for (const CTxIn& in : tx.vin) {
                 if (!ValidOutPoint(in.prevout, pindex->nHeight)) {
                     return state.DoS(100, error("%s : tried to spend invalid input %s in tx %s", __func__, in.prevout.ToString(),
                                   tx.GetHash().GetHex()), REJECT_INVALID, "bad-txns-invalid-inputs");
@@ -2896,6 +2933,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
+    // A filter that fails to index is only missing, peers and the wallet fall back to the block
+    BlockFilterIndexConnect(block, blockundo, pindex);
+
     //Record zFNS serials
     set<uint256> setAddedTx;
     for (pair<CoinSpend, uint256> pSpend : vSpends) {
@@ -2910,7 +2950,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     continue;
 
                 //Search block for matching tx, turn into wtx, set merkle branch, add to wallet
-                for (CTransaction tx : block.vtx) {
+                for (const CTransaction& tx : block.vtx) {
                     if (tx.GetHash() == pSpend.second) {
                         CWalletTx wtx(pwalletMain, tx);
                         wtx.nTimeReceived = pindex->GetBlockTime();
@@ -2935,10 +2975,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return state.Abort("Failed to write transaction index");
 
             // add new entries
-            for (const CTransaction tx: block.vtx) {
+            for (const CTransaction& tx : block.vtx) {
                 if (tx.IsCoinBase())
                     continue;
-                for (const CTxIn in: tx.vin) {
+                for (const CTxIn& in : tx.vin) {
                     LogPrint("map", "mapStakeSpent: Insert %s | %u\n", in.prevout.ToString(), pindex->nHeight);
                     mapStakeSpent.insert(std::make_pair(in.prevout, pindex->nHeight));
                 }
@@ -3001,8 +3041,9 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+        // The cache is over its memory budget
+        bool fCacheLarge = (mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage;
+        if ((mode == FLUSH_STATE_ALWAYS) || fCacheLarge ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -3033,7 +3074,10 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
             pblocktree->Sync();
             // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // Only dirty entries are written; clean ones stay cached unless the
+            // cache is over budget, in which case it is trimmed to half its size
+            // so that it does not have to be flushed again right away.
+            if (!pcoinsTip->FlushDirty(fCacheLarge ? nCoinCacheUsage / 2 : nCoinCacheUsage))
                 return state.Abort("Failed to write to coin database");
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
@@ -3066,10 +3110,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3178,6 +3222,8 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
             return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(inv.hash);
+        if (pblock != &block)
+            blockcache.Insert(inv.hash, std::make_shared<const CBlock>(*pblock));
         nTime3 = GetTimeMicros();
         nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
@@ -3264,14 +3310,14 @@ bool DisconnectBlockAndInputs(CValidationState& state, CTransaction txLock)
         vDisconnect.push_back(BlockReading);
         pindexNew = BlockReading->pprev; //new best block
 
-        CBlock block;
-        if (!ReadBlockFromDisk(block, BlockReading))
+        CBlockConstRef pblock;
+        if (!ReadBlockFromDisk(pblock, BlockReading))
             return state.Abort(_("Failed to read block"));
 
         // Queue memory transactions to resurrect.
         // We only do this for blocks after the last checkpoint (reorganisation before that
         // point should only happen with -reindex/-loadblock, or a misbehaving peer.
-        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
             if (!tx.IsCoinBase()) {
                 BOOST_FOREACH (const CTxIn& in1, txLock.vin) {
                     BOOST_FOREACH (const CTxIn& in2, tx.vin) {
@@ -4236,7 +4282,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         if (!coins.HaveInputs(block.vtx[1])) {
             // the inputs are spent at the chain tip so we should look at the recently spent outputs
 
-            for (CTxIn in : block.vtx[1].vin) {
+            for (const CTxIn& in : block.vtx[1].vin) {
                 auto it = mapStakeSpent.find(in.prevout);
                 if (it == mapStakeSpent.end()) {
                     return false;
@@ -4254,13 +4300,16 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
             // while that block is not on the main chain
             while (last != NULL && !chainActive.Contains(last)) {
-                CBlock bl;
-                ReadBlockFromDisk(bl, last);
+                CBlockConstRef pbl;
+                if (!ReadBlockFromDisk(pbl, last)) {
+                    last = last->pprev;
+                    continue;
+                }
                 // loop through every spent input from said block
-                for (CTransaction t : bl.vtx) {
-                    for (CTxIn in: t.vin) {
+                for (const CTransaction& t : pbl->vtx) {
+                    for (const CTxIn& in : t.vin) {
                         // loop through every spent input in the staking transaction of the new block
-                        for (CTxIn stakeIn : block.vtx[1].vin) {
+                        for (const CTxIn& stakeIn : block.vtx[1].vin) {
                             // if they spend the same input
                             if (stakeIn.prevout == in.prevout) {
                                 // reject the block
@@ -4365,9 +4414,9 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
 
     int nMints = 0;
     int nSpends = 0;
-    for (const CTransaction tx : pblock->vtx) {
+    for (const CTransaction& tx : pblock->vtx) {
         if (tx.ContainsZerocoins()) {
-            for (const CTxIn in : tx.vin) {
+            for (const CTxIn& in : tx.vin) {
                 if (in.scriptSig.IsZerocoinSpend())
                     nSpends++;
             }
@@ -4704,7 +4753,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4747,6 +4796,7 @@ void UnloadBlockIndex()
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    blockcache.Clear();
 }
 
 bool LoadBlockIndex(string& strError)
@@ -5117,8 +5167,10 @@ bool static AlreadyHave(const CInv& inv)
                mapTxLockReqRejected.count(inv.hash);
     case MSG_TXLOCK_VOTE:
         return mapTxLockVote.count(inv.hash);
-    case MSG_SPORK:
+    case MSG_SPORK: {
+        LOCK(cs_mapSporks);
         return mapSporks.count(inv.hash);
+    }
     case MSG_MASTERNODE_WINNER:
         if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
             masternodeSync.AddedMasternodeWinner(inv.hash);
@@ -5163,6 +5215,29 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/**
+ * Bloom elements of the last block served as a merkleblock. A new tip is
+ * requested by every connected SPV client, so its scripts are parsed once
+ * and each client's filter is matched against the shared result.
+ */
+static std::shared_ptr<const std::vector<CBloomTxElements> > GetBlockBloomElements(const CBlock& block)
+{
+    static uint256 hashLastBlock;
+    static std::shared_ptr<const std::vector<CBloomTxElements> > pLastElements;
+
+    AssertLockHeld(cs_main);
+    uint256 hash = block.GetHash();
+    if (!pLastElements || hash != hashLastBlock) {
+        std::shared_ptr<std::vector<CBloomTxElements> > pElements = std::make_shared<std::vector<CBloomTxElements> >();
+        pElements->reserve(block.vtx.size());
+        BOOST_FOREACH (const CTransaction& tx, block.vtx)
+            pElements->push_back(CBloomTxElements(tx));
+        pLastElements = pElements;
+        hashLastBlock = hash;
+    }
+    return pLastElements;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -5210,7 +5285,7 @@ void static ProcessGetData(CNode* pfrom)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            CMerkleBlock merkleBlock(block, *pfrom->pfilter, *GetBlockBloomElements(block));
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -5243,20 +5318,17 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CTransactionRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage(inv.GetCommand(), *(*mi).second);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    CTransactionRef ptx = mempool.get(inv.hash);
+                    if (ptx) {
+                        pfrom->PushMessage("tx", *ptx);
                         pushed = true;
                     }
                 }
@@ -5279,13 +5351,18 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_SPORK) {
-                    if (mapSporks.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        pfrom->PushMessage("spork", ss);
-                        pushed = true;
+                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    {
+                        LOCK(cs_mapSporks);
+                        std::map<uint256, CSporkMessage>::iterator mi = mapSporks.find(inv.hash);
+                        if (mi != mapSporks.end()) {
+                            ss.reserve(1000);
+                            ss << mi->second;
+                            pushed = true;
+                        }
                     }
+                    if (pushed)
+                        pfrom->PushMessage("spork", ss);
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
                     if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
@@ -5396,7 +5473,19 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+/** Handlers of the commands registered by subsystems, indexed by interned command id */
+static std::vector<MessageHandler> vMessageHandlers;
+
+void RegisterMessageHandler(const std::string& strCommand, const MessageHandler& handler)
+{
+    int nCommandId = RegisterMessageCommand(strCommand);
+    assert(nCommandId >= NETMSG_CORE_END);
+    if ((int)vMessageHandlers.size() <= nCommandId)
+        vMessageHandlers.resize(nCommandId + 1);
+    vMessageHandlers[nCommandId] = handler;
+}
+
+bool static ProcessMessage(CNode* pfrom, int nCommandId, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -5405,7 +5494,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         return true;
     }
 
-    if (strCommand == "version") {
+    if (nCommandId == NETMSG_VERSION) {
         // Each connection can only send one version message
         if (pfrom->nVersion != 0) {
             pfrom->PushMessage("reject", strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
@@ -5533,7 +5622,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "verack") {
+    else if (nCommandId == NETMSG_VERACK) {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
         // Mark this node as currently connected, so we update its timestamp later.
@@ -5544,7 +5633,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "addr") {
+    else if (nCommandId == NETMSG_ADDR) {
         vector<CAddress> vAddr;
         vRecv >> vAddr;
 
@@ -5574,9 +5663,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    static const uint256 hashSalt = GetRandHash();
                     uint64_t hashAddr = addr.GetHash();
                     uint256 hashRand = hashSalt ^ (hashAddr << 32) ^ ((GetTime() + hashAddr) / (24 * 60 * 60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
@@ -5607,7 +5694,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "inv") {
+    else if (nCommandId == NETMSG_INV) {
         vector<CInv> vInv;
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ) {
@@ -5656,7 +5743,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getdata") {
+    else if (nCommandId == NETMSG_GETDATA) {
         vector<CInv> vInv;
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ) {
@@ -5676,7 +5763,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (nCommandId == NETMSG_GETBLOCKS || nCommandId == NETMSG_GETHEADERS) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5708,7 +5795,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (nCommandId == NETMSG_HEADERS && Params().HeadersFirstSyncingActive()) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5746,10 +5833,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "tx" || strCommand == "dstx") {
+    else if (nCommandId == NETMSG_TX || nCommandId == NETMSG_DSTX) {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CTransaction tx;
+        // Deserialize straight into a shared transaction so the mempool,
+        // orphan pool and relay map all reference this one copy
+        std::shared_ptr<CTransaction> ptxRecv = std::make_shared<CTransaction>();
+        CTransaction& tx = *ptxRecv;
+        const CTransactionRef ptx = ptxRecv;
 
         //masternode signed transaction
         bool ignoreFees = false;
@@ -5757,9 +5848,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<unsigned char> vchSig;
         int64_t sigTime;
 
-        if (strCommand == "tx") {
+        if (nCommandId == NETMSG_TX) {
             vRecv >> tx;
-        } else if (strCommand == "dstx") {
+        } else if (nCommandId == NETMSG_DSTX) {
             //these allow masternodes to publish a limited amount of free transactions
             vRecv >> tx >> vin >> vchSig >> sigTime;
 
@@ -5808,9 +5899,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         mapAlreadyAskedFor.erase(inv);
 
-        if (!tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
+        if (!tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs, false, ignoreFees)) {
             mempool.check(pcoinsTip);
-            RelayTransaction(tx);
+            RelayTransaction(ptx);
             vWorkQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
@@ -5828,7 +5919,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     mi != itByPrev->second.end();
                     ++mi) {
                     const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
+                    const CTransactionRef porphanTx = mapOrphanTransactions[orphanHash].tx;
                     NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
@@ -5839,9 +5930,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
                     if(setMisbehaving.count(fromPeer))
                         continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+                    if(AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2)) {
                         LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
+                        RelayTransaction(porphanTx);
                         vWorkQueue.push_back(orphanHash);
                         vEraseQueue.push_back(orphanHash);
                     } else if(!fMissingInputs2) {
@@ -5862,16 +5953,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
 
             BOOST_FOREACH (uint256 hash, vEraseQueue)EraseOrphanTx(hash);
-        } else if (tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingZerocoinInputs, false, ignoreFees)) {
+        } else if (tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingZerocoinInputs, false, ignoreFees)) {
             //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
             //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
-            RelayTransaction(tx);
+            RelayTransaction(ptx);
             LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
                      pfrom->id, pfrom->cleanSubVer,
                      tx.GetHash().ToString(),
                      mempool.mapTx.size());
         } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
+            AddOrphanTx(ptx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
@@ -5886,7 +5977,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             RelayTransaction(tx);
         }
 
-        if (strCommand == "dstx") {
+        if (nCommandId == NETMSG_DSTX) {
             CInv inv(MSG_DSTX, tx.GetHash());
             RelayInv(inv);
         }
@@ -5904,7 +5995,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+    else if (nCommandId == NETMSG_HEADERS && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
     {
         std::vector<CBlockHeader> headers;
 
@@ -5963,7 +6054,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CheckBlockIndex();
     }
 
-    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+    else if (nCommandId == NETMSG_BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
         vRecv >> block;
@@ -6011,15 +6102,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // to users' AddrMan and later request them by sending getaddr messages.
     // Making users (which are behind NAT and can only make outgoing connections) ignore
     // getaddr message mitigates the attack.
-    else if ((strCommand == "getaddr") && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
+    else if ((nCommandId == NETMSG_GETADDR) && (pfrom->fInbound)) {
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH (const CAddress& addr, vAddr)
             pfrom->PushAddress(addr);
     }
 
 
-    else if (strCommand == "mempool") {
+    else if (nCommandId == NETMSG_MEMPOOL) {
         LOCK2(cs_main, pfrom->cs_filter);
 
         std::vector<uint256> vtxid;
@@ -6043,7 +6137,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "ping") {
+    else if (nCommandId == NETMSG_PING) {
         if (pfrom->nVersion > BIP0031_VERSION) {
             uint64_t nonce = 0;
             vRecv >> nonce;
@@ -6063,7 +6157,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "pong") {
+    else if (nCommandId == NETMSG_PONG) {
         int64_t pingUsecEnd = nTimeReceived;
         uint64_t nonce = 0;
         size_t nAvail = vRecv.in_avail();
@@ -6119,7 +6213,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (fAlerts && strCommand == "alert") {
+    else if (fAlerts && nCommandId == NETMSG_ALERT) {
         CAlert alert;
         vRecv >> alert;
 
@@ -6147,15 +6241,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
     else if (!(nLocalServices & NODE_BLOOM) &&
-             (strCommand == "filterload" ||
-                 strCommand == "filteradd" ||
-                 strCommand == "filterclear")) {
+             (nCommandId == NETMSG_FILTERLOAD ||
+                 nCommandId == NETMSG_FILTERADD ||
+                 nCommandId == NETMSG_FILTERCLEAR)) {
         LogPrintf("bloom message=%s\n", strCommand);
         LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 100);
     }
 
-    else if (strCommand == "filterload") {
+    else if (nCommandId == NETMSG_FILTERLOAD) {
         CBloomFilter filter;
         vRecv >> filter;
 
@@ -6173,7 +6267,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "filteradd") {
+    else if (nCommandId == NETMSG_FILTERADD) {
         vector<unsigned char> vData;
         vRecv >> vData;
 
@@ -6194,7 +6288,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "filterclear") {
+    else if (nCommandId == NETMSG_FILTERCLEAR) {
         LOCK(pfrom->cs_filter);
         delete pfrom->pfilter;
         pfrom->pfilter = new CBloomFilter();
@@ -6202,7 +6296,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "reject") {
+    else if (nCommandId == NETMSG_REJECT) {
         if (fDebug) {
             try {
                 string strMsg;
@@ -6224,15 +6318,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "Unparseable reject message received\n");
             }
         }
+    } else if (nCommandId < (int)vMessageHandlers.size() && vMessageHandlers[nCommandId]) {
+        // one of the extensions, registered at startup
+        vMessageHandlers[nCommandId](pfrom, strCommand, vRecv);
     } else {
-        //probably one the extensions
+        // obfuscation pool messages are not registered and handled here
         obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        budget.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
     }
 
 
@@ -6257,6 +6348,19 @@ int ActiveProtocol()
 }
 
 // requires LOCK(cs_vRecvMsg)
+/**
+ * Commands whose handlers only touch state with its own locking. They run on
+ * whichever message handler thread picks them up, without cs_main; every other
+ * command is handled under cs_main so those handlers stay serialized with each
+ * other as they were with a single handler thread.
+ */
+bool IsConcurrentMessage(const std::string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong" ||
+           strCommand == "addr" || strCommand == "getaddr" ||
+           strCommand == "spork" || strCommand == "getsporks";
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     //if (fDebug)
@@ -6272,8 +6376,11 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        // Serving getdata reads masternode and budget maps that the serialized handlers write
+        LOCK(cs_main);
         ProcessGetData(pfrom);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -6296,6 +6403,9 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // Recover the signatures of this and the following masternode messages in parallel
+        PrecheckQueuedSignatures(it, pfrom->vRecvMsg.end());
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -6330,8 +6440,15 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
+        int64_t nCpuStart = GetThreadCpuTimeMicros();
         try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsConcurrentMessage(strCommand)) {
+                fRet = ProcessMessage(pfrom, msg.nCommandId, strCommand, vRecv, msg.nTime);
+            } else {
+                LOCK(cs_main);
+                fRet = ProcessMessage(pfrom, msg.nCommandId, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
             pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
@@ -6352,6 +6469,8 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        RecordMessageProcessed(pfrom, msg, GetTimeMicros() - nProcessStart, GetThreadCpuTimeMicros() - nCpuStart);
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -6359,14 +6478,24 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        RecordMessagesRemoved(pfrom->vRecvMsg.begin(), it);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
 
 
-bool SendMessages(CNode* pto, bool fSendTrickle)
+/** Orders trickled transaction announcements by fee rate, highest first */
+struct CompareFeeRateDescending {
+    bool operator()(const pair<CFeeRate, uint256>& a, const pair<CFeeRate, uint256>& b) const
+    {
+        return b.first < a.first;
+    }
+};
+
+bool SendMessages(CNode* pto)
 {
     {
         // Don't send anything until we get their version message
@@ -6402,9 +6531,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
-        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
-        if (!lockMain)
+        // Acquire cs_main for IsInitialBlockDownload() and CNodeState(). While it
+        // is busy this node is skipped, but after MAX_SEND_LOCK_MISSES skipped
+        // rounds we wait for it, so inventory and getdata are not starved.
+        CCriticalBlock lockMain(cs_main, "cs_main", __FILE__, __LINE__, pto->nMainLockMisses < MAX_SEND_LOCK_MISSES);
+        if (!lockMain) {
+            pto->nMainLockMisses++;
             return true;
+        }
+        pto->nMainLockMisses = 0;
 
         // Address refresh broadcast
         static int64_t nLastRebroadcast;
@@ -6412,8 +6547,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addrKnown);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6425,23 +6562,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: addr
         //
-        if (fSendTrickle) {
+        int64_t nNow = GetTimeMicros();
+        if (pto->nNextAddrSend < nNow) {
+            pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000) {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+            {
+                LOCK(pto->cs_addrKnown);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t nStart = 0; nStart < vAddr.size(); nStart += 1000) {
+                vector<CAddress> vBatch(vAddr.begin() + nStart, vAddr.begin() + std::min(vAddr.size(), nStart + 1000));
+                pto->PushMessage("addr", vBatch);
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
         }
 
         CNodeState& state = *State(pto->GetId());
@@ -6490,33 +6629,70 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vInv.reserve(std::max<size_t>(pto->vInventoryToSend.size(), INVENTORY_BROADCAST_MAX));
+
+            // Blocks and masternode inventory are announced right away
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
+                // returns true if wasn't already contained in the set
+                if (pto->setInventoryKnown.insert(inv).second) {
+                    vInv.push_back(inv);
+                    if (vInv.size() >= 1000) {
+                        pto->PushMessage("inv", vInv);
+                        vInv.clear();
+                    }
+                }
+            }
+            pto->vInventoryToSend.clear();
+
+            // Transactions are trickled out on a Poisson timer to protect
+            // privacy. Inbound peers share one timer; outbound peers are
+            // trusted more and get their own, twice as frequent, one.
+            bool fSendTrickle = pto->fWhitelisted;
+            if (pto->nNextInvSend < nNow) {
+                fSendTrickle = true;
+                if (pto->fInbound)
+                    pto->nNextInvSend = PoissonNextSendInbound(nNow, INVENTORY_BROADCAST_INTERVAL);
+                else
+                    pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> 1);
+            }
+            if (!pto->fRelayTxes)
+                pto->setInventoryTxToSend.clear();
+
+            if (fSendTrickle && !pto->setInventoryTxToSend.empty()) {
+                // Announce the best paying transactions first; anything no
+                // longer in the mempool sorts last.
+                vector<pair<CFeeRate, uint256> > vTxToSend;
+                vTxToSend.reserve(pto->setInventoryTxToSend.size());
+                {
+                    LOCK(mempool.cs);
+                    BOOST_FOREACH (const uint256& hash, pto->setInventoryTxToSend) {
+                        map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(hash);
+                        CFeeRate feeRate = mi == mempool.mapTx.end() ? CFeeRate(0) : CFeeRate(mi->second.GetFee(), mi->second.GetTxSize());
+                        vTxToSend.push_back(make_pair(feeRate, hash));
+                    }
+                }
+                sort(vTxToSend.begin(), vTxToSend.end(), CompareFeeRateDescending());
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
+                unsigned int nRelayedTransactions = 0;
+                LOCK(pto->cs_filter);
+                for (vector<pair<CFeeRate, uint256> >::const_iterator it = vTxToSend.begin(); it != vTxToSend.end() && nRelayedTransactions < INVENTORY_BROADCAST_MAX; ++it) {
+                    const uint256& hash = it->second;
+                    pto->setInventoryTxToSend.erase(hash);
 
-                    if (fTrickleWait) {
-                        vInvWait.push_back(inv);
+                    CInv inv(MSG_TX, hash);
+                    if (pto->setInventoryKnown.count(inv))
+                        continue;
+                    // Gone from both the mempool and relay memory; nothing to serve
+                    CTransactionRef ptx = GetRelayTransaction(hash);
+                    if (!ptx)
+                        continue;
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*GetRelayBloomElements(ptx)))
                         continue;
-                    }
-                }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                    nRelayedTransactions++;
+                    pto->setInventoryKnown.insert(inv);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000) {
                         pto->PushMessage("inv", vInv);
@@ -6524,13 +6700,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -14,6 +14,7 @@
 #endif
 
 #include "amount.h"
+#include "blockcache.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
@@ -42,6 +43,7 @@
 
 #include "libzerocoin/CoinSpend.h"
 
+#include <boost/function.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
@@ -107,6 +109,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
+/** Rounds SendMessages skips a peer while cs_main is busy before it blocks on the lock. */
+static const int MAX_SEND_LOCK_MISSES = 10;
 
 /** Enable bloom filter */
  static const bool DEFAULT_PEERBLOOMFILTERS = true;
@@ -142,7 +146,7 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -210,15 +214,25 @@ bool LoadBlockIndex(std::string& strError);
 void UnloadBlockIndex();
 /** See whether the protocol update is enforced for connected nodes */
 int ActiveProtocol();
+/** Handler for a P2P command owned by a subsystem outside of ProcessMessage */
+typedef boost::function<void(CNode*, std::string&, CDataStream&)> MessageHandler;
+/**
+ * Route a command to a subsystem handler. Subsystems register their commands
+ * once during startup, before the message handler threads are started.
+ */
+void RegisterMessageHandler(const std::string& strCommand, const MessageHandler& handler);
+/** Whether a command may be handled without cs_main, concurrently with other peers' messages */
+bool IsConcurrentMessage(const std::string& strCommand);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
+ * Transaction inventory and addresses are trickled on per-peer Poisson timers.
+ *
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
-bool SendMessages(CNode* pto, bool fSendTrickle);
+bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 
@@ -258,6 +272,8 @@ void FlushStateToDisk();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+/** Same as above, but the mempool entry shares ptx instead of copying the transaction */
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
@@ -440,6 +456,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block through the shared block cache, without copying it */
+bool ReadBlockFromDisk(CBlockConstRef& pblock, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -9,11 +9,13 @@
 
 #include "addrman.h"
 #include "masternode-budget.h"
+#include "masternode-sigcheck.h"
 #include "masternode-sync.h"
 #include "masternode.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -278,153 +280,76 @@ void CBudgetManager::SubmitFinalBudget()
 // CBudgetDB
 //
 
-CBudgetDB::CBudgetDB()
+CBudgetDB* pBudgetDB = NULL;
+
+CBudgetDB::CBudgetDB(size_t nCacheSize, bool fMemory, bool fWipe) : CMasternodeCacheDB("budget", nCacheSize, fMemory, fWipe)
 {
-    pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
 }
 
 bool CBudgetDB::Write(const CBudgetManager& objToSave)
 {
-    LOCK(objToSave.cs);
+    if (!IsLoaded())
+        return error("%s : budget is still loading, not overwriting it", __func__);
 
     int64_t nStart = GetTimeMillis();
+    LOCK(objToSave.cs);
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("mnbudget","Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
+    // The seen maps are not stored, they are rebuilt from the network after a restart
+    BeginDump();
+    for (std::map<uint256, CBudgetProposal>::const_iterator it = objToSave.mapProposals.begin(); it != objToSave.mapProposals.end(); ++it)
+        DumpRecord('R', it->first, it->second);
+    for (std::map<uint256, CFinalizedBudget>::const_iterator it = objToSave.mapFinalizedBudgets.begin(); it != objToSave.mapFinalizedBudgets.end(); ++it)
+        DumpRecord('B', it->first, it->second);
+    for (std::map<uint256, CBudgetVote>::const_iterator it = objToSave.mapOrphanMasternodeBudgetVotes.begin(); it != objToSave.mapOrphanMasternodeBudgetVotes.end(); ++it)
+        DumpRecord('o', it->first, it->second);
+    for (std::map<uint256, CFinalizedBudgetVote>::const_iterator it = objToSave.mapOrphanFinalizedBudgetVotes.begin(); it != objToSave.mapOrphanFinalizedBudgetVotes.end(); ++it)
+        DumpRecord('O', it->first, it->second);
+    if (!EndDump())
+        return error("%s : Failed to write budget", __func__);
+
+    LogPrint("mnbudget","Written %u and erased %u records of budget  %dms\n", GetWritten(), GetErased(), GetTimeMillis() - nStart);
 
     return true;
 }
 
-CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
+bool CBudgetDB::Read(CBudgetManager& objToLoad)
 {
-    LOCK(objToLoad.cs);
-
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
+    std::vector<std::pair<uint256, CBudgetProposal> > vProposals;
+    std::vector<std::pair<uint256, CFinalizedBudget> > vFinalizedBudgets;
+    std::vector<std::pair<uint256, CBudgetVote> > vOrphanVotes;
+    std::vector<std::pair<uint256, CFinalizedBudgetVote> > vOrphanFinalizedVotes;
+    ReadRecords('R', vProposals);
+    ReadRecords('B', vFinalizedBudgets);
+    ReadRecords('o', vOrphanVotes);
+    ReadRecords('O', vOrphanFinalizedVotes);
 
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+    {
+        LOCK(objToLoad.cs);
+        objToLoad.mapProposals.insert(vProposals.begin(), vProposals.end());
+        objToLoad.mapFinalizedBudgets.insert(vFinalizedBudgets.begin(), vFinalizedBudgets.end());
+        objToLoad.mapOrphanMasternodeBudgetVotes.insert(vOrphanVotes.begin(), vOrphanVotes.end());
+        objToLoad.mapOrphanFinalizedBudgetVotes.insert(vOrphanFinalizedVotes.begin(), vOrphanFinalizedVotes.end());
     }
 
-    LogPrint("mnbudget","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("mnbudget","Loaded %u records from budget  %dms\n", size(), GetTimeMillis() - nStart);
+    LogPrint("mnbudget","Budget manager - cleaning....\n");
+    objToLoad.CheckAndRemove();
+    LogPrint("mnbudget","Budget manager - result:\n");
     LogPrint("mnbudget","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("mnbudget","Budget manager - cleaning....\n");
-        objToLoad.CheckAndRemove();
-        LogPrint("mnbudget","Budget manager - result:\n");
-        LogPrint("mnbudget","  %s\n", objToLoad.ToString());
-    }
 
-    return Ok;
+    return true;
 }
 
 void DumpBudgets()
 {
-    int64_t nStart = GetTimeMillis();
+    if (!pBudgetDB)
+        return;
 
-    CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
-
-    LogPrint("mnbudget","Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CBudgetDB::FileError)
-        LogPrint("mnbudget","Missing budgets file - budget.dat, will try to recreate\n");
-    else if (readResult != CBudgetDB::Ok) {
-        LogPrint("mnbudget","Error reading budget.dat: ");
-        if (readResult == CBudgetDB::IncorrectFormat)
-            LogPrint("mnbudget","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("mnbudget","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("mnbudget","Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
+    int64_t nStart = GetTimeMillis();
+    LogPrint("mnbudget","Writting info to budget...\n");
+    pBudgetDB->Write(budget);
 
     LogPrint("mnbudget","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
@@ -1050,6 +975,33 @@ void CBudgetManager::NewBlock()
     LogPrint("mnbudget","CBudgetManager::NewBlock - PASSED\n");
 }
 
+static void ExtractVoteSignatures(CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    CBudgetVote vote;
+    vRecv >> vote;
+    vChecks.push_back(CMessageSigCheck(vote.GetStrMessage(), vote.vchSig));
+}
+
+static void ExtractFinalizedVoteSignatures(CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    CFinalizedBudgetVote vote;
+    vRecv >> vote;
+    vChecks.push_back(CMessageSigCheck(vote.GetStrMessage(), vote.vchSig));
+}
+
+void CBudgetManager::RegisterMessageHandlers()
+{
+    MessageHandler handler = boost::bind(&CBudgetManager::ProcessMessage, this, _1, _2, _3);
+    RegisterMessageHandler("mnvs", handler);
+    RegisterMessageHandler("mprop", handler);
+    RegisterMessageHandler("mvote", handler);
+    RegisterMessageHandler("fbs", handler);
+    RegisterMessageHandler("fbvote", handler);
+
+    RegisterMessageSigExtractor("mvote", &ExtractVoteSignatures);
+    RegisterMessageSigExtractor("fbvote", &ExtractFinalizedVoteSignatures);
+}
+
 void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     // lite mode is not supported
@@ -1440,6 +1392,9 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1452,6 +1407,9 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1466,6 +1424,9 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
     fValid = true;
+    nYeas = other.nYeas;
+    nNays = other.nNays;
+    nAbstains = other.nAbstains;
 }
 
 bool CBudgetProposal::IsValid(std::string& strError, bool fCheckCollateral)
@@ -1572,7 +1533,11 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end())
+        CountVote((*it).second, -1);
     mapVotes[hash] = vote;
+    CountVote(vote, 1);
     LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s %s\n", strAction.c_str(), vote.GetHash().ToString().c_str());
 
     return true;
@@ -1584,66 +1549,54 @@ void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
+        bool fVoteValid = (*it).second.SignatureValid(fSignatureCheck);
+        if (fVoteValid != (*it).second.fValid) {
+            CountVote((*it).second, -1);
+            (*it).second.fValid = fVoteValid;
+            CountVote((*it).second, 1);
+        }
         ++it;
     }
 }
 
-double CBudgetProposal::GetRatio()
+void CBudgetProposal::CountVote(const CBudgetVote& vote, int nDelta)
 {
-    int yeas = 0;
-    int nays = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES) yeas++;
-        if ((*it).second.nVote == VOTE_NO) nays++;
-        ++it;
-    }
-
-    if (yeas + nays == 0) return 0.0f;
+    if (!vote.fValid) return;
 
-    return ((double)(yeas) / (double)(yeas + nays));
+    if (vote.nVote == VOTE_YES) nYeas += nDelta;
+    if (vote.nVote == VOTE_NO) nNays += nDelta;
+    if (vote.nVote == VOTE_ABSTAIN) nAbstains += nDelta;
 }
 
-int CBudgetProposal::GetYeas()
+void CBudgetProposal::RecountVotes()
 {
-    int ret = 0;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
+        CountVote((*it).second, 1);
         ++it;
     }
-
-    return ret;
 }
 
-int CBudgetProposal::GetNays()
+double CBudgetProposal::GetRatio()
 {
-    int ret = 0;
+    int yeas = 0;
+    int nays = 0;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
-}
-
-int CBudgetProposal::GetAbstains()
-{
-    int ret = 0;
 
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
+        if ((*it).second.nVote == VOTE_YES) yeas++;
+        if ((*it).second.nVote == VOTE_NO) nays++;
         ++it;
     }
 
-    return ret;
+    if (yeas + nays == 0) return 0.0f;
+
+    return ((double)(yeas) / (double)(yeas + nays));
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1743,6 +1696,11 @@ void CBudgetVote::Relay()
     RelayInv(inv);
 }
 
+std::string CBudgetVote::GetStrMessage() const
+{
+    return vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     // Choose coins to use
@@ -1750,7 +1708,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("mnbudget","CBudgetVote::Sign - Error upon calling SignMessage");
@@ -1768,7 +1726,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -1781,11 +1739,15 @@ bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 
     if (!fSignatureCheck) return true;
 
-    if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+    // Only verify again if the masternode has changed its key since
+    if (pubKeyVerified == pmn->pubKeyMasternode) return true;
+
+    if (!VerifyMasternodeMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
         LogPrint("mnbudget","CBudgetVote::SignatureValid() - Verify message failed\n");
         return false;
     }
 
+    pubKeyVerified = pmn->pubKeyMasternode;
     return true;
 }
 
@@ -2248,6 +2210,11 @@ void CFinalizedBudgetVote::Relay()
     RelayInv(inv);
 }
 
+std::string CFinalizedBudgetVote::GetStrMessage() const
+{
+    return vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     // Choose coins to use
@@ -2255,7 +2222,7 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("mnbudget","CFinalizedBudgetVote::Sign - Error upon calling SignMessage");
@@ -2274,7 +2241,7 @@ bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
 
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -2285,11 +2252,15 @@ bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 
     if (!fSignatureCheck) return true;
 
-    if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+    // Only verify again if the masternode has changed its key since
+    if (pubKeyVerified == pmn->pubKeyMasternode) return true;
+
+    if (!VerifyMasternodeMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
         LogPrint("mnbudget","CFinalizedBudgetVote::SignatureValid() - Verify message failed %s %s\n", strMessage, errorMessage);
         return false;
     }
 
+    pubKeyVerified = pmn->pubKeyMasternode;
     return true;
 }
 
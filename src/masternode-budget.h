@@ -12,6 +12,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternodedb.h"
 #include "net.h"
 #include "sync.h"
 #include "util.h"
@@ -66,6 +67,7 @@ class CBudgetVote
 public:
     bool fValid;  //if the vote is currently valid / counted
     bool fSynced; //if we've sent this to our peers
+    CPubKey pubKeyVerified; //masternode key vchSig was last verified against, not serialized
     CTxIn vin;
     uint256 nProposalHash;
     int nVote;
@@ -77,6 +79,8 @@ public:
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
+    /** The text covered by vchSig */
+    std::string GetStrMessage() const;
     void Relay();
 
     std::string GetVoteString()
@@ -119,6 +123,7 @@ class CFinalizedBudgetVote
 public:
     bool fValid;  //if the vote is currently valid / counted
     bool fSynced; //if we've sent this to our peers
+    CPubKey pubKeyVerified; //masternode key vchSig was last verified against, not serialized
     CTxIn vin;
     uint256 nBudgetHash;
     int64_t nTime;
@@ -129,6 +134,8 @@ public:
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
+    /** The text covered by vchSig */
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -152,30 +159,20 @@ public:
     }
 };
 
-/** Save Budget Manager (budget.dat)
+/** Save Budget Manager (budget/), one record per proposal, finalized budget and orphan vote
  */
-class CBudgetDB
+class CBudgetDB : public CMasternodeCacheDB
 {
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CBudgetDB();
+    CBudgetDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    /** Write what changed since the last dump */
     bool Write(const CBudgetManager& objToSave);
-    ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
+    /** Merge the stored records into the budget manager, keeping entries it already has */
+    bool Read(CBudgetManager& objToLoad);
 };
 
+extern CBudgetDB* pBudgetDB;
+
 
 //
 // Budget Manager : Contains all proposals for the budget
@@ -225,6 +222,8 @@ public:
 
     void Calculate();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    /** Route the budget P2P commands to ProcessMessage */
+    void RegisterMessageHandlers();
     void NewBlock();
     CBudgetProposal* FindProposal(const std::string& strProposalName);
     CBudgetProposal* FindProposal(uint256 nHash);
@@ -467,6 +466,17 @@ private:
     mutable CCriticalSection cs;
     CAmount nAlloted;
 
+protected:
+    // tallies of the valid votes in mapVotes, kept current as votes are added or invalidated
+    int nYeas;
+    int nNays;
+    int nAbstains;
+
+    /** Add (nDelta = 1) or remove (nDelta = -1) a vote from the tallies if it is valid */
+    void CountVote(const CBudgetVote& vote, int nDelta);
+    /** Recompute the tallies from mapVotes */
+    void RecountVotes();
+
 public:
     bool fValid;
     std::string strProposalName;
@@ -517,9 +527,9 @@ public:
     int GetBlockCurrentCycle();
     int GetBlockEndCycle();
     double GetRatio();
-    int GetYeas();
-    int GetNays();
-    int GetAbstains();
+    int GetYeas() const { return nYeas; }
+    int GetNays() const { return nNays; }
+    int GetAbstains() const { return nAbstains; }
     CAmount GetAmount() { return nAmount; }
     void SetAllotted(CAmount nAllotedIn) { nAlloted = nAllotedIn; }
     CAmount GetAllotted() { return nAlloted; }
@@ -558,6 +568,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -586,6 +598,9 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        swap(first.nYeas, second.nYeas);
+        swap(first.nNays, second.nNays);
+        swap(first.nAbstains, second.nAbstains);
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
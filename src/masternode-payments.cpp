@@ -7,6 +7,7 @@
 #include "masternode-payments.h"
 #include "addrman.h"
 #include "masternode-budget.h"
+#include "masternode-sigcheck.h"
 #include "masternode-sync.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
@@ -14,6 +15,7 @@
 #include "sync.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 #define REV_BLOCK 260000
@@ -30,150 +32,68 @@ CCriticalSection cs_mapMasternodePayeeVotes;
 // CMasternodePaymentDB
 //
 
-CMasternodePaymentDB::CMasternodePaymentDB()
+CMasternodePaymentDB* pMasternodePaymentDB = NULL;
+
+CMasternodePaymentDB::CMasternodePaymentDB(size_t nCacheSize, bool fMemory, bool fWipe) : CMasternodeCacheDB("mnpayments", nCacheSize, fMemory, fWipe)
 {
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
 }
 
 bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 {
-    int64_t nStart = GetTimeMillis();
+    if (!IsLoaded())
+        return error("%s : mnpayments is still loading, not overwriting it", __func__);
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
+    int64_t nStart = GetTimeMillis();
+    LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
 
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
+    BeginDump();
+    for (std::map<uint256, CMasternodePaymentWinner>::const_iterator it = objToSave.mapMasternodePayeeVotes.begin(); it != objToSave.mapMasternodePayeeVotes.end(); ++it)
+        DumpRecord('w', it->first, it->second);
+    for (std::map<int, CMasternodeBlockPayees>::const_iterator it = objToSave.mapMasternodeBlocks.begin(); it != objToSave.mapMasternodeBlocks.end(); ++it)
+        DumpRecord('h', it->first, it->second);
+    if (!EndDump())
+        return error("%s : Failed to write mnpayments", __func__);
 
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode","Written %u and erased %u records of mnpayments  %dms\n", GetWritten(), GetErased(), GetTimeMillis() - nStart);
 
     return true;
 }
 
-CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
+bool CMasternodePaymentDB::Read(CMasternodePayments& objToLoad)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
 
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
+    std::vector<std::pair<uint256, CMasternodePaymentWinner> > vWinners;
+    std::vector<std::pair<uint256, CMasternodeBlockPayees> > vBlocks;
+    ReadRecords('w', vWinners);
+    ReadRecords('h', vBlocks);
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+    {
+        LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
+        objToLoad.mapMasternodePayeeVotes.insert(vWinners.begin(), vWinners.end());
+        for (unsigned int i = 0; i < vBlocks.size(); i++)
+            objToLoad.mapMasternodeBlocks.insert(make_pair(vBlocks[i].second.nBlockHeight, vBlocks[i].second));
     }
 
-    LogPrint("masternode","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode","Loaded %u records from mnpayments  %dms\n", size(), GetTimeMillis() - nStart);
+    LogPrint("masternode","Masternode payments manager - cleaning....\n");
+    objToLoad.CleanPaymentList();
+    LogPrint("masternode","Masternode payments manager - result:\n");
     LogPrint("masternode","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode payments manager - cleaning....\n");
-        objToLoad.CleanPaymentList();
-        LogPrint("masternode","Masternode payments manager - result:\n");
-        LogPrint("masternode","  %s\n", objToLoad.ToString());
-    }
 
-    return Ok;
+    return true;
 }
 
 void DumpMasternodePayments()
 {
-    int64_t nStart = GetTimeMillis();
+    if (!pMasternodePaymentDB)
+        return;
 
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrint("masternode","Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError)
-        LogPrint("masternode","Missing budgets file - mnpayments.dat, will try to recreate\n");
-    else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrint("masternode","Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
+    int64_t nStart = GetTimeMillis();
+    LogPrint("masternode","Writting info to mnpayments...\n");
+    pMasternodePaymentDB->Write(masternodePayments);
 
-    LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode","Payments dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted)
@@ -428,6 +348,22 @@ int CMasternodePayments::GetMinMasternodePaymentsProto()
         return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT; // Also allow old peers as long as they are allowed to run
 }
 
+static void ExtractWinnerSignatures(CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    CMasternodePaymentWinner winner;
+    vRecv >> winner;
+    vChecks.push_back(CMessageSigCheck(winner.GetStrMessage(), winner.vchSig));
+}
+
+void CMasternodePayments::RegisterMessageHandlers()
+{
+    MessageHandler handler = boost::bind(&CMasternodePayments::ProcessMessageMasternodePayments, this, _1, _2, _3);
+    RegisterMessageHandler("mnget", handler);
+    RegisterMessageHandler("mnw", handler);
+
+    RegisterMessageSigExtractor("mnw", &ExtractWinnerSignatures);
+}
+
 void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (!masternodeSync.IsBlockchainSynced()) return;
@@ -512,14 +448,19 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
     }
 }
 
+std::string CMasternodePaymentWinner::GetStrMessage() const
+{
+    return vinMasternode.prevout.ToStringShort() +
+           boost::lexical_cast<std::string>(nBlockHeight) +
+           payee.ToString();
+}
+
 bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
-    std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                             boost::lexical_cast<std::string>(nBlockHeight) +
-                             payee.ToString();
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage.c_str());
@@ -862,12 +803,10 @@ bool CMasternodePaymentWinner::SignatureValid()
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                                 boost::lexical_cast<std::string>(nBlockHeight) +
-                                 payee.ToString();
+        std::string strMessage = GetStrMessage();
 
         std::string errorMessage = "";
-        if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+        if (!VerifyMasternodeMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
             return error("CMasternodePaymentWinner::SignatureValid() - Got bad Masternode address signature %s\n", vinMasternode.prevout.hash.ToString());
         }
 
@@ -10,6 +10,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternodedb.h"
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -35,30 +36,20 @@ void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStak
 
 void DumpMasternodePayments();
 
-/** Save Masternode Payment Data (mnpayments.dat)
+/** Save Masternode Payment Data (mnpayments/), one record per payment vote and block
  */
-class CMasternodePaymentDB
+class CMasternodePaymentDB : public CMasternodeCacheDB
 {
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CMasternodePaymentDB();
+    CMasternodePaymentDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    /** Write what changed since the last dump */
     bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+    /** Merge the stored records into the payments object, keeping entries it already has */
+    bool Read(CMasternodePayments& objToLoad);
 };
 
+extern CMasternodePaymentDB* pMasternodePaymentDB;
+
 class CMasternodePayee
 {
 public:
@@ -196,6 +187,8 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
+    /** The text covered by vchSig */
+    std::string GetStrMessage() const;
     void Relay();
 
     void AddPayee(CScript payeeIn)
@@ -283,6 +276,8 @@ public:
 
     int GetMinMasternodePaymentsProto();
     void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    /** Route the payment P2P commands to ProcessMessageMasternodePayments */
+    void RegisterMessageHandlers();
     std::string GetRequiredPaymentsString(int nBlockHeight);
     void FillBlockPayee(CMutableTransaction& txNew, int64_t nFees, bool fProofOfStake, bool fZFNSStake);
     std::string ToString() const;
@@ -0,0 +1,188 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-sigcheck.h"
+
+#include "base58.h"
+#include "checkqueue.h"
+#include "hash.h"
+#include "main.h"
+#include "random.h"
+#include "sync.h"
+#include "util.h"
+
+#include <map>
+
+#include <boost/thread.hpp>
+
+/** Upper bound on remembered signers; about 100 bytes per entry */
+static const unsigned int MAX_RECOVERED_SIGNERS = 50000;
+
+namespace
+{
+/**
+ * Signers recovered from (message hash, signature) pairs. A null key id marks
+ * a signature that could not be recovered at all.
+ */
+class CRecoveredSignerCache
+{
+private:
+    std::map<uint256, CKeyID> mapSigners;
+    boost::shared_mutex cs_signers;
+
+public:
+    bool Get(const uint256& key, CKeyID& keyID)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_signers);
+        std::map<uint256, CKeyID>::const_iterator it = mapSigners.find(key);
+        if (it == mapSigners.end())
+            return false;
+        keyID = it->second;
+        return true;
+    }
+
+    void Set(const uint256& key, const CKeyID& keyID)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_signers);
+        while (mapSigners.size() >= MAX_RECOVERED_SIGNERS) {
+            // Evict a random entry, like the script signature cache does
+            std::map<uint256, CKeyID>::iterator it = mapSigners.lower_bound(GetRandHash());
+            if (it == mapSigners.end())
+                it = mapSigners.begin();
+            mapSigners.erase(it);
+        }
+        mapSigners[key] = keyID;
+    }
+};
+
+CRecoveredSignerCache signerCache;
+
+/** Extractors of the commands carrying masternode signatures, indexed by interned command id */
+std::vector<MessageSigExtractor> vSigExtractors;
+
+CCheckQueue<CMessageSigCheck> messagesigcheckqueue(32);
+/** CCheckQueue serves a single master at a time, but several message handlers may submit */
+CCriticalSection cs_messagesigcheckqueue;
+} // anon namespace
+
+/** Hash that CObfuScationSigner::SignMessage signs for strMessage */
+static uint256 SignedMessageHash(const std::string& strMessage)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+    return ss.GetHash();
+}
+
+static uint256 SignerCacheKey(const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    return Hash(hash.begin(), hash.end(), vchSig.begin(), vchSig.end());
+}
+
+/** Recover the signer of hash, from the cache when possible */
+static CKeyID RecoverSigner(const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    uint256 key = SignerCacheKey(hash, vchSig);
+    CKeyID keyID;
+    if (signerCache.Get(key, keyID))
+        return keyID;
+
+    CPubKey pubkey;
+    if (pubkey.RecoverCompact(hash, vchSig))
+        keyID = pubkey.GetID();
+    signerCache.Set(key, keyID);
+    return keyID;
+}
+
+CMessageSigCheck::CMessageSigCheck(const std::string& strMessage, const std::vector<unsigned char>& vchSigIn) : hash(SignedMessageHash(strMessage)), vchSig(vchSigIn)
+{
+}
+
+bool CMessageSigCheck::operator()()
+{
+    RecoverSigner(hash, vchSig);
+    // A bad signature is not an error here; it is reported when the message is processed
+    return true;
+}
+
+bool VerifyMasternodeMessage(const CPubKey& pubkey, const std::vector<unsigned char>& vchSig, const std::string& strMessage, std::string& errorMessage)
+{
+    CKeyID keyID = RecoverSigner(SignedMessageHash(strMessage), vchSig);
+    if (keyID.IsNull()) {
+        errorMessage = "Error recovering public key.";
+        return false;
+    }
+
+    if (keyID != pubkey.GetID()) {
+        LogPrint("masternode", "VerifyMasternodeMessage -- keys don't match: %s %s\n", CBitcoinAddress(keyID).ToString(), CBitcoinAddress(pubkey.GetID()).ToString());
+        errorMessage = "Signer does not match the expected key.";
+        return false;
+    }
+    return true;
+}
+
+void CheckMessageSignatures(std::vector<CMessageSigCheck>& vChecks)
+{
+    if (nScriptCheckThreads == 0 || vChecks.size() < 2) {
+        BOOST_FOREACH (CMessageSigCheck& check, vChecks)
+            check();
+        return;
+    }
+
+    LOCK(cs_messagesigcheckqueue);
+    CCheckQueueControl<CMessageSigCheck> control(&messagesigcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+void RegisterMessageSigExtractor(const std::string& strCommand, const MessageSigExtractor& extractor)
+{
+    int nCommandId = RegisterMessageCommand(strCommand);
+    if ((int)vSigExtractors.size() <= nCommandId)
+        vSigExtractors.resize(nCommandId + 1);
+    vSigExtractors[nCommandId] = extractor;
+}
+
+static const MessageSigExtractor* GetSigExtractor(const CNetMessage& msg)
+{
+    if (msg.nCommandId >= (int)vSigExtractors.size() || !vSigExtractors[msg.nCommandId])
+        return NULL;
+    return &vSigExtractors[msg.nCommandId];
+}
+
+void PrecheckQueuedSignatures(std::deque<CNetMessage>::iterator begin, std::deque<CNetMessage>::iterator end)
+{
+    if (begin == end || begin->fSigsChecked || GetSigExtractor(*begin) == NULL)
+        return;
+
+    std::vector<CMessageSigCheck> vChecks;
+    unsigned int nMessages = 0;
+    for (std::deque<CNetMessage>::iterator it = begin; it != end && nMessages < MAX_SIGCHECK_BATCH_MESSAGES; ++it) {
+        if (!it->complete())
+            break;
+        const MessageSigExtractor* pextractor = GetSigExtractor(*it);
+        if (pextractor == NULL || it->fSigsChecked)
+            continue;
+        it->fSigsChecked = true;
+        nMessages++;
+
+        // Work on a copy so the message itself is still unread when it is processed
+        CDataStream vRecv(it->vRecv.begin(), it->vRecv.end(), it->vRecv.GetType(), it->vRecv.GetVersion());
+        try {
+            (*pextractor)(vRecv, vChecks);
+        } catch (const std::exception& e) {
+            // Malformed messages are rejected when they are processed
+        }
+    }
+
+    if (vChecks.size() > 1)
+        LogPrint("masternode", "PrecheckQueuedSignatures -- recovering %u signatures from %u messages\n", vChecks.size(), nMessages);
+    CheckMessageSignatures(vChecks);
+}
+
+void ThreadMessageSigCheck()
+{
+    RenameThread("fastnode-mnsigch");
+    messagesigcheckqueue.Thread();
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MASTERNODE_SIGCHECK_H
+#define MASTERNODE_SIGCHECK_H
+
+#include "net.h"
+#include "pubkey.h"
+#include "uint256.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+/** Maximum number of queued messages of one peer whose signatures are recovered as one batch */
+static const unsigned int MAX_SIGCHECK_BATCH_MESSAGES = 500;
+
+/**
+ * Recovery of one compact signature over a masternode network message. The
+ * expensive part of checking such a signature is recovering the signing key,
+ * which does not depend on the key the message is expected to be signed with,
+ * so it can be done ahead of processing. The result lands in the recovered
+ * signer cache consulted by VerifyMasternodeMessage.
+ */
+class CMessageSigCheck
+{
+private:
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+
+public:
+    CMessageSigCheck() {}
+    CMessageSigCheck(const std::string& strMessage, const std::vector<unsigned char>& vchSigIn);
+
+    bool operator()();
+
+    void swap(CMessageSigCheck& check)
+    {
+        std::swap(hash, check.hash);
+        vchSig.swap(check.vchSig);
+    }
+};
+
+/** Pull the signatures out of a serialized message, without acting on it */
+typedef boost::function<void(CDataStream&, std::vector<CMessageSigCheck>&)> MessageSigExtractor;
+
+/**
+ * Verify that strMessage was signed by pubkey, the way CObfuScationSigner does,
+ * but reuse the signer recovered earlier for the same message and signature.
+ */
+bool VerifyMasternodeMessage(const CPubKey& pubkey, const std::vector<unsigned char>& vchSig, const std::string& strMessage, std::string& errorMessage);
+
+/** Recover a batch of signatures, in parallel when verification threads are running */
+void CheckMessageSignatures(std::vector<CMessageSigCheck>& vChecks);
+
+/** Register the signature extractor of a command (only during startup) */
+void RegisterMessageSigExtractor(const std::string& strCommand, const MessageSigExtractor& extractor);
+
+/**
+ * When the message at begin carries masternode signatures, recover those of it
+ * and of the signed messages queued behind it as one parallel batch. The
+ * messages are still processed one by one and in order afterwards; their
+ * signature checks are then answered from the cache.
+ */
+void PrecheckQueuedSignatures(std::deque<CNetMessage>::iterator begin, std::deque<CNetMessage>::iterator end);
+
+/** Run an instance of the masternode message signature checking thread */
+void ThreadMessageSigCheck();
+
+#endif // MASTERNODE_SIGCHECK_H
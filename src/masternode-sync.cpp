@@ -17,6 +17,8 @@
 #include "addrman.h"
 // clang-format on
 
+#include <boost/bind.hpp>
+
 class CMasternodeSync;
 CMasternodeSync masternodeSync;
 
@@ -82,6 +84,14 @@ void CMasternodeSync::Reset()
     RequestedMasternodeAssets = MASTERNODE_SYNC_INITIAL;
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
+    {
+        LOCK(cs_syncRanges);
+        vSyncRanges.clear();
+        setRangePeers.clear();
+        nSyncRangesSince = 0;
+        fSyncRangesFailed = false;
+    }
+    nBudgetRequestsPipelined = 0;
 }
 
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
@@ -124,6 +134,119 @@ void CMasternodeSync::AddedBudgetItem(uint256 hash)
     }
 }
 
+bool CMasternodeSync::AddedMasternodeRange(NodeId nodeId, int nRange, int nCount, bool fLast)
+{
+    LOCK(cs_syncRanges);
+    if (nRange < 0 || nRange >= (int)vSyncRanges.size())
+        return false;
+
+    CMasternodeSyncRange& range = vSyncRanges[nRange];
+    // A peer that timed out may still deliver after the slice was handed to someone else
+    if (range.nPeer != nodeId || range.fDone)
+        return setRangePeers.count(nodeId) > 0;
+
+    range.nLastActivity = GetTime();
+    if (nCount > 0)
+        lastMasternodeList = GetTime();
+    sumMasternodeList += nCount;
+    if (fLast) {
+        range.fDone = true;
+        countMasternodeList++;
+        LogPrint("masternode", "CMasternodeSync::AddedMasternodeRange - slice %d complete from peer %d\n", nRange, nodeId);
+    }
+    return true;
+}
+
+bool CMasternodeSync::SyncListRanges(const std::vector<CNode*>& vNodesIn)
+{
+    LOCK(cs_syncRanges);
+    if (fSyncRangesFailed)
+        return false;
+
+    std::vector<CNode*> vPeers;
+    BOOST_FOREACH (CNode* pnode, vNodesIn) {
+        if (!pnode->fDisconnect && pnode->nVersion >= MNSYNC_RANGE_VERSION)
+            vPeers.push_back(pnode);
+    }
+
+    if (vSyncRanges.empty()) {
+        // Not worth it with a single capable peer; dseg does the same job
+        if (vPeers.size() < MASTERNODE_SYNC_RANGE_PEERS)
+            return false;
+
+        // A recent enough list from mncache.dat only needs what changed since it was saved
+        int64_t nSnapshotAge = GetTime() - mnodeman.nListSyncedTime;
+        if (mnodeman.size() > 0 && mnodeman.nListSyncedTime > 0 && nSnapshotAge < MASTERNODE_EXPIRATION_SECONDS)
+            nSyncRangesSince = mnodeman.nListSyncedTime - MASTERNODE_MIN_MNP_SECONDS;
+        else
+            nSyncRangesSince = 0;
+
+        vSyncRanges.assign(MASTERNODES_SYNC_RANGES, CMasternodeSyncRange());
+        LogPrintf("CMasternodeSync::SyncListRanges - fetching masternode list in %d slices from %u peers, since %d\n", MASTERNODES_SYNC_RANGES, vPeers.size(), nSyncRangesSince);
+    }
+
+    int nDone = 0;
+    BOOST_FOREACH (const CMasternodeSyncRange& range, vSyncRanges)
+        nDone += range.fDone;
+    if (nDone == (int)vSyncRanges.size()) {
+        // Every slice is in: no need to wait for the list to go quiet
+        LogPrintf("CMasternodeSync::SyncListRanges - masternode list synced, %d entries\n", sumMasternodeList);
+        mnodeman.nListSyncedTime = GetTime();
+        GetNextAsset();
+        return true;
+    }
+
+    // Count what each connected peer is already working on
+    std::map<NodeId, int> mapLoad;
+    int64_t nNow = GetTime();
+    BOOST_FOREACH (CNode* pnode, vPeers)
+        mapLoad[pnode->GetId()] = 0;
+    BOOST_FOREACH (CMasternodeSyncRange& range, vSyncRanges) {
+        if (range.fDone || range.nPeer == -1)
+            continue;
+        if (mapLoad.count(range.nPeer) && range.nLastActivity >= nNow - MASTERNODE_SYNC_TIMEOUT * 3)
+            mapLoad[range.nPeer]++;
+    }
+
+    // Hand unassigned slices, and slices whose peer went quiet or away, to the least busy peer
+    for (unsigned int i = 0; i < vSyncRanges.size(); i++) {
+        CMasternodeSyncRange& range = vSyncRanges[i];
+        if (range.fDone)
+            continue;
+        if (range.nPeer != -1 && mapLoad.count(range.nPeer) && range.nLastActivity >= nNow - MASTERNODE_SYNC_TIMEOUT * 3)
+            continue;
+
+        if (range.nAttempts >= MASTERNODE_SYNC_THRESHOLD * 3) {
+            LogPrintf("CMasternodeSync::SyncListRanges - slice %d keeps timing out, falling back to dseg\n", i);
+            vSyncRanges.clear();
+            fSyncRangesFailed = true;
+            return false;
+        }
+
+        CNode* pnodeBest = NULL;
+        BOOST_FOREACH (CNode* pnode, vPeers) {
+            // Prefer someone other than the peer that just let this slice time out
+            if (pnode->GetId() == range.nPeer && vPeers.size() > 1)
+                continue;
+            if (pnodeBest == NULL || mapLoad[pnode->GetId()] < mapLoad[pnodeBest->GetId()])
+                pnodeBest = pnode;
+        }
+        if (pnodeBest == NULL)
+            return true;
+
+        uint256 hashBegin, hashEnd;
+        GetMasternodeSyncRange(i, hashBegin, hashEnd);
+        mnodeman.RequestListRange(pnodeBest, hashBegin, hashEnd, nSyncRangesSince);
+
+        range.nPeer = pnodeBest->GetId();
+        range.nLastActivity = nNow;
+        range.nAttempts++;
+        setRangePeers.insert(range.nPeer);
+        mapLoad[range.nPeer]++;
+    }
+    return true;
+}
+
 bool CMasternodeSync::IsBudgetPropEmpty()
 {
     return sumBudgetItemProp == 0 && countBudgetItemProp > 0;
@@ -150,7 +273,10 @@ void CMasternodeSync::GetNextAsset()
         break;
     case (MASTERNODE_SYNC_MNW):
         RequestedMasternodeAssets = MASTERNODE_SYNC_BUDGET;
-        break;
+        // Peers asked for budgets alongside winners count as this stage's attempts
+        RequestedMasternodeAttempt = nBudgetRequestsPipelined;
+        nAssetSyncStarted = GetTime();
+        return;
     case (MASTERNODE_SYNC_BUDGET):
         LogPrintf("CMasternodeSync::GetNextAsset - Sync has finished\n");
         RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
@@ -181,6 +307,11 @@ std::string CMasternodeSync::GetSyncStatus()
     return "";
 }
 
+void CMasternodeSync::RegisterMessageHandlers()
+{
+    RegisterMessageHandler("ssc", boost::bind(&CMasternodeSync::ProcessMessage, this, _1, _2, _3));
+}
+
 void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (strCommand == "ssc") { //Sync status count
@@ -203,12 +334,12 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
             countMasternodeWinner++;
             break;
         case (MASTERNODE_SYNC_BUDGET_PROP):
-            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
+            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET && !IsBudgetPipelined()) return;
             sumBudgetItemProp += nCount;
             countBudgetItemProp++;
             break;
         case (MASTERNODE_SYNC_BUDGET_FIN):
-            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
+            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET && !IsBudgetPipelined()) return;
             sumBudgetItemFin += nCount;
             countBudgetItemFin++;
             break;
@@ -265,6 +396,11 @@ void CMasternodeSync::Process()
     TRY_LOCK(cs_vNodes, lockRecv);
     if (!lockRecv) return;
 
+    // Fetch the list in slices from several peers at once where they support it
+    if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST && Params().NetworkID() != CBaseChainParams::REGTEST) {
+        if (SyncListRanges(vNodes)) return;
+    }
+
     BOOST_FOREACH (CNode* pnode, vNodes) {
         if (Params().NetworkID() == CBaseChainParams::REGTEST) {
             if (RequestedMasternodeAttempt <= 2) {
@@ -361,6 +497,14 @@ void CMasternodeSync::Process()
                 pnode->PushMessage("mnget", nMnCount); //sync payees
                 RequestedMasternodeAttempt++;
 
+                // Budgets don't depend on the winners, so fetch them from the same peer now
+                if (pnode->nVersion >= ActiveProtocol() && !pnode->HasFulfilledRequest("busync")) {
+                    pnode->FulfilledRequest("busync");
+                    uint256 n = 0;
+                    pnode->PushMessage("mnvs", n); //sync masternode votes
+                    nBudgetRequestsPipelined++;
+                }
+
                 return;
             }
         }
@@ -7,6 +7,9 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "net.h"
+#include "sync.h"
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_SYNC_SPORKS 1
 #define MASTERNODE_SYNC_LIST 2
@@ -19,10 +22,21 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
+#define MASTERNODE_SYNC_RANGE_PEERS 2
 
 class CMasternodeSync;
 extern CMasternodeSync masternodeSync;
 
+/** One slice of the masternode list being fetched during ranged list sync */
+struct CMasternodeSyncRange {
+    NodeId nPeer;          // peer the slice is assigned to, -1 if none
+    int64_t nLastActivity; // when it was requested or last sent us a chunk
+    int nAttempts;
+    bool fDone;
+
+    CMasternodeSyncRange() : nPeer(-1), nLastActivity(0), nAttempts(0), fDone(false) {}
+};
+
 //
 // CMasternodeSync : Sync masternode assets in stages
 //
@@ -58,14 +72,30 @@ public:
     // Time when current masternode asset sync started
     int64_t nAssetSyncStarted;
 
+    // Ranged list sync: slices of the list fetched from several peers at once
+    std::vector<CMasternodeSyncRange> vSyncRanges;
+    std::set<NodeId> setRangePeers;
+    int64_t nSyncRangesSince;
+    bool fSyncRangesFailed;
+    CCriticalSection cs_syncRanges;
+
+    // Budget requests already sent while winners were still syncing
+    int nBudgetRequestsPipelined;
+
     CMasternodeSync();
 
     void AddedMasternodeList(uint256 hash);
     void AddedMasternodeWinner(uint256 hash);
     void AddedBudgetItem(uint256 hash);
+    /** Account a chunk of list slice nRange; false if the peer was not asked for that slice */
+    bool AddedMasternodeRange(NodeId nodeId, int nRange, int nCount, bool fLast);
+    /** Hand out list slices to capable peers; false if the legacy dseg sync has to be used instead */
+    bool SyncListRanges(const std::vector<CNode*>& vNodesIn);
     void GetNextAsset();
     std::string GetSyncStatus();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    /** Route the sync status P2P command to ProcessMessage */
+    void RegisterMessageHandlers();
     bool IsBudgetFinEmpty();
     bool IsBudgetPropEmpty();
 
@@ -74,6 +104,7 @@ public:
     bool IsSynced();
     bool IsBlockchainSynced();
     bool IsMasternodeListSynced() { return RequestedMasternodeAssets > MASTERNODE_SYNC_LIST; }
+    bool IsBudgetPipelined() { return RequestedMasternodeAssets == MASTERNODE_SYNC_MNW && nBudgetRequestsPipelined > 0; }
     void ClearFulfilledRequest();
 };
 
@@ -6,6 +6,7 @@
 
 #include "masternode.h"
 #include "addrman.h"
+#include "masternode-sigcheck.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
 #include "sync.h"
@@ -147,6 +148,7 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
         protocolVersion = mnb.protocolVersion;
         addr = mnb.addr;
         lastTimeChecked = 0;
+        mnodeman.NotifyMasternodeUpdate();
         int nDoS = 0;
         if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
             lastPing = mnb.lastPing;
@@ -189,6 +191,15 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
 }
 
 void CMasternode::Check(bool forceCheck)
+{
+    int nStatePrev = activeState;
+    CheckState(forceCheck);
+    // enabled and disabled entries rank differently
+    if (activeState != nStatePrev)
+        mnodeman.NotifyMasternodeUpdate();
+}
+
+void CMasternode::CheckState(bool forceCheck)
 {
     if (ShutdownRequested()) return;
 
@@ -563,8 +574,8 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
     }
 
     std::string errorMessage = "";
-    if (!obfuScationSigner.VerifyMessage(pubKeyCollateralAddress, sig, GetNewStrMessage(), errorMessage)
-    		&& !obfuScationSigner.VerifyMessage(pubKeyCollateralAddress, sig, GetOldStrMessage(), errorMessage))
+    if (!VerifyMasternodeMessage(pubKeyCollateralAddress, sig, GetNewStrMessage(), errorMessage)
+    		&& !VerifyMasternodeMessage(pubKeyCollateralAddress, sig, GetOldStrMessage(), errorMessage))
     {
         // don't ban for old masternodes, their sigs could be broken because of the bug
         nDos = protocolVersion < MIN_PEER_MNANNOUNCE ? 0 : 100;
@@ -770,8 +781,8 @@ bool CMasternodeBroadcast::VerifySignature()
 {
     std::string errorMessage;
 
-    if(!obfuScationSigner.VerifyMessage(pubKeyCollateralAddress, sig, GetNewStrMessage(), errorMessage)
-            && !obfuScationSigner.VerifyMessage(pubKeyCollateralAddress, sig, GetOldStrMessage(), errorMessage))
+    if(!VerifyMasternodeMessage(pubKeyCollateralAddress, sig, GetNewStrMessage(), errorMessage)
+            && !VerifyMasternodeMessage(pubKeyCollateralAddress, sig, GetOldStrMessage(), errorMessage))
         return error("CMasternodeBroadcast::VerifySignature() - Error: %s", errorMessage);
 
     return true;
@@ -814,13 +825,18 @@ CMasternodePing::CMasternodePing(CTxIn& newVin)
 }
 
 
+std::string CMasternodePing::GetStrMessage() const
+{
+    return vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+}
+
 bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
     sigTime = GetAdjustedTime();
-    std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage);
@@ -836,10 +852,10 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 }
 
 bool CMasternodePing::VerifySignature(CPubKey& pubKeyMasternode, int &nDos) {
-	std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+	std::string strMessage = GetStrMessage();
 	std::string errorMessage = "";
 
-	if(!obfuScationSigner.VerifyMessage(pubKeyMasternode, vchSig, strMessage, errorMessage)){
+	if(!VerifyMasternodeMessage(pubKeyMasternode, vchSig, strMessage, errorMessage)){
 		nDos = 33;
 		return error("CMasternodePing::VerifySignature - Got bad Masternode ping signature %s Error: %s", vin.ToString(), errorMessage);
 	}
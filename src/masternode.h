@@ -63,6 +63,8 @@ public:
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true, bool fCheckSigTimeOnly = false);
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool VerifySignature(CPubKey& pubKeyMasternode, int &nDos);
+    /** The text covered by vchSig */
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -112,6 +114,8 @@ private:
     mutable CCriticalSection cs;
     int64_t lastTimeChecked;
 
+    void CheckState(bool forceCheck);
+
 public:
     enum state {
         MASTERNODE_PRE_ENABLED,
@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodedb.h"
+
+#include "chainparams.h"
+#include "masternode-budget.h"
+#include "masternode-payments.h"
+#include "masternodeman.h"
+#include "protocol.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+CMasternodeCacheDB::CMasternodeCacheDB(const std::string& strNameIn, size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / strNameIn, nCacheSize, fMemory, fWipe),
+                                                                                                                     strName(strNameIn),
+                                                                                                                     nDump(0),
+                                                                                                                     nWritten(0),
+                                                                                                                     nErased(0),
+                                                                                                                     fLoaded(false)
+{
+    // Records written for another network are useless, start over
+    std::vector<unsigned char> vchMagic(Params().MessageStart(), Params().MessageStart() + MESSAGE_START_SIZE);
+    std::pair<std::string, std::vector<unsigned char> > version;
+    std::pair<std::string, std::vector<unsigned char> > versionExpected(strName, vchMagic);
+    if (Read(std::string("version"), version) && version == versionExpected)
+        return;
+
+    LogPrintf("%s : %s store is empty or has an unknown format, recreating\n", __func__, strName);
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    CLevelDBBatch batchWipe;
+    for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != 1 + sizeof(uint256))
+            continue;
+        uint256 id;
+        memcpy(id.begin(), slKey.data() + 1, sizeof(uint256));
+        batchWipe.Erase(std::make_pair(slKey[0], id));
+    }
+    batchWipe.Write(std::string("version"), versionExpected);
+    WriteBatch(batchWipe);
+}
+
+void CMasternodeCacheDB::BeginDump()
+{
+    nDump++;
+    nWritten = 0;
+    nErased = 0;
+}
+
+bool CMasternodeCacheDB::EndDump()
+{
+    std::map<RecordKey, std::pair<uint256, unsigned int> >::iterator it = mapRecords.begin();
+    while (it != mapRecords.end()) {
+        if (it->second.second != nDump) {
+            batch.Erase(it->first);
+            mapRecords.erase(it++);
+            nErased++;
+        } else {
+            ++it;
+        }
+    }
+
+    CLevelDBBatch batchCommit;
+    std::swap(batch, batchCommit);
+    return WriteBatch(batchCommit);
+}
+
+void ThreadLoadMasternodeCaches()
+{
+    RenameThread("fastnode-mnload");
+    int64_t nStart = GetTimeMillis();
+    try {
+        if (pMasternodeDB) {
+            pMasternodeDB->Read(mnodeman);
+            pMasternodeDB->SetLoaded();
+        }
+        boost::this_thread::interruption_point();
+        if (pMasternodePaymentDB) {
+            pMasternodePaymentDB->Read(masternodePayments);
+            pMasternodePaymentDB->SetLoaded();
+        }
+        boost::this_thread::interruption_point();
+        if (pBudgetDB) {
+            pBudgetDB->Read(budget);
+            pBudgetDB->SetLoaded();
+        }
+    } catch (const boost::thread_interrupted&) {
+        LogPrintf("Masternode cache loading interrupted\n");
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadLoadMasternodeCaches()");
+        return;
+    }
+    LogPrintf("Masternode caches loaded in %dms\n", GetTimeMillis() - nStart);
+}
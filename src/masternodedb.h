@@ -0,0 +1,112 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FASTNODE_MASTERNODEDB_H
+#define FASTNODE_MASTERNODEDB_H
+
+#include "hash.h"
+#include "leveldbwrapper.h"
+#include "uint256.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+
+/**
+ * LevelDB store for one of the masternode caches, one record per cached
+ * object, keyed by a record type and the object's 256-bit id.
+ *
+ * A dump hands over every object it wants stored between BeginDump() and
+ * EndDump(). The store remembers the hash of each record it holds, so only
+ * records whose content changed are written and only records that were not
+ * handed over again are erased. A dump costs I/O proportional to what
+ * changed rather than to the size of the cache.
+ */
+class CMasternodeCacheDB : public CLevelDBWrapper
+{
+private:
+    typedef std::pair<char, uint256> RecordKey;
+
+    std::string strName;
+    //! hash of every stored record and the dump that last handed it over
+    std::map<RecordKey, std::pair<uint256, unsigned int> > mapRecords;
+    unsigned int nDump;
+    CLevelDBBatch batch;
+    unsigned int nWritten;
+    unsigned int nErased;
+    bool fLoaded;
+
+    CMasternodeCacheDB(const CMasternodeCacheDB&);
+    void operator=(const CMasternodeCacheDB&);
+
+public:
+    CMasternodeCacheDB(const std::string& strNameIn, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    /** Read all records of one type with their ids; undecodable records are dropped */
+    template <typename V>
+    void ReadRecords(char chType, std::vector<std::pair<uint256, V> >& vRecords)
+    {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+        pcursor->Seek(leveldb::Slice(&chType, 1));
+
+        CLevelDBBatch batchErase;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() != 1 + sizeof(uint256) || slKey[0] != chType)
+                break;
+            uint256 id;
+            memcpy(id.begin(), slKey.data() + 1, sizeof(uint256));
+            leveldb::Slice slValue = pcursor->value();
+            try {
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                vRecords.push_back(std::make_pair(id, V()));
+                ssValue >> vRecords.back().second;
+                mapRecords[std::make_pair(chType, id)] = std::make_pair(Hash(slValue.data(), slValue.data() + slValue.size()), nDump);
+            } catch (const std::exception& e) {
+                LogPrintf("%s : dropping undecodable %s record %c %s - %s\n", __func__, strName, chType, id.ToString(), e.what());
+                batchErase.Erase(std::make_pair(chType, id));
+            }
+        }
+        WriteBatch(batchErase);
+    }
+
+    /** Mark the store loaded; dumps are refused until then so they cannot erase records not yet read */
+    void SetLoaded() { fLoaded = true; }
+    bool IsLoaded() const { return fLoaded; }
+
+    void BeginDump();
+
+    /** Hand over one object for the current dump; it is written only if it changed */
+    template <typename V>
+    void DumpRecord(char chType, const uint256& id, const V& value)
+    {
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << value;
+        uint256 hash = Hash(ssValue.begin(), ssValue.end());
+
+        std::pair<uint256, unsigned int>& record = mapRecords[std::make_pair(chType, id)];
+        if (record.second == nDump && record.first == hash)
+            return; // the same object handed over twice
+        if (record.first != hash) {
+            batch.Write(std::make_pair(chType, id), value);
+            record.first = hash;
+            nWritten++;
+        }
+        record.second = nDump;
+    }
+
+    /** Erase the records not handed over since BeginDump() and commit the changes */
+    bool EndDump();
+
+    unsigned int GetWritten() const { return nWritten; }
+    unsigned int GetErased() const { return nErased; }
+    unsigned int size() const { return mapRecords.size(); }
+};
+
+/** Load the masternode, payment and budget caches into their managers, merging with what arrived meanwhile */
+void ThreadLoadMasternodeCaches();
+
+#endif // FASTNODE_MASTERNODEDB_H
@@ -8,9 +8,12 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "masternode.h"
+#include "masternode-sigcheck.h"
+#include "masternode-sync.h"
 #include "obfuscation.h"
 #include "spork.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -47,156 +50,133 @@ struct CompareScoreMN {
 // CMasternodeDB
 //
 
-CMasternodeDB::CMasternodeDB()
+CMasternodeDB* pMasternodeDB = NULL;
+
+CMasternodeDB::CMasternodeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CMasternodeCacheDB("mncache", nCacheSize, fMemory, fWipe)
 {
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
 }
 
 bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 {
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
+    if (!IsLoaded())
+        return error("%s : mncache is still loading, not overwriting it", __func__);
 
-    LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
+    int64_t nStart = GetTimeMillis();
+    LOCK(mnodemanToSave.cs);
+
+    BeginDump();
+    BOOST_FOREACH (const CMasternode& mn, mnodemanToSave.vMasternodes)
+        DumpRecord('m', GetMasternodeSyncKey(mn.vin.prevout), mn);
+    for (map<uint256, CMasternodeBroadcast>::const_iterator it = mnodemanToSave.mapSeenMasternodeBroadcast.begin(); it != mnodemanToSave.mapSeenMasternodeBroadcast.end(); ++it)
+        DumpRecord('b', it->first, it->second);
+    for (map<uint256, CMasternodePing>::const_iterator it = mnodemanToSave.mapSeenMasternodePing.begin(); it != mnodemanToSave.mapSeenMasternodePing.end(); ++it)
+        DumpRecord('p', it->first, it->second);
+    DumpRecord('A', 0, mnodemanToSave.mAskedUsForMasternodeList);
+    DumpRecord('W', 0, mnodemanToSave.mWeAskedForMasternodeList);
+    DumpRecord('E', 0, mnodemanToSave.mWeAskedForMasternodeListEntry);
+    DumpRecord('d', 0, mnodemanToSave.nDsqCount);
+    DumpRecord('t', 0, mnodemanToSave.nListSyncedTime);
+    if (!EndDump())
+        return error("%s : Failed to write mncache", __func__);
+
+    LogPrint("masternode","Written %u and erased %u records of mncache  %dms\n", GetWritten(), GetErased(), GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
 
     return true;
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
+bool CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
+    // Decode outside the lock, the manager keeps serving peers meanwhile
+    std::vector<std::pair<uint256, CMasternode> > vMasternodes;
+    std::vector<std::pair<uint256, CMasternodeBroadcast> > vBroadcasts;
+    std::vector<std::pair<uint256, CMasternodePing> > vPings;
+    std::vector<std::pair<uint256, std::map<CNetAddr, int64_t> > > vAskedUs, vWeAsked;
+    std::vector<std::pair<uint256, std::map<COutPoint, int64_t> > > vWeAskedEntry;
+    std::vector<std::pair<uint256, int64_t> > vDsqCount, vListSyncedTime;
+    ReadRecords('m', vMasternodes);
+    ReadRecords('b', vBroadcasts);
+    ReadRecords('p', vPings);
+    ReadRecords('A', vAskedUs);
+    ReadRecords('W', vWeAsked);
+    ReadRecords('E', vWeAskedEntry);
+    ReadRecords('d', vDsqCount);
+    ReadRecords('t', vListSyncedTime);
 
-        ssMasternodes >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
+    {
+        LOCK(mnodemanToLoad.cs);
+        for (unsigned int i = 0; i < vMasternodes.size(); i++) {
+            if (!mnodemanToLoad.Find(vMasternodes[i].second.vin))
+                mnodemanToLoad.vMasternodes.push_back(vMasternodes[i].second);
         }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+        mnodemanToLoad.NotifyMasternodeUpdate();
+        mnodemanToLoad.mapSeenMasternodeBroadcast.insert(vBroadcasts.begin(), vBroadcasts.end());
+        mnodemanToLoad.mapSeenMasternodePing.insert(vPings.begin(), vPings.end());
+        if (!vAskedUs.empty())
+            mnodemanToLoad.mAskedUsForMasternodeList.insert(vAskedUs[0].second.begin(), vAskedUs[0].second.end());
+        if (!vWeAsked.empty())
+            mnodemanToLoad.mWeAskedForMasternodeList.insert(vWeAsked[0].second.begin(), vWeAsked[0].second.end());
+        if (!vWeAskedEntry.empty())
+            mnodemanToLoad.mWeAskedForMasternodeListEntry.insert(vWeAskedEntry[0].second.begin(), vWeAskedEntry[0].second.end());
+        if (!vDsqCount.empty())
+            mnodemanToLoad.nDsqCount = std::max(mnodemanToLoad.nDsqCount, vDsqCount[0].second);
+        if (!vListSyncedTime.empty() && mnodemanToLoad.nListSyncedTime == 0)
+            mnodemanToLoad.nListSyncedTime = vListSyncedTime[0].second;
     }
 
-    LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode","Loaded %u records from mncache  %dms\n", size(), GetTimeMillis() - nStart);
+    LogPrint("masternode","Masternode manager - cleaning....\n");
+    mnodemanToLoad.CheckAndRemove(true);
+    LogPrint("masternode","Masternode manager - result:\n");
     LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrint("masternode","Masternode manager - result:\n");
-        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    }
 
-    return Ok;
+    return true;
 }
 
 void DumpMasternodes()
 {
-    int64_t nStart = GetTimeMillis();
+    if (!pMasternodeDB)
+        return;
 
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrint("masternode","Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+    int64_t nStart = GetTimeMillis();
+    LogPrint("masternode","Writting info to mncache...\n");
+    if (masternodeSync.IsMasternodeListSynced())
+        mnodeman.nListSyncedTime = GetTime();
+    pMasternodeDB->Write(mnodeman);
 
     LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
-CMasternodeMan::CMasternodeMan()
+uint256 GetMasternodeSyncKey(const COutPoint& prevout)
+{
+    return SerializeHash(prevout);
+}
+
+void GetMasternodeSyncRange(int nRange, uint256& hashBegin, uint256& hashEnd)
+{
+    // MASTERNODES_SYNC_RANGES is 16, so a slice is one value of the top nibble.
+    // The end of the last slice wraps around to all ones.
+    hashBegin = uint256(nRange) << 252;
+    hashEnd = (uint256(nRange + 1) << 252) - 1;
+}
+
+int GetMasternodeSyncRangeIndex(const uint256& hashBegin, const uint256& hashEnd)
+{
+    for (int i = 0; i < MASTERNODES_SYNC_RANGES; i++) {
+        uint256 hashRangeBegin, hashRangeEnd;
+        GetMasternodeSyncRange(i, hashRangeBegin, hashRangeEnd);
+        if (hashRangeBegin == hashBegin)
+            return hashRangeEnd == hashEnd ? i : -1;
+    }
+    return -1;
+}
+
+CMasternodeMan::CMasternodeMan() : nListVersion(0)
 {
     nDsqCount = 0;
+    nListSyncedTime = 0;
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -210,6 +190,7 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        NotifyMasternodeUpdate();
         return true;
     }
 
@@ -280,6 +261,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             it = vMasternodes.erase(it);
+            NotifyMasternodeUpdate();
         } else {
             ++it;
         }
@@ -341,12 +323,16 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    NotifyMasternodeUpdate();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    mAskedUsForMasternodeRanges.clear();
+    mapRankCache.clear();
     nDsqCount = 0;
+    nListSyncedTime = 0;
 }
 
 int CMasternodeMan::stable_size ()
@@ -436,6 +422,12 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
+void CMasternodeMan::RequestListRange(CNode* pnode, const uint256& hashBegin, const uint256& hashEnd, int64_t nSince)
+{
+    LogPrint("masternode", "mnrange - asking peer %i for %s..%s since %d\n", pnode->GetId(), hashBegin.ToString().substr(0, 4), hashEnd.ToString().substr(0, 4), nSince);
+    pnode->PushMessage("mnrange", hashBegin, hashEnd, nSince);
+}
+
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
@@ -594,49 +586,72 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
-    int64_t nMasternode_Age = 0;
-
     //make sure we know about this block
     uint256 hash = 0;
     if (!GetBlockHash(hash, nBlockHeight)) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) {
-            LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
-            continue;                                                       // Skip obsolete versions
+    LOCK(cs);
+
+    std::pair<int64_t, std::pair<int, bool> > key = make_pair(nBlockHeight, make_pair(minProtocol, fOnlyActive));
+    std::map<std::pair<int64_t, std::pair<int, bool> >, CRankCache>::iterator it = mapRankCache.find(key);
+    if (it == mapRankCache.end() || it->second.nTime < GetTime() - MASTERNODES_RANK_CACHE_SECONDS || it->second.nListVersion != nListVersion) {
+        // drop stale rankings, and the lowest heights if still too many are kept
+        std::map<std::pair<int64_t, std::pair<int, bool> >, CRankCache>::iterator itOld = mapRankCache.begin();
+        while (itOld != mapRankCache.end()) {
+            if (itOld->second.nTime < GetTime() - MASTERNODES_RANK_CACHE_SECONDS)
+                mapRankCache.erase(itOld++);
+            else
+                ++itOld;
         }
+        while (mapRankCache.size() >= MASTERNODES_RANK_CACHE_SIZE)
+            mapRankCache.erase(mapRankCache.begin());
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-            nMasternode_Age = GetAdjustedTime() - mn.sigTime;
-            if ((nMasternode_Age) < nMasternode_Min_Age) {
-                if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
-                continue;                                                   // Skip masternodes younger than (default) 1 hour
+        std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+        int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
+        int64_t nMasternode_Age = 0;
+
+        // scan for winner
+        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+            if (mn.protocolVersion < minProtocol) {
+                LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
+                continue;                                                       // Skip obsolete versions
             }
-        }
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+            if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+                nMasternode_Age = GetAdjustedTime() - mn.sigTime;
+                if ((nMasternode_Age) < nMasternode_Min_Age) {
+                    if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
+                    continue;                                                   // Skip masternodes younger than (default) 1 hour
+                }
+            }
+            if (fOnlyActive) {
+                mn.Check();
+                if (!mn.IsEnabled()) continue;
+            }
+            uint256 n = mn.CalculateScore(1, nBlockHeight);
+            int64_t n2 = n.GetCompact(false);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+            vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        }
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
+        sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+
+        CRankCache& cache = mapRankCache[key];
+        cache.nTime = GetTime();
+        cache.nListVersion = nListVersion;
+        cache.mapRanks.clear();
+        int rank = 0;
+        BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
+            rank++;
+            cache.mapRanks.insert(make_pair(s.second.prevout, rank));
         }
+        it = mapRankCache.find(key);
     }
 
-    return -1;
+    std::map<COutPoint, int>::const_iterator itRank = it->second.mapRanks.find(vin.prevout);
+    if (itRank == it->second.mapRanks.end())
+        return -1;
+    return itRank->second;
 }
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
@@ -723,6 +738,119 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
+static void ExtractBroadcastSignatures(CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    CMasternodeBroadcast mnb;
+    vRecv >> mnb;
+    // Only the current message format; broadcasts of old masternodes fall back to checking inline
+    vChecks.push_back(CMessageSigCheck(mnb.GetNewStrMessage(), mnb.sig));
+    if (mnb.lastPing != CMasternodePing())
+        vChecks.push_back(CMessageSigCheck(mnb.lastPing.GetStrMessage(), mnb.lastPing.vchSig));
+}
+
+static void ExtractPingSignatures(CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    CMasternodePing mnp;
+    vRecv >> mnp;
+    vChecks.push_back(CMessageSigCheck(mnp.GetStrMessage(), mnp.vchSig));
+}
+
+static void ExtractSyncDataSignatures(CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    uint256 hashBegin, hashEnd;
+    std::vector<CMasternodeBroadcast> vMnb;
+    std::vector<CMasternodePing> vMnp;
+    vRecv >> hashBegin >> hashEnd >> vMnb >> vMnp;
+    BOOST_FOREACH (CMasternodeBroadcast& mnb, vMnb) {
+        vChecks.push_back(CMessageSigCheck(mnb.GetNewStrMessage(), mnb.sig));
+        if (mnb.lastPing != CMasternodePing())
+            vChecks.push_back(CMessageSigCheck(mnb.lastPing.GetStrMessage(), mnb.lastPing.vchSig));
+    }
+    BOOST_FOREACH (const CMasternodePing& mnp, vMnp)
+        vChecks.push_back(CMessageSigCheck(mnp.GetStrMessage(), mnp.vchSig));
+}
+
+void CMasternodeMan::RegisterMessageHandlers()
+{
+    MessageHandler handler = boost::bind(&CMasternodeMan::ProcessMessage, this, _1, _2, _3);
+    RegisterMessageHandler("mnb", handler);
+    RegisterMessageHandler("mnp", handler);
+    RegisterMessageHandler("dseg", handler);
+    RegisterMessageHandler("mnrange", handler);
+    RegisterMessageHandler("mnsyncdata", handler);
+    RegisterMessageHandler("dsee", handler);
+    RegisterMessageHandler("dseep", handler);
+
+    // A full list sync (dseg) answers with a burst of these
+    RegisterMessageSigExtractor("mnb", &ExtractBroadcastSignatures);
+    RegisterMessageSigExtractor("mnp", &ExtractPingSignatures);
+    RegisterMessageSigExtractor("mnsyncdata", &ExtractSyncDataSignatures);
+}
+
+void CMasternodeMan::ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb)
+{
+    if (mapSeenMasternodeBroadcast.count(mnb.GetHash())) { //seen
+        masternodeSync.AddedMasternodeList(mnb.GetHash());
+        return;
+    }
+    mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+
+    int nDoS = 0;
+    if (!mnb.CheckAndUpdate(nDoS)) {
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+
+        //failed
+        return;
+    }
+
+    // make sure the vout that was signed is related to the transaction that spawned the Masternode
+    //  - this is expensive, so it's only done once per Masternode
+    if (!obfuScationSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
+        LogPrintf("CMasternodeMan::ProcessMessage() : mnb - Got mismatched pubkey and vin\n");
+        Misbehaving(pfrom->GetId(), 33);
+        return;
+    }
+
+    // make sure it's still unspent
+    //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
+    if (mnb.CheckInputsAndAdd(nDoS)) {
+        // use this as a peer
+        addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
+        masternodeSync.AddedMasternodeList(mnb.GetHash());
+    } else {
+        LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
+
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+void CMasternodeMan::ProcessPing(CNode* pfrom, CMasternodePing& mnp)
+{
+    LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
+
+    if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
+    mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+
+    int nDoS = 0;
+    if (mnp.CheckAndUpdate(nDoS)) return;
+
+    if (nDoS > 0) {
+        // if anything significant failed, mark that node
+        Misbehaving(pfrom->GetId(), nDoS);
+    } else {
+        // if nothing significant failed, search existing Masternode list
+        CMasternode* pmn = Find(mnp.vin);
+        // if it's known, don't ask for the mnb, just return
+        if (pmn != NULL) return;
+    }
+
+    // something significant is broken or mn is unknown,
+    // we might have to ask for a masternode entry once
+    AskForMN(pfrom, mnp.vin);
+}
+
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -733,69 +861,110 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
     if (strCommand == "mnb") { //Masternode Broadcast
         CMasternodeBroadcast mnb;
         vRecv >> mnb;
+        ProcessBroadcast(pfrom, mnb);
+    }
 
-        if (mapSeenMasternodeBroadcast.count(mnb.GetHash())) { //seen
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-            return;
+    else if (strCommand == "mnp") { //Masternode Ping
+        CMasternodePing mnp;
+        vRecv >> mnp;
+        ProcessPing(pfrom, mnp);
+
+    } else if (strCommand == "mnrange") { //Get the entries of one slice of the Masternode list
+        uint256 hashBegin, hashEnd;
+        int64_t nSince;
+        vRecv >> hashBegin >> hashEnd >> nSince;
+
+        bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
+        if (!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
+            // All slices together cost as much as one full dseg, so allow each slice
+            // twice (to cover reassignment after a timeout) per dseg interval
+            std::pair<int64_t, int>& asked = mAskedUsForMasternodeRanges[pfrom->addr];
+            if (GetTime() >= asked.first)
+                asked = std::make_pair(GetTime() + MASTERNODES_DSEG_SECONDS, 0);
+            if (++asked.second > MASTERNODES_SYNC_RANGES * 2) {
+                LogPrintf("CMasternodeMan::ProcessMessage() : mnrange - peer asked me for too many list ranges\n");
+                Misbehaving(pfrom->GetId(), 34);
+                return;
+            }
         }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
 
-        int nDoS = 0;
-        if (!mnb.CheckAndUpdate(nDoS)) {
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        // Entries announced after nSince go out as full broadcasts; entries the
+        // peer already has only need their latest ping.
+        std::vector<CMasternodeBroadcast> vMnb;
+        std::vector<CMasternodePing> vMnp;
+        int nInvCount = 0;
+        {
+            LOCK(cs);
+            BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+                if (mn.addr.IsRFC1918()) continue; //local network
+                if (!mn.IsEnabled()) continue;
+
+                uint256 key = GetMasternodeSyncKey(mn.vin.prevout);
+                if (key < hashBegin || key > hashEnd) continue;
 
-            //failed
+                if (mn.sigTime > nSince) {
+                    CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+                    uint256 hash = mnb.GetHash();
+                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                    vMnb.push_back(mnb);
+                } else if (mn.lastPing.sigTime > nSince) {
+                    vMnp.push_back(mn.lastPing);
+                } else
+                    continue;
+                nInvCount++;
+
+                if (vMnb.size() + vMnp.size() >= MASTERNODES_SYNC_CHUNK) {
+                    pfrom->PushMessage("mnsyncdata", hashBegin, hashEnd, vMnb, vMnp, false);
+                    vMnb.clear();
+                    vMnp.clear();
+                }
+            }
+        }
+        pfrom->PushMessage("mnsyncdata", hashBegin, hashEnd, vMnb, vMnp, true);
+        LogPrint("masternode", "mnrange - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
+
+    } else if (strCommand == "mnsyncdata") { //One chunk of a Masternode list slice we asked for
+        uint256 hashBegin, hashEnd;
+        std::vector<CMasternodeBroadcast> vMnb;
+        std::vector<CMasternodePing> vMnp;
+        bool fLast;
+        vRecv >> hashBegin >> hashEnd >> vMnb >> vMnp >> fLast;
+
+        if (vMnb.size() + vMnp.size() > MASTERNODES_SYNC_CHUNK) {
+            LogPrintf("CMasternodeMan::ProcessMessage() : mnsyncdata - oversized chunk from peer %i\n", pfrom->GetId());
+            Misbehaving(pfrom->GetId(), 20);
             return;
         }
-
-        // make sure the vout that was signed is related to the transaction that spawned the Masternode
-        //  - this is expensive, so it's only done once per Masternode
-        if (!obfuScationSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
-            LogPrintf("CMasternodeMan::ProcessMessage() : mnb - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 33);
+        int nRange = GetMasternodeSyncRangeIndex(hashBegin, hashEnd);
+        if (nRange == -1) {
+            LogPrintf("CMasternodeMan::ProcessMessage() : mnsyncdata - invalid list range from peer %i\n", pfrom->GetId());
+            Misbehaving(pfrom->GetId(), 20);
             return;
         }
-
-        // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
-        if (mnb.CheckInputsAndAdd(nDoS)) {
-            // use this as a peer
-            addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-        } else {
-            LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
-
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        // Every entry has to belong to the slice it is delivered for
+        bool fOutOfRange = false;
+        BOOST_FOREACH (const CMasternodeBroadcast& mnb, vMnb) {
+            uint256 key = GetMasternodeSyncKey(mnb.vin.prevout);
+            fOutOfRange |= key < hashBegin || key > hashEnd;
         }
-    }
-
-    else if (strCommand == "mnp") { //Masternode Ping
-        CMasternodePing mnp;
-        vRecv >> mnp;
-
-        LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
-
-        if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
-        mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
-
-        int nDoS = 0;
-        if (mnp.CheckAndUpdate(nDoS)) return;
-
-        if (nDoS > 0) {
-            // if anything significant failed, mark that node
-            Misbehaving(pfrom->GetId(), nDoS);
-        } else {
-            // if nothing significant failed, search existing Masternode list
-            CMasternode* pmn = Find(mnp.vin);
-            // if it's known, don't ask for the mnb, just return
-            if (pmn != NULL) return;
+        BOOST_FOREACH (const CMasternodePing& mnp, vMnp) {
+            uint256 key = GetMasternodeSyncKey(mnp.vin.prevout);
+            fOutOfRange |= key < hashBegin || key > hashEnd;
+        }
+        if (fOutOfRange) {
+            LogPrintf("CMasternodeMan::ProcessMessage() : mnsyncdata - entry outside the list range from peer %i\n", pfrom->GetId());
+            Misbehaving(pfrom->GetId(), 20);
+            return;
+        }
+        if (!masternodeSync.AddedMasternodeRange(pfrom->GetId(), nRange, vMnb.size() + vMnp.size(), fLast)) {
+            LogPrint("masternode", "mnsyncdata - ignoring unrequested list range from peer %i\n", pfrom->GetId());
+            return;
         }
 
-        // something significant is broken or mn is unknown,
-        // we might have to ask for a masternode entry once
-        AskForMN(pfrom, mnp.vin);
+        BOOST_FOREACH (CMasternodeBroadcast& mnb, vMnb)
+            ProcessBroadcast(pfrom, mnb);
+        BOOST_FOREACH (CMasternodePing& mnp, vMnp)
+            ProcessPing(pfrom, mnp);
 
     } else if (strCommand == "dseg") { //Get Masternode list or specific entry
 
@@ -1138,6 +1307,7 @@ void CMasternodeMan::Remove(CTxIn vin)
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
             vMasternodes.erase(it);
+            NotifyMasternodeUpdate();
             break;
         }
         ++it;
@@ -11,12 +11,19 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternodedb.h"
 #include "net.h"
 #include "sync.h"
 #include "util.h"
 
+#include <atomic>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SYNC_RANGES 16
+#define MASTERNODES_SYNC_CHUNK 100
+#define MASTERNODES_RANK_CACHE_SECONDS 60
+#define MASTERNODES_RANK_CACHE_SIZE 32
 
 using namespace std;
 
@@ -25,30 +32,27 @@ class CMasternodeMan;
 extern CMasternodeMan mnodeman;
 void DumpMasternodes();
 
-/** Access to the MN database (mncache.dat)
+/** Position of a masternode in the key space that ranged list sync slices up */
+uint256 GetMasternodeSyncKey(const COutPoint& prevout);
+/** Inclusive bounds of slice nRange of MASTERNODES_SYNC_RANGES equal slices */
+void GetMasternodeSyncRange(int nRange, uint256& hashBegin, uint256& hashEnd);
+/** Index of the slice with exactly these bounds, or -1 if there is none */
+int GetMasternodeSyncRangeIndex(const uint256& hashBegin, const uint256& hashEnd);
+
+/** Access to the MN database (mncache/), one record per masternode, broadcast and ping
  */
-class CMasternodeDB
+class CMasternodeDB : public CMasternodeCacheDB
 {
-private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CMasternodeDB();
+    CMasternodeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    /** Write what changed since the last dump */
     bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    /** Merge the stored records into the manager, keeping entries it already has */
+    bool Read(CMasternodeMan& mnodemanToLoad);
 };
 
+extern CMasternodeDB* pMasternodeDB;
+
 class CMasternodeMan
 {
 private:
@@ -66,6 +70,26 @@ private:
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // who's asked us for list ranges: when their window resets and how many they've asked for in it
+    std::map<CNetAddr, std::pair<int64_t, int> > mAskedUsForMasternodeRanges;
+
+    // Ranks for recently asked (height, min protocol, active only) combinations, so the rank
+    // checks for a burst of votes at one height sort the list once
+    struct CRankCache {
+        int64_t nTime;
+        uint64_t nListVersion;
+        std::map<COutPoint, int> mapRanks;
+    };
+    std::map<std::pair<int64_t, std::pair<int, bool> >, CRankCache> mapRankCache;
+
+    // bumped whenever an entry is added, removed or changes state, so cached ranks are never reused after that
+    std::atomic<uint64_t> nListVersion;
+
+    /// Validate and apply a broadcast or ping, whether it arrived on its own or in a list range
+    void ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb);
+    void ProcessPing(CNode* pfrom, CMasternodePing& mnp);
+
+    friend class CMasternodeDB;
 
 public:
     // Keep track of all broadcasts I've seen
@@ -76,6 +100,9 @@ public:
     // keep track of dsq count to prevent masternodes from gaming obfuscation queue
     int64_t nDsqCount;
 
+    // last time the list was known to be in sync; after a restart peers only send what changed since
+    int64_t nListSyncedTime;
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -90,6 +117,7 @@ public:
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+        READWRITE(nListSyncedTime);
     }
 
     CMasternodeMan();
@@ -98,6 +126,10 @@ public:
     /// Add an entry
     bool Add(CMasternode& mn);
 
+    /// Note that the list changed, invalidating the cached ranks
+    void NotifyMasternodeUpdate() { nListVersion++; }
+    uint64_t GetListVersion() const { return nListVersion; }
+
     /// Ask (source) node for mnb
     void AskForMN(CNode* pnode, CTxIn& vin);
 
@@ -116,6 +148,9 @@ public:
 
     void DsegUpdate(CNode* pnode);
 
+    /// Ask (source) node for the entries in [hashBegin, hashEnd] that changed after nSince
+    void RequestListRange(CNode* pnode, const uint256& hashBegin, const uint256& hashEnd, int64_t nSince);
+
     /// Find an entry
     CMasternode* Find(const CScript& payee);
     CMasternode* Find(const CTxIn& vin);
@@ -143,6 +178,8 @@ public:
     void ProcessMasternodeConnections();
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    /** Route this manager's P2P commands to ProcessMessage */
+    void RegisterMessageHandlers();
 
     /// Return the number of (unique) Masternodes
     int size() { return vMasternodes.size(); }
@@ -0,0 +1,90 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include "poolalloc.h"
+
+#include <stdlib.h>
+
+#include <functional>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+namespace memusage
+{
+
+/**
+ * Compute the total memory used by allocating alloc bytes, assuming the
+ * usual glibc-style malloc rounding (16 bytes on 64-bit, 8 bytes on 32-bit)
+ * plus one pointer of per-allocation overhead.
+ */
+static inline size_t MallocUsage(size_t alloc)
+{
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    return ((alloc + 15) >> 3) << 3;
+}
+
+/** Dynamic memory owned by a vector, not counting memory owned by its elements */
+template <typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+/** Dynamic memory owned by a bit vector, which packs its bits into words */
+static inline size_t DynamicUsage(const std::vector<bool>& v)
+{
+    return MallocUsage((v.capacity() + 7) / 8);
+}
+
+// STL data structures
+
+template <typename X>
+struct stl_tree_node {
+private:
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+// Boost data structures
+
+template <typename X>
+struct boost_unordered_node : private X {
+private:
+    void* ptr;
+};
+
+/** Dynamic memory owned by a node-based map: one allocation per node plus the bucket array */
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+/**
+ * Dynamic memory owned by a pooled map: the blocks its nodes take in the pool,
+ * without malloc overhead, plus the bucket array. Assumes the pool serves no
+ * other container.
+ */
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, std::equal_to<X>, pool_allocator<std::pair<const X, Y> > >& m)
+{
+    const CPoolResource* pool = m.get_allocator().pool;
+    size_t nNodes = pool ? pool->UsedBytes() : MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size();
+    return nNodes + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+} // namespace memusage
+
+#endif // BITCOIN_MEMUSAGE_H
@@ -36,6 +36,30 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomTxElements>& vElements)
+{
+    assert(vElements.size() == block.vtx.size());
+    header = block.GetBlockHeader();
+
+    vector<bool> vMatch;
+    vector<uint256> vHashes;
+
+    vMatch.reserve(block.vtx.size());
+    vHashes.reserve(block.vtx.size());
+
+    for (unsigned int i = 0; i < vElements.size(); i++) {
+        const uint256& hash = vElements[i].hash;
+        if (filter.IsRelevantAndUpdate(vElements[i])) {
+            vMatch.push_back(true);
+            vMatchedTxn.push_back(make_pair(i, hash));
+        } else
+            vMatch.push_back(false);
+        vHashes.push_back(hash);
+    }
+
+    txn = CPartialMerkleTree(vHashes, vMatch);
+}
+
 uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256>& vTxid)
 {
     if (height == 0) {
@@ -142,6 +142,13 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    /**
+     * Same, but matching against bloom elements extracted beforehand, one per
+     * transaction in block order, so a block served to many filtered peers
+     * only has its scripts parsed once.
+     */
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomTxElements>& vElements);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
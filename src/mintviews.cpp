@@ -0,0 +1,94 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mintviews.h"
+
+void CMintMetaViews::EraseFrom(HeightIndex& index, const CMintMeta* pmeta)
+{
+    std::pair<HeightIndex::iterator, HeightIndex::iterator> range = index.equal_range(pmeta->nHeight);
+    for (HeightIndex::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == pmeta) {
+            index.erase(it);
+            return;
+        }
+    }
+}
+
+void CMintMetaViews::Clear()
+{
+    mapMints.clear();
+    mapByDenom.clear();
+    mapByHeight.clear();
+    mapStakable.clear();
+}
+
+void CMintMetaViews::Add(const CMintMeta& meta)
+{
+    Remove(meta.hashSerial);
+    const CMintMeta* pmeta = &mapMints.insert(std::make_pair(meta.hashSerial, meta)).first->second;
+    mapByDenom[meta.denom].insert(std::make_pair(meta.nHeight, pmeta));
+    mapByHeight.insert(std::make_pair(meta.nHeight, pmeta));
+    if (meta.nVersion >= CZerocoinMint::STAKABLE_VERSION)
+        mapStakable.insert(std::make_pair(meta.nHeight, pmeta));
+}
+
+bool CMintMetaViews::Remove(const uint256& hashSerial)
+{
+    std::map<uint256, CMintMeta>::iterator mi = mapMints.find(hashSerial);
+    if (mi == mapMints.end())
+        return false;
+    const CMintMeta* pmeta = &mi->second;
+
+    std::map<libzerocoin::CoinDenomination, HeightIndex>::iterator itDenom = mapByDenom.find(pmeta->denom);
+    EraseFrom(itDenom->second, pmeta);
+    if (itDenom->second.empty())
+        mapByDenom.erase(itDenom);
+    EraseFrom(mapByHeight, pmeta);
+    if (pmeta->nVersion >= CZerocoinMint::STAKABLE_VERSION)
+        EraseFrom(mapStakable, pmeta);
+
+    mapMints.erase(mi);
+    return true;
+}
+
+bool CMintMetaViews::SetStakeHash(const uint256& hashSerial, const uint256& hashStake)
+{
+    std::map<uint256, CMintMeta>::iterator mi = mapMints.find(hashSerial);
+    if (mi == mapMints.end())
+        return false;
+    mi->second.hashStake = hashStake;
+    return true;
+}
+
+const CMintMeta* CMintMetaViews::Get(const uint256& hashSerial) const
+{
+    std::map<uint256, CMintMeta>::const_iterator mi = mapMints.find(hashSerial);
+    return mi == mapMints.end() ? NULL : &mi->second;
+}
+
+std::map<libzerocoin::CoinDenomination, CAmount> CMintMetaViews::GetDenominationCounts() const
+{
+    std::map<libzerocoin::CoinDenomination, CAmount> mapCounts;
+    for (const auto& denom : libzerocoin::zerocoinDenomList)
+        mapCounts.insert(std::make_pair(denom, 0));
+    for (std::map<libzerocoin::CoinDenomination, HeightIndex>::const_iterator it = mapByDenom.begin(); it != mapByDenom.end(); ++it)
+        mapCounts[it->first] = it->second.size();
+    return mapCounts;
+}
+
+const CMintMetaViews::HeightIndex* CMintMetaViews::GetByDenomination(libzerocoin::CoinDenomination denom) const
+{
+    std::map<libzerocoin::CoinDenomination, HeightIndex>::const_iterator it = mapByDenom.find(denom);
+    return it == mapByDenom.end() ? NULL : &it->second;
+}
+
+std::pair<CMintMetaViews::HeightIndex::const_iterator, CMintMetaViews::HeightIndex::const_iterator> CMintMetaViews::GetStakable(int nMaxHeight) const
+{
+    return std::make_pair(mapStakable.begin(), mapStakable.lower_bound(nMaxHeight));
+}
+
+bool CMintMetaViews::HasStakable(int nMaxHeight) const
+{
+    return !mapStakable.empty() && mapStakable.begin()->first < nMaxHeight;
+}
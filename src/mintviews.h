@@ -0,0 +1,62 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FASTNODE_MINTVIEWS_H
+#define FASTNODE_MINTVIEWS_H
+
+#include "amount.h"
+#include "libzerocoin/Denominations.h"
+#include "primitives/zerocoin.h"
+#include "uint256.h"
+
+#include <map>
+#include <utility>
+
+/**
+ * Indexed views over a set of zerocoin mints: by serial hash, by
+ * denomination and by confirmation height, and by height again for the
+ * mints of a stakable version, so that the mints deep enough to stake are
+ * a range of it. Callers iterate the views or take summaries instead of
+ * copying and filtering the whole set.
+ */
+class CMintMetaViews
+{
+public:
+    //! Mints by confirmation height, unconfirmed ones at height 0
+    typedef std::multimap<int, const CMintMeta*> HeightIndex;
+
+private:
+    std::map<uint256, CMintMeta> mapMints;
+    std::map<libzerocoin::CoinDenomination, HeightIndex> mapByDenom;
+    HeightIndex mapByHeight;
+    HeightIndex mapStakable;
+
+    static void EraseFrom(HeightIndex& index, const CMintMeta* pmeta);
+
+public:
+    CMintMetaViews() {}
+
+    void Clear();
+    //! Add a mint, replacing the one of the same serial hash
+    void Add(const CMintMeta& meta);
+    bool Remove(const uint256& hashSerial);
+    //! Set the stake hash of a mint, which no view is ordered by
+    bool SetStakeHash(const uint256& hashSerial, const uint256& hashStake);
+
+    bool empty() const { return mapMints.empty(); }
+    size_t size() const { return mapMints.size(); }
+    const CMintMeta* Get(const uint256& hashSerial) const;
+    const std::map<uint256, CMintMeta>& GetMints() const { return mapMints; }
+
+    //! The number of mints of each denomination, every denomination listed
+    std::map<libzerocoin::CoinDenomination, CAmount> GetDenominationCounts() const;
+    //! Mints of a denomination, oldest first; NULL if there are none
+    const HeightIndex* GetByDenomination(libzerocoin::CoinDenomination denom) const;
+    const HeightIndex& GetByHeight() const { return mapByHeight; }
+    //! The mints of a stakable version confirmed below nMaxHeight, oldest first
+    std::pair<HeightIndex::const_iterator, HeightIndex::const_iterator> GetStakable(int nMaxHeight) const;
+    bool HasStakable(int nMaxHeight) const;
+};
+
+#endif // FASTNODE_MINTVIEWS_H
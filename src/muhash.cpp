@@ -0,0 +1,63 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+
+#include "crypto/sha512.h"
+#include "hash.h"
+
+#include <vector>
+
+static const unsigned int MUHASH_BYTES = 384;
+
+static const CBigNum& MuHashModulus()
+{
+    static const CBigNum bnModulus = (CBigNum(1) << (MUHASH_BYTES * 8)) - CBigNum(1103717);
+    return bnModulus;
+}
+
+/** Expand a 256-bit hash to a 3072-bit group element using SHA512 in counter mode */
+static CBigNum ToGroupElement(const uint256& hash)
+{
+    // One extra zero byte keeps the little-endian MPI encoding positive
+    std::vector<unsigned char> vch(MUHASH_BYTES + 1, 0);
+    for (unsigned char nCounter = 0; nCounter < MUHASH_BYTES / CSHA512::OUTPUT_SIZE; nCounter++) {
+        CSHA512().Write(hash.begin(), hash.size()).Write(&nCounter, 1).Finalize(&vch[nCounter * CSHA512::OUTPUT_SIZE]);
+    }
+    CBigNum bn(vch);
+    if (bn >= MuHashModulus())
+        bn = bn % MuHashModulus();
+    return bn;
+}
+
+CMuHash3072::CMuHash3072() : bnNumerator(1), bnDenominator(1)
+{
+}
+
+CMuHash3072& CMuHash3072::Insert(const uint256& hash)
+{
+    bnNumerator = bnNumerator.mul_mod(ToGroupElement(hash), MuHashModulus());
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::Remove(const uint256& hash)
+{
+    bnDenominator = bnDenominator.mul_mod(ToGroupElement(hash), MuHashModulus());
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& other)
+{
+    bnNumerator = bnNumerator.mul_mod(other.bnNumerator, MuHashModulus());
+    bnDenominator = bnDenominator.mul_mod(other.bnDenominator, MuHashModulus());
+    return *this;
+}
+
+uint256 CMuHash3072::Finalize() const
+{
+    CBigNum bnResult = bnNumerator.mul_mod(bnDenominator.inverse(MuHashModulus()), MuHashModulus());
+    std::vector<unsigned char> vch = bnResult.getvch();
+    vch.resize(MUHASH_BYTES, 0);
+    return Hash(vch.begin(), vch.end());
+}
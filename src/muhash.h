@@ -0,0 +1,40 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FASTNODE_MUHASH_H
+#define FASTNODE_MUHASH_H
+
+#include "libzerocoin/bignum.h"
+#include "uint256.h"
+
+/**
+ * Order-independent multiset hash over the group of integers modulo the
+ * prime 2^3072 - 1103717.
+ *
+ * Every element is expanded to a 3072-bit group member and multiplied into
+ * a running numerator (insertions) or denominator (removals), so the final
+ * digest does not depend on the order in which elements were added. Two
+ * partial hashes can be merged with operator*=, which lets disjoint parts
+ * of a set be hashed on separate threads.
+ */
+class CMuHash3072
+{
+private:
+    CBigNum bnNumerator;
+    CBigNum bnDenominator;
+
+public:
+    CMuHash3072();
+
+    /** Add an element, identified by its 256-bit hash */
+    CMuHash3072& Insert(const uint256& hash);
+    /** Remove a previously inserted element */
+    CMuHash3072& Remove(const uint256& hash);
+    /** Merge the set hashed by another instance into this one */
+    CMuHash3072& operator*=(const CMuHash3072& other);
+    /** Return the 256-bit digest of the current set */
+    uint256 Finalize() const;
+};
+
+#endif // FASTNODE_MUHASH_H
@@ -15,6 +15,8 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "main.h"
+#include "memusage.h"
 #include "miner.h"
 #include "obfuscation.h"
 #include "primitives/transaction.h"
@@ -22,12 +24,18 @@
 #include "ui_interface.h"
 #include "wallet.h"
 
+#include <cmath>
+
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -89,9 +97,12 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CTransactionRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
+size_t nRelayMemoryUsage = 0;
 CCriticalSection cs_mapRelay;
+/** Bloom elements of transactions in mapRelay, extracted on first use by a filtered peer */
+static map<uint256, std::shared_ptr<const CBloomTxElements> > mapRelayBloomElements;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -109,10 +120,67 @@ CCriticalSection cs_nLastNodeId;
 static CSemaphore* semOutbound = NULL;
 boost::condition_variable messageHandlerCondition;
 
+static void RegisterNodeSocket(CNode* pnode);
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+// Per-command message handling statistics, indexed by interned command id
+static std::vector<CMessageStats> vMessageStats;
+static CCriticalSection cs_vMessageStats;
+
+/** Statistics entry for a command (requires LOCK(cs_vMessageStats)) */
+static CMessageStats& MessageStatsEntry(int nCommandId)
+{
+    if (nCommandId < 0 || nCommandId >= GetMessageCommandCount())
+        nCommandId = NETMSG_UNKNOWN;
+    if ((int)vMessageStats.size() <= nCommandId)
+        vMessageStats.resize(GetMessageCommandCount());
+    return vMessageStats[nCommandId];
+}
+
+void RecordMessageQueued(int nCommandId)
+{
+    LOCK(cs_vMessageStats);
+    MessageStatsEntry(nCommandId).nQueued++;
+}
+
+void RecordMessagesRemoved(std::deque<CNetMessage>::const_iterator begin, std::deque<CNetMessage>::const_iterator end)
+{
+    LOCK(cs_vMessageStats);
+    for (std::deque<CNetMessage>::const_iterator it = begin; it != end; ++it) {
+        if (!it->complete())
+            continue;
+        CMessageStats& stats = MessageStatsEntry(it->nCommandId);
+        if (stats.nQueued > 0)
+            stats.nQueued--;
+    }
+}
+
+void RecordMessageProcessed(CNode* pnode, const CNetMessage& msg, int64_t nProcessTimeMicros, int64_t nCpuTimeMicros)
+{
+    int64_t nQueueTimeMicros = GetTimeMicros() - nProcessTimeMicros - msg.nTime;
+    {
+        LOCK(cs_vMessageStats);
+        MessageStatsEntry(msg.nCommandId).AddProcessed(msg.hdr.nMessageSize, nQueueTimeMicros, nProcessTimeMicros, nCpuTimeMicros);
+    }
+    {
+        LOCK(pnode->cs_msgStats);
+        pnode->mapMsgStats[msg.nCommandId].AddProcessed(msg.hdr.nMessageSize, nQueueTimeMicros, nProcessTimeMicros, nCpuTimeMicros);
+    }
+}
+
+void GetMessageStats(std::map<std::string, CMessageStats>& mapStats)
+{
+    mapStats.clear();
+    LOCK(cs_vMessageStats);
+    for (unsigned int i = 0; i < vMessageStats.size(); i++) {
+        if (vMessageStats[i].nProcessed > 0 || vMessageStats[i].nQueued > 0)
+            mapStats[GetMessageCommandName(i)] = vMessageStats[i];
+    }
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -430,6 +498,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         if (obfuScationMaster) pnode->fObfuScationMaster = true;
@@ -454,8 +523,10 @@ void CNode::CloseSocketDisconnect()
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
     TRY_LOCK(cs_vRecvMsg, lockRecv);
-    if (lockRecv)
+    if (lockRecv) {
+        RecordMessagesRemoved(vRecvMsg.begin(), vRecvMsg.end());
         vRecvMsg.clear();
+    }
 }
 
 bool CNode::DisconnectOldProtocol(int nVersionRequired, string strLastCommand)
@@ -702,6 +773,12 @@ void CNode::copyStats(CNodeStats& stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_msgStats);
+        for (std::map<int, CMessageStats>::const_iterator it = mapMsgStats.begin(); it != mapMsgStats.end(); ++it)
+            stats.mapMsgStats[GetMessageCommandName(it->first)] = it->second;
+    }
 }
 #undef X
 
@@ -736,6 +813,8 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            msg.nCommandId = GetMessageCommandId(msg.hdr.GetCommand());
+            RecordMessageQueued(msg.nCommandId);
             messageHandlerCondition.notify_one();
         }
     }
@@ -835,70 +914,491 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+#ifdef USE_EPOLL
+//! Consecutive zero-timeout polls before the socket handler waits again
+static const int MAX_SOCKET_BUSY_ROUNDS = 16;
+//! Poll timeout of the socket handler, which also paces retries of deferred nodes (milliseconds)
+static const int SOCKET_WAIT_MILLIS = 50;
+//! Interval between inactivity checks of all nodes (milliseconds)
+static const int64_t INACTIVITY_CHECK_MILLIS = 1000;
+
+/**
+ * Persistent epoll registration of the listening sockets, a wakeup pipe and
+ * every connected node. Node sockets are edge-triggered: an event only sets
+ * the node's fSocketRecvReady/fSocketSendReady flags, which stay set until a
+ * recv() or send() reports that the socket would block.
+ *
+ * Nodes with events, queued sends or deferred work are collected in a
+ * pending set, so the socket handler only visits those.
+ */
+class CSocketEvents
+{
+private:
+    int fdEpoll;
+    int fdWakeup[2];
+    CCriticalSection cs_socketEvents;
+    std::map<SOCKET, CNode*> mapNodes;
+    std::map<CNode*, SOCKET> mapNodeSockets;
+    std::set<CNode*> setPending;
+
+public:
+    CSocketEvents() : fdEpoll(-1)
+    {
+        fdWakeup[0] = fdWakeup[1] = -1;
+    }
+
+    ~CSocketEvents()
+    {
+        if (fdEpoll != -1)
+            close(fdEpoll);
+        if (fdWakeup[0] != -1) {
+            close(fdWakeup[0]);
+            close(fdWakeup[1]);
+        }
+    }
+
+    bool IsActive() const { return fdEpoll != -1; }
+
+    bool Init()
+    {
+        fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (fdEpoll == -1) {
+            LogPrintf("epoll_create1() failed: %s, falling back to select()\n", NetworkErrorString(errno));
+            return false;
+        }
+        if (pipe2(fdWakeup, O_NONBLOCK | O_CLOEXEC) == -1) {
+            LogPrintf("pipe2() failed: %s, falling back to select()\n", NetworkErrorString(errno));
+            close(fdEpoll);
+            fdEpoll = -1;
+            return false;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fdWakeup[0];
+        epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fdWakeup[0], &event);
+
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+            event.events = EPOLLIN;
+            event.data.fd = hListenSocket.socket;
+            if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) == -1)
+                LogPrintf("epoll_ctl() for listening socket failed: %s\n", NetworkErrorString(errno));
+        }
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            AddNode(pnode);
+        return true;
+    }
+
+    void AddNode(CNode* pnode)
+    {
+        if (fdEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+            return;
+        LOCK(cs_socketEvents);
+        // A closed node's descriptor number may already have been reused
+        mapNodes[pnode->hSocket] = pnode;
+        mapNodeSockets[pnode] = pnode->hSocket;
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = pnode->hSocket;
+        if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+            LogPrintf("epoll_ctl() for peer=%d failed: %s\n", pnode->id, NetworkErrorString(errno));
+    }
+
+    //! Forget a node before it is deleted; its closed socket already left the epoll set
+    void RemoveNode(CNode* pnode)
+    {
+        LOCK(cs_socketEvents);
+        std::map<CNode*, SOCKET>::iterator it = mapNodeSockets.find(pnode);
+        if (it == mapNodeSockets.end())
+            return;
+        std::map<SOCKET, CNode*>::iterator itNode = mapNodes.find(it->second);
+        if (itNode != mapNodes.end() && itNode->second == pnode)
+            mapNodes.erase(itNode);
+        mapNodeSockets.erase(it);
+        setPending.erase(pnode);
+    }
+
+    //! Have the next round of the socket handler visit pnode
+    void Defer(CNode* pnode)
+    {
+        LOCK(cs_socketEvents);
+        if (mapNodeSockets.count(pnode))
+            setPending.insert(pnode);
+    }
+
+    //! Hand over the nodes to visit in this round
+    void TakePending(std::set<CNode*>& setNodes)
+    {
+        LOCK(cs_socketEvents);
+        setNodes.swap(setPending);
+        setPending.clear();
+    }
+
+    //! Interrupt a pending Wait()
+    void Wakeup()
+    {
+        if (fdWakeup[1] == -1)
+            return;
+        char ch = 0;
+        if (write(fdWakeup[1], &ch, 1) == -1) {
+            // Pipe already full: the socket handler is awake anyway
+        }
+    }
+
+    /**
+     * Wait up to nTimeout milliseconds for socket events, flag the nodes that
+     * became readable or writable and return the listening sockets with
+     * pending connections.
+     */
+    void Wait(int nTimeout, std::vector<const ListenSocket*>& vListenReady)
+    {
+        struct epoll_event events[256];
+        int nEvents = epoll_wait(fdEpoll, events, 256, nTimeout);
+        if (nEvents == -1) {
+            if (errno != EINTR)
+                LogPrintf("epoll_wait() failed: %s\n", NetworkErrorString(errno));
+            return;
+        }
+
+        LOCK(cs_socketEvents);
+        for (int i = 0; i < nEvents; i++) {
+            int fd = events[i].data.fd;
+            if (fd == fdWakeup[0]) {
+                char buf[64];
+                while (read(fdWakeup[0], buf, sizeof(buf)) > 0) {
+                }
+                continue;
+            }
+            std::map<SOCKET, CNode*>::iterator it = mapNodes.find(fd);
+            if (it == mapNodes.end()) {
+                BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+                    if (hListenSocket.socket == fd)
+                        vListenReady.push_back(&hListenSocket);
+                continue;
+            }
+            // Errors and hangups surface through the next recv() or send()
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                it->second->fSocketRecvReady = true;
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                it->second->fSocketSendReady = true;
+            setPending.insert(it->second);
+        }
+    }
+};
+
+static CSocketEvents socketEvents;
+#endif
+
+void WakeSocketHandler(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    socketEvents.Defer(pnode);
+    socketEvents.Wakeup();
+#endif
+}
+
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    socketEvents.AddNode(pnode);
+#endif
+}
+
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+#ifdef USE_EPOLL
+                socketEvents.RemoveNode(pnode);
+#endif
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
+                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (!IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        RegisterNodeSocket(pnode);
+    }
+}
+
+/** Read once from the node's socket (requires LOCK(cs_vRecvMsg)); returns false if nothing was read */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return true;
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+/** Whether the node has room for more received data (requires LOCK(cs_vRecvMsg)) */
+static bool CanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+static void ThreadSocketHandlerEpoll()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fMoreWork = false;
+    int nBusyRounds = 0;
+    int64_t nLastInactivityCheck = GetTimeMillis();
     while (true) {
+        DisconnectNodes(nPrevNodeCount);
+
+        // Only skip the wait while a node has unread data or a lock was busy,
+        // and only for a bounded number of rounds so one peer cannot keep this
+        // thread spinning.
+        nBusyRounds = fMoreWork ? nBusyRounds + 1 : 0;
+        std::vector<const ListenSocket*> vListenReady;
+        socketEvents.Wait(fMoreWork && nBusyRounds <= MAX_SOCKET_BUSY_ROUNDS ? 0 : SOCKET_WAIT_MILLIS, vListenReady);
+        boost::this_thread::interruption_point();
+        fMoreWork = false;
+
         //
-        // Disconnect nodes
+        // Accept new connections
         //
+        BOOST_FOREACH (const ListenSocket* pListenSocket, vListenReady)
+            AcceptConnection(*pListenSocket);
+
+        //
+        // Service the sockets with events, queued sends or deferred work
+        //
+        std::set<CNode*> setReady;
+        socketEvents.TakePending(setReady);
+        bool fInactivityCheck = GetTimeMillis() - nLastInactivityCheck >= INACTIVITY_CHECK_MILLIS;
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+            if (fInactivityCheck) {
+                vNodesCopy = vNodes;
+            } else {
+                // Nodes in the pending set are registered, so not yet deleted
+                vNodesCopy.assign(setReady.begin(), setReady.end());
             }
+            BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
+        BOOST_FOREACH (CNode* pnode, setReady) {
+            boost::this_thread::interruption_point();
+
+            //
+            // Send
+            //
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            bool fSendQueued = true;
+            bool fDefer = false;
+            if (pnode->fSocketSendReady) {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend) {
+                    if (!pnode->vSendMsg.empty()) {
+                        SocketSendData(pnode);
+                        // Data left over means the kernel buffer is full: wait for EPOLLOUT
+                        if (!pnode->vSendMsg.empty())
+                            pnode->fSocketSendReady = false;
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                    fSendQueued = !pnode->vSendMsg.empty();
+                } else {
+                    fDefer = fMoreWork = true;
+                }
+            } else {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                fSendQueued = !lockSend || !pnode->vSendMsg.empty();
+            }
+
+            //
+            // Receive, unless we are still draining the send queue (see the select() loop)
+            //
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (pnode->fSocketRecvReady) {
+                if (fSendQueued) {
+                    // Picked up again once the send queue drains
+                    fDefer = true;
+                } else {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (!lockRecv || !CanReceive(pnode)) {
+                        // Retried on the next round, at the latest after SOCKET_WAIT_MILLIS
+                        fDefer = true;
+                    } else if (SocketRecvData(pnode)) {
+                        fDefer = fMoreWork = true;
+                    } else {
+                        pnode->fSocketRecvReady = false;
                     }
                 }
             }
+            if (fDefer)
+                socketEvents.Defer(pnode);
+        }
+
+        //
+        // Inactivity checking
+        //
+        if (fInactivityCheck) {
+            nLastInactivityCheck = GetTimeMillis();
+            BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                InactivityCheck(pnode);
         }
-        size_t vNodesSize;
         {
             LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
-        }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                pnode->Release();
         }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (socketEvents.IsActive()) {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true) {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -927,6 +1427,13 @@ void ThreadSocketHandler()
             BOOST_FOREACH (CNode* pnode, vNodes) {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
+#ifndef WIN32
+                // Sockets accepted for epoll may be out of range if it failed to start
+                if (pnode->hSocket >= FD_SETSIZE) {
+                    pnode->fDisconnect = true;
+                    continue;
+                }
+#endif
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 have_fds = true;
@@ -955,8 +1462,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && CanReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -982,49 +1488,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -1043,37 +1508,12 @@ void ThreadSocketHandler()
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
+            if (pnode->hSocket == INVALID_SOCKET || pnode->hSocket > hSocketMax)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockRecv)
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1090,22 +1530,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1492,6 +1917,13 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
+/**
+ * Message handler worker. Several of these run side by side; each pass visits
+ * every peer, and a worker claims a peer by taking its cs_vRecvMsg for both
+ * the receive and the send step. A peer is therefore only ever serviced by one
+ * worker at a time, which keeps its messages in FIFO order, while a slow
+ * message from one peer no longer holds up the others.
+ */
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
@@ -1509,28 +1941,24 @@ void ThreadMessageHandler()
         }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
             if (pnode->fDisconnect)
                 continue;
 
+            // Another worker (or the socket thread) owns this peer right now
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv)
+                continue;
+
             // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
-                            fSleep = false;
-                        }
-                    }
+            if (pnode->nSendSize < SendBufferSize()) {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                    fSleep = false;
                 }
             }
             boost::this_thread::interruption_point();
@@ -1539,7 +1967,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(pnode);
             }
             boost::this_thread::interruption_point();
         }
@@ -1757,6 +2185,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+#ifdef USE_EPOLL
+    socketEvents.Init();
+#endif
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1766,7 +2197,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = std::max(1, std::min((int)GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS), MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -1838,40 +2271,103 @@ void CExplicitNetCleanup::callCleanup()
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    // Share the mempool's copy when there is one
+    CTransactionRef ptx = mempool.get(tx.GetHash());
+    RelayTransaction(ptx ? ptx : MakeTransactionRef(tx));
+}
+
+/**
+ * Memory charged for one relay memory entry. The transaction itself is
+ * usually shared with the mempool, but it is counted in full because relay
+ * memory becomes its only owner once it is mined or evicted.
+ */
+static size_t RelayEntryUsage(const CTransactionRef& ptx)
+{
+    return memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const CInv, CTransactionRef> >)) +
+           memusage::MallocUsage(sizeof(std::pair<int64_t, CInv>)) +
+           memusage::MallocUsage(sizeof(CTransaction) + ::GetSerializeSize(*ptx, SER_NETWORK, PROTOCOL_VERSION));
+}
+
+static void RelayMemoryPopFront()
+{
+    const CInv& inv = vRelayExpiration.front().second;
+    map<CInv, CTransactionRef>::iterator mi = mapRelay.find(inv);
+    if (mi != mapRelay.end()) {
+        nRelayMemoryUsage -= RelayEntryUsage(mi->second);
+        mapRelay.erase(mi);
+    }
+    map<uint256, std::shared_ptr<const CBloomTxElements> >::iterator it = mapRelayBloomElements.find(inv.hash);
+    if (it != mapRelayBloomElements.end()) {
+        nRelayMemoryUsage -= it->second->DynamicMemoryUsage();
+        mapRelayBloomElements.erase(it);
+    }
+    vRelayExpiration.pop_front();
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
-    CInv inv(MSG_TX, tx.GetHash());
+    CInv inv(MSG_TX, ptx->GetHash());
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
+        int64_t nNow = GetTime();
+        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
+            RelayMemoryPopFront();
+
+        // Keep a reference so getdata can be served after the tx leaves the mempool
+        if (mapRelay.insert(std::make_pair(inv, ptx)).second) {
+            vRelayExpiration.push_back(std::make_pair(nNow + RELAY_EXPIRY_INTERVAL, inv));
+            nRelayMemoryUsage += RelayEntryUsage(ptx);
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        // Stay within -maxrelaymemory by dropping the oldest entries early
+        size_t nMaxUsage = GetArg("-maxrelaymemory", DEFAULT_MAX_RELAY_MEMORY) * 1000000;
+        while (nRelayMemoryUsage > nMaxUsage && !vRelayExpiration.empty())
+            RelayMemoryPopFront();
     }
+
+    // Only queue the txid here; bloom filters are matched when the peer's
+    // next trickle goes out, so relaying does not take every peer's filter lock.
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
-        if (!pnode->fRelayTxes)
-            continue;
-        LOCK(pnode->cs_filter);
-        if (pnode->pfilter) {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
-                pnode->PushInventory(inv);
-        } else
+        if (pnode->fRelayTxes)
             pnode->PushInventory(inv);
     }
 }
 
+std::shared_ptr<const CBloomTxElements> GetRelayBloomElements(const CTransactionRef& ptx)
+{
+    const uint256& hash = ptx->GetHash();
+    {
+        LOCK(cs_mapRelay);
+        map<uint256, std::shared_ptr<const CBloomTxElements> >::const_iterator it = mapRelayBloomElements.find(hash);
+        if (it != mapRelayBloomElements.end())
+            return it->second;
+    }
+
+    // Parse outside the lock; another peer racing us just wastes one extraction
+    std::shared_ptr<const CBloomTxElements> pelements = std::make_shared<const CBloomTxElements>(*ptx);
+
+    LOCK(cs_mapRelay);
+    // Only kept for as long as the transaction itself is in relay memory
+    if (mapRelay.count(CInv(MSG_TX, hash)) && mapRelayBloomElements.insert(std::make_pair(hash, pelements)).second)
+        nRelayMemoryUsage += pelements->DynamicMemoryUsage();
+    return pelements;
+}
+
+CTransactionRef GetRelayTransaction(const uint256& hash)
+{
+    CTransactionRef ptx = mempool.get(hash);
+    if (ptx)
+        return ptx;
+
+    LOCK(cs_mapRelay);
+    map<CInv, CTransactionRef>::const_iterator mi = mapRelay.find(CInv(MSG_TX, hash));
+    if (mi != mapRelay.end())
+        return mi->second;
+    return CTransactionRef();
+}
+
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
@@ -1896,6 +2392,24 @@ void RelayInv(CInv& inv)
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
+int64_t PoissonNextSendInbound(int64_t nNow, int average_interval_seconds)
+{
+    // Sharing the timer means a spy opening many inbound connections learns
+    // no more about the origin of a transaction than it would from one.
+    static CCriticalSection cs_nextInboundSend;
+    static int64_t nNextInboundSend = 0;
+
+    LOCK(cs_nextInboundSend);
+    if (nNextInboundSend < nNow)
+        nNextInboundSend = PoissonNextSend(nNow, average_interval_seconds);
+    return nNextInboundSend;
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -2081,12 +2595,17 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fGetAddr = false;
     fRelayTxes = false;
     setInventoryKnown.max_size(SendBufferSize() / 1000);
+    nNextInvSend = 0;
+    nNextAddrSend = 0;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
+    nMainLockMisses = 0;
     fObfuScationMaster = false;
+    fSocketRecvReady = true;
+    fSocketSendReady = true;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2112,6 +2631,8 @@ CNode::~CNode()
     if (pfilter)
         delete pfilter;
 
+    RecordMessagesRemoved(vRecvMsg.begin(), vRecvMsg.end());
+
     GetNodeSignals().FinalizeNode(GetId());
 }
 
@@ -2201,6 +2722,10 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (it == vSendMsg.begin())
         SocketSendData(this);
 
+    // Let the socket handler pick up whatever could not be written right away
+    if (!vSendMsg.empty())
+        WakeSocketHandler(this);
+
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
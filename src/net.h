@@ -14,6 +14,7 @@
 #include "limitedmap.h"
 #include "mruset.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -62,6 +63,20 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -msghandthreads default */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** Average delay between trickled transaction inventory announcements to inbound peers (in seconds); outbound peers get half of it */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transactions announced to a peer per trickle */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Average delay between address announcements to a peer (in seconds) */
+static const int AVG_ADDRESS_BROADCAST_INTERVAL = 30;
+/** How long a relayed transaction can still be fetched from relay memory (in seconds) */
+static const int RELAY_EXPIRY_INTERVAL = 15 * 60;
+/** -maxrelaymemory default, in megabytes */
+static const unsigned int DEFAULT_MAX_RELAY_MEMORY = 20;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -81,6 +96,8 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+/** Wake the socket handler thread so it services pnode's queued data without waiting for its poll timeout */
+void WakeSocketHandler(CNode* pnode);
 
 typedef int NodeId;
 
@@ -88,7 +105,7 @@ typedef int NodeId;
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
     boost::signals2::signal<bool(CNode*)> ProcessMessages;
-    boost::signals2::signal<bool(CNode*, bool)> SendMessages;
+    boost::signals2::signal<bool(CNode*)> SendMessages;
     boost::signals2::signal<void(NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void(NodeId)> FinalizeNode;
 };
@@ -132,8 +149,9 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CTransactionRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
+extern size_t nRelayMemoryUsage;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
@@ -151,6 +169,31 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Accounting for one message command */
+class CMessageStats
+{
+public:
+    uint64_t nQueued;              //! complete messages waiting in peer receive queues
+    uint64_t nProcessed;           //! messages handed to ProcessMessage
+    uint64_t nBytes;               //! payload bytes of the processed messages
+    int64_t nQueueTimeMicros;      //! total time processed messages spent queued
+    int64_t nProcessTimeMicros;    //! total wall-clock time spent in the handler
+    int64_t nCpuTimeMicros;        //! total CPU time spent in the handler
+    int64_t nMaxProcessTimeMicros; //! slowest single handler invocation
+
+    CMessageStats() : nQueued(0), nProcessed(0), nBytes(0), nQueueTimeMicros(0), nProcessTimeMicros(0), nCpuTimeMicros(0), nMaxProcessTimeMicros(0) {}
+
+    void AddProcessed(unsigned int nBytesIn, int64_t nQueueTime, int64_t nProcessTime, int64_t nCpuTime)
+    {
+        nProcessed++;
+        nBytes += nBytesIn;
+        nQueueTimeMicros += nQueueTime;
+        nProcessTimeMicros += nProcessTime;
+        nCpuTimeMicros += nCpuTime;
+        nMaxProcessTimeMicros = std::max(nMaxProcessTimeMicros, nProcessTime);
+    }
+};
+
 class CNodeStats
 {
 public:
@@ -171,6 +214,7 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    std::map<std::string, CMessageStats> mapMsgStats;
 };
 
 
@@ -187,6 +231,8 @@ public:
     unsigned int nDataPos;
 
     int64_t nTime; // time (in microseconds) of message receipt.
+    int nCommandId; // interned command, set once the message is complete
+    bool fSigsChecked; // signatures already recovered ahead of processing
 
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
     {
@@ -195,6 +241,8 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nCommandId = NETMSG_UNKNOWN;
+        fSigsChecked = false;
     }
 
     bool complete() const
@@ -222,6 +270,16 @@ typedef enum BanReason
     BanReasonManuallyAdded    = 2
 } BanReason;
 
+/** Account a message that became complete and was queued for processing */
+void RecordMessageQueued(int nCommandId);
+/** Account complete messages leaving a receive queue, processed or not */
+void RecordMessagesRemoved(std::deque<CNetMessage>::const_iterator begin, std::deque<CNetMessage>::const_iterator end);
+/** Account one handled message, both globally and for the peer it came from */
+void RecordMessageProcessed(CNode* pnode, const CNetMessage& msg, int64_t nProcessTimeMicros, int64_t nCpuTimeMicros);
+/** Node-wide statistics, keyed by command name */
+void GetMessageStats(std::map<std::string, CMessageStats>& mapStats);
+
+
 class CBanEntry
 {
 public:
@@ -317,6 +375,9 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Socket readiness reported by the epoll event loop; only used by the socket handler thread
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -356,18 +417,31 @@ public:
     int nStartingHeight;
 
     // flood relay
+    // vAddrToSend and setAddrKnown are touched by every message handler thread
+    // relaying addresses, so they are guarded by cs_addrKnown.
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
+    // Transactions waiting to be trickled are kept in a set so repeated
+    // relays of the same txid collapse into one announcement; everything else
+    // (blocks, masternode and budget objects) goes out on the next send.
     mruset<CInv> setInventoryKnown;
+    std::set<uint256> setInventoryTxToSend;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    int64_t nNextInvSend;
+    int64_t nNextAddrSend;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
 
+    // Per-command accounting of the messages processed from this peer
+    std::map<int, CMessageStats> mapMsgStats;
+    CCriticalSection cs_msgStats;
+
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
     uint64_t nPingNonceSent;
@@ -377,6 +451,8 @@ public:
     int64_t nPingUsecTime;
     // Whether a ping is requested.
     bool fPingQueued;
+    // Consecutive SendMessages rounds skipped because cs_main was busy; only used by the message handler thread
+    int nMainLockMisses;
 
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false);
     ~CNode();
@@ -437,6 +513,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -445,6 +522,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr)) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -467,7 +545,11 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (setInventoryKnown.count(inv))
+                return;
+            if (inv.type == MSG_TX)
+                setInventoryTxToSend.insert(inv.hash);
+            else
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -737,10 +819,19 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
+/** Look up a transaction that can be served to peers, from the mempool or relay memory */
+CTransactionRef GetRelayTransaction(const uint256& hash);
+/** Bloom elements of a relayed transaction, shared by every filtered peer it is announced to */
+std::shared_ptr<const CBloomTxElements> GetRelayBloomElements(const CTransactionRef& ptx);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+/** Like PoissonNextSend, but one timer is shared by all inbound peers. */
+int64_t PoissonNextSendInbound(int64_t nNow, int average_interval_seconds);
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
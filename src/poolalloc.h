@@ -0,0 +1,199 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_POOLALLOC_H
+#define BITCOIN_POOLALLOC_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Memory pool for the nodes of a node-based container.
+ *
+ * Blocks are carved from large chunks, and freed blocks go on a free list per
+ * block size to be reused by the next allocation of that size. This avoids the
+ * per-allocation malloc overhead and keeps the nodes densely packed. Chunks
+ * are only returned to the system by Release() or on destruction.
+ *
+ * Not thread-safe: a pool belongs to a single container.
+ */
+class CPoolResource
+{
+public:
+    //! Alignment and size granularity of the blocks
+    static const size_t BLOCK_ALIGN = 8;
+    //! Larger allocations are not served from the pool
+    static const size_t MAX_BLOCK_SIZE = 256;
+    //! Size of the chunks the blocks are carved from
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    //! Size of the block an allocation of nBytes occupies in the pool
+    static size_t BlockSize(size_t nBytes)
+    {
+        return (nBytes + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+    }
+
+    //! Whether an object of the given size and alignment is served from the pool
+    static bool Fits(size_t nBytes, size_t nAlign)
+    {
+        return nBytes > 0 && nBytes <= MAX_BLOCK_SIZE && BLOCK_ALIGN % nAlign == 0;
+    }
+
+    CPoolResource() : vFree(MAX_BLOCK_SIZE / BLOCK_ALIGN + 1, (FreeBlock*)NULL), pChunkPos(NULL), pChunkEnd(NULL), nUsedBytes(0) {}
+
+    ~CPoolResource()
+    {
+        FreeChunks();
+    }
+
+    void* Allocate(size_t nBytes)
+    {
+        const size_t nBlock = BlockSize(nBytes);
+        FreeBlock*& pFree = vFree[nBlock / BLOCK_ALIGN];
+        void* p;
+        if (pFree != NULL) {
+            p = pFree;
+            pFree = pFree->pNext;
+        } else {
+            if ((size_t)(pChunkEnd - pChunkPos) < nBlock) {
+                // The tail of the previous chunk is too small and stays unused
+                pChunkPos = static_cast<char*>(::operator new(CHUNK_SIZE));
+                pChunkEnd = pChunkPos + CHUNK_SIZE;
+                vChunks.push_back(pChunkPos);
+            }
+            p = pChunkPos;
+            pChunkPos += nBlock;
+        }
+        nUsedBytes += nBlock;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes)
+    {
+        const size_t nBlock = BlockSize(nBytes);
+        FreeBlock*& pFree = vFree[nBlock / BLOCK_ALIGN];
+        FreeBlock* pBlock = new (p) FreeBlock;
+        pBlock->pNext = pFree;
+        pFree = pBlock;
+        assert(nUsedBytes >= nBlock);
+        nUsedBytes -= nBlock;
+    }
+
+    //! Return all chunks to the system; only possible once every block has been freed
+    bool Release()
+    {
+        if (nUsedBytes != 0)
+            return false;
+        FreeChunks();
+        return true;
+    }
+
+    //! Bytes in blocks currently handed out
+    size_t UsedBytes() const { return nUsedBytes; }
+
+    //! Bytes held from the system, including free blocks
+    size_t ChunkBytes() const { return vChunks.size() * CHUNK_SIZE; }
+
+private:
+    struct FreeBlock {
+        FreeBlock* pNext;
+    };
+
+    std::vector<FreeBlock*> vFree;
+    std::vector<char*> vChunks;
+    char* pChunkPos;
+    char* pChunkEnd;
+    size_t nUsedBytes;
+
+    void FreeChunks()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        vChunks.clear();
+        vFree.assign(vFree.size(), (FreeBlock*)NULL);
+        pChunkPos = pChunkEnd = NULL;
+    }
+
+    CPoolResource(const CPoolResource&);
+    CPoolResource& operator=(const CPoolResource&);
+};
+
+/**
+ * Allocator serving single-object allocations (container nodes) from a
+ * CPoolResource. Array allocations such as bucket tables, and every allocation
+ * of a default-constructed allocator, go to the global operator new.
+ */
+template <typename T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    pool_allocator() throw() : pool(NULL) {}
+    explicit pool_allocator(CPoolResource* poolIn) throw() : pool(poolIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : pool(a.pool)
+    {
+    }
+
+    T* allocate(size_t n, const void* hint = 0)
+    {
+        if (pool != NULL && n == 1 && CPoolResource::Fits(sizeof(T), alignof(T)))
+            return static_cast<T*>(pool->Allocate(sizeof(T)));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (pool != NULL && n == 1 && CPoolResource::Fits(sizeof(T), alignof(T)))
+            pool->Deallocate(p, sizeof(T));
+        else
+            ::operator delete(p);
+    }
+
+    size_t max_size() const throw() { return size_t(-1) / sizeof(T); }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U* p)
+    {
+        p->~U();
+    }
+
+    CPoolResource* pool;
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.pool != b.pool;
+}
+
+#endif // BITCOIN_POOLALLOC_H
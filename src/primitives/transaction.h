@@ -14,6 +14,7 @@
 #include "uint256.h"
 
 #include <list>
+#include <memory>
 
 class CTransaction;
 
@@ -347,4 +348,10 @@ struct CMutableTransaction
 
 };
 
+/** Reference-counted immutable transaction, shared between mempool, orphan pool and relay */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx>
+static inline CTransactionRef MakeTransactionRef(const Tx& txIn) { return std::make_shared<const CTransaction>(txIn); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
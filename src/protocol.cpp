@@ -16,6 +16,8 @@
 #include <arpa/inet.h>
 #endif
 
+#include <boost/unordered_map.hpp>
+
 static const char* ppszTypeName[] =
     {
         "ERROR",
@@ -36,6 +38,87 @@ static const char* ppszTypeName[] =
         "mn ping",
         "dstx"};
 
+static const char* ppszCoreCommand[] =
+    {
+        "*other*",
+        "version",
+        "verack",
+        "addr",
+        "inv",
+        "getdata",
+        "getblocks",
+        "getheaders",
+        "tx",
+        "dstx",
+        "headers",
+        "block",
+        "getaddr",
+        "mempool",
+        "ping",
+        "pong",
+        "alert",
+        "filterload",
+        "filteradd",
+        "filterclear",
+        "reject",
+        "notfound",
+        "merkleblock"};
+
+/** Command name <-> identifier tables, written during startup only and read lock-free afterwards */
+class CMessageCommandTable
+{
+public:
+    boost::unordered_map<std::string, int> mapIds;
+    std::vector<std::string> vNames;
+
+    CMessageCommandTable()
+    {
+        for (int i = 0; i < NETMSG_CORE_END; i++) {
+            vNames.push_back(ppszCoreCommand[i]);
+            if (i != NETMSG_UNKNOWN)
+                mapIds[ppszCoreCommand[i]] = i;
+        }
+    }
+};
+
+static CMessageCommandTable& CommandTable()
+{
+    static CMessageCommandTable table;
+    return table;
+}
+
+int RegisterMessageCommand(const std::string& strCommand)
+{
+    CMessageCommandTable& table = CommandTable();
+    boost::unordered_map<std::string, int>::const_iterator it = table.mapIds.find(strCommand);
+    if (it != table.mapIds.end())
+        return it->second;
+    int nId = table.vNames.size();
+    table.mapIds[strCommand] = nId;
+    table.vNames.push_back(strCommand);
+    return nId;
+}
+
+int GetMessageCommandId(const std::string& strCommand)
+{
+    const CMessageCommandTable& table = CommandTable();
+    boost::unordered_map<std::string, int>::const_iterator it = table.mapIds.find(strCommand);
+    return it == table.mapIds.end() ? (int)NETMSG_UNKNOWN : it->second;
+}
+
+std::string GetMessageCommandName(int nCommandId)
+{
+    const CMessageCommandTable& table = CommandTable();
+    if (nCommandId < 0 || nCommandId >= (int)table.vNames.size())
+        return table.vNames[NETMSG_UNKNOWN];
+    return table.vNames[nCommandId];
+}
+
+int GetMessageCommandCount()
+{
+    return CommandTable().vNames.size();
+}
+
 CMessageHeader::CMessageHeader()
 {
     memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
@@ -80,6 +80,10 @@ enum {
 
 	 NODE_BLOOM_WITHOUT_MN = (1 << 4),
 
+    // NODE_COMPACT_FILTERS means the node serves the basic block filters and
+    // their headers (BIP157/BIP158) through getcfilters and getcfheaders.
+    NODE_COMPACT_FILTERS = (1 << 6),
+
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
     // bitcoin-development mailing list. Remember that service bits are just
@@ -176,4 +180,45 @@ enum {
     MSG_DSTX
 };
 
+/**
+ * Interned identifiers of P2P commands. The core commands below are interned
+ * in this order; subsystems intern their own commands at startup through
+ * RegisterMessageCommand and get the identifiers that follow.
+ */
+enum {
+    NETMSG_UNKNOWN = 0, //! any command that was never registered
+    NETMSG_VERSION,
+    NETMSG_VERACK,
+    NETMSG_ADDR,
+    NETMSG_INV,
+    NETMSG_GETDATA,
+    NETMSG_GETBLOCKS,
+    NETMSG_GETHEADERS,
+    NETMSG_TX,
+    NETMSG_DSTX,
+    NETMSG_HEADERS,
+    NETMSG_BLOCK,
+    NETMSG_GETADDR,
+    NETMSG_MEMPOOL,
+    NETMSG_PING,
+    NETMSG_PONG,
+    NETMSG_ALERT,
+    NETMSG_FILTERLOAD,
+    NETMSG_FILTERADD,
+    NETMSG_FILTERCLEAR,
+    NETMSG_REJECT,
+    NETMSG_NOTFOUND,
+    NETMSG_MERKLEBLOCK,
+    NETMSG_CORE_END
+};
+
+/** Intern a command and return its identifier. Only call during startup, before the network threads run. */
+int RegisterMessageCommand(const std::string& strCommand);
+/** Identifier of a command, or NETMSG_UNKNOWN if it was never registered */
+int GetMessageCommandId(const std::string& strCommand);
+/** Name of an interned command */
+std::string GetMessageCommandName(int nCommandId);
+/** Number of interned command identifiers, including NETMSG_UNKNOWN */
+int GetMessageCommandCount();
+
 #endif // BITCOIN_PROTOCOL_H
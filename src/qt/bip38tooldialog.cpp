@@ -216,6 +216,13 @@ void Bip38ToolDialog::on_importAddressButton_DEC_clicked()
         return;
     }
 
+    CWalletRescanReserver reserver(pwalletMain);
+    if (!reserver.Reserve()) {
+        ui->statusLabel_DEC->setStyleSheet("QLabel { color: red; }");
+        ui->statusLabel_DEC->setText(tr("Wallet is currently rescanning.") + QString(" ") + tr("Please try again."));
+        return;
+    }
+
     CKeyID vchAddress = pubkey.GetID();
     {
         ui->statusLabel_DEC->setStyleSheet("QLabel { color: red; }");
@@ -241,7 +248,7 @@ void Bip38ToolDialog::on_importAddressButton_DEC_clicked()
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), reserver, true);
     }
 
     ui->statusLabel_DEC->setStyleSheet("QLabel { color: green; }");
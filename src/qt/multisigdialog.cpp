@@ -234,7 +234,13 @@ void MultisigDialog::on_importAddressButton_clicked(){
     addMultisig(stoi(vRedeem[0]), keys);
 
     // rescan to find txs associated with imported address
-    pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+    CWalletRescanReserver reserver(pwalletMain);
+    if (!reserver.Reserve()) {
+        ui->addMultisigStatus->setStyleSheet("QLabel { color: red; }");
+        ui->addMultisigStatus->setText("Wallet is currently rescanning, rescan later to find the transactions of the imported address.");
+        return;
+    }
+    pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), reserver, true);
     pwalletMain->ReacceptWalletTransactions();
 }
 
@@ -5,6 +5,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "blockfilterdb.h"
 #include "chain.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
@@ -266,6 +267,147 @@ static bool rest_block_notxdetails(HTTPRequest* req, const std::string& strURIPa
     return rest_block(req, strURIPart, false);
 }
 
+static bool rest_block_filter(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    if (!pblockfilterdb)
+        return RESTERR(req, HTTP_NOT_FOUND, "Block filters are not indexed, restart with -blockfilterindex");
+
+    string hashStr = params[0];
+    uint256 hash;
+    if (!ParseHashStr(hashStr, hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+
+    CBlockFilter filter;
+    if (!pblockfilterdb->ReadFilter(hash, filter))
+        return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+
+    CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+    ssFilter << filter.GetEncodedFilter();
+
+    switch (rf) {
+    case RF_BINARY: {
+        string binaryFilter = ssFilter.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryFilter);
+        return true;
+    }
+
+    case RF_HEX: {
+        string strHex = HexStr(ssFilter.begin(), ssFilter.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+
+    case RF_JSON: {
+        UniValue objFilter(UniValue::VOBJ);
+        objFilter.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+        string strJSON = objFilter.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_filter_headers(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (!pblockfilterdb)
+        return RESTERR(req, HTTP_NOT_FOUND, "Block filters are not indexed, restart with -blockfilterindex");
+
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "No header count specified. Use /rest/blockfilterheaders/<count>/<hash>.<ext>.");
+
+    long count = strtol(path[0].c_str(), NULL, 10);
+    if (count < 1 || count > MAX_GETCFHEADERS_SIZE)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Header count out of range: " + path[0]);
+
+    string hashStr = path[1];
+    uint256 hash;
+    if (!ParseHashStr(hashStr, hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+
+    std::vector<uint256> vBlocks;
+    vBlocks.reserve(count);
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        const CBlockIndex *pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
+        while (pindex != NULL && chainActive.Contains(pindex)) {
+            vBlocks.push_back(pindex->GetBlockHash());
+            if (vBlocks.size() == (unsigned long)count)
+                break;
+            pindex = chainActive.Next(pindex);
+        }
+    }
+
+    // Stop at the first block whose filter is not indexed yet
+    std::vector<uint256> vHeaders;
+    vHeaders.reserve(vBlocks.size());
+    BOOST_FOREACH(const uint256& hashBlock, vBlocks) {
+        uint256 hashFilter, hashHeader;
+        if (!pblockfilterdb->ReadFilterHashes(hashBlock, hashFilter, hashHeader))
+            break;
+        vHeaders.push_back(hashHeader);
+    }
+
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH(const uint256& hashHeader, vHeaders) {
+        ssHeader << hashHeader;
+    }
+
+    switch (rf) {
+    case RF_BINARY: {
+        string binaryHeader = ssHeader.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryHeader);
+        return true;
+    }
+
+    case RF_HEX: {
+        string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+    case RF_JSON: {
+        UniValue jsonHeaders(UniValue::VARR);
+        BOOST_FOREACH(const uint256& hashHeader, vHeaders) {
+            jsonHeaders.push_back(hashHeader.GetHex());
+        }
+        string strJSON = jsonHeaders.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -601,6 +743,8 @@ static const struct {
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
+      {"/rest/blockfilter/", rest_block_filter},
+      {"/rest/blockfilterheaders/", rest_filter_headers},
       {"/rest/getutxos", rest_getutxos},
 };
 
@@ -7,6 +7,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "base58.h"
+#include "blockfilterdb.h"
 #include "checkpoints.h"
 #include "clientversion.h"
 #include "main.h"
@@ -424,14 +425,60 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     return blockheaderToJSON(pblockindex);
 }
 
+UniValue getblockfilter(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getblockfilter \"hash\"\n"
+            "\nReturns the basic compact block filter (BIP158) of block 'hash' and its filter header.\n"
+            "Requires -blockfilterindex.\n"
+
+            "\nArguments:\n"
+            "1. \"hash\"          (string, required) The block hash\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"xxxx\",   (string) The hex-encoded filter data\n"
+            "  \"header\" : \"xxxx\"    (string) The hex-encoded filter header\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getblockfilter", "\"00000000000fd08c2fb661d2fcb0d49abb3a91e5f27082ce64feed3b4dede2e2\"") +
+            HelpExampleRpc("getblockfilter", "\"00000000000fd08c2fb661d2fcb0d49abb3a91e5f27082ce64feed3b4dede2e2\""));
+
+    if (!pblockfilterdb)
+        throw JSONRPCError(RPC_MISC_ERROR, "Block filters are not indexed, restart with -blockfilterindex");
+
+    uint256 hash(params[0].get_str());
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    }
+
+    CBlockFilter filter;
+    uint256 hashFilter, hashHeader;
+    if (!pblockfilterdb->ReadFilter(hash, filter) || !pblockfilterdb->ReadFilterHashes(hash, hashFilter, hashHeader))
+        throw JSONRPCError(RPC_MISC_ERROR, "Filter not found, the index may still be building");
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    ret.push_back(Pair("header", hashHeader.GetHex()));
+    return ret;
+}
+
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
             "Note this call may take some time.\n"
 
+            "\nArguments:\n"
+            "1. \"hash_type\"  (string, optional, default=legacy) Which UTXO set hash to calculate: \"legacy\" (ordered, single-threaded)\n"
+            "                 or \"muhash\" (order-independent, scanned on multiple threads)\n"
+
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -439,26 +486,37 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (only with hash_type legacy)\n"
+            "  \"muhash\": \"hash\",            (string) The order-independent set hash (only with hash_type muhash)\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
 
             "\nExamples:\n" +
-            HelpExampleCli("gettxoutsetinfo", "") + HelpExampleRpc("gettxoutsetinfo", ""));
+            HelpExampleCli("gettxoutsetinfo", "") + HelpExampleCli("gettxoutsetinfo", "\"muhash\"") + HelpExampleRpc("gettxoutsetinfo", ""));
 
-    LOCK(cs_main);
+    CCoinsStats stats;
+    if (params.size() > 0) {
+        std::string strHashType = params[0].get_str();
+        if (strHashType == "muhash")
+            stats.fMuHash = true;
+        else if (strHashType != "legacy")
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid hash_type, expected legacy or muhash");
+    }
 
-    UniValue ret(UniValue::VOBJ);
+    // Only the flush needs cs_main; the scan itself runs from a database snapshot
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+    }
 
-    CCoinsStats stats;
-    FlushStateToDisk();
+    UniValue ret(UniValue::VOBJ);
     if (pcoinsTip->GetStats(stats)) {
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair(stats.fMuHash ? "muhash" : "hash_serialized", stats.hashSerialized.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
@@ -591,6 +649,13 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"blockcache\": {            (object) statistics of the recently read block cache\n"
+            "     \"entries\": xxxx,        (numeric) number of blocks in the cache\n"
+            "     \"bytes\": xxxx,          (numeric) memory used by cached blocks\n"
+            "     \"maxbytes\": xxxx,       (numeric) configured cache limit (-blockcachesize)\n"
+            "     \"hits\": xxxx,           (numeric) block reads served from the cache\n"
+            "     \"misses\": xxxx          (numeric) block reads that went to disk\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -606,6 +671,16 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+
+    CBlockCacheStats cachestats;
+    blockcache.GetStats(cachestats);
+    UniValue cache(UniValue::VOBJ);
+    cache.push_back(Pair("entries", cachestats.nEntries));
+    cache.push_back(Pair("bytes", cachestats.nBytes));
+    cache.push_back(Pair("maxbytes", cachestats.nMaxBytes));
+    cache.push_back(Pair("hits", cachestats.nHits));
+    cache.push_back(Pair("misses", cachestats.nMisses));
+    obj.push_back(Pair("blockcache", cache));
     return obj;
 }
 
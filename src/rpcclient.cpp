@@ -41,6 +41,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"settxfee", 0},
         {"getreceivedbyaddress", 1},
         {"getreceivedbyaccount", 1},
+        {"listaddresstransactions", 1},
+        {"listaddresstransactions", 2},
         {"listreceivedbyaddress", 0},
         {"listreceivedbyaddress", 1},
         {"listreceivedbyaddress", 2},
@@ -104,10 +104,6 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
             "\nAs a JSON-RPC call\n" +
             HelpExampleRpc("importprivkey", "\"mykey\", \"testing\", false"));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
-
     string strSecret = params[0].get_str();
     string strLabel = "";
     if (params.size() > 1)
@@ -118,6 +114,10 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fRescan = params[2].get_bool();
 
+    CWalletRescanReserver reserver(pwalletMain);
+    if (fRescan && !reserver.Reserve())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -129,7 +129,12 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
     CPubKey pubkey = key.GetPubKey();
     assert(key.VerifyPubKey(pubkey));
     CKeyID vchAddress = pubkey.GetID();
+    CBlockIndex* pindexGenesis;
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
 
@@ -144,11 +149,16 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+        pindexGenesis = chainActive.Genesis();
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-        }
+    // The rescan takes the locks per batch of blocks, so they are not held across it
+    if (fRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexGenesis, reserver, true);
+        if (pwalletMain->IsAbortingRescan())
+            throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
     }
+    EnsureWalletIsSynced();
 
     return NullUniValue;
 }
@@ -175,8 +185,6 @@ UniValue importaddress(const UniValue& params, bool fHelp)
             "\nAs a JSON-RPC call\n" +
             HelpExampleRpc("importaddress", "\"myaddress\", \"testing\", false"));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
     CScript script;
 
     CBitcoinAddress address(params[0].get_str());
@@ -198,7 +206,14 @@ UniValue importaddress(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fRescan = params[2].get_bool();
 
+    CWalletRescanReserver reserver(pwalletMain);
+    if (fRescan && !reserver.Reserve())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
+    CBlockIndex* pindexGenesis;
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
         if (::IsMine(*pwalletMain, script) == ISMINE_SPENDABLE)
             throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
 
@@ -215,15 +230,42 @@ UniValue importaddress(const UniValue& params, bool fHelp)
         if (!pwalletMain->AddWatchOnly(script))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+        pindexGenesis = chainActive.Genesis();
     }
 
+    // The rescan takes the locks per batch of blocks, so they are not held across it
+    if (fRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexGenesis, reserver, true);
+        if (pwalletMain->IsAbortingRescan())
+            throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+        pwalletMain->ReacceptWalletTransactions();
+    }
+    EnsureWalletIsSynced();
+
     return NullUniValue;
 }
 
+UniValue abortrescan(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "\nStops the current wallet rescan triggered e.g. by an importprivkey call.\n"
+
+            "\nResult:\n"
+            "true|false          (boolean) Whether a running rescan was asked to stop\n"
+
+            "\nExamples:\n"
+            "\nImport a private key\n" +
+            HelpExampleCli("importprivkey", "\"mykey\"") +
+            "\nAbort the running wallet rescan\n" +
+            HelpExampleCli("abortrescan", "") +
+            "\nAs a JSON-RPC call\n" +
+            HelpExampleRpc("abortrescan", ""));
+
+    return pwalletMain->AbortRescan();
+}
+
 UniValue importwallet(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -243,6 +285,10 @@ UniValue importwallet(const UniValue& params, bool fHelp)
             "\nImport using the json rpc call\n" +
             HelpExampleRpc("importwallet", "\"test\""));
 
+    CWalletRescanReserver reserver(pwalletMain);
+    if (!reserver.Reserve())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
     EnsureWalletIsUnlocked();
@@ -318,11 +364,12 @@ UniValue importwallet(const UniValue& params, bool fHelp)
         pwalletMain->nTimeFirstKey = nTimeBegin;
 
     LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+    pwalletMain->ScanForWalletTransactions(pindex, reserver);
     pwalletMain->MarkDirty();
 
     if (!fGood)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error adding some keys to wallet");
+    EnsureWalletIsSynced();
 
     return NullUniValue;
 }
@@ -491,6 +538,10 @@ UniValue bip38decrypt(const UniValue& params, bool fHelp)
             HelpExampleCli("bip38decrypt", "\"encryptedkey\" \"mypassphrase\"") +
             HelpExampleRpc("bip38decrypt", "\"encryptedkey\" \"mypassphrase\""));
 
+    CWalletRescanReserver reserver(pwalletMain);
+    if (!reserver.Reserve())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
     EnsureWalletIsUnlocked();
@@ -533,7 +584,7 @@ UniValue bip38decrypt(const UniValue& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), reserver, true);
     }
 
     return result;
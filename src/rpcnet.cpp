@@ -109,7 +109,14 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"msgstats\": {             (json object) Messages processed from this peer, per command\n"
+            "      \"command\": {\n"
+            "        \"count\": n,           (numeric) Messages handled\n"
+            "        \"bytes\": n,           (numeric) Payload bytes handled\n"
+            "        \"cputime\": n          (numeric) CPU time spent in the handler, in microseconds\n"
+            "      }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -161,6 +168,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
+        UniValue msgstats(UniValue::VOBJ);
+        for (std::map<std::string, CMessageStats>::const_iterator it = stats.mapMsgStats.begin(); it != stats.mapMsgStats.end(); ++it) {
+            UniValue entry(UniValue::VOBJ);
+            entry.push_back(Pair("count", it->second.nProcessed));
+            entry.push_back(Pair("bytes", it->second.nBytes));
+            entry.push_back(Pair("cputime", it->second.nCpuTimeMicros));
+            msgstats.push_back(Pair(it->first, entry));
+        }
+        obj.push_back(Pair("msgstats", msgstats));
+
         ret.push_back(obj);
     }
 
@@ -368,6 +385,52 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetstats\n"
+            "\nReturns per-command statistics of the peer message handlers. Commands that\n"
+            "were never registered are accounted together under \"*other*\".\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {                (json object) One entry per message command seen\n"
+            "    \"concurrent\": true|false,  (boolean) Whether the command is handled without cs_main\n"
+            "    \"queued\": n,               (numeric) Messages currently waiting in peer receive queues\n"
+            "    \"count\": n,                (numeric) Messages handled so far\n"
+            "    \"bytes\": n,                (numeric) Payload bytes of the handled messages\n"
+            "    \"cputime\": n,              (numeric) CPU time spent in the handler, in microseconds\n"
+            "    \"avgqueuetime\": n,         (numeric) Average time a message waited before being handled, in microseconds\n"
+            "    \"avghandlertime\": n,       (numeric) Average time spent in the handler, in microseconds\n"
+            "    \"maxhandlertime\": n        (numeric) Slowest single handler run, in microseconds\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getnetstats", "") + HelpExampleRpc("getnetstats", ""));
+
+    std::map<std::string, CMessageStats> mapStats;
+    GetMessageStats(mapStats);
+
+    UniValue ret(UniValue::VOBJ);
+    for (std::map<std::string, CMessageStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CMessageStats& stats = it->second;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("concurrent", IsConcurrentMessage(it->first)));
+        obj.push_back(Pair("queued", stats.nQueued));
+        obj.push_back(Pair("count", stats.nProcessed));
+        obj.push_back(Pair("bytes", stats.nBytes));
+        obj.push_back(Pair("cputime", stats.nCpuTimeMicros));
+        obj.push_back(Pair("avgqueuetime", stats.nProcessed ? stats.nQueueTimeMicros / (int64_t)stats.nProcessed : 0));
+        obj.push_back(Pair("avghandlertime", stats.nProcessed ? stats.nProcessTimeMicros / (int64_t)stats.nProcessed : 0));
+        obj.push_back(Pair("maxhandlertime", stats.nMaxProcessTimeMicros));
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
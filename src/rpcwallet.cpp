@@ -48,6 +48,13 @@ void EnsureWalletIsUnlocked(bool fAllowAnonOnly)
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 }
 
+/** Commit the queued wallet records to disk before a reply that promises they persist */
+void EnsureWalletIsSynced()
+{
+    if (!pwalletMain->SyncWalletDB())
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error: Failed to write the wallet database");
+}
+
 void WalletTxToJSON(const CWalletTx& wtx, UniValue& entry)
 {
     int confirms = wtx.GetDepthInMainChain(false);
@@ -117,6 +124,7 @@ UniValue getnewaddress(const UniValue& params, bool fHelp)
     CKeyID keyID = newKey.GetID();
 
     pwalletMain->SetAddressBook(keyID, strAccount, "receive");
+    EnsureWalletIsSynced();
 
     return CBitcoinAddress(keyID).ToString();
 }
@@ -181,6 +189,7 @@ UniValue getaccountaddress(const UniValue& params, bool fHelp)
     UniValue ret(UniValue::VSTR);
 
     ret = GetAccountAddress(strAccount).ToString();
+    EnsureWalletIsSynced();
     return ret;
 }
 
@@ -352,6 +361,7 @@ void SendMoney(const CTxDestination& address, CAmount nValue, CWalletTx& wtxNew,
     }
     if (!pwalletMain->CommitTransaction(wtxNew, reservekey, (!fUseIX ? "tx" : "ix")))
         throw JSONRPCError(RPC_WALLET_ERROR, "Error: The transaction was rejected! This might happen if some of the coins in your wallet were already spent, such as if you used a copy of wallet.dat and coins were spent in the copy but not marked as spent here.");
+    EnsureWalletIsSynced();
 }
 
 UniValue sendtoaddress(const UniValue& params, bool fHelp)
@@ -590,17 +600,24 @@ UniValue getreceivedbyaddress(const UniValue& params, bool fHelp)
     if (params.size() > 1)
         nMinDepth = params[1].get_int();
 
-    // Tally
+    // Tally the transactions of the address's ledger
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
-            continue;
+    const map<CTxDestination, AddressLedger>& mapLedgers = pwalletMain->GetAddressLedgers();
+    map<CTxDestination, AddressLedger>::const_iterator mi = mapLedgers.find(address.Get());
+    if (mi != mapLedgers.end()) {
+        for (AddressLedger::const_iterator it = mi->second.begin(); it != mi->second.end(); ++it) {
+            map<uint256, CWalletTx>::const_iterator itTx = pwalletMain->mapWallet.find(it->first.second);
+            if (itTx == pwalletMain->mapWallet.end())
+                continue;
+            const CWalletTx& wtx = itTx->second;
+            if (it->second.fCoinBase || !IsFinalTx(wtx) || wtx.GetDepthInMainChain() < nMinDepth)
+                continue;
 
-        BOOST_FOREACH (const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
+            // Pay-to-pubkey outputs share the address but not the script
+            BOOST_FOREACH (unsigned int i, it->second.vOut)
+                if (wtx.vout[i].scriptPubKey == scriptPubKey)
+                    nAmount += wtx.vout[i].nValue;
+        }
     }
 
     return ValueFromAmount(nAmount);
@@ -992,6 +1009,7 @@ UniValue sendmany(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, strFailReason);
     if (!pwalletMain->CommitTransaction(wtx, keyChange))
         throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed");
+    EnsureWalletIsSynced();
 
     return wtx.GetHash().GetHex();
 }
@@ -1074,34 +1092,33 @@ UniValue ListReceived(const UniValue& params, bool fByAccounts)
         if (params[2].get_bool())
             filter = filter | ISMINE_WATCH_ONLY;
 
-    // Tally
+    // Tally the address ledgers
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
-            continue;
-
-        int nDepth = wtx.GetDepthInMainChain();
-        int nBCDepth = wtx.GetDepthInMainChain(false);
-        if (nDepth < nMinDepth)
-            continue;
+    const map<CTxDestination, AddressLedger>& mapLedgers = pwalletMain->GetAddressLedgers();
+    for (map<CTxDestination, AddressLedger>::const_iterator mi = mapLedgers.begin(); mi != mapLedgers.end(); ++mi) {
+        for (AddressLedger::const_iterator it = mi->second.begin(); it != mi->second.end(); ++it) {
+            const CAddressLedgerEntry& entry = it->second;
+            if (entry.fCoinBase || !(entry.mine & filter))
+                continue;
 
-        BOOST_FOREACH (const CTxOut& txout, wtx.vout) {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address))
+            map<uint256, CWalletTx>::const_iterator itTx = pwalletMain->mapWallet.find(it->first.second);
+            if (itTx == pwalletMain->mapWallet.end())
+                continue;
+            const CWalletTx& wtx = itTx->second;
+            if (!IsFinalTx(wtx))
                 continue;
 
-            isminefilter mine = IsMine(*pwalletMain, address);
-            if (!(mine & filter))
+            int nDepth = wtx.GetDepthInMainChain();
+            int nBCDepth = wtx.GetDepthInMainChain(false);
+            if (nDepth < nMinDepth)
                 continue;
 
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
+            tallyitem& item = mapTally[mi->first];
+            item.nAmount += entry.nAmount;
             item.nConf = min(item.nConf, nDepth);
             item.nBCConf = min(item.nBCConf, nBCDepth);
-            item.txids.push_back(wtx.GetHash());
-            if (mine & ISMINE_WATCH_ONLY)
+            item.txids.insert(item.txids.end(), entry.vOut.size(), wtx.GetHash());
+            if (entry.mine & ISMINE_WATCH_ONLY)
                 item.fIsWatchonly = true;
         }
     }
@@ -1445,6 +1462,110 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue listaddresstransactions(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "listaddresstransactions \"fastnodeaddress\" ( count cursor )\n"
+            "\nReturns up to 'count' of the most recent wallet transactions paying the given fastnodeaddress.\n"
+            "Older transactions are paged through by passing back the cursor of the previous call.\n"
+
+            "\nArguments:\n"
+            "1. \"fastnodeaddress\"  (string, required) The fastnode address of the wallet.\n"
+            "2. count             (numeric, optional, default=10) The number of transactions to return\n"
+            "3. cursor            (numeric, optional) The cursor of the previous call, to continue with older transactions\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"transactions\": [             (array) Oldest to newest\n"
+            "    {\n"
+            "      \"category\":\"receive\",     (string) 'receive', or 'generate', 'immature' or 'orphan' for coinbase transactions\n"
+            "      \"amount\": x.xxx,          (numeric) The amount in FNS the transaction pays to the address\n"
+            "      \"vout\": [n,...],          (array) The outputs paying the address\n"
+            "      \"confirmations\": n,       (numeric) The number of confirmations for the transaction\n"
+            "      \"txid\": \"transactionid\", (string) The transaction id\n"
+            "      ...                       As for listtransactions\n"
+            "    }\n"
+            "    ,...\n"
+            "  ],\n"
+            "  \"cursor\": n                 (numeric) Pass to the next call for older transactions. Absent when there are none.\n"
+            "}\n"
+
+            "\nExamples:\n"
+            "\nThe 10 most recent transactions paying an address\n" +
+            HelpExampleCli("listaddresstransactions", "\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"") +
+            "\nThe next 100, using the cursor returned\n" +
+            HelpExampleCli("listaddresstransactions", "\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\" 100 1234") +
+            "\nAs a json rpc call\n" +
+            HelpExampleRpc("listaddresstransactions", "\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\", 100, 1234"));
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CBitcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid FASTNODE address");
+    int nCount = 10;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    if (nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+    int64_t nCursor = std::numeric_limits<int64_t>::max();
+    if (params.size() > 2)
+        nCursor = params[2].get_int64();
+
+    // The cursor is the order position of the last transaction returned
+    vector<UniValue> vEntries;
+    bool fOlder = false;
+    int64_t nNextCursor = 0;
+    const map<CTxDestination, AddressLedger>& mapLedgers = pwalletMain->GetAddressLedgers();
+    map<CTxDestination, AddressLedger>::const_iterator mi = mapLedgers.find(address.Get());
+    if (mi != mapLedgers.end()) {
+        AddressLedger::const_iterator it = mi->second.lower_bound(make_pair(nCursor, uint256(0)));
+        while (it != mi->second.begin() && (int)vEntries.size() < nCount) {
+            --it;
+            const CAddressLedgerEntry& ledgerEntry = it->second;
+            map<uint256, CWalletTx>::const_iterator itTx = pwalletMain->mapWallet.find(it->first.second);
+            if (itTx == pwalletMain->mapWallet.end())
+                continue;
+            const CWalletTx& wtx = itTx->second;
+
+            UniValue entry(UniValue::VOBJ);
+            if (ledgerEntry.mine & ISMINE_WATCH_ONLY)
+                entry.push_back(Pair("involvesWatchonly", true));
+            if (wtx.IsCoinBase()) {
+                if (wtx.GetDepthInMainChain() < 1)
+                    entry.push_back(Pair("category", "orphan"));
+                else if (wtx.GetBlocksToMaturity() > 0)
+                    entry.push_back(Pair("category", "immature"));
+                else
+                    entry.push_back(Pair("category", "generate"));
+            } else {
+                entry.push_back(Pair("category", "receive"));
+            }
+            entry.push_back(Pair("amount", ValueFromAmount(ledgerEntry.nAmount)));
+            UniValue vout(UniValue::VARR);
+            BOOST_FOREACH (unsigned int i, ledgerEntry.vOut)
+                vout.push_back((int)i);
+            entry.push_back(Pair("vout", vout));
+            WalletTxToJSON(wtx, entry);
+            vEntries.push_back(entry);
+        }
+        if (!vEntries.empty() && it != mi->second.begin()) {
+            fOlder = true;
+            nNextCursor = it->first.first;
+        }
+    }
+    std::reverse(vEntries.begin(), vEntries.end()); // Return oldest to newest
+
+    UniValue ret(UniValue::VOBJ);
+    UniValue transactions(UniValue::VARR);
+    transactions.push_backV(vEntries);
+    ret.push_back(Pair("transactions", transactions));
+    if (fOlder)
+        ret.push_back(Pair("cursor", nNextCursor));
+    return ret;
+}
+
 UniValue listaccounts(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -1723,8 +1844,6 @@ UniValue keypoolrefill(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("keypoolrefill", "") + HelpExampleRpc("keypoolrefill", ""));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
     // 0 is interpreted by TopUpKeyPool() as the default keypool size given by -keypool
     unsigned int kpSize = 0;
     if (params.size() > 0) {
@@ -1733,11 +1852,18 @@ UniValue keypoolrefill(const UniValue& params, bool fHelp)
         kpSize = (unsigned int)params[0].get_int();
     }
 
-    EnsureWalletIsUnlocked();
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        EnsureWalletIsUnlocked();
+    }
+
+    // Without the locks held, the wallet stays usable while the keys are derived
     pwalletMain->TopUpKeyPool(kpSize);
 
+    LOCK(pwalletMain->cs_wallet);
     if (pwalletMain->GetKeyPoolSize() < kpSize)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error refreshing keypool.");
+    EnsureWalletIsSynced();
 
     return NullUniValue;
 }
@@ -1778,30 +1904,33 @@ UniValue walletpassphrase(const UniValue& params, bool fHelp)
             "\nAs json rpc call\n" +
             HelpExampleRpc("walletpassphrase", "\"my pass phrase\", 60"));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    if (fHelp)
-        return true;
-    if (!pwalletMain->IsCrypted())
-        throw JSONRPCError(RPC_WALLET_WRONG_ENC_STATE, "Error: running with an unencrypted wallet, but walletpassphrase was called.");
+        if (fHelp)
+            return true;
+        if (!pwalletMain->IsCrypted())
+            throw JSONRPCError(RPC_WALLET_WRONG_ENC_STATE, "Error: running with an unencrypted wallet, but walletpassphrase was called.");
 
-    // Note that the walletpassphrase is stored in params[0] which is not mlock()ed
-    SecureString strWalletPass;
-    strWalletPass.reserve(100);
-    // TODO: get rid of this .c_str() by implementing SecureString::operator=(std::string)
-    // Alternately, find a way to make params[0] mlock()'d to begin with.
-    strWalletPass = params[0].get_str().c_str();
+        // Note that the walletpassphrase is stored in params[0] which is not mlock()ed
+        SecureString strWalletPass;
+        strWalletPass.reserve(100);
+        // TODO: get rid of this .c_str() by implementing SecureString::operator=(std::string)
+        // Alternately, find a way to make params[0] mlock()'d to begin with.
+        strWalletPass = params[0].get_str().c_str();
 
-    bool anonymizeOnly = false;
-    if (params.size() == 3)
-        anonymizeOnly = params[2].get_bool();
+        bool anonymizeOnly = false;
+        if (params.size() == 3)
+            anonymizeOnly = params[2].get_bool();
 
-    if (!pwalletMain->IsLocked() && pwalletMain->fWalletUnlockAnonymizeOnly && anonymizeOnly)
-        throw JSONRPCError(RPC_WALLET_ALREADY_UNLOCKED, "Error: Wallet is already unlocked.");
+        if (!pwalletMain->IsLocked() && pwalletMain->fWalletUnlockAnonymizeOnly && anonymizeOnly)
+            throw JSONRPCError(RPC_WALLET_ALREADY_UNLOCKED, "Error: Wallet is already unlocked.");
 
-    if (!pwalletMain->Unlock(strWalletPass, anonymizeOnly))
-        throw JSONRPCError(RPC_WALLET_PASSPHRASE_INCORRECT, "Error: The wallet passphrase entered was incorrect.");
+        if (!pwalletMain->Unlock(strWalletPass, anonymizeOnly))
+            throw JSONRPCError(RPC_WALLET_PASSPHRASE_INCORRECT, "Error: The wallet passphrase entered was incorrect.");
+    }
 
+    // The key pool is refilled without the locks, so the wallet stays usable meanwhile
     pwalletMain->TopUpKeyPool();
 
     int64_t nSleepTime = params[1].get_int64();
@@ -2120,6 +2249,15 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
             "  \"keypoololdest\": xxxxxx,    (numeric) the timestamp (seconds since GMT epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
+            "  \"dbwrites\": {               (object) the wallet database write queue\n"
+            "    \"pending\": n,             (numeric) records queued and not yet committed\n"
+            "    \"batches\": n,             (numeric) batches committed since startup\n"
+            "    \"records\": n,             (numeric) records committed since startup\n"
+            "    \"avgbatch\": x.xx,         (numeric) average records per batch\n"
+            "    \"maxbatch\": n,            (numeric) largest batch\n"
+            "    \"avglatency\": x.xx,       (numeric) average time to commit a batch, in milliseconds\n"
+            "    \"maxlatency\": x.xx        (numeric) longest time to commit a batch, in milliseconds\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -2135,6 +2273,17 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("keypoolsize", (int)pwalletMain->GetKeyPoolSize()));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+
+    CDBWriteStats stats = bitdb.GetWriteStats();
+    UniValue dbwrites(UniValue::VOBJ);
+    dbwrites.push_back(Pair("pending", (int)bitdb.GetPendingWriteCount()));
+    dbwrites.push_back(Pair("batches", (int64_t)stats.nBatches));
+    dbwrites.push_back(Pair("records", (int64_t)stats.nRecords));
+    dbwrites.push_back(Pair("avgbatch", stats.nBatches ? (double)stats.nRecords / stats.nBatches : 0.0));
+    dbwrites.push_back(Pair("maxbatch", (int)stats.nMaxBatch));
+    dbwrites.push_back(Pair("avglatency", stats.nBatches ? stats.nTotalMicros * 0.001 / stats.nBatches : 0.0));
+    dbwrites.push_back(Pair("maxlatency", stats.nMaxMicros * 0.001));
+    obj.push_back(Pair("dbwrites", dbwrites));
     return obj;
 }
 
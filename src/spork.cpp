@@ -25,6 +25,8 @@ CSporkManager sporkManager;
 
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
+// Sporks are handled on any message handler thread, so both maps are guarded
+CCriticalSection cs_mapSporks;
 
 // FASTNODE: on startup load spork values from previous session if they exist in the sporkDB
 void LoadSporksFromDB()
@@ -42,8 +44,11 @@ void LoadSporksFromDB()
         }
 
         // add spork to memory
-        mapSporks[spork.GetHash()] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporks);
+            mapSporks[spork.GetHash()] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         std::time_t result = spork.nValue;
         // If SPORK Value is greater than 1,000,000 assume it's actually a Date and then convert to a more readable format
         if (spork.nValue > 1000000) {
@@ -57,6 +62,12 @@ void LoadSporksFromDB()
     }
 }
 
+void RegisterSporkMessageHandlers()
+{
+    RegisterMessageHandler("spork", &ProcessSpork);
+    RegisterMessageHandler("getsporks", &ProcessSpork);
+}
+
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all obfuscation/masternode related functionality
@@ -67,44 +78,67 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         CSporkMessage spork;
         vRecv >> spork;
 
-        if (chainActive.Tip() == NULL) return;
+        int nChainHeight;
+        {
+            LOCK(cs_main);
+            if (chainActive.Tip() == NULL) return;
+            nChainHeight = chainActive.Height();
+        }
 
         // Ignore spork messages about unknown/deleted sporks
         std::string strSpork = sporkManager.GetSporkNameByID(spork.nSporkID);
         if (strSpork == "Unknown") return;
 
         uint256 hash = spork.GetHash();
-        if (mapSporksActive.count(spork.nSporkID)) {
-            if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
-                if (fDebug) LogPrintf("%s : seen %s block %d \n", __func__, hash.ToString(), chainActive.Tip()->nHeight);
+        int64_t nTimeSignedKnown = -1;
+        {
+            LOCK(cs_mapSporks);
+            std::map<int, CSporkMessage>::iterator it = mapSporksActive.find(spork.nSporkID);
+            if (it != mapSporksActive.end())
+                nTimeSignedKnown = it->second.nTimeSigned;
+        }
+        if (nTimeSignedKnown != -1) {
+            if (nTimeSignedKnown >= spork.nTimeSigned) {
+                if (fDebug) LogPrintf("%s : seen %s block %d \n", __func__, hash.ToString(), nChainHeight);
                 return;
             } else {
-                if (fDebug) LogPrintf("%s : got updated spork %s block %d \n", __func__, hash.ToString(), chainActive.Tip()->nHeight);
+                if (fDebug) LogPrintf("%s : got updated spork %s block %d \n", __func__, hash.ToString(), nChainHeight);
             }
         }
 
-        LogPrintf("%s : new %s ID %d Time %d bestHeight %d\n", __func__, hash.ToString(), spork.nSporkID, spork.nValue, chainActive.Tip()->nHeight);
+        LogPrintf("%s : new %s ID %d Time %d bestHeight %d\n", __func__, hash.ToString(), spork.nSporkID, spork.nValue, nChainHeight);
 
         if (!sporkManager.CheckSignature(spork)) {
             LogPrintf("%s : Invalid Signature\n", __func__);
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
             return;
         }
 
-        mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporks);
+            // A newer spork may have been accepted by another message handler meanwhile
+            std::map<int, CSporkMessage>::iterator it = mapSporksActive.find(spork.nSporkID);
+            if (it != mapSporksActive.end() && it->second.nTimeSigned >= spork.nTimeSigned)
+                return;
+            mapSporks[hash] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         sporkManager.Relay(spork);
 
         // FASTNODE: add to spork database.
         pSporkDB->WriteSpork(spork.nSporkID, spork);
     }
     if (strCommand == "getsporks") {
-        std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
-
-        while (it != mapSporksActive.end()) {
-            pfrom->PushMessage("spork", it->second);
-            it++;
+        std::vector<CSporkMessage> vSporks;
+        {
+            LOCK(cs_mapSporks);
+            for (std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin(); it != mapSporksActive.end(); ++it)
+                vSporks.push_back(it->second);
         }
+
+        BOOST_FOREACH (const CSporkMessage& spork, vSporks)
+            pfrom->PushMessage("spork", spork);
     }
 }
 
@@ -114,8 +148,10 @@ int64_t GetSporkValue(int nSporkID)
 {
     int64_t r = -1;
 
-    if (mapSporksActive.count(nSporkID)) {
-        r = mapSporksActive[nSporkID].nValue;
+    LOCK(cs_mapSporks);
+    std::map<int, CSporkMessage>::iterator it = mapSporksActive.find(nSporkID);
+    if (it != mapSporksActive.end()) {
+        r = it->second.nValue;
     } else {
         if (nSporkID == SPORK_2_SWIFTTX) r = SPORK_2_SWIFTTX_DEFAULT;
         if (nSporkID == SPORK_3_SWIFTTX_BLOCK_FILTERING) r = SPORK_3_SWIFTTX_BLOCK_FILTERING_DEFAULT;
@@ -242,6 +278,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
 
     if (Sign(msg)) {
         Relay(msg);
+        LOCK(cs_mapSporks);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
         return true;
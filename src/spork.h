@@ -96,10 +96,13 @@ class CSporkManager;
 
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
+extern CCriticalSection cs_mapSporks;
 extern CSporkManager sporkManager;
 
 void LoadSporksFromDB();
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+/** Route the spork P2P commands to ProcessSpork */
+void RegisterSporkMessageHandlers();
 int64_t GetSporkValue(int nSporkID);
 bool IsSporkActive(int nSporkID);
 void ReprocessBlocks(int nBlocks);
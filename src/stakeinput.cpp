@@ -162,6 +162,7 @@ bool CZPivStake::MarkSpent(CWallet *pwallet, const uint256& txid)
         return error("%s: tracker does not have serialhash", __func__);
 
     zfnsTracker->SetPubcoinUsed(meta.hashPubcoin, txid);
+    pwallet->MarkMintViewsDirty();
     return true;
 }
 
@@ -8,6 +8,7 @@
 #include "activemasternode.h"
 #include "base58.h"
 #include "key.h"
+#include "masternode-sigcheck.h"
 #include "masternodeman.h"
 #include "net.h"
 #include "obfuscation.h"
@@ -28,8 +29,28 @@ std::map<uint256, CConsensusVote> mapTxLockVote;
 std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+int64_t nUnknownVotesTotal = 0; //sum of the times in mapUnknownVotes
+std::multimap<int64_t, uint256> mapTxLockExpiry; //lock expiration times, entries for changed expirations go stale
 int nCompleteTXLocks;
 
+static void SetUnknownVoteTime(const uint256& hash, int64_t nTime)
+{
+    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.find(hash);
+    if (it != mapUnknownVotes.end()) {
+        nUnknownVotesTotal += nTime - it->second;
+        it->second = nTime;
+    } else {
+        nUnknownVotesTotal += nTime;
+        mapUnknownVotes.insert(make_pair(hash, nTime));
+    }
+}
+
+static void SetLockExpiration(CTransactionLock& lock, int64_t nExpiration)
+{
+    lock.nExpiration = nExpiration;
+    mapTxLockExpiry.insert(make_pair(nExpiration, lock.txHash));
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -37,6 +58,21 @@ int nCompleteTXLocks;
 //         Send "txvote", CTransaction, Signature, Approve
 //step 3.) Top 1 masternode, waits for SWIFTTX_SIGNATURES_REQUIRED messages. Upon success, sends "txlock'
 
+static void ExtractConsensusVoteSignatures(CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    CConsensusVote vote;
+    vRecv >> vote;
+    vChecks.push_back(CMessageSigCheck(vote.GetStrMessage(), vote.vchMasterNodeSignature));
+}
+
+void RegisterSwiftTXMessageHandlers()
+{
+    RegisterMessageHandler("ix", &ProcessMessageSwiftTX);
+    RegisterMessageHandler("txlvote", &ProcessMessageSwiftTX);
+
+    RegisterMessageSigExtractor("txlvote", &ExtractConsensusVoteSignatures);
+}
+
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all obfuscation/masternode related functionality
@@ -152,7 +188,7 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
             */
             if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
                 if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
+                    SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10));
                 }
 
                 if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
@@ -162,7 +198,7 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
                         ctx.txHash.ToString().c_str());
                     return;
                 } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
+                    SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10));
                 }
             }
             RelayInv(inv);
@@ -247,9 +283,9 @@ int64_t CreateNewLock(CTransaction tx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = tx.GetHash();
+        SetLockExpiration(newLock, GetTime() + (60 * 60)); //locks expire after 60 minutes (24 confirmations)
         mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
     } else {
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
@@ -334,9 +370,9 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime() + (60 * 60);
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = ctx.txHash;
+        SetLockExpiration(newLock, GetTime() + (60 * 60));
         mapTxLocks.insert(make_pair(ctx.txHash, newLock));
     } else
         LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
@@ -402,14 +438,16 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    uint256 txHash = tx.GetHash();
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
+        std::map<COutPoint, uint256>::iterator itLocked = mapLockedInputs.find(in.prevout);
+        if (itLocked != mapLockedInputs.end() && itLocked->second != txHash) {
+            LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", txHash.ToString().c_str(), itLocked->second.ToString().c_str());
+            std::map<uint256, CTransactionLock>::iterator itLock = mapTxLocks.find(txHash);
+            if (itLock != mapTxLocks.end()) SetLockExpiration(itLock->second, GetTime());
+            itLock = mapTxLocks.find(itLocked->second);
+            if (itLock != mapTxLocks.end()) SetLockExpiration(itLock->second, GetTime());
+            return true;
         }
     }
 
@@ -418,46 +456,40 @@ bool CheckForConflictingLocks(CTransaction& tx)
 
 int64_t GetAverageVoteTime()
 {
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
-
-    while (it != mapUnknownVotes.end()) {
-        total += it->second;
-        count++;
-        it++;
-    }
+    if (mapUnknownVotes.empty()) return 0;
 
-    return total / count;
+    return nUnknownVotesTotal / (int64_t)mapUnknownVotes.size();
 }
 
 void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    // Only the locks due to expire are visited, in expiration order
+    while (!mapTxLockExpiry.empty() && mapTxLockExpiry.begin()->first < GetTime()) {
+        uint256 txHash = mapTxLockExpiry.begin()->second;
+        mapTxLockExpiry.erase(mapTxLockExpiry.begin());
 
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        if (it == mapTxLocks.end() || GetTime() <= it->second.nExpiration)
+            continue; // already removed, or its expiration changed since
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+        LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        if (mapTxLockReq.count(it->second.txHash)) {
+            CTransaction& tx = mapTxLockReq[it->second.txHash];
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+            BOOST_FOREACH (const CTxIn& in, tx.vin)
+                mapLockedInputs.erase(in.prevout);
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
+            mapTxLockReq.erase(it->second.txHash);
+            mapTxLockReqRejected.erase(it->second.txHash);
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
         }
+
+        mapTxLocks.erase(it);
     }
 }
 
@@ -478,10 +510,15 @@ uint256 CConsensusVote::GetHash() const
 }
 
 
+std::string CConsensusVote::GetStrMessage() const
+{
+    return txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+}
+
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -491,7 +528,7 @@ bool CConsensusVote::SignatureValid()
         return false;
     }
 
-    if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchMasterNodeSignature, strMessage, errorMessage)) {
+    if (!VerifyMasternodeMessage(pmn->pubKeyMasternode, vchMasterNodeSignature, strMessage, errorMessage)) {
         LogPrintf("SwiftX::CConsensusVote::SignatureValid() - Verify message failed\n");
         return false;
     }
@@ -505,7 +542,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
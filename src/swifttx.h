@@ -52,6 +52,8 @@ bool IsIXTXValid(const CTransaction& txCollateral);
 bool CheckForConflictingLocks(CTransaction& tx);
 
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+/** Route the SwiftX P2P commands to ProcessMessageSwiftTX */
+void RegisterSwiftTXMessageHandlers();
 
 //check if we need to vote on this transaction
 void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
@@ -78,6 +80,8 @@ public:
     uint256 GetHash() const;
 
     bool SignatureValid();
+    /** The text covered by vchMasterNodeSignature */
+    std::string GetStrMessage() const;
     bool Sign();
 
     ADD_SERIALIZE_METHODS;
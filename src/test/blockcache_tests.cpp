@@ -0,0 +1,90 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "clientversion.h"
+#include "primitives/transaction.h"
+#include "serialize.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CBlockConstRef MakeBlock(int n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << n << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n;
+
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    pblock->nNonce = n;
+    pblock->vtx.push_back(CTransaction(tx));
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    return pblock;
+}
+
+static size_t CachedSize(const CBlockConstRef& pblock)
+{
+    return ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION) + pblock->vMerkleTree.size() * sizeof(uint256);
+}
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+BOOST_AUTO_TEST_CASE(blockcache_hit_miss)
+{
+    CBlockCache cache;
+    CBlockConstRef pblock = MakeBlock(1);
+    uint256 hash = pblock->GetHash();
+
+    BOOST_CHECK(!cache.Get(hash));
+    cache.Insert(hash, pblock);
+    BOOST_CHECK(cache.Get(hash) == pblock);
+
+    CBlockCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.nBytes, CachedSize(pblock));
+
+    cache.Clear();
+    BOOST_CHECK(!cache.Get(hash));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru_eviction)
+{
+    std::vector<CBlockConstRef> vBlocks;
+    for (int i = 0; i < 4; i++)
+        vBlocks.push_back(MakeBlock(i));
+
+    // Room for exactly three blocks
+    size_t nBlockSize = CachedSize(vBlocks[0]);
+    CBlockCache cache(nBlockSize * 3);
+    for (int i = 0; i < 3; i++)
+        cache.Insert(vBlocks[i]->GetHash(), vBlocks[i]);
+
+    // Touch the oldest entry so the second one becomes least recently used
+    BOOST_CHECK(cache.Get(vBlocks[0]->GetHash()));
+    cache.Insert(vBlocks[3]->GetHash(), vBlocks[3]);
+
+    BOOST_CHECK(cache.Get(vBlocks[0]->GetHash()));
+    BOOST_CHECK(!cache.Get(vBlocks[1]->GetHash()));
+    BOOST_CHECK(cache.Get(vBlocks[2]->GetHash()));
+    BOOST_CHECK(cache.Get(vBlocks[3]->GetHash()));
+
+    // Shrinking the limit evicts down to the new size
+    cache.SetMaxSize(nBlockSize);
+    CBlockCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK(cache.Get(vBlocks[3]->GetHash()));
+
+    // A zero-sized cache stores nothing
+    cache.SetMaxSize(0);
+    cache.Insert(vBlocks[0]->GetHash(), vBlocks[0]);
+    BOOST_CHECK(!cache.Get(vBlocks[0]->GetHash()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,131 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "hash.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "utilstrencodings.h"
+
+#include <boost/test/unit_test.hpp>
+
+static std::vector<unsigned char> Element(int n)
+{
+    uint256 hash = Hash(BEGIN(n), END(n));
+    return std::vector<unsigned char>(hash.begin(), hash.end());
+}
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vectors of the SipHash-2-4 paper, key 00 01 02 ... 0f
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ULL);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x74f839c593dc67fdULL);
+    static const unsigned char t1[7] = {1, 2, 3, 4, 5, 6, 7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ULL);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbULL);
+}
+
+BOOST_AUTO_TEST_CASE(gcs_match)
+{
+    CGolombCodedSet::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        included.insert(Element(i));
+        excluded.insert(Element(1000 + i));
+    }
+
+    CGolombCodedSet::Params params(0, 0, BASIC_FILTER_P, BASIC_FILTER_M);
+    CGolombCodedSet filter(params, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    for (CGolombCodedSet::ElementSet::const_iterator it = included.begin(); it != included.end(); ++it)
+        BOOST_CHECK(filter.Match(*it));
+    BOOST_CHECK(filter.MatchAny(included));
+    BOOST_CHECK(!filter.MatchAny(excluded));
+
+    CGolombCodedSet::ElementSet mixed(excluded);
+    mixed.insert(Element(42));
+    BOOST_CHECK(filter.MatchAny(mixed));
+
+    // Decoding the encoded set gives the same answers
+    CGolombCodedSet decoded(params, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 100U);
+    BOOST_CHECK(decoded.MatchAny(included));
+    BOOST_CHECK(!decoded.MatchAny(excluded));
+
+    // A truncated set is rejected
+    std::vector<unsigned char> vTruncated(filter.GetEncoded().begin(), filter.GetEncoded().end() - 10);
+    BOOST_CHECK_THROW(CGolombCodedSet(params, vTruncated), std::ios_base::failure);
+
+    // An empty set matches nothing
+    CGolombCodedSet empty(params, CGolombCodedSet::ElementSet());
+    BOOST_CHECK(!empty.MatchAny(included));
+    BOOST_CHECK(empty.GetEncoded() == CGolombCodedSet(params).GetEncoded());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic)
+{
+    CScript scriptPaid = CScript() << OP_DUP << OP_HASH160 << Element(1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptData = CScript() << OP_RETURN << Element(2);
+    CScript scriptSpent = CScript() << OP_HASH160 << Element(3) << OP_EQUAL;
+    CScript scriptOther = CScript() << OP_HASH160 << Element(4) << OP_EQUAL;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = scriptPaid;
+    tx.vout[1].scriptPubKey = scriptData;
+    CBlock block;
+    block.vtx.push_back(CTransaction(tx));
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1, scriptSpent)));
+
+    uint256 hashBlock = block.GetHash();
+    CBlockFilter filter(hashBlock, block, blockundo);
+    const CGolombCodedSet& gcs = filter.GetFilter();
+    BOOST_CHECK(gcs.Match(std::vector<unsigned char>(scriptPaid.begin(), scriptPaid.end())));
+    BOOST_CHECK(gcs.Match(std::vector<unsigned char>(scriptSpent.begin(), scriptSpent.end())));
+    BOOST_CHECK(!gcs.Match(std::vector<unsigned char>(scriptData.begin(), scriptData.end())));
+    BOOST_CHECK(!gcs.Match(std::vector<unsigned char>(scriptOther.begin(), scriptOther.end())));
+
+    // The stored encoding decodes to the same filter
+    CBlockFilter decoded(hashBlock, filter.GetEncodedFilter());
+    BOOST_CHECK(decoded.GetHash() == filter.GetHash());
+    BOOST_CHECK(decoded.GetFilter().Match(std::vector<unsigned char>(scriptPaid.begin(), scriptPaid.end())));
+
+    // Headers chain onto the previous header
+    uint256 hashHeader = filter.ComputeHeader(uint256(0));
+    BOOST_CHECK(hashHeader != filter.ComputeHeader(hashHeader));
+    BOOST_CHECK(hashHeader == decoded.ComputeHeader(uint256(0)));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_bip158_vector)
+{
+    // Testnet3 genesis block, from the BIP158 test vectors
+    uint256 hashBlock;
+    hashBlock.SetHex("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943");
+    std::vector<unsigned char> vchScript = ParseHex("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac");
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript(vchScript.begin(), vchScript.end());
+    CBlock block;
+    block.vtx.push_back(CTransaction(tx));
+
+    CBlockFilter filter(hashBlock, block, CBlockUndo());
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncodedFilter()), "019dfca8");
+    BOOST_CHECK_EQUAL(filter.ComputeHeader(uint256(0)).GetHex(), "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
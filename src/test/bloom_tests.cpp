@@ -437,6 +437,22 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_p2pubkey_only)
     BOOST_CHECK(filter.contains(COutPoint(uint256("0x147caa76786596590baa4e98f5d9f48b86c7765e489f7a6ff3360fe5c674360b"), 0)));
     // ... but not the 4th transaction's output (its not pay-2-pubkey)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
+
+    // Matching against pre-extracted elements gives the same block and filter
+    CBloomFilter filter2(10, 0.000001, 0, BLOOM_UPDATE_P2PUBKEY_ONLY);
+    filter2.insert(ParseHex("04eaafc2314def4ca98ac970241bcab022b9c1e1f4ea423a20f134c876f2c01ec0f0dd5b2e86e7168cefe0d81113c3807420ce13ad1357231a2252247d97a46a91"));
+    filter2.insert(ParseHex("b6efd80d99179f4f4ff6f4dd0a007d018c385d21"));
+
+    std::vector<CBloomTxElements> vElements;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        vElements.push_back(CBloomTxElements(block.vtx[i]));
+    CMerkleBlock merkleBlock2(block, filter2, vElements);
+    BOOST_CHECK(merkleBlock2.vMatchedTxn == merkleBlock.vMatchedTxn);
+
+    CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION), ssFilter2(SER_NETWORK, PROTOCOL_VERSION);
+    ssFilter << filter;
+    ssFilter2 << filter2;
+    BOOST_CHECK(ssFilter.str() == ssFilter2.str());
 }
 
 BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
@@ -30,4 +30,43 @@ BOOST_AUTO_TEST_CASE(budget_value)
     CheckBudgetValue(nHeightTest, "mainnet", 43200*COIN);
 }
 
+BOOST_AUTO_TEST_CASE(budget_vote_tallies)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    CBudgetProposal proposal("test", "http://test", 0, 100, CScript(), 100 * COIN, 0);
+    std::string strError;
+
+    for (int i = 0; i < 6; i++) {
+        CBudgetVote vote(CTxIn(COutPoint(uint256(i + 1), 0)), proposal.GetHash(), i < 3 ? VOTE_YES : (i < 5 ? VOTE_NO : VOTE_ABSTAIN));
+        vote.nTime = GetTime() - 2 * BUDGET_VOTE_UPDATE_MIN;
+        BOOST_CHECK(proposal.AddOrUpdateVote(vote, strError));
+    }
+    BOOST_CHECK_EQUAL(proposal.GetYeas(), 3);
+    BOOST_CHECK_EQUAL(proposal.GetNays(), 2);
+    BOOST_CHECK_EQUAL(proposal.GetAbstains(), 1);
+
+    // A changed vote moves between tallies instead of being counted twice
+    CBudgetVote vote(CTxIn(COutPoint(uint256(1), 0)), proposal.GetHash(), VOTE_NO);
+    BOOST_CHECK(proposal.AddOrUpdateVote(vote, strError));
+    BOOST_CHECK_EQUAL(proposal.GetYeas(), 2);
+    BOOST_CHECK_EQUAL(proposal.GetNays(), 3);
+
+    // Copies and serialized round trips keep the tallies
+    CBudgetProposal copy(proposal);
+    BOOST_CHECK_EQUAL(copy.GetNays(), 3);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << proposal;
+    CBudgetProposal loaded;
+    ss >> loaded;
+    BOOST_CHECK_EQUAL(loaded.GetYeas(), 2);
+    BOOST_CHECK_EQUAL(loaded.GetNays(), 3);
+    BOOST_CHECK_EQUAL(loaded.GetAbstains(), 1);
+
+    // Votes of masternodes that are not in the list stop counting
+    proposal.CleanAndRemove(false);
+    BOOST_CHECK_EQUAL(proposal.GetYeas(), 0);
+    BOOST_CHECK_EQUAL(proposal.GetNays(), 0);
+    BOOST_CHECK_EQUAL(proposal.GetAbstains(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 #include "random.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <vector>
 #include <map>
 
@@ -44,6 +45,16 @@ public:
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
+            if ((it->second.flags & CCoinsCacheEntry::DIRTY) && !(it->second.flags & CCoinsCacheEntry::FRESH) && it->second.HasBase()) {
+                // The recorded base must match what we hold
+                const CCoins& coinsBase = map_[it->first];
+                size_t nOutputs = std::max(coinsBase.vout.size(), it->second.vBaseUnspent.size());
+                for (unsigned int i = 0; i < nOutputs; i++) {
+                    bool fUnspent = i < coinsBase.vout.size() && !coinsBase.vout[i].IsNull();
+                    BOOST_CHECK_EQUAL(fUnspent, i < it->second.vBaseUnspent.size() && it->second.vBaseUnspent[i]);
+                }
+                BOOST_CHECK_EQUAL(coinsBase.nHeight, it->second.nBaseHeight);
+            }
             map_[it->first] = it->second.coins;
             if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
                 // Randomly delete empty entries on write.
@@ -58,6 +69,35 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+        // Every node is served from the pool
+        BOOST_CHECK_EQUAL(cacheCoinsPool.UsedBytes() % CPoolResource::BLOCK_ALIGN, 0U);
+        BOOST_CHECK(cacheCoins.empty() || cacheCoinsPool.UsedBytes() / cacheCoins.size() <= CPoolResource::MAX_BLOCK_SIZE);
+    }
+
+    size_t PoolChunkBytes() const
+    {
+        return cacheCoinsPool.ChunkBytes();
+    }
+
+    bool IsCached(const uint256& txid) const
+    {
+        return cacheCoins.count(txid) != 0;
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -83,14 +123,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool partially_flushed = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -135,6 +176,17 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
+        }
+
+        if (insecure_rand() % 100 == 50) {
+            // Every 100 iterations, write the dirty entries of the tip down,
+            // evicting either nothing or everything that is clean.
+            stack.back()->FlushDirty(insecure_rand() % 2 ? stack.back()->DynamicMemoryUsage() : 0);
+            stack.back()->SelfTest();
+            partially_flushed = true;
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +203,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +225,45 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(partially_flushed);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_eviction_test)
+{
+    CCoinsViewTest base;
+    CCoinsMap mapBase;
+    uint256 txids[3];
+    for (int i = 0; i < 3; i++) {
+        txids[i] = GetRandHash();
+        CCoinsCacheEntry& entry = mapBase[txids[i]];
+        entry.coins.vout.resize(1);
+        entry.coins.vout[0].nValue = 1000;
+        entry.flags = CCoinsCacheEntry::DIRTY;
+    }
+    base.BatchWrite(mapBase, uint256(0));
+
+    CCoinsViewCacheTest cache(&base);
+    BOOST_CHECK(cache.AccessCoins(txids[0]));
+    BOOST_CHECK(cache.AccessCoins(txids[1]));
+    // Nothing is evicted; the read marks are reset
+    cache.FlushDirty(cache.DynamicMemoryUsage());
+    BOOST_CHECK(cache.IsCached(txids[0]) && cache.IsCached(txids[1]));
+
+    // Read one cached entry again and fetch a new one: only the entry that
+    // was not touched since the last flush goes when trimming a little.
+    BOOST_CHECK(cache.AccessCoins(txids[0]));
+    BOOST_CHECK(cache.AccessCoins(txids[2]));
+    cache.FlushDirty(cache.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(cache.IsCached(txids[0]));
+    BOOST_CHECK(!cache.IsCached(txids[1]));
+    BOOST_CHECK(cache.IsCached(txids[2]));
+    cache.SelfTest();
+
+    // A full flush hands the pool memory back
+    cache.Flush();
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(cache.PoolChunkBytes(), 0U);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,178 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+
+#include "random.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+static std::vector<CSelectionCoin> vCoins;
+
+static void add_coin(const CAmount& nValue)
+{
+    // The solvers never look behind the pointer, the index tells coins apart
+    vCoins.push_back(std::make_pair(nValue, std::make_pair((const CWalletTx*)NULL, (unsigned int)vCoins.size())));
+}
+
+static CAmount SumCoins(const std::vector<CSelectionCoin>& vSum)
+{
+    CAmount nSum = 0;
+    for (unsigned int i = 0; i < vSum.size(); i++)
+        nSum += vSum[i].first;
+    return nSum;
+}
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+BOOST_AUTO_TEST_CASE(bnb_exact_match)
+{
+    CSelectionSet setCoinsRet;
+    CAmount nValueRet;
+
+    vCoins.clear();
+    for (int i = 1; i <= 5; i++)
+        add_coin(i * CENT);
+
+    // 5 + 4 + 1 is the first exact match found, the largest coins going first
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 10 * CENT, 0, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+
+    // With inputs priced, the fewest inputs win: 5 + 4 for 9 cents
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 9 * CENT, 0, 1000, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 9 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // Every coin
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 15 * CENT, 0, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 15 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 5U);
+}
+
+BOOST_AUTO_TEST_CASE(bnb_no_solution)
+{
+    CSelectionSet setCoinsRet;
+    CAmount nValueRet;
+
+    vCoins.clear();
+    for (int i = 0; i < 4; i++)
+        add_coin(2 * CENT);
+
+    // Not enough in the wallet
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 9 * CENT, 0, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK(setCoinsRet.empty());
+    BOOST_CHECK_EQUAL(nValueRet, 0);
+
+    // Odd amounts cannot be matched by even coins
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 3 * CENT, 0, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 7 * CENT, CENT / 2, 0, setCoinsRet, nValueRet));
+
+    // No coins at all
+    vCoins.clear();
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 1, 0, 0, setCoinsRet, nValueRet));
+}
+
+BOOST_AUTO_TEST_CASE(bnb_cost_of_change)
+{
+    CSelectionSet setCoinsRet;
+    CAmount nValueRet;
+
+    vCoins.clear();
+    add_coin(4 * CENT);
+    add_coin(6 * CENT);
+
+    // 4 cents for a target of 3.5 is within a cost of change of 1 cent
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 35 * CENT / 10, CENT, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 4 * CENT);
+
+    // but not within a quarter
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 35 * CENT / 10, CENT / 4, 0, setCoinsRet, nValueRet));
+
+    // The bounds of the window are inclusive
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 3 * CENT, CENT, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 4 * CENT);
+
+    // Of the sets in the window, the one wasting least is kept
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 55 * CENT / 10, 5 * CENT, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 6 * CENT);
+}
+
+BOOST_AUTO_TEST_CASE(value_bucket_grouping)
+{
+    std::vector<CSelectionCoin> vGrouped;
+
+    // 2^19 < CENT < 2^20, so 10 cents take at most 20 coins of a cent
+    vCoins.clear();
+    for (int i = 0; i < 2000; i++)
+        add_coin(CENT);
+    GroupCoinsByValueBucket(vCoins, 10 * CENT, vGrouped);
+    BOOST_CHECK_EQUAL(vGrouped.size(), 20U);
+    BOOST_CHECK(SumCoins(vGrouped) >= 10 * CENT);
+
+    // Buckets are thinned separately, keeping their largest coins
+    add_coin(50 * CENT);
+    add_coin(60 * CENT);
+    GroupCoinsByValueBucket(vCoins, 10 * CENT, vGrouped);
+    BOOST_CHECK_EQUAL(vGrouped.size(), 21U);
+    BOOST_CHECK_EQUAL(vGrouped[0].first, 60 * CENT);
+    for (unsigned int i = 1; i < vGrouped.size(); i++)
+        BOOST_CHECK(vGrouped[i - 1].first >= vGrouped[i].first);
+
+    // Nothing to thin
+    vCoins.clear();
+    GroupCoinsByValueBucket(vCoins, 10 * CENT, vGrouped);
+    BOOST_CHECK(vGrouped.empty());
+}
+
+BOOST_AUTO_TEST_CASE(selection_waste)
+{
+    // Exact match: only the inputs cost
+    BOOST_CHECK_EQUAL(GetSelectionWaste(3, 10 * CENT, 10 * CENT, CENT, 1000), 3000);
+    // Excess below the cost of change goes to the fee
+    BOOST_CHECK_EQUAL(GetSelectionWaste(2, 10 * CENT + 500, 10 * CENT, CENT, 1000), 2500);
+    // Beyond it the change output is paid for instead
+    BOOST_CHECK_EQUAL(GetSelectionWaste(1, 20 * CENT, 10 * CENT, CENT, 1000), CENT + 1000);
+}
+
+BOOST_AUTO_TEST_CASE(selection_benchmark)
+{
+    // A wallet of 100k small outputs, as left behind by mining or masternode
+    // payouts, timed through each stage of the selection
+    seed_insecure_rand(true);
+    vCoins.clear();
+    for (int i = 0; i < 100000; i++)
+        add_coin(CENT / 10 + insecure_rand() % CENT);
+    CAmount nTarget = 50 * CENT + 12345;
+
+    CSelectionSet setCoinsRet;
+    CAmount nValueRet;
+    int64_t nStart = GetTimeMicros();
+    bool fBnB = SelectCoinsBnB(vCoins, nTarget, CENT / 100, 0, setCoinsRet, nValueRet);
+    int64_t nTimeBnB = GetTimeMicros() - nStart;
+    if (fBnB) {
+        BOOST_CHECK(nValueRet >= nTarget && nValueRet <= nTarget + CENT / 100);
+    }
+
+    std::vector<CSelectionCoin> vGrouped;
+    nStart = GetTimeMicros();
+    GroupCoinsByValueBucket(vCoins, nTarget, vGrouped);
+    int64_t nTimeGroup = GetTimeMicros() - nStart;
+    BOOST_CHECK(vGrouped.size() < 2000U);
+    BOOST_CHECK(SumCoins(vGrouped) >= nTarget);
+
+    std::vector<char> vfBest;
+    CAmount nBest;
+    nStart = GetTimeMicros();
+    ApproximateBestSubset(vGrouped, SumCoins(vGrouped), nTarget, vfBest, nBest);
+    int64_t nTimeKnapsack = GetTimeMicros() - nStart;
+    BOOST_CHECK(nBest >= nTarget);
+
+    BOOST_TEST_MESSAGE(strprintf("100000 coins: bnb %s in %.2fms, grouping to %u in %.2fms, knapsack in %.2fms",
+        fBnB ? "matched" : "failed", nTimeBnB * 0.001, vGrouped.size(), nTimeGroup * 0.001, nTimeKnapsack * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -46,4 +46,20 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_lanes)
+{
+    // Every lane must agree with the scalar implementation, for all tail lengths
+    std::vector<unsigned char> vData;
+    for (unsigned int nLen = 0; nLen < 40; nLen++) {
+        unsigned int vSeeds[MURMURHASH3_LANES];
+        unsigned int vHashes[MURMURHASH3_LANES];
+        for (unsigned int j = 0; j < MURMURHASH3_LANES; j++)
+            vSeeds[j] = (nLen + j) * 0xFBA4C795 + 0xffffffff * (j & 1);
+        MurmurHash3Lanes(vSeeds, vData.empty() ? NULL : &vData[0], vData.size(), vHashes);
+        for (unsigned int j = 0; j < MURMURHASH3_LANES; j++)
+            BOOST_CHECK_EQUAL(vHashes[j], MurmurHash3(vSeeds[j], vData));
+        vData.push_back((unsigned char)(nLen * 37 + 11));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
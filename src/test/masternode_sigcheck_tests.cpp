@@ -0,0 +1,69 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-sigcheck.h"
+
+#include "hash.h"
+#include "key.h"
+#include "main.h"
+
+#include <boost/test/unit_test.hpp>
+
+static std::vector<unsigned char> SignMessage(const CKey& key, const std::string& strMessage)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.SignCompact(ss.GetHash(), vchSig));
+    return vchSig;
+}
+
+BOOST_AUTO_TEST_SUITE(masternode_sigcheck_tests)
+
+BOOST_AUTO_TEST_CASE(sigcheck_verify)
+{
+    CKey key, other;
+    key.MakeNewKey(true);
+    other.MakeNewKey(true);
+
+    std::string strMessage = "masternode ping";
+    std::vector<unsigned char> vchSig = SignMessage(key, strMessage);
+    std::string strError;
+
+    BOOST_CHECK(VerifyMasternodeMessage(key.GetPubKey(), vchSig, strMessage, strError));
+    BOOST_CHECK(!VerifyMasternodeMessage(other.GetPubKey(), vchSig, strMessage, strError));
+    BOOST_CHECK(!VerifyMasternodeMessage(key.GetPubKey(), vchSig, strMessage + "x", strError));
+
+    // Cached results must not change the outcome
+    BOOST_CHECK(VerifyMasternodeMessage(key.GetPubKey(), vchSig, strMessage, strError));
+    BOOST_CHECK(!VerifyMasternodeMessage(other.GetPubKey(), vchSig, strMessage, strError));
+
+    std::vector<unsigned char> vchBad(vchSig);
+    vchBad[0] = 0;
+    BOOST_CHECK(!VerifyMasternodeMessage(key.GetPubKey(), vchBad, strMessage, strError));
+    BOOST_CHECK(!VerifyMasternodeMessage(key.GetPubKey(), std::vector<unsigned char>(), strMessage, strError));
+}
+
+BOOST_AUTO_TEST_CASE(sigcheck_batch)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    std::vector<CMessageSigCheck> vChecks;
+    for (int i = 0; i < 16; i++) {
+        std::string strMessage = strprintf("vote %d", i);
+        vChecks.push_back(CMessageSigCheck(strMessage, SignMessage(key, strMessage)));
+    }
+    CheckMessageSignatures(vChecks);
+
+    for (int i = 0; i < 16; i++) {
+        std::string strMessage = strprintf("vote %d", i);
+        std::string strError;
+        BOOST_CHECK(VerifyMasternodeMessage(key.GetPubKey(), SignMessage(key, strMessage), strMessage, strError));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,71 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-sync.h"
+#include "masternodeman.h"
+#include "random.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternode_sync_tests)
+
+BOOST_AUTO_TEST_CASE(masternode_sync_range_bounds)
+{
+    uint256 hashBegin, hashEnd, hashPrevEnd;
+    for (int i = 0; i < MASTERNODES_SYNC_RANGES; i++) {
+        GetMasternodeSyncRange(i, hashBegin, hashEnd);
+        BOOST_CHECK(hashBegin < hashEnd);
+        // The slices are contiguous and cover the whole key space
+        if (i == 0)
+            BOOST_CHECK(hashBegin == 0);
+        else
+            BOOST_CHECK(hashBegin == hashPrevEnd + 1);
+        hashPrevEnd = hashEnd;
+
+        BOOST_CHECK_EQUAL(GetMasternodeSyncRangeIndex(hashBegin, hashEnd), i);
+        BOOST_CHECK_EQUAL(GetMasternodeSyncRangeIndex(hashBegin, hashEnd - 1), -1);
+        BOOST_CHECK_EQUAL(GetMasternodeSyncRangeIndex(hashBegin + 1, hashEnd), -1);
+    }
+    BOOST_CHECK(hashPrevEnd == ~uint256(0));
+
+    // Every key lands in exactly one slice
+    for (int n = 0; n < 100; n++) {
+        uint256 key = GetMasternodeSyncKey(COutPoint(GetRandHash(), n));
+        int nSlices = 0;
+        for (int i = 0; i < MASTERNODES_SYNC_RANGES; i++) {
+            GetMasternodeSyncRange(i, hashBegin, hashEnd);
+            nSlices += !(key < hashBegin || key > hashEnd);
+        }
+        BOOST_CHECK_EQUAL(nSlices, 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(masternode_sync_added_range)
+{
+    CMasternodeSync sync;
+    sync.vSyncRanges.assign(MASTERNODES_SYNC_RANGES, CMasternodeSyncRange());
+    sync.vSyncRanges[3].nPeer = 7;
+    sync.setRangePeers.insert(7);
+    sync.setRangePeers.insert(8);
+
+    // Unknown slices and peers that were never asked are refused
+    BOOST_CHECK(!sync.AddedMasternodeRange(7, -1, 1, false));
+    BOOST_CHECK(!sync.AddedMasternodeRange(7, MASTERNODES_SYNC_RANGES, 1, false));
+    BOOST_CHECK(!sync.AddedMasternodeRange(9, 3, 1, false));
+
+    // Chunks from the assigned peer count until the last one
+    BOOST_CHECK(sync.AddedMasternodeRange(7, 3, 5, false));
+    BOOST_CHECK(!sync.vSyncRanges[3].fDone);
+    BOOST_CHECK(sync.AddedMasternodeRange(7, 3, 2, true));
+    BOOST_CHECK(sync.vSyncRanges[3].fDone);
+    BOOST_CHECK_EQUAL(sync.sumMasternodeList, 7);
+    BOOST_CHECK_EQUAL(sync.countMasternodeList, 1);
+
+    // A late chunk from another range peer is accepted but not counted
+    BOOST_CHECK(sync.AddedMasternodeRange(8, 3, 4, true));
+    BOOST_CHECK_EQUAL(sync.sumMasternodeList, 7);
+    BOOST_CHECK_EQUAL(sync.countMasternodeList, 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
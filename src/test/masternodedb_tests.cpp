@@ -0,0 +1,51 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodedb.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternodedb_tests)
+
+BOOST_AUTO_TEST_CASE(masternodedb_incremental_dump)
+{
+    CMasternodeCacheDB db("mncache", 1 << 20, true);
+    db.SetLoaded();
+
+    db.BeginDump();
+    for (int i = 0; i < 10; i++)
+        db.DumpRecord('x', i, std::string(i + 1, 'a'));
+    BOOST_CHECK(db.EndDump());
+    BOOST_CHECK_EQUAL(db.GetWritten(), 10U);
+    BOOST_CHECK_EQUAL(db.GetErased(), 0U);
+
+    // Unchanged records are not written again, changed ones are, dropped ones are erased
+    db.BeginDump();
+    for (int i = 0; i < 9; i++)
+        db.DumpRecord('x', i, std::string(i + 1, i == 4 ? 'b' : 'a'));
+    db.DumpRecord('y', 0, std::string("other type"));
+    BOOST_CHECK(db.EndDump());
+    BOOST_CHECK_EQUAL(db.GetWritten(), 2U);
+    BOOST_CHECK_EQUAL(db.GetErased(), 1U);
+    BOOST_CHECK_EQUAL(db.size(), 10U);
+
+    std::vector<std::pair<uint256, std::string> > vRecords;
+    db.ReadRecords('x', vRecords);
+    BOOST_CHECK_EQUAL(vRecords.size(), 9U);
+    for (unsigned int i = 0; i < vRecords.size(); i++) {
+        BOOST_CHECK(vRecords[i].first == uint256(i));
+        BOOST_CHECK_EQUAL(vRecords[i].second, std::string(i + 1, i == 4 ? 'b' : 'a'));
+    }
+
+    // Records read back count as stored, so an identical dump writes nothing
+    db.BeginDump();
+    for (unsigned int i = 0; i < vRecords.size(); i++)
+        db.DumpRecord('x', vRecords[i].first, vRecords[i].second);
+    db.DumpRecord('y', 0, std::string("other type"));
+    BOOST_CHECK(db.EndDump());
+    BOOST_CHECK_EQUAL(db.GetWritten(), 0U);
+    BOOST_CHECK_EQUAL(db.GetErased(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,54 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodeman.h"
+#include "random.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternodeman_tests)
+
+BOOST_AUTO_TEST_CASE(masternode_list_version)
+{
+    mnodeman.Clear();
+
+    CMasternode mn;
+    mn.vin = CTxIn(COutPoint(GetRandHash(), 0));
+    mn.unitTest = true;
+
+    // Adding an entry invalidates the ranks, a duplicate does not
+    uint64_t nVersion = mnodeman.GetListVersion();
+    BOOST_CHECK(mnodeman.Add(mn));
+    BOOST_CHECK(mnodeman.GetListVersion() > nVersion);
+    nVersion = mnodeman.GetListVersion();
+    BOOST_CHECK(!mnodeman.Add(mn));
+    BOOST_CHECK_EQUAL(mnodeman.GetListVersion(), nVersion);
+
+    // So does a state change, even when the list keeps its size
+    CMasternode* pmn = mnodeman.Find(mn.vin);
+    BOOST_REQUIRE(pmn != NULL);
+    BOOST_CHECK(pmn->IsEnabled());
+    pmn->Check(true);
+    BOOST_CHECK(!pmn->IsEnabled());
+    BOOST_CHECK_EQUAL(mnodeman.size(), 1);
+    BOOST_CHECK(mnodeman.GetListVersion() > nVersion);
+    nVersion = mnodeman.GetListVersion();
+    pmn->Check(true);
+    BOOST_CHECK_EQUAL(mnodeman.GetListVersion(), nVersion);
+
+    // And a newer broadcast for the entry
+    CMasternodeBroadcast mnb(*pmn);
+    mnb.sigTime = pmn->sigTime + 1;
+    BOOST_CHECK(pmn->UpdateFromNewBroadcast(mnb));
+    BOOST_CHECK(mnodeman.GetListVersion() > nVersion);
+    nVersion = mnodeman.GetListVersion();
+
+    mnodeman.Remove(mn.vin);
+    BOOST_CHECK_EQUAL(mnodeman.size(), 0);
+    BOOST_CHECK(mnodeman.GetListVersion() > nVersion);
+
+    mnodeman.Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
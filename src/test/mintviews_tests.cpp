@@ -0,0 +1,87 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mintviews.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CMintMeta Meta(int n, libzerocoin::CoinDenomination denom, int nHeight, uint8_t nVersion = CZerocoinMint::STAKABLE_VERSION)
+{
+    CMintMeta meta;
+    meta.hashSerial = uint256(n);
+    meta.hashPubcoin = uint256(1000 + n);
+    meta.hashStake = 0;
+    meta.denom = denom;
+    meta.nHeight = nHeight;
+    meta.nVersion = nVersion;
+    meta.isUsed = false;
+    meta.isArchived = false;
+    meta.isDeterministic = true;
+    return meta;
+}
+
+BOOST_AUTO_TEST_SUITE(mintviews_tests)
+
+BOOST_AUTO_TEST_CASE(mintviews_denominations)
+{
+    CMintMetaViews views;
+    views.Add(Meta(1, libzerocoin::ZQ_ONE, 100));
+    views.Add(Meta(2, libzerocoin::ZQ_ONE, 50));
+    views.Add(Meta(3, libzerocoin::ZQ_TEN, 70));
+    BOOST_CHECK_EQUAL(views.size(), 3U);
+
+    // Every denomination is summarized, those without mints at zero
+    std::map<libzerocoin::CoinDenomination, CAmount> mapCounts = views.GetDenominationCounts();
+    BOOST_CHECK_EQUAL(mapCounts.size(), libzerocoin::zerocoinDenomList.size());
+    BOOST_CHECK_EQUAL(mapCounts[libzerocoin::ZQ_ONE], 2);
+    BOOST_CHECK_EQUAL(mapCounts[libzerocoin::ZQ_TEN], 1);
+    BOOST_CHECK_EQUAL(mapCounts[libzerocoin::ZQ_FIVE], 0);
+
+    // Oldest first within a denomination
+    const CMintMetaViews::HeightIndex* pindex = views.GetByDenomination(libzerocoin::ZQ_ONE);
+    BOOST_CHECK(pindex && pindex->size() == 2 && pindex->begin()->second->hashSerial == uint256(2));
+    BOOST_CHECK(!views.GetByDenomination(libzerocoin::ZQ_FIVE));
+
+    // Replacing a mint moves it in every view
+    views.Add(Meta(2, libzerocoin::ZQ_TEN, 60));
+    BOOST_CHECK_EQUAL(views.size(), 3U);
+    BOOST_CHECK_EQUAL(views.GetDenominationCounts()[libzerocoin::ZQ_ONE], 1);
+    BOOST_CHECK_EQUAL(views.GetDenominationCounts()[libzerocoin::ZQ_TEN], 2);
+    BOOST_CHECK_EQUAL(views.GetByHeight().begin()->first, 60);
+
+    BOOST_CHECK(views.Remove(uint256(1)));
+    BOOST_CHECK(!views.Remove(uint256(1)));
+    BOOST_CHECK(!views.GetByDenomination(libzerocoin::ZQ_ONE));
+    BOOST_CHECK_EQUAL(views.GetByHeight().size(), 2U);
+
+    views.Clear();
+    BOOST_CHECK(views.empty());
+    BOOST_CHECK_EQUAL(views.GetDenominationCounts()[libzerocoin::ZQ_TEN], 0);
+}
+
+BOOST_AUTO_TEST_CASE(mintviews_stakable)
+{
+    CMintMetaViews views;
+    views.Add(Meta(1, libzerocoin::ZQ_ONE, 100));
+    views.Add(Meta(2, libzerocoin::ZQ_FIVE, 200));
+    views.Add(Meta(3, libzerocoin::ZQ_TEN, 50, 1)); // too old a version to stake
+
+    // Only stakable versions, confirmed below the height given
+    BOOST_CHECK(!views.HasStakable(100));
+    BOOST_CHECK(views.HasStakable(101));
+    std::pair<CMintMetaViews::HeightIndex::const_iterator, CMintMetaViews::HeightIndex::const_iterator> range = views.GetStakable(201);
+    BOOST_CHECK_EQUAL(std::distance(range.first, range.second), 2);
+    range = views.GetStakable(150);
+    BOOST_CHECK(std::distance(range.first, range.second) == 1 && range.first->second->hashSerial == uint256(1));
+
+    // Stake hashes are set in place
+    BOOST_CHECK(views.SetStakeHash(uint256(1), uint256(42)));
+    BOOST_CHECK(views.Get(uint256(1))->hashStake == uint256(42));
+    BOOST_CHECK(!views.SetStakeHash(uint256(4), uint256(42)));
+
+    BOOST_CHECK(views.Remove(uint256(1)));
+    BOOST_CHECK(!views.HasStakable(200));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,57 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+
+#include "hash.h"
+#include "utilstrencodings.h"
+
+#include <boost/test/unit_test.hpp>
+
+static uint256 Element(int n)
+{
+    return Hash(BEGIN(n), END(n));
+}
+
+BOOST_AUTO_TEST_SUITE(muhash_tests)
+
+BOOST_AUTO_TEST_CASE(muhash_order_independent)
+{
+    CMuHash3072 forward, backward;
+    for (int i = 0; i < 8; i++) {
+        forward.Insert(Element(i));
+        backward.Insert(Element(7 - i));
+    }
+    BOOST_CHECK(forward.Finalize() == backward.Finalize());
+
+    CMuHash3072 other;
+    other.Insert(Element(0));
+    BOOST_CHECK(forward.Finalize() != other.Finalize());
+    BOOST_CHECK(CMuHash3072().Finalize() != other.Finalize());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_merge_and_remove)
+{
+    // Hashing two halves separately and merging matches hashing the whole set
+    CMuHash3072 whole, low, high;
+    for (int i = 0; i < 8; i++) {
+        whole.Insert(Element(i));
+        (i < 4 ? low : high).Insert(Element(i));
+    }
+    low *= high;
+    BOOST_CHECK(low.Finalize() == whole.Finalize());
+
+    // Removing an element cancels its insertion
+    CMuHash3072 partial;
+    for (int i = 0; i < 7; i++)
+        partial.Insert(Element(i));
+    whole.Remove(Element(7));
+    BOOST_CHECK(whole.Finalize() == partial.Finalize());
+
+    CMuHash3072 empty;
+    empty.Insert(Element(3)).Remove(Element(3));
+    BOOST_CHECK(empty.Finalize() == CMuHash3072().Finalize());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
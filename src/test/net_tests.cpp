@@ -0,0 +1,88 @@
+// Copyright (c) 2018 The FASTNODE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "primitives/transaction.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CTransactionRef MakeRelayTx(int n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << n << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n;
+    return MakeTransactionRef(tx);
+}
+
+static void ClearRelayMemory()
+{
+    LOCK(cs_mapRelay);
+    mapRelay.clear();
+    vRelayExpiration.clear();
+    nRelayMemoryUsage = 0;
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(poisson_next_send)
+{
+    const int64_t nNow = 1000000000LL * 1000000;
+    const int nAverage = 100;
+    const int nSamples = 10000;
+    double dSum = 0;
+    for (int i = 0; i < nSamples; i++) {
+        int64_t nNext = PoissonNextSend(nNow, nAverage);
+        BOOST_CHECK(nNext >= nNow);
+        dSum += (nNext - nNow) / 1000000.0;
+    }
+    // The standard error of the mean is nAverage / sqrt(nSamples) = 1 second
+    double dMean = dSum / nSamples;
+    BOOST_CHECK(dMean > nAverage * 0.9 && dMean < nAverage * 1.1);
+
+    // The shared inbound timer never goes back, and only moves once it has passed
+    int64_t nNext = PoissonNextSendInbound(nNow, nAverage);
+    BOOST_CHECK(nNext >= nNow);
+    BOOST_CHECK_EQUAL(PoissonNextSendInbound(nNow, nAverage), nNext);
+    for (int64_t nTime = nNow; nTime < nNow + 3600LL * 1000000; nTime += 10 * 1000000) {
+        int64_t nNextNow = PoissonNextSendInbound(nTime, nAverage);
+        BOOST_CHECK(nNextNow >= nNext);
+        BOOST_CHECK(nNextNow >= nTime);
+        nNext = nNextNow;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(relay_memory_eviction)
+{
+    ClearRelayMemory();
+    mapArgs["-maxrelaymemory"] = "1";
+
+    std::vector<CTransactionRef> vtx;
+    for (int i = 0; i < 20000; i++) {
+        vtx.push_back(MakeRelayTx(i));
+        RelayTransaction(vtx.back());
+        LOCK(cs_mapRelay);
+        BOOST_CHECK(nRelayMemoryUsage <= 1000000);
+    }
+
+    {
+        LOCK(cs_mapRelay);
+        BOOST_CHECK_EQUAL(mapRelay.size(), vRelayExpiration.size());
+        // The budget forced early eviction, oldest first
+        BOOST_CHECK(mapRelay.size() < vtx.size());
+        BOOST_CHECK(!mapRelay.count(CInv(MSG_TX, vtx.front()->GetHash())));
+        BOOST_CHECK(mapRelay.count(CInv(MSG_TX, vtx.back()->GetHash())));
+        BOOST_CHECK(vRelayExpiration.front().second.hash == vtx[vtx.size() - mapRelay.size()]->GetHash());
+    }
+    BOOST_CHECK(GetRelayTransaction(vtx.back()->GetHash()) == vtx.back());
+    BOOST_CHECK(!GetRelayTransaction(vtx.front()->GetHash()));
+
+    mapArgs.erase("-maxrelaymemory");
+    ClearRelayMemory();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
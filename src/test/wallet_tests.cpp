@@ -2,7 +2,9 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
 #include "wallet.h"
+#include "walletdb.h"
 
 #include <set>
 #include <stdint.h>
@@ -21,6 +23,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -305,4 +309,511 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+/**
+ * Give the wallet a new key and add a payment of 10 COIN to it, followed by
+ * vExtraOut (outputs with an empty script pay to the key too). wtxSpend is set
+ * to a spend of that first output returning 4 COIN to the key, not yet added.
+ */
+static CScript AddWalletPayment(CWallet& wallet, CWalletTx& wtx, CWalletTx& wtxSpend, std::vector<CTxOut> vExtraOut = std::vector<CTxOut>())
+{
+    CKey key;
+    key.MakeNewKey(true);
+    {
+        LOCK(wallet.cs_wallet);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+    }
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.push_back(CTxOut(10 * COIN, scriptPubKey));
+    BOOST_FOREACH (CTxOut& txout, vExtraOut) {
+        if (txout.scriptPubKey.empty())
+            txout.scriptPubKey = scriptPubKey;
+        tx.vout.push_back(txout);
+    }
+    wtx = CWalletTx(&wallet, tx);
+    wtx.nOrderPos = 0;
+    wallet.AddToWallet(wtx, true);
+
+    CMutableTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(wtx.GetHash(), 0));
+    txSpend.vout.push_back(CTxOut(4 * COIN, scriptPubKey));
+    wtxSpend = CWalletTx(&wallet, txSpend);
+    wtxSpend.nOrderPos = 1;
+    return scriptPubKey;
+}
+
+static void CheckBalanceTotals(const CWallet& wallet)
+{
+    LOCK2(cs_main, wallet.cs_wallet);
+    BOOST_CHECK(wallet.GetBalances() == wallet.ComputeBalances());
+}
+
+BOOST_AUTO_TEST_CASE(balance_totals_tests)
+{
+    // The running totals alone, without GetBalances() repairing them
+    bool fCheckWalletBalancesPrev = fCheckWalletBalances;
+    fCheckWalletBalances = false;
+
+    CWallet wallet;
+    CWalletTx wtx, wtxSpend;
+    AddWalletPayment(wallet, wtx, wtxSpend);
+
+    // Neither in a block nor in the mempool: conflicted
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 0);
+    CheckBalanceTotals(wallet);
+
+    mempool.addUnchecked(wtx.GetHash(), CTxMemPoolEntry(wtx, 0, 0, 0, 0));
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 10 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    CheckBalanceTotals(wallet);
+
+    // Spending it moves the value from the output to the change
+    wallet.AddToWallet(wtxSpend, true);
+    mempool.addUnchecked(wtxSpend.GetHash(), CTxMemPoolEntry(wtxSpend, 0, 0, 0, 0));
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 0);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 4 * COIN);
+    CheckBalanceTotals(wallet);
+
+    // The spend dropping out of the mempool gives the output back
+    std::list<CTransaction> removed;
+    mempool.remove(wtxSpend, removed);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 10 * COIN);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    CheckBalanceTotals(wallet);
+
+    // Dropping the output as well leaves nothing
+    mempool.remove(wtx, removed);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 0);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    CheckBalanceTotals(wallet);
+
+    fCheckWalletBalances = fCheckWalletBalancesPrev;
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index_tests)
+{
+    CWallet wallet;
+    CWalletTx wtx, wtxSpend;
+    AddWalletPayment(wallet, wtx, wtxSpend, vector<CTxOut>(1, CTxOut(1 * COIN, CScript() << OP_TRUE)));
+    mempool.addUnchecked(wtx.GetHash(), CTxMemPoolEntry(wtx, 0, 0, 0, 0));
+
+    // Only the output paying to the wallet is listed
+    vector<COutput> vAvailable;
+    wallet.AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable.size() == 1 && vAvailable[0].tx->GetHash() == wtx.GetHash() && vAvailable[0].i == 0);
+
+    // Spent outputs drop out of the index, the change comes in
+    wallet.AddToWallet(wtxSpend, true);
+    mempool.addUnchecked(wtxSpend.GetHash(), CTxMemPoolEntry(wtxSpend, 0, 0, 0, 0));
+    wallet.AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable.size() == 1 && vAvailable[0].tx->GetHash() == wtxSpend.GetHash());
+
+    // Locked coins are left out
+    COutPoint outpoint(wtxSpend.GetHash(), 0);
+    {
+        LOCK(wallet.cs_wallet);
+        wallet.LockCoin(outpoint);
+    }
+    wallet.AvailableCoins(vAvailable, false);
+    BOOST_CHECK(vAvailable.empty());
+    {
+        LOCK(wallet.cs_wallet);
+        wallet.UnlockCoin(outpoint);
+    }
+
+    // A spend that left the mempool no longer spends
+    std::list<CTransaction> removed;
+    mempool.remove(wtxSpend, removed);
+    wallet.AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable.size() == 1 && vAvailable[0].tx->GetHash() == wtx.GetHash());
+
+    mempool.remove(wtx, removed);
+}
+
+BOOST_AUTO_TEST_CASE(write_behind_tests)
+{
+    const std::string& strFile = pwalletMain->strWalletFile;
+    int64_t nWriteBehindMillis = bitdb.nWriteBehindMillis;
+    bitdb.nWriteBehindMillis = DEFAULT_WALLET_FLUSH_INTERVAL;
+    CDBWriteStats statsBefore = bitdb.GetWriteStats();
+
+    CKeyPool keypool;
+    keypool.nTime = 1;
+    CKeyPool keypoolLater;
+    keypoolLater.nTime = 2;
+
+    // A write-behind handle only queues, the last write of a key replacing earlier ones
+    {
+        CWalletDB walletdb(strFile, "r+", true);
+        BOOST_CHECK(walletdb.WritePool(1000001, keypool));
+        BOOST_CHECK(walletdb.WritePool(1000001, keypoolLater));
+        BOOST_CHECK(walletdb.WritePool(1000002, keypool));
+        BOOST_CHECK(walletdb.ErasePool(1000003));
+        BOOST_CHECK(!walletdb.ReadPool(1000001, keypool));
+    }
+    BOOST_CHECK(bitdb.HasPendingWrites(strFile));
+    BOOST_CHECK_EQUAL(bitdb.GetPendingWriteCount(), 3U);
+    BOOST_CHECK(bitdb.GetPendingWriteTime(strFile) > 0);
+
+    // Opening the file directly commits the queue first
+    {
+        CWalletDB walletdb(strFile);
+        BOOST_CHECK(!bitdb.HasPendingWrites(strFile));
+        CKeyPool keypoolRead;
+        BOOST_CHECK(walletdb.ReadPool(1000001, keypoolRead));
+        BOOST_CHECK_EQUAL(keypoolRead.nTime, 2);
+        BOOST_CHECK(walletdb.ReadPool(1000002, keypoolRead));
+        BOOST_CHECK_EQUAL(keypoolRead.nTime, 1);
+    }
+    CDBWriteStats stats = bitdb.GetWriteStats();
+    BOOST_CHECK_EQUAL(stats.nBatches, statsBefore.nBatches + 1);
+    BOOST_CHECK_EQUAL(stats.nRecords, statsBefore.nRecords + 3);
+    BOOST_CHECK(stats.nMaxBatch >= 3);
+
+    // Queued erases apply too, and a sync with nothing queued succeeds
+    {
+        CWalletDB walletdb(strFile, "r+", true);
+        BOOST_CHECK(walletdb.ErasePool(1000001));
+        BOOST_CHECK(walletdb.ErasePool(1000002));
+    }
+    BOOST_CHECK(CDB::FlushPendingWrites(strFile, true));
+    BOOST_CHECK(CDB::FlushPendingWrites(strFile, true));
+    BOOST_CHECK_EQUAL(bitdb.GetWriteStats().nBatches, statsBefore.nBatches + 2);
+    {
+        CWalletDB walletdb(strFile);
+        BOOST_CHECK(!walletdb.ReadPool(1000001, keypool));
+        BOOST_CHECK(!walletdb.ReadPool(1000002, keypool));
+    }
+
+    // Without a flush interval the handles write through
+    bitdb.nWriteBehindMillis = 0;
+    {
+        CWalletDB walletdb(strFile, "r+", true);
+        BOOST_CHECK(walletdb.WritePool(1000001, keypool));
+        BOOST_CHECK(!bitdb.HasPendingWrites(strFile));
+        BOOST_CHECK(walletdb.ReadPool(1000001, keypool));
+        BOOST_CHECK(walletdb.ErasePool(1000001));
+    }
+    bitdb.nWriteBehindMillis = nWriteBehindMillis;
+}
+
+BOOST_AUTO_TEST_CASE(write_behind_add_tx_tests)
+{
+    const std::string& strFile = pwalletMain->strWalletFile;
+    int64_t nWriteBehindMillis = bitdb.nWriteBehindMillis;
+    bitdb.nWriteBehindMillis = DEFAULT_WALLET_FLUSH_INTERVAL;
+    BOOST_CHECK(CDB::FlushPendingWrites(strFile, true));
+    CDBWriteStats statsBefore = bitdb.GetWriteStats();
+
+    // Each new transaction queues its record and the order counter, nothing is committed yet
+    const unsigned int nTx = 20;
+    vector<uint256> vHashes;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i << OP_0;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1 * COIN;
+        CWalletTx wtx(pwalletMain, tx);
+        BOOST_CHECK(pwalletMain->AddToWallet(wtx));
+        vHashes.push_back(wtx.GetHash());
+    }
+    BOOST_CHECK_EQUAL(bitdb.GetWriteStats().nBatches, statsBefore.nBatches);
+    BOOST_CHECK_EQUAL(bitdb.GetPendingWriteCount(), nTx + 1);
+
+    // They land in a single batch
+    BOOST_CHECK(CDB::FlushPendingWrites(strFile, true));
+    CDBWriteStats stats = bitdb.GetWriteStats();
+    BOOST_CHECK_EQUAL(stats.nBatches, statsBefore.nBatches + 1);
+    BOOST_CHECK_EQUAL(stats.nRecords, statsBefore.nRecords + nTx + 1);
+
+    BOOST_FOREACH (const uint256& hash, vHashes)
+        pwalletMain->EraseFromWallet(hash);
+    BOOST_CHECK_EQUAL(bitdb.GetWriteStats().nBatches, statsBefore.nBatches + 1);
+    BOOST_CHECK(CDB::FlushPendingWrites(strFile, true));
+    BOOST_CHECK_EQUAL(bitdb.GetWriteStats().nBatches, statsBefore.nBatches + 2);
+    bitdb.nWriteBehindMillis = nWriteBehindMillis;
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup_tests)
+{
+    // Enough keys to spread the derivation over several threads
+    unsigned int nTarget;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        nTarget = pwalletMain->GetKeyPoolSize() + 6 * KEYPOOL_KEYS_PER_THREAD;
+    }
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget));
+
+    LOCK(pwalletMain->cs_wallet);
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+
+    // Every pool entry is on disk and names a distinct key of the wallet
+    set<CKeyID> setAddress;
+    pwalletMain->GetAllReserveKeys(setAddress);
+    BOOST_CHECK_EQUAL(setAddress.size(), nTarget + 1);
+    BOOST_FOREACH (const CKeyID& keyID, setAddress) {
+        CKey key;
+        BOOST_CHECK(pwalletMain->GetKey(keyID, key));
+        BOOST_CHECK(key.GetPubKey().GetID() == keyID);
+        BOOST_CHECK(pwalletMain->mapKeyMetadata.count(keyID));
+    }
+
+    // A full pool is left alone
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+}
+
+BOOST_AUTO_TEST_CASE(load_tx_indexes_tests)
+{
+    // Two conflicting spends of one output, the older carrying a comment
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 10 * COIN;
+    tx.vout[1].nValue = 1 * COIN;
+    CWalletTx wtx(NULL, tx);
+    wtx.nOrderPos = 0;
+    vector<CWalletTx> vSpends;
+    for (int i = 0; i < 2; i++) {
+        CMutableTransaction txSpend;
+        txSpend.vin.push_back(CTxIn(wtx.GetHash(), 0));
+        txSpend.vout.resize(1);
+        txSpend.vout[0].nValue = (4 + i) * COIN;
+        vSpends.push_back(CWalletTx(NULL, txSpend));
+        vSpends.back().nOrderPos = i + 1;
+    }
+    vSpends[0].mapValue["comment"] = "first";
+
+    // Indexed one at a time as transactions arrive
+    CWallet walletAdded;
+    walletAdded.AddToWallet(wtx, true);
+    walletAdded.AddToWallet(vSpends[1], true);
+    walletAdded.AddToWallet(vSpends[0], true);
+
+    // Indexed at once after all are loaded, as LoadWallet does
+    CWallet walletLoaded;
+    {
+        LOCK(walletLoaded.cs_wallet);
+        walletLoaded.LoadToWallet(vSpends[1]);
+        walletLoaded.LoadToWallet(wtx);
+        walletLoaded.LoadToWallet(vSpends[0]);
+        walletLoaded.BuildTxIndexes();
+    }
+
+    BOOST_CHECK_EQUAL(walletLoaded.wtxOrdered.size(), walletAdded.wtxOrdered.size());
+    BOOST_CHECK(walletLoaded.wtxOrdered.begin()->second.first == &walletLoaded.mapWallet[wtx.GetHash()]);
+    BOOST_CHECK(walletLoaded.IsSpent(wtx.GetHash(), 0) && walletAdded.IsSpent(wtx.GetHash(), 0));
+    BOOST_CHECK(!walletLoaded.IsSpent(wtx.GetHash(), 1) && !walletAdded.IsSpent(wtx.GetHash(), 1));
+    BOOST_CHECK_EQUAL(walletLoaded.mapWallet[vSpends[1].GetHash()].mapValue["comment"], "first");
+    BOOST_CHECK_EQUAL(walletAdded.mapWallet[vSpends[1].GetHash()].mapValue["comment"], "first");
+}
+
+BOOST_AUTO_TEST_CASE(address_ledger_tests)
+{
+    // Two outputs to the address and one elsewhere
+    CWallet wallet;
+    CWalletTx wtx, wtxSpend;
+    vector<CTxOut> vExtraOut;
+    vExtraOut.push_back(CTxOut(1 * COIN, CScript() << OP_TRUE));
+    vExtraOut.push_back(CTxOut(2 * COIN, CScript()));
+    CScript scriptPubKey = AddWalletPayment(wallet, wtx, wtxSpend, vExtraOut);
+    CTxDestination dest;
+    BOOST_CHECK(ExtractDestination(scriptPubKey, dest));
+
+    LOCK2(cs_main, wallet.cs_wallet);
+    const std::map<CTxDestination, AddressLedger>& mapLedgers = wallet.GetAddressLedgers();
+    BOOST_CHECK_EQUAL(mapLedgers.size(), 1U);
+    BOOST_CHECK(mapLedgers.count(dest));
+    const AddressLedger& ledger = mapLedgers.find(dest)->second;
+    BOOST_CHECK_EQUAL(ledger.size(), 1U);
+    const CAddressLedgerEntry& entry = ledger.begin()->second;
+    BOOST_CHECK(ledger.begin()->first == make_pair((int64_t)0, wtx.GetHash()));
+    BOOST_CHECK_EQUAL(entry.nAmount, 12 * COIN);
+    BOOST_CHECK_EQUAL(entry.vOut.size(), 2U);
+    BOOST_CHECK(entry.mine == ISMINE_SPENDABLE);
+
+    // A later payment goes after it in the ledger
+    wallet.AddToWallet(wtxSpend, true);
+    BOOST_CHECK_EQUAL(wallet.GetAddressLedgers().find(dest)->second.size(), 2U);
+    BOOST_CHECK(wallet.GetAddressLedgers().find(dest)->second.rbegin()->first.second == wtxSpend.GetHash());
+
+    // Transactions leaving the wallet leave the ledger; empty ledgers go
+    wallet.EraseFromWallet(wtxSpend.GetHash());
+    BOOST_CHECK_EQUAL(wallet.GetAddressLedgers().find(dest)->second.size(), 1U);
+    wallet.EraseFromWallet(wtx.GetHash());
+    BOOST_CHECK(wallet.GetAddressLedgers().empty());
+    BOOST_CHECK(wallet.wtxOrdered.empty());
+}
+
+BOOST_AUTO_TEST_CASE(rescan_tests)
+{
+    CWallet wallet;
+    CKey key;
+    key.MakeNewKey(true);
+    {
+        LOCK(wallet.cs_wallet);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+    }
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // More blocks than the read-ahead and several commit batches hold, every
+    // seventh paying the wallet and the last spending the first payment
+    const int nBlocks = 2 * RESCAN_COMMIT_BATCH + MAX_RESCAN_THREADS * RESCAN_READAHEAD_PER_THREAD;
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+    vector<uint256> vHashes(nBlocks);
+    vector<CBlockIndex*> vIndex;
+    vector<pair<uint256, int> > vPaid;
+    uint256 hashSpend;
+    CBlockIndex* pindexBase;
+    {
+        LOCK(cs_main);
+        pindexBase = chainActive.Tip();
+        CBlockIndex* pindexPrev = pindexBase;
+        CDiskBlockPos pos(999, 0);
+        for (int i = 0; i < nBlocks; i++) {
+            CBlock block;
+            block.nVersion = 1;
+            block.hashPrevBlock = pindexPrev->GetBlockHash();
+            block.nTime = GetTime();
+            block.nBits = pindexPrev->nBits;
+            block.nNonce = i;
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].scriptSig = CScript() << i << OP_0;
+            tx.vout.resize(1);
+            tx.vout[0].nValue = 1 * COIN;
+            tx.vout[0].scriptPubKey = i % 7 == 0 ? scriptPubKey : CScript() << OP_TRUE;
+            block.vtx.push_back(tx);
+            if (i % 7 == 0)
+                vPaid.push_back(make_pair(tx.GetHash(), i));
+            if (i == nBlocks - 1) {
+                CMutableTransaction txSpend;
+                txSpend.vin.push_back(CTxIn(vPaid[0].first, 0));
+                txSpend.vout.resize(1);
+                txSpend.vout[0].nValue = 1 * COIN;
+                txSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+                block.vtx.push_back(txSpend);
+                hashSpend = txSpend.GetHash();
+            }
+            block.hashMerkleRoot = block.BuildMerkleTree();
+            BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+
+            vHashes[i] = block.GetHash();
+            CBlockIndex* pindex = new CBlockIndex(block);
+            pindex->phashBlock = &vHashes[i];
+            pindex->pprev = pindexPrev;
+            pindex->nHeight = pindexPrev->nHeight + 1;
+            pindex->nFile = pos.nFile;
+            pindex->nDataPos = pos.nPos;
+            pindex->nStatus |= BLOCK_HAVE_DATA;
+            pindex->nChainTx = pindexPrev->nChainTx + block.vtx.size();
+            pos.nPos += ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            vIndex.push_back(pindex);
+            pindexPrev = pindex;
+        }
+        chainActive.SetTip(pindexPrev);
+    }
+
+    // One rescan at a time
+    {
+        CWalletRescanReserver reserver(&wallet);
+        BOOST_CHECK(!wallet.AbortRescan());
+        BOOST_CHECK(reserver.Reserve());
+        BOOST_CHECK(wallet.IsScanning());
+        CWalletRescanReserver reserverOther(&wallet);
+        BOOST_CHECK(!reserverOther.Reserve());
+
+        // Every payment is found in its block, and the spend through the payment committed before it
+        BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(vIndex.front(), reserver, true), (int)vPaid.size() + 1);
+        BOOST_CHECK(!wallet.IsAbortingRescan());
+        LOCK(wallet.cs_wallet);
+        BOOST_CHECK_EQUAL(wallet.mapWallet.size(), vPaid.size() + 1);
+        for (unsigned int i = 0; i < vPaid.size(); i++) {
+            BOOST_CHECK(wallet.mapWallet.count(vPaid[i].first));
+            BOOST_CHECK(wallet.mapWallet[vPaid[i].first].hashBlock == vHashes[vPaid[i].second]);
+        }
+        BOOST_CHECK(wallet.mapWallet.count(hashSpend));
+    }
+    BOOST_CHECK(!wallet.IsScanning());
+    BOOST_CHECK(!wallet.AbortRescan());
+
+    // An abort asked for once the rescan holds the wallet stops it before any block is committed
+    CWallet walletAborted;
+    {
+        LOCK(walletAborted.cs_wallet);
+        walletAborted.AddKeyPubKey(key, key.GetPubKey());
+    }
+    {
+        CWalletRescanReserver reserver(&walletAborted);
+        BOOST_CHECK(reserver.Reserve());
+        BOOST_CHECK(walletAborted.AbortRescan());
+        BOOST_CHECK_EQUAL(walletAborted.ScanForWalletTransactions(vIndex.front(), reserver, true), 0);
+        BOOST_CHECK(walletAborted.IsAbortingRescan());
+        BOOST_CHECK(walletAborted.mapWallet.empty());
+    }
+    BOOST_CHECK(!walletAborted.IsScanning());
+
+    // and the next reservation starts over
+    {
+        CWalletRescanReserver reserver(&walletAborted);
+        BOOST_CHECK(reserver.Reserve());
+        BOOST_CHECK(!walletAborted.IsAbortingRescan());
+    }
+
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(pindexBase);
+    }
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        delete vIndex[i];
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+}
+
+BOOST_AUTO_TEST_CASE(filter_elements_tests)
+{
+    CWallet wallet;
+    CKey key, key2;
+    key.MakeNewKey(true);
+    key2.MakeNewKey(true);
+    {
+        LOCK(wallet.cs_wallet);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+        wallet.AddKeyPubKey(key2, key2.GetPubKey());
+    }
+    std::vector<CPubKey> vPubKeys;
+    vPubKeys.push_back(key.GetPubKey());
+    vPubKeys.push_back(key2.GetPubKey());
+    CScript scriptMultiSig = GetScriptForMultisig(1, vPubKeys);
+    std::vector<unsigned char> vchMultiSig(scriptMultiSig.begin(), scriptMultiSig.end());
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CGolombCodedSet::ElementSet setElements;
+    wallet.GetFilterElements(setElements);
+    BOOST_CHECK(setElements.count(std::vector<unsigned char>(scriptPubKey.begin(), scriptPubKey.end())));
+    BOOST_CHECK(!setElements.count(vchMultiSig));
+
+    // A bare multisig output of the wallet's keys is the wallet's, so it has to be probed for too
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 10 * COIN;
+    tx.vout[0].scriptPubKey = scriptMultiSig;
+    tx.vout[1].nValue = 1 * COIN;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_CHECK(wallet.IsMine(tx.vout[0]) == ISMINE_SPENDABLE);
+    CWalletTx wtx(&wallet, tx);
+    wallet.AddToWallet(wtx, true);
+
+    setElements.clear();
+    wallet.GetFilterElements(setElements);
+    BOOST_CHECK(setElements.count(vchMultiSig));
+    BOOST_CHECK(!setElements.count(std::vector<unsigned char>(tx.vout[1].scriptPubKey.begin(), tx.vout[1].scriptPubKey.end())));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
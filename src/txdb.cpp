@@ -7,23 +7,125 @@
 #include "txdb.h"
 
 #include "main.h"
+#include "muhash.h"
 #include "pow.h"
 #include "uint256.h"
 #include "accumulators.h"
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 using namespace libzerocoin;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+static const char DB_COINS = 'c';
+static const char DB_COIN_OUTPUT = 'C';
+
+//! Size of a DB_COIN_OUTPUT key: type, txid and output index
+static const size_t COIN_OUTPUT_KEY_SIZE = 1 + sizeof(uint256) + sizeof(uint32_t);
+
+/**
+ * Value of a per-output chainstate record ('C' + txid + n). Every output
+ * carries the transaction metadata so spending one output only erases its
+ * own record.
+ */
+class CCoinsOutRecord
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+public:
+    int nVersion;
+    unsigned int nCode; //! nHeight * 4 + fCoinStake * 2 + fCoinBase
+    CTxOut out;
+
+    static unsigned int GetCode(const CCoins& coins)
+    {
+        return coins.nHeight * 4 + (coins.fCoinStake ? 2 : 0) + (coins.fCoinBase ? 1 : 0);
+    }
+
+    CCoinsOutRecord() : nVersion(0), nCode(0) {}
+    CCoinsOutRecord(const CCoins& coins, const CTxOut& outIn) : nVersion(coins.nVersion), nCode(GetCode(coins)), out(outIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(VARINT(this->nVersion));
+        READWRITE(VARINT(nCode));
+        READWRITE(REF(CTxOutCompressor(out)));
+    }
+};
+
+/**
+ * Collect the per-output records of txid starting at the cursor position
+ * into coins, leaving the cursor on the first record after them.
+ * Returns false if there are none.
+ */
+static bool ReadCoinOutputs(leveldb::Iterator* pcursor, const uint256& txid, CCoins& coins, size_t* pnSize = NULL)
+{
+    bool fFound = false;
+    while (pcursor->Valid()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != COIN_OUTPUT_KEY_SIZE || slKey[0] != DB_COIN_OUTPUT || memcmp(slKey.data() + 1, txid.begin(), sizeof(uint256)) != 0)
+            break;
+        CDataStream ssKey(slKey.data() + 1, slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        COutPoint outpoint;
+        ssKey >> outpoint;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutRecord record;
+        ssValue >> record;
+
+        if (!fFound) {
+            coins.Clear();
+            coins.nVersion = record.nVersion;
+            coins.nHeight = record.nCode / 4;
+            coins.fCoinStake = (record.nCode & 2) != 0;
+            coins.fCoinBase = (record.nCode & 1) != 0;
+            fFound = true;
+        }
+        if (outpoint.n >= coins.vout.size())
+            coins.vout.resize(outpoint.n + 1);
+        coins.vout[outpoint.n] = record.out;
+        if (pnSize)
+            *pnSize += slValue.size();
+        pcursor->Next();
+    }
+    return fFound;
+}
+
+//! Position a lookup iterator on the first per-output record of txid
+static void SeekCoinOutputs(leveldb::Iterator* pcursor, const uint256& txid)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(DB_COIN_OUTPUT, txid);
+    pcursor->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+}
+
+/**
+ * Write the changes of txid's coins to batch, given which outputs the database
+ * holds unspent and at which height. Returns the number of records touched.
+ */
+static size_t BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins, const std::vector<bool>& vStored, int nStoredHeight)
+{
+    size_t nWrites = 0;
+    // Per-output records carry the height, so a move to another block rewrites them all
+    const bool fSameTx = coins.nHeight == nStoredHeight;
+    for (unsigned int i = 0; i < vStored.size(); i++) {
+        if (vStored[i] && (!fSameTx || i >= coins.vout.size() || coins.vout[i].IsNull())) {
+            batch.Erase(make_pair(DB_COIN_OUTPUT, COutPoint(hash, i)));
+            nWrites++;
+        }
+    }
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (coins.vout[i].IsNull() || (fSameTx && i < vStored.size() && vStored[i]))
+            continue;
+        batch.Write(make_pair(DB_COIN_OUTPUT, COutPoint(hash, i)), CCoinsOutRecord(coins, coins.vout[i]));
+        nWrites++;
+    }
+    return nWrites;
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
@@ -33,16 +135,36 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
 {
+    fLegacyCoins = HaveLegacyCoins();
+}
+
+bool CCoinsViewDB::ReadLegacyCoins(const uint256& txid, CCoins& coins) const
+{
+    return fLegacyCoins && db.Read(make_pair(DB_COINS, txid), coins);
 }
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    // The legacy record goes first: the migration writes the new records and
+    // erases the old one atomically, so a miss here means any per-output
+    // records are already in place.
+    if (ReadLegacyCoins(txid, coins))
+        return true;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewLookupIterator());
+    SeekCoinOutputs(pcursor.get(), txid);
+    return ReadCoinOutputs(pcursor.get(), txid, coins);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    if (fLegacyCoins && db.Exists(make_pair(DB_COINS, txid)))
+        return true;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewLookupIterator());
+    SeekCoinOutputs(pcursor.get(), txid);
+    if (!pcursor->Valid())
+        return false;
+    leveldb::Slice slKey = pcursor->key();
+    return slKey.size() == COIN_OUTPUT_KEY_SIZE && slKey[0] == DB_COIN_OUTPUT && memcmp(slKey.data() + 1, txid.begin(), sizeof(uint256)) == 0;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -55,12 +177,32 @@ uint256 CCoinsViewDB::GetBestBlock() const
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
+    // Serialize with the migration, which also rewrites records
+    LOCK(cs_coinsdb);
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
+    size_t records = 0;
+    size_t reads = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            CCoinsCacheEntry& entry = it->second;
+            if (!(entry.flags & CCoinsCacheEntry::FRESH) && fLegacyCoins && db.Exists(make_pair(DB_COINS, it->first))) {
+                // Not migrated yet: replace the legacy record with per-output ones
+                batch.Erase(make_pair(DB_COINS, it->first));
+                records++;
+                entry.vBaseUnspent.clear();
+            } else if (!entry.HasBase()) {
+                // Written without the cache's help, so compare with the stored version
+                CCoinsCacheEntry stored;
+                GetCoins(it->first, stored.coins);
+                stored.SetBase();
+                entry.vBaseUnspent.swap(stored.vBaseUnspent);
+                entry.nBaseHeight = stored.nBaseHeight;
+                reads++;
+            }
+            // Fresh entries have nothing stored
+            records += BatchWriteCoins(batch, it->first, entry.coins, entry.vBaseUnspent, entry.nBaseHeight);
             changed++;
         }
         count++;
@@ -70,10 +212,75 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transactions (%u output records, %u read back, out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)records, (unsigned int)reads, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::HaveLegacyCoins() const
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    const char chType = DB_COINS;
+    pcursor->Seek(leveldb::Slice(&chType, 1));
+    return pcursor->Valid() && pcursor->key().size() > 0 && pcursor->key()[0] == DB_COINS;
+}
+
+bool CCoinsViewDB::MigrateLegacyCoins(unsigned int nMaxRecords)
+{
+    LOCK(cs_coinsdb);
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    const char chType = DB_COINS;
+    pcursor->Seek(leveldb::Slice(&chType, 1));
+
+    // Converted outputs and the removal of their legacy record go in one
+    // batch, so an interrupted migration simply resumes where it stopped.
+    CLevelDBBatch batch;
+    unsigned int nRecords = 0;
+    for (; pcursor->Valid() && nRecords < nMaxRecords; pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != 1 + sizeof(uint256) || slKey[0] != DB_COINS)
+            break;
+        uint256 txid;
+        memcpy(txid.begin(), slKey.data() + 1, sizeof(uint256));
+        CDataStream ssValue(pcursor->value().data(), pcursor->value().data() + pcursor->value().size(), SER_DISK, CLIENT_VERSION);
+        CCoins coins;
+        ssValue >> coins;
+        batch.Erase(make_pair(DB_COINS, txid));
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull())
+                batch.Write(make_pair(DB_COIN_OUTPUT, COutPoint(txid, i)), CCoinsOutRecord(coins, coins.vout[i]));
+        }
+        nRecords++;
+    }
+    bool fMore = pcursor->Valid() && pcursor->key().size() > 0 && pcursor->key()[0] == DB_COINS;
+    if (nRecords > 0)
+        db.WriteBatch(batch);
+    if (!fMore)
+        fLegacyCoins = false;
+    return fMore;
+}
+
+void ThreadMigrateCoinsDB(CCoinsViewDB* pcoinsdb)
+{
+    RenameThread("fastnode-coinsdb");
+    LogPrintf("Migrating the coin database to per-output records in the background...\n");
+    int64_t nStart = GetTimeMillis();
+    uint64_t nBatches = 0;
+    try {
+        while (pcoinsdb->MigrateLegacyCoins(COINSDB_MIGRATE_BATCH)) {
+            boost::this_thread::interruption_point();
+            if (++nBatches % 100 == 0)
+                LogPrint("coindb", "Migrated %u transactions to per-output records\n", nBatches * COINSDB_MIGRATE_BATCH);
+        }
+    } catch (const boost::thread_interrupted&) {
+        LogPrintf("Coin database migration interrupted, it will resume at the next start\n");
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadMigrateCoinsDB()");
+        return;
+    }
+    LogPrintf("Coin database migration finished in %dms\n", GetTimeMillis() - nStart);
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
 {
 }
@@ -117,57 +324,201 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+//! Maximum number of threads used to scan the coin database for MuHash statistics
+static const unsigned int MAX_COINSTATS_THREADS = 16;
+
+template <typename Stream>
+static void SerializeCoinsStats(Stream& ss, const uint256& txhash, const CCoins& coins)
 {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    ss << txhash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut& out = coins.vout[i];
+        if (!out.IsNull()) {
+            ss << VARINT(i + 1);
+            ss << out;
+        }
+    }
+    ss << VARINT(0);
+}
+
+/**
+ * Walks the coins of one txid range of a snapshot in key order, merging the
+ * per-output records with any legacy per-transaction records that have not
+ * been migrated yet.
+ */
+class CCoinsStatsCursor
+{
+private:
+    boost::scoped_ptr<leveldb::Iterator> pcursorOutputs;
+    boost::scoped_ptr<leveldb::Iterator> pcursorLegacy;
+    unsigned int nEnd;
+
+    //! txid of the record at the cursor, or false once it leaves the range
+    bool GetTxid(leveldb::Iterator* pcursor, char chType, size_t nKeySize, uint256& txid) const
+    {
+        if (!pcursor->Valid())
+            return false;
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != nKeySize || slKey[0] != chType || (unsigned char)slKey[1] >= nEnd)
+            return false;
+        memcpy(txid.begin(), slKey.data() + 1, sizeof(uint256));
+        return true;
+    }
+
+public:
+    CCoinsStatsCursor(CLevelDBWrapper* pdb, const leveldb::Snapshot* snapshot, unsigned int nBegin, unsigned int nEndIn) : pcursorOutputs(pdb->NewIterator(snapshot)), pcursorLegacy(pdb->NewIterator(snapshot)), nEnd(nEndIn)
+    {
+        const char chOutputs[2] = {DB_COIN_OUTPUT, (char)nBegin};
+        pcursorOutputs->Seek(leveldb::Slice(chOutputs, sizeof(chOutputs)));
+        const char chLegacy[2] = {DB_COINS, (char)nBegin};
+        pcursorLegacy->Seek(leveldb::Slice(chLegacy, sizeof(chLegacy)));
+    }
+
+    //! Read the next transaction's coins and their on-disk value size; false at the end of the range
+    bool Next(uint256& txid, CCoins& coins, size_t& nSize)
+    {
+        uint256 txidOutputs, txidLegacy;
+        bool fOutputs = GetTxid(pcursorOutputs.get(), DB_COIN_OUTPUT, COIN_OUTPUT_KEY_SIZE, txidOutputs);
+        bool fLegacy = GetTxid(pcursorLegacy.get(), DB_COINS, 1 + sizeof(uint256), txidLegacy);
+        nSize = 0;
+        if (fLegacy && (!fOutputs || memcmp(txidLegacy.begin(), txidOutputs.begin(), sizeof(uint256)) < 0)) {
+            leveldb::Slice slValue = pcursorLegacy->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> coins;
+            nSize = slValue.size();
+            txid = txidLegacy;
+            pcursorLegacy->Next();
+            return true;
+        }
+        if (!fOutputs)
+            return false;
+        txid = txidOutputs;
+        return ReadCoinOutputs(pcursorOutputs.get(), txid, coins, &nSize);
+    }
+};
+
+/**
+ * Scan the coins whose txid starts with a byte in [nBegin, nEnd) as seen by
+ * snapshot. Records are either appended in key order to pss, or hashed
+ * individually into the order-independent pmuhash.
+ */
+static void GetStatsRange(CLevelDBWrapper* pdb, const leveldb::Snapshot* snapshot, unsigned int nBegin, unsigned int nEnd, CCoinsStats* pstats, CHashWriter* pss, CMuHash3072* pmuhash, bool* pfOk)
+{
+    *pfOk = false;
+    CCoinsStatsCursor cursor(pdb, snapshot, nBegin, nEnd);
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
+    while (true) {
         boost::this_thread::interruption_point();
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+            uint256 txhash;
+            CCoins coins;
+            size_t nSize;
+            if (!cursor.Next(txhash, coins, nSize))
+                break;
+
+            if (pmuhash) {
+                CHashWriter ssRecord(SER_GETHASH, PROTOCOL_VERSION);
+                SerializeCoinsStats(ssRecord, txhash, coins);
+                pmuhash->Insert(ssRecord.GetHash());
+            } else {
+                SerializeCoinsStats(*pss, txhash, coins);
+            }
+
+            pstats->nTransactions++;
+            BOOST_FOREACH (const CTxOut& out, coins.vout) {
+                if (!out.IsNull()) {
+                    pstats->nTransactionOutputs++;
+                    nTotalAmount += out.nValue;
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
-            pcursor->Next();
+            pstats->nSerializedSize += 32 + nSize;
         } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return;
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    pstats->nTotalAmount += nTotalAmount;
+    *pfOk = true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+{
+    /* It seems that there are no "const iterators" for LevelDB.  Since we
+       only need read operations on it, use a const-cast to get around
+       that restriction.  */
+    CLevelDBWrapper* pdb = const_cast<CLevelDBWrapper*>(&db);
+
+    // Work from a snapshot so the scan sees one consistent chainstate and
+    // does not need cs_main while blocks keep connecting.
+    const leveldb::Snapshot* snapshot = pdb->GetSnapshot();
+    bool fOk = true;
+    try {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator(snapshot));
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << 'B';
+        pcursor->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+        stats.hashBlock = 0;
+        if (pcursor->Valid() && pcursor->key() == leveldb::Slice(&ssKey[0], ssKey.size())) {
+            CDataStream ssValue(pcursor->value().data(), pcursor->value().data() + pcursor->value().size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> stats.hashBlock;
+        }
+
+        if (!stats.fMuHash) {
+            // The legacy hash commits to the records in key order, so it is computed on one thread
+            CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+            ss << stats.hashBlock;
+            GetStatsRange(pdb, snapshot, 0, 256, &stats, &ss, NULL, &fOk);
+            stats.hashSerialized = ss.GetHash();
+        } else {
+            // Shard the key space on the first txid byte and merge the partial results
+            unsigned int nThreads = std::max(1U, std::min(MAX_COINSTATS_THREADS, (unsigned int)boost::thread::hardware_concurrency()));
+            std::vector<CCoinsStats> vStats(nThreads);
+            std::vector<CMuHash3072> vMuHash(nThreads);
+            boost::scoped_array<bool> vfOk(new bool[nThreads]);
+            boost::thread_group threadGroup;
+            try {
+                for (unsigned int i = 0; i < nThreads; i++) {
+                    threadGroup.create_thread(boost::bind(&GetStatsRange, pdb, snapshot, i * 256 / nThreads, (i + 1) * 256 / nThreads,
+                        &vStats[i], (CHashWriter*)NULL, &vMuHash[i], &vfOk[i]));
+                }
+                threadGroup.join_all();
+            } catch (...) {
+                // Never leave workers running against stack state or a released snapshot
+                threadGroup.interrupt_all();
+                threadGroup.join_all();
+                throw;
+            }
+
+            CMuHash3072 muhash;
+            for (unsigned int i = 0; i < nThreads; i++) {
+                fOk &= vfOk[i];
+                stats.nTransactions += vStats[i].nTransactions;
+                stats.nTransactionOutputs += vStats[i].nTransactionOutputs;
+                stats.nSerializedSize += vStats[i].nSerializedSize;
+                stats.nTotalAmount += vStats[i].nTotalAmount;
+                muhash *= vMuHash[i];
+            }
+            stats.hashSerialized = muhash.Finalize();
+        }
+    } catch (...) {
+        pdb->ReleaseSnapshot(snapshot);
+        throw;
+    }
+    pdb->ReleaseSnapshot(snapshot);
+    if (!fOk)
+        return false;
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return error("%s : best block %s not in block index", __func__, stats.hashBlock.GetHex());
+        stats.nHeight = mi->second->nHeight;
+    }
     return true;
 }
 
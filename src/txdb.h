@@ -11,6 +11,7 @@
 #include "main.h"
 #include "primitives/zerocoin.h"
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <utility>
@@ -25,12 +26,28 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! number of legacy coin records converted per migration batch
+static const unsigned int COINSDB_MIGRATE_BATCH = 10000;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/).
+ *
+ * Unspent outputs are stored one record per output ('C' + txid + n), so a
+ * spend only erases that output's record. Databases written by older
+ * versions hold one record per transaction ('c' + txid); those are still
+ * read, and converted in the background by ThreadMigrateCoinsDB. Once none
+ * are left the old layout is no longer looked up.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    //! serializes BatchWrite with the legacy record migration
+    CCriticalSection cs_coinsdb;
+    //! whether legacy records may remain; cleared once the migration finishes
+    std::atomic<bool> fLegacyCoins;
+
+    bool ReadLegacyCoins(const uint256& txid, CCoins& coins) const;
 
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
@@ -40,8 +57,16 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Whether any per-transaction records of the old format remain
+    bool HaveLegacyCoins() const;
+    //! Convert up to nMaxRecords legacy records, returning whether more remain
+    bool MigrateLegacyCoins(unsigned int nMaxRecords);
 };
 
+/** Convert the legacy coin database records to per-output records, resuming where a previous run stopped */
+void ThreadMigrateCoinsDB(CCoinsViewDB* pcoinsdb);
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
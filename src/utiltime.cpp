@@ -12,6 +12,8 @@
 #include "tinyformat.h"
 #include "utiltime.h"
 
+#include <time.h>
+
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 
@@ -45,6 +47,16 @@ int64_t GetTimeMicros()
         .total_microseconds();
 }
 
+int64_t GetThreadCpuTimeMicros()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    return GetTimeMicros();
+}
+
 void MilliSleep(int64_t n)
 {
 /**
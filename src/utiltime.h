@@ -14,6 +14,8 @@
 int64_t GetTime();
 int64_t GetTimeMillis();
 int64_t GetTimeMicros();
+/** CPU time consumed by the calling thread, in microseconds (wall-clock time where unsupported) */
+int64_t GetThreadCpuTimeMicros();
 void SetMockTime(int64_t nMockTimeIn);
 void MilliSleep(int64_t n);
 
@@ -10,6 +10,7 @@
 
 #include "accumulators.h"
 #include "base58.h"
+#include "blockfilterdb.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
 #include "kernel.h"
@@ -32,6 +33,7 @@
 #include "zfnswallet.h"
 #include "primitives/deterministicmint.h"
 #include <assert.h>
+#include <deque>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/thread.hpp>
@@ -50,6 +52,8 @@ bool bSpendZeroConfChange = true;
 bool bdisableSystemnotifications = false; // Those bubbles can be annoying and slow down the UI when you get lots of trx
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
+bool fCheckWalletBalances = false;
+bool fCoinSelectBnB = DEFAULT_COINSELECT_BNB;
 int64_t nStartupTime = GetTime(); //!< Client startup time for use with automint
 
 /**
@@ -103,15 +107,62 @@ CPubKey CWallet::GenerateNewKey()
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
 
+    if (!AddNewKey(secret, pubkey))
+        throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
+    return pubkey;
+}
+
+bool CWallet::AddNewKey(const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+
     // Create new metadata
     int64_t nCreationTime = GetTime();
     mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
-    if (!AddKeyPubKey(secret, pubkey))
-        throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
-    return pubkey;
+    return AddKeyPubKey(secret, pubkey);
+}
+
+typedef std::vector<std::pair<CKey, CPubKey> > KeyPairVector;
+
+static void DeriveKeyRange(KeyPairVector* pvKeys, unsigned int nBegin, unsigned int nEnd, bool fCompressed)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        CKey& secret = (*pvKeys)[i].first;
+        secret.MakeNewKey(fCompressed);
+        (*pvKeys)[i].second = secret.GetPubKey();
+        assert(secret.VerifyPubKey((*pvKeys)[i].second));
+    }
+}
+
+/**
+ * Make nKeys new keys and derive their public keys, spread over up to
+ * MAX_KEYPOOL_THREADS threads. Needs no wallet lock.
+ */
+static void DeriveNewKeys(unsigned int nKeys, bool fCompressed, KeyPairVector& vKeys)
+{
+    vKeys.assign(nKeys, std::make_pair(CKey(), CPubKey()));
+    RandAddSeedPerfmon();
+
+    unsigned int nThreads = std::min(nKeys / KEYPOOL_KEYS_PER_THREAD, std::min(MAX_KEYPOOL_THREADS, (unsigned int)boost::thread::hardware_concurrency()));
+    if (nThreads <= 1) {
+        DeriveKeyRange(&vKeys, 0, nKeys, fCompressed);
+        return;
+    }
+
+    boost::thread_group threadGroup;
+    try {
+        for (unsigned int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&DeriveKeyRange, &vKeys, i * nKeys / nThreads, (i + 1) * nKeys / nThreads, fCompressed));
+        threadGroup.join_all();
+    } catch (...) {
+        // Never leave workers running against vKeys
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
@@ -129,7 +180,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+        return CWalletDB(strWalletFile, "r+", true).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
@@ -148,7 +199,7 @@ bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
                 vchCryptedSecret,
                 mapKeyMetadata[vchPubKey.GetID()]);
         else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
+            return CWalletDB(strWalletFile, "r+", true).WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
     }
     return false;
 }
@@ -449,6 +500,10 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi != mapWallet.end())
+        mi->second.MarkDirty();
+
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
@@ -626,7 +681,8 @@ int64_t CWallet::IncOrderPosNext(CWalletDB* pwalletdb)
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
     } else {
-        CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
+        // Queued along with the transaction AddToWallet writes next
+        CWalletDB(strWalletFile, "r+", true).WriteOrderPosNext(nOrderPosNext);
     }
     return nRet;
 }
@@ -635,11 +691,51 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        fDirtyAllTx = true;
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
     }
 }
 
+void CWallet::MarkTxDirty(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    if (!fDirtyAllTx)
+        setDirtyTx.insert(hash);
+}
+
+void CWallet::LoadToWallet(const CWalletTx& wtxIn)
+{
+    AssertLockHeld(cs_wallet);
+    CWalletTx& wtx = mapWallet[wtxIn.GetHash()];
+    wtx = wtxIn;
+    wtx.BindWallet(this);
+}
+
+void CWallet::BuildTxIndexes()
+{
+    AssertLockHeld(cs_wallet);
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        CWalletTx& wtx = it->second;
+        wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+        if (wtx.IsCoinBase()) // Coinbases don't spend anything!
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, wtx.vin)
+            mapTxSpends.insert(make_pair(txin.prevout, it->first));
+    }
+
+    // Conflicting spends share the metadata of the oldest, as AddToSpends leaves them
+    TxSpends::iterator it = mapTxSpends.begin();
+    while (it != mapTxSpends.end()) {
+        TxSpends::iterator itEnd = mapTxSpends.upper_bound(it->first);
+        if (std::distance(it, itEnd) > 1)
+            SyncMetaData(make_pair(it, itEnd));
+        it = itEnd;
+    }
+
+    MarkDirty();
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 {
     uint256 hash = wtxIn.GetHash();
@@ -734,6 +830,9 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
+    // Zerocoin transactions add and spend mints
+    if (tx.ContainsZerocoins())
+        fMintViewsDirty = true;
     if (!AddToWalletIfInvolvingMe(tx, pblock, true))
         return; // Not one of ours
 
@@ -746,14 +845,36 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     }
 }
 
+void CWallet::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    // Mints mature and become stakable as the chain moves
+    MarkMintViewsDirty();
+}
+
 void CWallet::EraseFromWallet(const uint256& hash)
 {
-    if (!fFileBacked)
-        return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            return;
+        // The outputs it spent are no longer spent by the wallet
+        if (!mi->second.IsCoinBase() && !mi->second.IsZerocoinSpend()) {
+            BOOST_FOREACH (const CTxIn& txin, mi->second.vin)
+                MarkTxDirty(txin.prevout.hash);
+        }
+        // Don't leave the order index pointing at the erased transaction
+        std::pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(mi->second.nOrderPos);
+        for (TxItems::iterator it = range.first; it != range.second; ++it) {
+            if (it->second.first == &mi->second) {
+                wtxOrdered.erase(it);
+                break;
+            }
+        }
+        mapWallet.erase(mi);
+        if (fFileBacked)
+            CWalletDB(strWalletFile, "r+", true).EraseTx(hash);
+        MarkTxDirty(hash);
     }
     return;
 }
@@ -1414,7 +1535,8 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
 
 bool CWalletTx::WriteToDisk()
 {
-    return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
+    // Rescans write thousands of these, the queue commits them in batches
+    return CWalletDB(pwallet->strWalletFile, "r+", true).WriteTx(GetHash(), *this);
 }
 
 /**
@@ -1422,36 +1544,228 @@ bool CWalletTx::WriteToDisk()
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+namespace
+{
+/**
+ * Read-ahead queue of a wallet rescan. Worker threads read the queued blocks
+ * from disk and mark the transactions that pay to the wallet's keys, which
+ * needs neither cs_main nor cs_wallet. Blocks whose filter matches none of
+ * the wallet's scripts are not read at all. The scanning thread takes the
+ * blocks back in chain order and commits them to the wallet.
+ */
+class CRescanQueue
+{
+public:
+    struct Item {
+        CBlockIndex* pindex;
+        CBlockConstRef pblock;
+        std::vector<bool> vMatch;
+        bool fDone;
+
+        Item(CBlockIndex* pindexIn) : pindex(pindexIn), fDone(false) {}
+    };
+
+private:
+    const CWallet& wallet;
+    //! wallet scripts to probe the block filters with, NULL to read every block
+    const CGolombCodedSet::ElementSet* psetFilterElements;
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    //! queued blocks in chain order, numbered from nFirst
+    std::deque<Item> queue;
+    uint64_t nFirst;
+    //! number of the next block to hand to a worker
+    uint64_t nNextTaken;
+    bool fQuit;
+
+public:
+    CRescanQueue(const CWallet& walletIn, const CGolombCodedSet::ElementSet* psetFilterElementsIn) : wallet(walletIn), psetFilterElements(psetFilterElementsIn), nFirst(0), nNextTaken(0), fQuit(false) {}
+
+    void Thread()
+    {
+        while (true) {
+            uint64_t nItem;
+            CBlockIndex* pindex;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nNextTaken == nFirst + queue.size())
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                nItem = nNextTaken++;
+                pindex = queue[nItem - nFirst].pindex;
+            }
+
+            // Bypass the block cache so a rescan does not evict the recent blocks
+            std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+            CBlockFilter filter;
+            if (psetFilterElements && pblockfilterdb->ReadFilter(pindex->GetBlockHash(), filter) && !filter.GetFilter().MatchAny(*psetFilterElements)) {
+                // none of the wallet's scripts in the block, leave it empty
+            } else if (!ReadBlockFromDisk(*pblockRead, pindex->GetBlockPos()) || pblockRead->GetHash() != pindex->GetBlockHash()) {
+                LogPrintf("CRescanQueue::Thread : failed to read block %s at height %d, skipping it\n", pindex->GetBlockHash().ToString(), pindex->nHeight);
+                pblockRead = std::make_shared<CBlock>();
+            }
+            std::vector<bool> vMatch(pblockRead->vtx.size());
+            for (unsigned int i = 0; i < pblockRead->vtx.size(); i++)
+                vMatch[i] = wallet.IsMine(pblockRead->vtx[i]);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nItem < nFirst)
+                continue; // dropped by Clear() meanwhile
+            Item& item = queue[nItem - nFirst];
+            item.pblock = pblockRead;
+            item.vMatch.swap(vMatch);
+            item.fDone = true;
+            if (nItem == nFirst)
+                condMaster.notify_one();
+        }
+    }
+
+    void Push(CBlockIndex* pindex)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.push_back(Item(pindex));
+        condWorker.notify_one();
+    }
+
+    size_t size()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    //! Wait until the first queued block has been matched; false if the queue is empty
+    bool WaitFront()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!queue.empty() && !queue.front().fDone)
+            condMaster.wait(lock);
+        return !queue.empty();
+    }
+
+    //! Take the first queued block if it has been matched
+    bool PopFront(Item& item)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.empty() || !queue.front().fDone)
+            return false;
+        item = queue.front();
+        queue.pop_front();
+        nFirst++;
+        return true;
+    }
+
+    //! Drop every queued block, e.g. after a reorganization made them stale
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nFirst += queue.size();
+        nNextTaken = nFirst;
+        queue.clear();
+    }
+
+    void Quit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
+    }
+};
+} // anonymous namespace
+
+/**
+ * Scan the active chain from pindexStart and add the wallet's transactions.
+ * Blocks are read and matched against the keys ahead of the scan on worker
+ * threads; cs_main and cs_wallet are only held while a batch of matched
+ * blocks is committed, so the node keeps running during long rescans.
+ * The position is recorded in the wallet as the scan goes, and a scan cut
+ * short by a shutdown resumes from there on the next start.
+ */
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, const CWalletRescanReserver& reserver, bool fUpdate)
 {
+    assert(reserver.IsReserved());
+
     int ret = 0;
     int64_t nNow = GetTime();
     bool fCheckZFNS = GetBoolArg("-zapwallettxes", false);
-    if (fCheckZFNS)
+    if (fCheckZFNS) {
         zfnsTracker->Init();
+        MarkMintViewsDirty();
+    }
 
-    CBlockIndex* pindex = pindexStart;
+    CBlockIndex* pindexNext = pindexStart;
+    double dProgressStart, dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_main);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
-        while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)) && pindex->nHeight <= Params().Zerocoin_StartHeight())
-            pindex = chainActive.Next(pindex);
-
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        set<uint256> setAddedToWallet;
-        while (pindex) {
+        while (pindexNext && nTimeFirstKey && (pindexNext->GetBlockTime() < (nTimeFirstKey - 7200)) && pindexNext->nHeight <= Params().Zerocoin_StartHeight())
+            pindexNext = chainActive.Next(pindexNext);
+
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindexNext, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+
+        if (fFileBacked && pindexNext)
+            CWalletDB(strWalletFile, "r+", true).WriteRescanProgress(chainActive.GetLocator(pindexNext));
+    }
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+
+    // Block filters can't tell which blocks hold zFNS mints, so a zap scan reads every block
+    CGolombCodedSet::ElementSet setFilterElements;
+    bool fUseFilters = pblockfilterdb && !fCheckZFNS;
+    if (fUseFilters)
+        GetFilterElements(setFilterElements);
+
+    int nThreads = std::max(1, std::min(MAX_RESCAN_THREADS, (int)boost::thread::hardware_concurrency()));
+    CRescanQueue queue(*this, fUseFilters ? &setFilterElements : NULL);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CRescanQueue::Thread, &queue));
+
+    int64_t nLastProgress = GetTime();
+    CBlockIndex* pindexLastCommitted = NULL;
+    set<uint256> setAddedToWallet;
+    while (!fAbortRescan && !ShutdownRequested()) {
+        {
+            LOCK(cs_main);
+            while (pindexNext && queue.size() < (size_t)(nThreads * RESCAN_READAHEAD_PER_THREAD)) {
+                queue.Push(pindexNext);
+                pindexNext = chainActive.Next(pindexNext);
+            }
+        }
+        if (!queue.WaitFront())
+            break; // reached the tip
+
+        LOCK2(cs_main, cs_wallet);
+        CRescanQueue::Item item(NULL);
+        for (int n = 0; n < RESCAN_COMMIT_BATCH && queue.PopFront(item); n++) {
+            CBlockIndex* pindex = item.pindex;
+            if (!chainActive.Contains(pindex)) {
+                // Reorganized away while the locks were released, continue on the new branch
+                queue.Clear();
+                pindexNext = chainActive.Next(chainActive.FindFork(pindex));
+                break;
+            }
+
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+            // Transactions spending the wallet's coins are found here, as
+            // they depend on what the earlier blocks added
+            const CBlock& block = *item.pblock;
+            for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                const CTransaction& tx = block.vtx[i];
+                bool fExisted = mapWallet.count(tx.GetHash()) != 0;
+                if (fExisted && !fUpdate)
+                    continue;
+                if (fExisted || item.vMatch[i] || IsFromMe(tx)) {
+                    CWalletTx wtx(this, tx);
+                    wtx.SetMerkleBranch(block);
+                    if (AddToWallet(wtx))
+                        ret++;
+                }
             }
 
             //If this is a zapwallettx, need to readd zfns
@@ -1488,9 +1802,9 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 
                             CWalletTx wtx(pwalletMain, txSpend);
                             CBlockIndex* pindexSpend = chainActive[nHeightSpend];
-                            CBlock blockSpend;
-                            if (ReadBlockFromDisk(blockSpend, pindexSpend))
-                                wtx.SetMerkleBranch(blockSpend);
+                            CBlockConstRef pblockSpend;
+                            if (ReadBlockFromDisk(pblockSpend, pindexSpend))
+                                wtx.SetMerkleBranch(*pblockSpend);
 
                             wtx.nTimeReceived = pindexSpend->nTime;
                             pwalletMain->AddToWallet(wtx);
@@ -1499,18 +1813,72 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                     }
                 }
             }
+            pindexLastCommitted = pindex;
+        }
 
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
-            }
+        if (pindexLastCommitted && GetTime() >= nNow + 60) {
+            nNow = GetTime();
+            LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexLastCommitted->nHeight, Checkpoints::GuessVerificationProgress(pindexLastCommitted));
+        }
+        if (fFileBacked && pindexLastCommitted && GetTime() >= nLastProgress + 60) {
+            nLastProgress = GetTime();
+            CWalletDB(strWalletFile, "r+", true).WriteRescanProgress(chainActive.GetLocator(pindexLastCommitted));
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+
+    queue.Quit();
+    threadGroup.join_all();
+
+    if (fAbortRescan)
+        LogPrintf("Rescan aborted at block %d\n", pindexLastCommitted ? pindexLastCommitted->nHeight : -1);
+    // A scan interrupted by shutdown keeps its progress so the next start resumes it
+    if (fFileBacked && !ShutdownRequested())
+        CWalletDB(strWalletFile, "r+", true).EraseRescanProgress();
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
+void CWallet::GetFilterElements(CGolombCodedSet::ElementSet& setElements) const
+{
+    LOCK2(cs_wallet, cs_KeyStore);
+    std::set<CKeyID> setKeyIds;
+    GetKeys(setKeyIds);
+    BOOST_FOREACH (const CKeyID& keyid, setKeyIds) {
+        CScript script = GetScriptForDestination(keyid);
+        setElements.insert(std::vector<unsigned char>(script.begin(), script.end()));
+        CPubKey pubkey;
+        if (GetPubKey(keyid, pubkey)) {
+            script = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+            setElements.insert(std::vector<unsigned char>(script.begin(), script.end()));
+        }
+    }
+    BOOST_FOREACH (const PAIRTYPE(const CScriptID, CScript) & item, mapScripts) {
+        CScript script = GetScriptForDestination(item.first);
+        setElements.insert(std::vector<unsigned char>(script.begin(), script.end()));
+        setElements.insert(std::vector<unsigned char>(item.second.begin(), item.second.end()));
+    }
+    BOOST_FOREACH (const CScript& script, setWatchOnly)
+        setElements.insert(std::vector<unsigned char>(script.begin(), script.end()));
+    BOOST_FOREACH (const CScript& script, setMultiSig)
+        setElements.insert(std::vector<unsigned char>(script.begin(), script.end()));
+    // Scripts of the wallet that no key or script above names, such as bare
+    // multisig outputs paying to the wallet's keys only
+    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        BOOST_FOREACH (const CTxOut& txout, it->second.vout) {
+            if (IsMine(txout) != ISMINE_NO)
+                setElements.insert(std::vector<unsigned char>(txout.scriptPubKey.begin(), txout.scriptPubKey.end()));
+        }
+    }
+}
+
+bool CWallet::AbortRescan()
+{
+    if (!fScanningWallet)
+        return false;
+    fAbortRescan = true;
+    return true;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     LOCK2(cs_main, cs_wallet);
@@ -1612,20 +1980,192 @@ void CWallet::ResendWalletTransactions()
  * @{
  */
 
-CAmount CWallet::GetBalance() const
+/** The part of a transaction in each balance, as the balance queries used to sum it over mapWallet */
+CWalletBalances CWallet::GetTxBalances(const CWalletTx& wtx) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+    CWalletBalances part;
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fTrusted = wtx.IsTrusted();
+    bool fUnconfirmed = !IsFinalTx(wtx) || (!fTrusted && nDepth == 0);
+
+    if (fTrusted) {
+        part.nTrusted = wtx.GetAvailableCredit();
+        part.nWatchOnlyTrusted = wtx.GetAvailableWatchOnlyCredit();
+    }
+    if (fUnconfirmed) {
+        part.nUnconfirmed = wtx.GetAvailableCredit();
+        part.nWatchOnlyUnconfirmed = wtx.GetAvailableWatchOnlyCredit();
+    }
+    part.nImmature = wtx.GetImmatureCredit();
+    part.nWatchOnlyImmature = wtx.GetImmatureWatchOnlyCredit();
+    if (fTrusted && nDepth > 0)
+        part.nWatchOnlyLocked = wtx.GetLockedWatchOnlyCredit();
+
+    if (!fLiteMode) {
+        if (fTrusted) {
+            part.nAnonymizable = wtx.GetAnonymizableCredit();
+            part.nAnonymized = wtx.GetAnonymizedCredit();
         }
+        if (fTrusted && nDepth > 0) {
+            part.nUnlocked = wtx.GetUnlockedCredit();
+            part.nLocked = wtx.GetLockedCredit();
+        }
+        part.nDenominatedConfirmed = wtx.GetDenominatedCredit(false);
+        part.nDenominatedUnconfirmed = wtx.GetDenominatedCredit(true);
     }
+    return part;
+}
 
-    return nTotal;
+CWalletBalances CWallet::ComputeBalances() const
+{
+    AssertLockHeld(cs_wallet);
+    CWalletBalances total;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        total += GetTxBalances(it->second);
+    return total;
+}
+
+void CWallet::UpdateDirtyTransactions() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // Unsettled transactions move with the chain and the mempool; on a
+    // reorg settled ones may have been disconnected too
+    bool fUnsettledDirty = false;
+    if (pindexViewTip != chainActive.Tip()) {
+        if (!pindexViewTip || !chainActive.Contains(pindexViewTip))
+            fDirtyAllTx = true;
+        pindexViewTip = chainActive.Tip();
+        fUnsettledDirty = true;
+    }
+    if (nViewMempoolUpdated != mempool.GetTransactionsUpdated()) {
+        nViewMempoolUpdated = mempool.GetTransactionsUpdated();
+        fUnsettledDirty = true;
+    }
+    if (nViewZeromintPercentage != nZeromintPercentage) {
+        nViewZeromintPercentage = nZeromintPercentage;
+        fDirtyAllTx = true;
+    }
+
+    if (fDirtyAllTx) {
+        balances.SetNull();
+        mapBalanceParts.clear();
+        mapUnspent.clear();
+        mapAddressLedger.clear();
+        mapLedgerTx.clear();
+        setDirtyTx.clear();
+        setUnsettledTx.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setDirtyTx.insert(it->first);
+        fDirtyAllTx = false;
+    } else if (fUnsettledDirty) {
+        BOOST_FOREACH (const uint256& hash, setUnsettledTx) {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+            if (it != mapWallet.end())
+                it->second.MarkDirty();
+        }
+    }
+
+    while (!setDirtyTx.empty()) {
+        uint256 hash = *setDirtyTx.begin();
+        setDirtyTx.erase(setDirtyTx.begin());
+
+        std::map<uint256, CWalletBalances>::iterator mi = mapBalanceParts.find(hash);
+        if (mi != mapBalanceParts.end()) {
+            balances -= mi->second;
+            mapBalanceParts.erase(mi);
+        }
+        bool fWasUnsettled = setUnsettledTx.erase(hash);
+        std::map<COutPoint, CWalletUnspent>::iterator mu = mapUnspent.lower_bound(COutPoint(hash, 0));
+        while (mu != mapUnspent.end() && mu->first.hash == hash)
+            mapUnspent.erase(mu++);
+        std::map<uint256, std::pair<int64_t, std::vector<CTxDestination> > >::iterator ml = mapLedgerTx.find(hash);
+        if (ml != mapLedgerTx.end()) {
+            BOOST_FOREACH (const CTxDestination& dest, ml->second.second) {
+                std::map<CTxDestination, AddressLedger>::iterator itLedger = mapAddressLedger.find(dest);
+                itLedger->second.erase(make_pair(ml->second.first, hash));
+                if (itLedger->second.empty())
+                    mapAddressLedger.erase(itLedger);
+            }
+            mapLedgerTx.erase(ml);
+        }
+
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue; // erased from the wallet
+        const CWalletTx& wtx = it->second;
+
+        CWalletBalances part = GetTxBalances(wtx);
+        if (!part.IsNull()) {
+            balances += part;
+            mapBalanceParts.insert(make_pair(hash, part));
+        }
+
+        std::map<CTxDestination, CAddressLedgerEntry> mapEntries;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            isminetype mine = IsMine(wtx.vout[i]);
+            if (mine == ISMINE_NO)
+                continue;
+            if (!IsSpent(hash, i))
+                mapUnspent.insert(make_pair(COutPoint(hash, i), CWalletUnspent(wtx.vout[i].nValue, mine, IsLockedCoin(hash, i))));
+
+            CTxDestination dest;
+            if (!ExtractDestination(wtx.vout[i].scriptPubKey, dest))
+                continue;
+            CAddressLedgerEntry& entry = mapEntries[dest];
+            entry.nAmount += wtx.vout[i].nValue;
+            entry.mine = (isminetype)(entry.mine | mine);
+            entry.fCoinBase = wtx.IsCoinBase();
+            entry.vOut.push_back(i);
+        }
+        if (!mapEntries.empty()) {
+            std::pair<int64_t, std::vector<CTxDestination> >& ledgerTx = mapLedgerTx[hash];
+            ledgerTx.first = wtx.nOrderPos;
+            for (std::map<CTxDestination, CAddressLedgerEntry>::const_iterator itEntry = mapEntries.begin(); itEntry != mapEntries.end(); ++itEntry) {
+                mapAddressLedger[itEntry->first].insert(make_pair(make_pair(wtx.nOrderPos, hash), itEntry->second));
+                ledgerTx.second.push_back(itEntry->first);
+            }
+        }
+
+        bool fUnsettled = wtx.GetDepthInMainChain(false) <= 0 || wtx.GetBlocksToMaturity() > 0;
+        if (fUnsettled)
+            setUnsettledTx.insert(hash);
+
+        // Whether the outputs this transaction spends count as spent follows its depth
+        if ((fUnsettled || fWasUnsettled) && !wtx.IsCoinBase() && !wtx.IsZerocoinSpend()) {
+            BOOST_FOREACH (const CTxIn& txin, wtx.vin) {
+                map<uint256, CWalletTx>::const_iterator itPrev = mapWallet.find(txin.prevout.hash);
+                if (itPrev != mapWallet.end())
+                    itPrev->second.MarkDirty();
+            }
+        }
+    }
+}
+
+CWalletBalances CWallet::GetBalances() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTransactions();
+
+    if (fCheckWalletBalances) {
+        CWalletBalances check = ComputeBalances();
+        if (check != balances) {
+            LogPrintf("ERROR: %s : running balance totals out of sync (trusted %s, recomputed %s), rebuilding\n", __func__,
+                FormatMoney(balances.nTrusted), FormatMoney(check.nTrusted));
+            fDirtyAllTx = true;
+            UpdateDirtyTransactions();
+        }
+    }
+    return balances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nTrusted;
 }
 
 std::map<libzerocoin::CoinDenomination, int> mapMintMaturity;
@@ -1664,51 +2204,40 @@ CAmount CWallet::GetUnlockedCoins() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetUnlockedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nUnlocked;
 }
 
 CAmount CWallet::GetLockedCoins() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetLockedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nLocked;
 }
 
 // Get a Map pairing the Denominations with the amount of Zerocoin for each Denomination
 std::map<libzerocoin::CoinDenomination, CAmount> CWallet::GetMyZerocoinDistribution() const
 {
-    std::map<libzerocoin::CoinDenomination, CAmount> spread;
-    for (const auto& denom : libzerocoin::zerocoinDenomList)
-        spread.insert(std::pair<libzerocoin::CoinDenomination, CAmount>(denom, 0));
-    {
-        LOCK(cs_wallet);
+    LOCK(cs_wallet);
+    return GetMintViews().GetDenominationCounts();
+}
+
+const CMintMetaViews& CWallet::GetMintViews() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fMintViewsDirty) {
+        mintViews.Clear();
         set<CMintMeta> setMints = zfnsTracker->ListMints(true, true, true);
-        for (auto& mint : setMints)
-            spread.at(mint.denom)++;
+        for (const CMintMeta& meta : setMints)
+            mintViews.Add(meta);
+        fMintViewsDirty = false;
     }
-    return spread;
+    return mintViews;
+}
+
+void CWallet::MarkMintViewsDirty() const
+{
+    LOCK(cs_wallet);
+    fMintViewsDirty = true;
 }
 
 
@@ -1716,36 +2245,14 @@ CAmount CWallet::GetAnonymizableBalance() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizableCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nAnonymizable;
 }
 
 CAmount CWallet::GetAnonymizedBalance() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nAnonymized;
 }
 
 // Note: calculated including unconfirmed,
@@ -1815,100 +2322,38 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    CWalletBalances total = GetBalances();
+    return unconfirmed ? total.nDenominatedUnconfirmed : total.nDenominatedConfirmed;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyImmature;
 }
 
 CAmount CWallet::GetLockedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetLockedWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyLocked;
 }
 
 /**
@@ -1920,80 +2365,73 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!CheckFinalTx(*pcoin))
+        UpdateDirtyTransactions();
+
+        // Only the wallet's unspent outputs, grouped by transaction
+        const CWalletTx* pcoin = NULL;
+        bool fTxAvailable = false;
+        int nDepth = 0;
+        for (std::map<COutPoint, CWalletUnspent>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it) {
+            const COutPoint& outpoint = it->first;
+            const CWalletUnspent& unspent = it->second;
+
+            if (!pcoin || pcoin->GetHash() != outpoint.hash) {
+                std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+                if (mi == mapWallet.end())
+                    continue;
+                pcoin = &mi->second;
+                nDepth = pcoin->GetDepthInMainChain(false);
+                fTxAvailable = CheckFinalTx(*pcoin) &&
+                               (!fOnlyConfirmed || pcoin->IsTrusted()) &&
+                               !((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0) &&
+                               // do not use IX for inputs that have less then 6 blockchain confirmations
+                               !(fUseIX && nDepth < 6) &&
+                               // We should not consider coins which aren't at least in our mempool
+                               // It's possible for these to be conflicted via ancestors which we may never be able to detect
+                               !(nDepth == 0 && !pcoin->InMempool());
+            }
+            if (!fTxAvailable)
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+            unsigned int i = outpoint.n;
+            bool found = false;
+            if (nCoinType == ONLY_DENOMINATED) {
+                found = IsDenominatedAmount(unspent.nValue);
+            } else if (nCoinType == ONLY_NOT10000IFMN) {
+                found = !(fMasterNode && obfuScationSigner.IsCollateralAmount(unspent.nValue));
+            } else if (nCoinType == ONLY_10000) {
+                found = obfuScationSigner.IsCollateralAmount(unspent.nValue);
+            } else {
+                found = true;
+            }
+            if (!found) continue;
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+            if (nCoinType == STAKABLE_COINS) {
+                if (pcoin->vout[i].IsZerocoinMint())
+                    continue;
+            }
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (fUseIX && nDepth < 6)
+            isminetype mine = unspent.mine;
+            if ((mine == ISMINE_MULTISIG || mine == ISMINE_SPENDABLE) && nWatchonlyConfig == 2)
                 continue;
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
+            if (mine == ISMINE_WATCH_ONLY && nWatchonlyConfig == 1)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if (nCoinType == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if (nCoinType == ONLY_NOT10000IFMN) {
-                    found = !(fMasterNode && obfuScationSigner.IsCollateralAmount(pcoin->vout[i].nValue));
-                }/*
-                else if (nCoinType == ONLY_NONDENOMINATED_NOT10000IFMN) {
-                   if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                   found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                   if (found && fMasterNode) found = pcoin->vout[i].nValue != GetMstrNodCollateral() * COIN; // do not use Hot MN funds
-               }
-                */ else if (nCoinType == ONLY_10000) {
-                   found = obfuScationSigner.IsCollateralAmount(pcoin->vout[i].nValue);
-                } else {
-                    found = true;
-                }
-                if (!found) continue;
-
-                if (nCoinType == STAKABLE_COINS) {
-                    if (pcoin->vout[i].IsZerocoinMint())
-                        continue;
-                }
-
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (IsSpent(wtxid, i))
-                    continue;
-                if (mine == ISMINE_NO)
-                    continue;
-
-                if ((mine == ISMINE_MULTISIG || mine == ISMINE_SPENDABLE) && nWatchonlyConfig == 2)
-                    continue;
-
-                if (mine == ISMINE_WATCH_ONLY && nWatchonlyConfig == 1)
-                    continue;
-
-                if (IsLockedCoin((*it).first, i) && nCoinType != ONLY_10000)
-                    continue;
-                if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
-                    continue;
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected((*it).first, i))
-                    continue;
+            if (unspent.fLocked && nCoinType != ONLY_10000)
+                continue;
+            if (unspent.nValue <= 0 && !fIncludeZeroValue)
+                continue;
+            if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(outpoint.hash, i))
+                continue;
 
-                bool fIsSpendable = false;
-                if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
-                    fIsSpendable = true;
-                if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
-                    fIsSpendable = true;
+            bool fIsSpendable = false;
+            if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
+                fIsSpendable = true;
+            if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
+                fIsSpendable = true;
 
-                vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
-            }
+            vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
         }
     }
 }
@@ -2018,46 +2456,6 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
-        vfIncluded.assign(vValue.size(), false);
-        CAmount nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++) {
-            for (unsigned int i = 0; i < vValue.size(); i++) {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng is fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand() & 1 : !vfIncluded[i]) {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue) {
-                        fReachedTarget = true;
-                        if (nTotal < nBest) {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
-
 // TODO: find appropriate place for this sort function
 // move denoms down
 bool less_then_denom(const COutput& out1, const COutput& out2)
@@ -2116,30 +2514,32 @@ bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInp
 
     if (GetBoolArg("-zfnsstake", true) && chainActive.Height() > Params().Zerocoin_Block_V2_Start() && !IsSporkActive(SPORK_16_ZEROCOIN_MAINTENANCE_MODE)) {
 
-        bool fUpdate = false;
+        // The views follow the chain; have the mints' status checked now and then regardless
         static int64_t nTimeLastUpdate = 0;
         if (GetAdjustedTime() - nTimeLastUpdate > nStakeSetUpdateTime) {
-            fUpdate = true;
+            MarkMintViewsDirty();
             nTimeLastUpdate = GetAdjustedTime();
         }
 
-        set<CMintMeta> setMints = zfnsTracker->ListMints(true, true, fUpdate);
-        for (auto meta : setMints) {
+        LOCK(cs_wallet);
+        const CMintMetaViews& views = GetMintViews();
+        std::pair<CMintMetaViews::HeightIndex::const_iterator, CMintMetaViews::HeightIndex::const_iterator> range;
+        range = views.GetStakable(chainActive.Height() - Params().Zerocoin_RequiredStakeDepth());
+        for (CMintMetaViews::HeightIndex::const_iterator it = range.first; it != range.second; ++it) {
+            const CMintMeta& meta = *it->second;
             if (meta.hashStake == 0) {
                 CZerocoinMint mint;
                 if (GetMint(meta.hashSerial, mint)) {
                     uint256 hashStake = mint.GetSerialNumber().getuint256();
                     hashStake = Hash(hashStake.begin(), hashStake.end());
-                    meta.hashStake = hashStake;
-                    zfnsTracker->UpdateState(meta);
+                    CMintMeta metaUpdated = meta;
+                    metaUpdated.hashStake = hashStake;
+                    zfnsTracker->UpdateState(metaUpdated);
+                    mintViews.SetStakeHash(meta.hashSerial, hashStake);
                 }
             }
-            if (meta.nVersion < CZerocoinMint::STAKABLE_VERSION)
-                continue;
-            if (meta.nHeight < chainActive.Height() - Params().Zerocoin_RequiredStakeDepth()) {
-                std::unique_ptr<CZPivStake> input(new CZPivStake(meta.denom, meta.hashStake));
-                listInputs.emplace_back(std::move(input));
-            }
+            std::unique_ptr<CZPivStake> input(new CZPivStake(meta.denom, meta.hashStake));
+            listInputs.emplace_back(std::move(input));
         }
     }
 
@@ -2177,14 +2577,9 @@ bool CWallet::MintableCoins()
 
 
     if (nZpivBalance > 0) {
-        set<CMintMeta> setMints = zfnsTracker->ListMints(true, true, true);
-        for (auto mint : setMints) {
-            if (mint.nVersion < CZerocoinMint::STAKABLE_VERSION)
-                continue;
-            if (mint.nHeight > chainActive.Height() - Params().Zerocoin_RequiredStakeDepth())
-                continue;
-           return true;
-        }
+        LOCK(cs_wallet);
+        if (GetMintViews().HasStakable(chainActive.Height() - Params().Zerocoin_RequiredStakeDepth() + 1))
+            return true;
     }
 
     return false;
@@ -2269,6 +2664,21 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
 
     // Solve subset sum by stochastic approximation
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+
+    // On large pools only the coins that can be part of a tight set are worth the passes
+    if (vValue.size() >= COIN_GROUPING_MIN_COINS) {
+        vector<CSelectionCoin> vGrouped;
+        GroupCoinsByValueBucket(vValue, nTargetValue + CENT, vGrouped);
+        CAmount nTotalGrouped = 0;
+        for (unsigned int i = 0; i < vGrouped.size(); i++)
+            nTotalGrouped += vGrouped[i].first;
+        if (nTotalGrouped >= nTargetValue) {
+            LogPrint("selectcoins", "%s : %u of %u coins kept by value bucket\n", __func__, vGrouped.size(), vValue.size());
+            vValue.swap(vGrouped);
+            nTotalLower = nTotalGrouped;
+        }
+    }
+
     vector<char> vfBest;
     CAmount nBest;
 
@@ -2343,9 +2753,53 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    return (SelectCoinsTier(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsTier(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
+            (bSpendZeroConfChange && SelectCoinsTier(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+}
+
+bool CWallet::SelectCoinsTier(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Change below the dust threshold goes to the fee, so a set within that
+    // much of the target needs no change output
+    CTxOut txoutChange(0, GetScriptForDestination(CKeyID()));
+    CAmount nCostOfChange = 3 * ::minRelayTxFee.GetFee(txoutChange.GetSerializeSize(SER_DISK, 0) + 148u) - 1;
+    CAmount nInputCost = std::max(payTxFee, minTxFee).GetFee(COIN_SELECTION_INPUT_SIZE);
+
+    std::string strAlgorithm;
+    bool fFound = false;
+    if (fCoinSelectBnB) {
+        // Non-denominated coins first, as in the knapsack solver
+        for (unsigned int tryDenom = 0; tryDenom < 2 && !fFound; tryDenom++) {
+            vector<CSelectionCoin> vPool;
+            BOOST_FOREACH (const COutput& output, vCoins) {
+                if (!output.fSpendable)
+                    continue;
+                const CWalletTx* pcoin = output.tx;
+                if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+                    continue;
+                CAmount n = pcoin->vout[output.i].nValue;
+                if (tryDenom == 0 && IsDenominatedAmount(n))
+                    continue;
+                vPool.push_back(make_pair(n, make_pair(pcoin, (unsigned int)output.i)));
+            }
+            fFound = SelectCoinsBnB(vPool, nTargetValue, nCostOfChange, nInputCost, setCoinsRet, nValueRet);
+        }
+        strAlgorithm = "bnb";
+    }
+    if (!fFound) {
+        if (!SelectCoinsMinConf(nTargetValue, nConfMine, nConfTheirs, vCoins, setCoinsRet, nValueRet))
+            return false;
+        strAlgorithm = "knapsack";
+    }
+
+    LogPrint("selectcoins", "%s : %s selected %u of %u coins, %s for %s, waste %s, %.2fms\n", __func__, strAlgorithm,
+        setCoinsRet.size(), vCoins.size(), FormatMoney(nValueRet), FormatMoney(nTargetValue),
+        FormatMoney(GetSelectionWaste(setCoinsRet.size(), nValueRet, nTargetValue, nCostOfChange, nInputCost)),
+        0.001 * (GetTimeMicros() - nTimeStart));
+    return true;
 }
 
 struct CompareByPriority {
@@ -3078,6 +3532,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             CMintMeta meta = zfnsTracker->GetMetaFromPubcoin(hashPubcoin);
             meta.txid = txNew.GetHash();
             meta.nHeight = chainActive.Height() + 1;
+            MarkMintViewsDirty();
             if (!zfnsTracker->UpdateState(meta))
                 return error("%s: failed to update metadata in tracker", __func__);
         }
@@ -3370,6 +3825,13 @@ DBErrors CWallet::ZapWalletTx(std::vector<CWalletTx>& vWtx)
     return DB_LOAD_OK;
 }
 
+bool CWallet::SyncWalletDB()
+{
+    if (!fFileBacked)
+        return true;
+    return CDB::FlushPendingWrites(strWalletFile, true);
+}
+
 bool CWallet::SetAddressBook(const CTxDestination& address, const string& strName, const string& strPurpose)
 {
     bool fUpdated = false;
@@ -3431,7 +3893,8 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        // Queued with the new keys, so the pool is replaced in one batch
+        CWalletDB walletdb(strWalletFile, "r+", true);
         BOOST_FOREACH (int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
         setKeyPool.clear();
@@ -3439,10 +3902,18 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
+        bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY);
+
         int64_t nKeys = max(GetArg("-keypool", 1000), (int64_t)0);
+        KeyPairVector vKeys;
+        DeriveNewKeys(nKeys, fCompressed, vKeys);
         for (int i = 0; i < nKeys; i++) {
             int64_t nIndex = i + 1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
+            if (!AddNewKey(vKeys[i].first, vKeys[i].second))
+                throw runtime_error("NewKeyPool() : adding generated key failed");
+            walletdb.WritePool(nIndex, CKeyPool(vKeys[i].second));
             setKeyPool.insert(nIndex);
         }
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
@@ -3452,34 +3923,63 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
-    {
-        LOCK(cs_wallet);
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
 
-        if (IsLocked())
-            return false;
+    int64_t nStart = GetTimeMillis();
+    unsigned int nAdded = 0;
+    while (true) {
+        unsigned int nMissing;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                break;
+            nMissing = std::min((unsigned int)(nTargetSize + 1 - setKeyPool.size()), KEYPOOL_TOPUP_BATCH);
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        }
 
-        CWalletDB walletdb(strWalletFile);
+        // The EC math runs without cs_wallet, unless the caller holds it
+        KeyPairVector vKeys;
+        DeriveNewKeys(nMissing, fCompressed, vKeys);
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
-
-        while (setKeyPool.size() < (nTargetSize + 1)) {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
+        {
+            LOCK(cs_wallet);
+            // Locked again meanwhile, the keys can no longer be encrypted
+            if (IsLocked())
+                return false;
+            if (fCompressed)
+                SetMinVersion(FEATURE_COMPRPUBKEY);
+
+            CWalletDB walletdb(strWalletFile, "r+", true);
+            for (unsigned int i = 0; i < vKeys.size() && setKeyPool.size() < nTargetSize + 1; i++) {
+                int64_t nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!AddNewKey(vKeys[i].first, vKeys[i].second))
+                    throw runtime_error("TopUpKeyPool() : adding generated key failed");
+                if (!walletdb.WritePool(nEnd, CKeyPool(vKeys[i].second)))
+                    throw runtime_error("TopUpKeyPool() : writing generated key failed");
+                setKeyPool.insert(nEnd);
+                nAdded++;
+            }
+            double dProgress = 100.f * setKeyPool.size() / (nTargetSize + 1);
             std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
             uiInterface.InitMessage(strMsg);
         }
     }
+
+    if (nAdded > 0) {
+        // The refill reaches the database as one batch
+        if (fFileBacked && !CDB::FlushPendingWrites(strWalletFile))
+            return error("%s : failed to write the key pool", __func__);
+        LogPrintf("keypool added %u keys in %dms, size=%u\n", nAdded, GetTimeMillis() - nStart, setKeyPool.size());
+    }
     return true;
 }
 
@@ -3514,7 +4014,7 @@ void CWallet::KeepKey(int64_t nIndex)
 {
     // Remove from key pool
     if (fFileBacked) {
-        CWalletDB walletdb(strWalletFile);
+        CWalletDB walletdb(strWalletFile, "r+", true);
         walletdb.ErasePool(nIndex);
     }
     LogPrintf("keypool keep %d\n", nIndex);
@@ -3564,39 +4064,43 @@ std::map<CTxDestination, CAmount> CWallet::GetAddressBalances()
     map<CTxDestination, CAmount> balances;
 
     {
-        LOCK(cs_wallet);
-        BOOST_FOREACH (PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet) {
-            CWalletTx* pcoin = &walletEntry.second;
-
-            if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        LOCK2(cs_main, cs_wallet);
+        UpdateDirtyTransactions();
+
+        const CWalletTx* pcoin = NULL;
+        bool fTxCounted = false;
+        for (std::map<COutPoint, CWalletUnspent>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it) {
+            const COutPoint& outpoint = it->first;
+            if (!pcoin || pcoin->GetHash() != outpoint.hash) {
+                std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+                if (mi == mapWallet.end())
+                    continue;
+                pcoin = &mi->second;
+                fTxCounted = IsFinalTx(*pcoin) && pcoin->IsTrusted() &&
+                             !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) &&
+                             pcoin->GetDepthInMainChain() >= (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1);
+            }
+            if (!fTxCounted)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1))
+            CTxDestination addr;
+            if (!ExtractDestination(pcoin->vout[outpoint.n].scriptPubKey, addr))
                 continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
-                    continue;
-                if (!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
-                    continue;
-
-                CAmount n = IsSpent(walletEntry.first, i) ? 0 : pcoin->vout[i].nValue;
-
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-                balances[addr] += n;
-            }
+            balances[addr] += it->second.nValue;
         }
     }
 
     return balances;
 }
 
+const std::map<CTxDestination, AddressLedger>& CWallet::GetAddressLedgers() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    UpdateDirtyTransactions();
+    return mapAddressLedger;
+}
+
 set<set<CTxDestination> > CWallet::GetAddressGroupings()
 {
     AssertLockHeld(cs_wallet); // mapWallet
@@ -3751,6 +4255,8 @@ bool CWallet::UpdatedTransaction(const uint256& hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()) {
+            // A SwiftTX lock changes the depth of the transaction
+            MarkTxDirty(hashTx);
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -3762,17 +4268,28 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    map<uint256, CWalletTx>::iterator mi = mapWallet.find(output.hash);
+    if (mi != mapWallet.end())
+        mi->second.MarkDirty();
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    map<uint256, CWalletTx>::iterator mi = mapWallet.find(output.hash);
+    if (mi != mapWallet.end())
+        mi->second.MarkDirty();
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
+    BOOST_FOREACH (const COutPoint& outpoint, setLockedCoins) {
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(outpoint.hash);
+        if (mi != mapWallet.end())
+            mi->second.MarkDirty();
+    }
     setLockedCoins.clear();
 }
 
@@ -4670,6 +5187,7 @@ bool CWallet::MintToTxIn(CZerocoinMint zerocoinSelected, int nSecurityLevel, con
 
             CMintMeta meta = zfnsTracker->Get(hashSerial);
             meta.isUsed = true;
+            MarkMintViewsDirty();
             if (!zfnsTracker->UpdateState(meta))
                 LogPrintf("%s: failed to write zerocoinmint\n", __func__);
 
@@ -4717,7 +5235,12 @@ bool CWallet::CreateZerocoinSpendTransaction(CAmount nValue, int nSecurityLevel,
     const int nMaxSpends = Params().Zerocoin_MaxSpendsPerTransaction(); // Maximum possible spends for one zFNS transaction
     vector<CMintMeta> vMintsToFetch;
     if (vSelectedMints.empty()) {
-        setMints = zfnsTracker->ListMints(true, true, true); // need to find mints to spend
+        {
+            // need to find mints to spend
+            LOCK(cs_wallet);
+            for (const auto& item : GetMintViews().GetMints())
+                setMints.insert(item.second);
+        }
         if(setMints.empty()) {
             receipt.SetStatus(_("Failed to find Zerocoins in wallet.dat"), nStatus);
             return false;
@@ -4759,6 +5282,7 @@ bool CWallet::CreateZerocoinSpendTransaction(CAmount nValue, int nSecurityLevel,
             CMintMeta meta = zfnsTracker->Get(hashSerial);
             meta.isUsed = true;
             zfnsTracker->UpdateState(meta);
+            MarkMintViewsDirty();
 
             return false;
         }
@@ -4932,11 +5456,13 @@ string CWallet::ResetMintZerocoin()
     for (CMintMeta meta : vMintsToUpdate) {
         updates++;
         zfnsTracker->UpdateState(meta);
+        MarkMintViewsDirty();
     }
 
     // Delete any mints that were unable to be located on the blockchain
     for (CMintMeta mint : vMintsMissing) {
         deletions++;
+        MarkMintViewsDirty();
         if (!zfnsTracker->Archive(mint))
             LogPrintf("%s: failed to archive mint\n", __func__);
     }
@@ -4975,6 +5501,7 @@ string CWallet::ResetSpentZerocoin()
                 removed++;
                 meta.isUsed = false;
                 zfnsTracker->UpdateState(meta);
+                MarkMintViewsDirty();
                 walletdb.EraseZerocoinSpendSerialEntry(spend.GetSerial());
                 continue;
             }
@@ -5024,10 +5551,12 @@ void CWallet::ReconsiderZerocoins(std::list<CZerocoinMint>& listMintsRestored, s
         mint.SetHeight(nHeight);
         mint.SetUsed(IsSerialInBlockchain(mint.GetSerialNumber(), nHeight));
 
+        MarkMintViewsDirty();
         if (!zfnsTracker->UnArchive(hashPubcoin, false)) {
             LogPrintf("%s : failed to unarchive mint %s\n", __func__, mint.GetValue().GetHex());
         } else {
             zfnsTracker->UpdateZerocoinMint(mint);
+            MarkMintViewsDirty();
         }
         listMintsRestored.emplace_back(mint);
     }
@@ -5043,10 +5572,12 @@ void CWallet::ReconsiderZerocoins(std::list<CZerocoinMint>& listMintsRestored, s
         uint256 txidSpend;
         dMint.SetUsed(IsSerialInBlockchain(dMint.GetSerialHash(), nHeight, txidSpend));
 
+        MarkMintViewsDirty();
         if (!zfnsTracker->UnArchive(dMint.GetPubcoinHash(), true)) {
             LogPrintf("%s : failed to unarchive deterministic mint %s\n", __func__, dMint.GetPubcoinHash().GetHex());
         } else {
             zfnsTracker->Add(dMint, true);
+            MarkMintViewsDirty();
         }
         listDMintsRestored.emplace_back(dMint);
     }
@@ -5174,6 +5705,7 @@ string CWallet::MintZerocoin(CAmount nValue, CWalletTx& wtxNew, vector<CDetermin
         for (CDeterministicMint dMint : vDMints) {
             dMint.SetTxHash(wtxNew.GetHash());
             zfnsTracker->Add(dMint, true);
+            MarkMintViewsDirty();
         }
     }
 
@@ -5212,6 +5744,7 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
         for (CZerocoinMint mint : vMintsSelected) {
             uint256 hashPubcoin = GetPubCoinHash(mint.GetValue());
             zfnsTracker->SetPubcoinNotUsed(hashPubcoin);
+            MarkMintViewsDirty();
             pwalletMain->NotifyZerocoinChanged(pwalletMain, mint.GetValue().GetHex(), "New", CT_UPDATED);
         }
 
@@ -5241,6 +5774,7 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
     for (CZerocoinMint mint : vMintsSelected) {
         uint256 hashPubcoin = GetPubCoinHash(mint.GetValue());
         zfnsTracker->SetPubcoinUsed(hashPubcoin, txidSpend);
+        MarkMintViewsDirty();
 
         CMintMeta metaCheck = zfnsTracker->GetMetaFromPubcoin(hashPubcoin);
         if (!metaCheck.isUsed) {
@@ -5253,6 +5787,7 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
     for (auto& dMint : vNewMints) {
         dMint.SetTxHash(txidSpend);
         zfnsTracker->Add(dMint, true);
+        MarkMintViewsDirty();
     }
 
     receipt.SetStatus("Spend Successful", ZFNS_SPEND_OKAY);  // When we reach this point spending zFNS was successful
@@ -5307,6 +5842,7 @@ bool CWallet::UpdateMint(const CBigNum& bnValue, const int& nHeight, const uint2
         CMintMeta meta = zfnsTracker->GetMetaFromPubcoin(hashValue);
         meta.nHeight = nHeight;
         meta.txid = txid;
+        MarkMintViewsDirty();
         return zfnsTracker->UpdateState(meta);
     } else {
         //Check if this mint is one that is in our mintpool (a potential future mint from our deterministic generation)
@@ -5328,12 +5864,13 @@ bool CWallet::SetMintUnspent(const CBigNum& bnSerial)
 
     CMintMeta meta = zfnsTracker->Get(hashSerial);
     zfnsTracker->SetPubcoinNotUsed(meta.hashPubcoin);
+    MarkMintViewsDirty();
     return true;
 }
 
 bool CWallet::DatabaseMint(CDeterministicMint& dMint)
 {
-    CWalletDB walletdb(strWalletFile);
     zfnsTracker->Add(dMint, true);
+    MarkMintViewsDirty();
     return true;
 }
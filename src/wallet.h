@@ -11,11 +11,14 @@
 
 #include "amount.h"
 #include "base58.h"
+#include "blockfilter.h"
+#include "coinselection.h"
 #include "crypter.h"
 #include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "main.h"
+#include "mintviews.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "primitives/zerocoin.h"
@@ -28,6 +31,7 @@
 #include "zfnstracker.h"
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -46,6 +50,8 @@ extern bool bSpendZeroConfChange;
 extern bool bdisableSystemnotifications;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern bool fCheckWalletBalances;
+extern bool fCoinSelectBnB;
 
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -59,6 +65,18 @@ static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWa
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 //! -custombackupthreshold default
 static const int DEFAULT_CUSTOMBACKUPTHRESHOLD = 1;
+//! Maximum number of threads matching blocks during a rescan
+static const int MAX_RESCAN_THREADS = 8;
+//! Blocks read ahead of the rescan per matching thread
+static const int RESCAN_READAHEAD_PER_THREAD = 16;
+//! Most blocks committed to the wallet per cs_main/cs_wallet acquisition during a rescan
+static const int RESCAN_COMMIT_BATCH = 100;
+//! Maximum number of threads deriving key pool keys
+static const unsigned int MAX_KEYPOOL_THREADS = 8;
+//! Fewest keys worth handing to a key derivation thread of their own
+static const unsigned int KEYPOOL_KEYS_PER_THREAD = 50;
+//! Most keys added to the key pool per cs_wallet acquisition while topping it up
+static const unsigned int KEYPOOL_TOPUP_BATCH = 1000;
 
 // Zerocoin denomination which creates exactly one of each denominations:
 // 6666 = 1*5000 + 1*1000 + 1*500 + 1*100 + 1*50 + 1*10 + 1*5 + 1
@@ -69,6 +87,7 @@ class CCoinControl;
 class COutput;
 class CReserveKey;
 class CScript;
+class CWalletRescanReserver;
 class CWalletTx;
 
 /** (client) version numbers for particular wallet features */
@@ -159,6 +178,115 @@ public:
     StringMap destdata;
 };
 
+/** Wallet balances by kind, as returned by the CWallet::Get*Balance() family */
+struct CWalletBalances {
+    CAmount nTrusted;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nWatchOnlyTrusted;
+    CAmount nWatchOnlyUnconfirmed;
+    CAmount nWatchOnlyImmature;
+    CAmount nWatchOnlyLocked;
+    CAmount nLocked;
+    CAmount nUnlocked;
+    CAmount nAnonymizable;
+    CAmount nAnonymized;
+    CAmount nDenominatedConfirmed;
+    CAmount nDenominatedUnconfirmed;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nTrusted = nUnconfirmed = nImmature = 0;
+        nWatchOnlyTrusted = nWatchOnlyUnconfirmed = nWatchOnlyImmature = nWatchOnlyLocked = 0;
+        nLocked = nUnlocked = nAnonymizable = nAnonymized = 0;
+        nDenominatedConfirmed = nDenominatedUnconfirmed = 0;
+    }
+
+    bool IsNull() const
+    {
+        return *this == CWalletBalances();
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nTrusted += b.nTrusted;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nWatchOnlyTrusted += b.nWatchOnlyTrusted;
+        nWatchOnlyUnconfirmed += b.nWatchOnlyUnconfirmed;
+        nWatchOnlyImmature += b.nWatchOnlyImmature;
+        nWatchOnlyLocked += b.nWatchOnlyLocked;
+        nLocked += b.nLocked;
+        nUnlocked += b.nUnlocked;
+        nAnonymizable += b.nAnonymizable;
+        nAnonymized += b.nAnonymized;
+        nDenominatedConfirmed += b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed += b.nDenominatedUnconfirmed;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nWatchOnlyTrusted -= b.nWatchOnlyTrusted;
+        nWatchOnlyUnconfirmed -= b.nWatchOnlyUnconfirmed;
+        nWatchOnlyImmature -= b.nWatchOnlyImmature;
+        nWatchOnlyLocked -= b.nWatchOnlyLocked;
+        nLocked -= b.nLocked;
+        nUnlocked -= b.nUnlocked;
+        nAnonymizable -= b.nAnonymizable;
+        nAnonymized -= b.nAnonymized;
+        nDenominatedConfirmed -= b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed -= b.nDenominatedUnconfirmed;
+        return *this;
+    }
+
+    friend bool operator==(const CWalletBalances& a, const CWalletBalances& b)
+    {
+        return a.nTrusted == b.nTrusted && a.nUnconfirmed == b.nUnconfirmed && a.nImmature == b.nImmature &&
+               a.nWatchOnlyTrusted == b.nWatchOnlyTrusted && a.nWatchOnlyUnconfirmed == b.nWatchOnlyUnconfirmed &&
+               a.nWatchOnlyImmature == b.nWatchOnlyImmature && a.nWatchOnlyLocked == b.nWatchOnlyLocked &&
+               a.nLocked == b.nLocked && a.nUnlocked == b.nUnlocked && a.nAnonymizable == b.nAnonymizable &&
+               a.nAnonymized == b.nAnonymized && a.nDenominatedConfirmed == b.nDenominatedConfirmed &&
+               a.nDenominatedUnconfirmed == b.nDenominatedUnconfirmed;
+    }
+
+    friend bool operator!=(const CWalletBalances& a, const CWalletBalances& b)
+    {
+        return !(a == b);
+    }
+};
+
+/** An output of a wallet transaction that is ours and that no wallet transaction spends */
+struct CWalletUnspent {
+    CAmount nValue;
+    isminetype mine;
+    bool fLocked;
+
+    CWalletUnspent(CAmount nValueIn = 0, isminetype mineIn = ISMINE_NO, bool fLockedIn = false) : nValue(nValueIn), mine(mineIn), fLocked(fLockedIn) {}
+};
+
+/** What a wallet transaction pays to one address of the wallet: an entry of the address's ledger */
+struct CAddressLedgerEntry {
+    CAmount nAmount;
+    isminetype mine;
+    bool fCoinBase;
+    //! The outputs paying the address
+    std::vector<unsigned int> vOut;
+
+    CAddressLedgerEntry() : nAmount(0), mine(ISMINE_NO), fCoinBase(false) {}
+};
+
+//! The ledger of an address, by order position and hash of the transactions
+typedef std::map<std::pair<int64_t, uint256>, CAddressLedgerEntry> AddressLedger;
+
 /**
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -167,6 +295,8 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
     bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = true) const;
+    //! Select for one confirmation tier: an exact match without change if there is one, else the knapsack solver
+    bool SelectCoinsTier(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
     //it was public bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
 
     CWalletDB* pwalletdbEncryption;
@@ -192,6 +322,46 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    std::atomic<bool> fScanningWallet;
+    std::atomic<bool> fAbortRescan;
+
+    friend class CWalletRescanReserver;
+
+    /**
+     * Views over mapWallet kept up to date incrementally: the running balance
+     * totals, the sum of the part each wallet transaction adds to them, and
+     * the unspent outputs of the wallet. A transaction marked dirty gets its
+     * part and its outputs recomputed on the next query. Those of unsettled
+     * transactions (not confirmed, conflicted or immature) depend on the
+     * chain and the mempool and are recomputed when those change; so are the
+     * outputs they spend. The address ledgers list what each transaction
+     * pays to each address of the wallet, mapLedgerTx the addresses it pays
+     * and the order position it was listed at. All guarded by cs_wallet.
+     */
+    mutable CWalletBalances balances;
+    mutable std::map<uint256, CWalletBalances> mapBalanceParts;
+    mutable std::map<COutPoint, CWalletUnspent> mapUnspent;
+    mutable std::map<CTxDestination, AddressLedger> mapAddressLedger;
+    mutable std::map<uint256, std::pair<int64_t, std::vector<CTxDestination> > > mapLedgerTx;
+    mutable std::set<uint256> setDirtyTx;
+    mutable std::set<uint256> setUnsettledTx;
+    mutable bool fDirtyAllTx;
+    mutable const CBlockIndex* pindexViewTip;
+    mutable unsigned int nViewMempoolUpdated;
+    mutable int nViewZeromintPercentage;
+
+    /**
+     * The unspent mature zerocoin mints of the tracker, indexed. Rebuilt from
+     * one tracker listing, with the mints' chain status updated, on the
+     * first query after a new tip or a change to the mints. Guarded by
+     * cs_wallet.
+     */
+    mutable CMintMetaViews mintViews;
+    mutable bool fMintViewsDirty;
+
+    CWalletBalances GetTxBalances(const CWalletTx& wtx) const;
+    void UpdateDirtyTransactions() const;
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount);
@@ -301,6 +471,13 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        fDirtyAllTx = true;
+        pindexViewTip = NULL;
+        nViewMempoolUpdated = 0;
+        nViewZeromintPercentage = 0;
+        fMintViewsDirty = true;
         fWalletUnlockAnonymizeOnly = false;
         fBackupMints = false;
 
@@ -406,6 +583,8 @@ public:
     //  keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
+    //! Adds a newly generated key with fresh metadata, and saves it to disk
+    bool AddNewKey(const CKey& secret, const CPubKey& pubkey);
 
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey);
@@ -465,12 +644,30 @@ public:
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
+    //! Add a transaction read by LoadWallet, leaving the indexes to BuildTxIndexes
+    void LoadToWallet(const CWalletTx& wtxIn);
+    //! Index all loaded transactions by order and by the outputs they spend
+    void BuildTxIndexes();
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void UpdatedBlockTip(const CBlockIndex* pindex);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    //! Scan the chain from pindexStart; the caller must hold a rescan reservation
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, const CWalletRescanReserver& reserver, bool fUpdate = false);
+    //! Scripts the wallet's keys, scripts and transactions pay to, to probe block filters with
+    void GetFilterElements(CGolombCodedSet::ElementSet& setElements) const;
+    //! Ask a running rescan to stop; returns false if no rescan is running
+    bool AbortRescan();
+    bool IsScanning() const { return fScanningWallet; }
+    bool IsAbortingRescan() const { return fAbortRescan; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    //! Have the balance part and the unspent outputs of a transaction recomputed on the next query
+    void MarkTxDirty(const uint256& hash) const;
+    //! All balances at once; checked against a full recomputation with -checkwalletbalances
+    CWalletBalances GetBalances() const;
+    //! All balances recomputed from every wallet transaction, bypassing the running totals
+    CWalletBalances ComputeBalances() const;
     CAmount GetBalance() const;
     CAmount GetZerocoinBalance(bool fMatureOnly) const;
     CAmount GetUnconfirmedZerocoinBalance() const;
@@ -478,6 +675,10 @@ public:
     CAmount GetLockedCoins() const;
     CAmount GetUnlockedCoins() const;
     std::map<libzerocoin::CoinDenomination, CAmount> GetMyZerocoinDistribution() const;
+    //! The indexed views of the unspent mature mints, brought up to date. Needs cs_wallet.
+    const CMintMetaViews& GetMintViews() const;
+    //! Have the mint views rebuilt, after a change to the tracker's mints
+    void MarkMintViewsDirty() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
     CAmount GetAnonymizableBalance() const;
@@ -525,6 +726,8 @@ public:
 
     std::set<std::set<CTxDestination> > GetAddressGroupings();
     std::map<CTxDestination, CAmount> GetAddressBalances();
+    //! The ledgers of the wallet's addresses, brought up to date. Needs cs_main and cs_wallet.
+    const std::map<CTxDestination, AddressLedger>& GetAddressLedgers() const;
 
     std::set<CTxDestination> GetAccountAddresses(std::string strAccount) const;
 
@@ -608,6 +811,8 @@ public:
 
     DBErrors LoadWallet(bool& fFirstRunRet);
     DBErrors ZapWalletTx(std::vector<CWalletTx>& vWtx);
+    //! Commit the queued wallet records and force them to disk, before replies that promise they persist
+    bool SyncWalletDB();
 
     bool SetAddressBook(const CTxDestination& address, const std::string& strName, const std::string& purpose);
 
@@ -704,6 +909,42 @@ public:
 };
 
 
+/** Reserves the wallet for a rescan; only one rescan can hold the reservation at a time. */
+class CWalletRescanReserver
+{
+private:
+    CWallet* pwallet;
+    bool fReserved;
+
+public:
+    explicit CWalletRescanReserver(CWallet* pwalletIn) : pwallet(pwalletIn), fReserved(false) {}
+
+    ~CWalletRescanReserver()
+    {
+        if (fReserved)
+            pwallet->fScanningWallet = false;
+    }
+
+    //! Take the reservation; false if another rescan holds it
+    bool Reserve()
+    {
+        assert(!fReserved);
+        bool fExpected = false;
+        if (!pwallet->fScanningWallet.compare_exchange_strong(fExpected, true))
+            return false;
+        // an abort requested from here on applies to this rescan
+        pwallet->fAbortRescan = false;
+        fReserved = true;
+        return true;
+    }
+
+    bool IsReserved() const
+    {
+        return fReserved && pwallet->fScanningWallet;
+    }
+};
+
+
 typedef std::map<std::string, std::string> mapValue_t;
 
 
@@ -950,7 +1191,7 @@ public:
     }
 
     //! make sure balances are recalculated
-    void MarkDirty()
+    void MarkDirty() const
     {
         fCreditCached = false;
         fAvailableCreditCached = false;
@@ -964,6 +1205,8 @@ public:
         fImmatureWatchCreditCached = false;
         fDebitCached = false;
         fChangeCached = false;
+        if (pwallet)
+            pwallet->MarkTxDirty(GetHash());
     }
 
     void BindWallet(CWallet* pwalletIn)
@@ -155,6 +155,23 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
     return Read(std::string("bestblock"), locator);
 }
 
+bool CWalletDB::WriteRescanProgress(const CBlockLocator& locator)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("rescanprogress"), locator);
+}
+
+bool CWalletDB::ReadRescanProgress(CBlockLocator& locator)
+{
+    return Read(std::string("rescanprogress"), locator);
+}
+
+bool CWalletDB::EraseRescanProgress()
+{
+    nWalletDBUpdated++;
+    return Erase(std::string("rescanprogress"));
+}
+
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
     nWalletDBUpdated++;
@@ -419,6 +436,93 @@ public:
     }
 };
 
+/**
+ * Deserialize and check a "tx" record, the key stream positioned after the
+ * type. fUpgraded is set when the record was repaired and has to be written
+ * back. Needs no wallet, so the loading threads can run it.
+ */
+static bool DecodeWalletTx(CDataStream& ssKey, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    uint256 hash;
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    // false because there is no reason to go through the zerocoin checks for our own wallet
+    if (!(CheckTransaction(wtx, false, false, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
+        if (!ssValue.empty()) {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        } else {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+/** Deserialize a "key" or "wkey" record and check the private key against its public key */
+static bool DecodeWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CPubKey& vchPubKey, CKey& key, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid()) {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash = 0;
+
+    if (strType == "key") {
+        ssValue >> pkey;
+    } else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try {
+        ssValue >> hash;
+    } catch (...) {
+    }
+
+    bool fSkipCheck = false;
+
+    if (hash != 0) {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash) {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fSkipCheck = true;
+    }
+
+    if (!key.Load(pkey, vchPubKey, fSkipCheck)) {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
 bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CWalletScanState& wss, string& strType, string& strErr)
 {
     try {
@@ -435,30 +539,12 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             ssKey >> strAddress;
             ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
         } else if (strType == "tx") {
-            uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            // false because there is no reason to go through the zerocoin checks for our own wallet
-            if (!(CheckTransaction(wtx, false, false, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!DecodeWalletTx(ssKey, ssValue, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
-                if (!ssValue.empty()) {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                        wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                } else {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
+            if (fUpgraded)
+                wss.vWalletUpgrade.push_back(wtx.GetHash());
 
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
@@ -502,55 +588,11 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             pwallet->nTimeFirstKey = 1;
         } else if (strType == "key" || strType == "wkey") {
             CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid()) {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
             CKey key;
-            CPrivKey pkey;
-            uint256 hash = 0;
-
-            if (strType == "key") {
-                wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try {
-                ssValue >> hash;
-            } catch (...) {
-            }
-
-            bool fSkipCheck = false;
-
-            if (hash != 0) {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash) {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
-                }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck)) {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            if (!DecodeWalletKey(strType, ssKey, ssValue, vchPubKey, key, strErr))
                 return false;
-            }
+            if (strType == "key")
+                wss.nKeys++;
             if (!pwallet->LoadKey(key, vchPubKey)) {
                 strErr = "Error reading wallet database: LoadKey failed";
                 return false;
@@ -673,6 +715,63 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** A wallet record as read from the cursor, with what the loading threads decoded of it */
+struct CWalletLoadRecord {
+    CDataStream ssKey;
+    CDataStream ssValue;
+    string strType;
+    string strErr;
+    //! Set for the types decoded off the loading thread; the others go through ReadKeyValue
+    bool fDecoded;
+    bool fDecodedOK;
+    int64_t nDecodeMicros;
+
+    //! "tx"
+    CWalletTx wtx;
+    bool fUpgraded;
+    //! "key" and "wkey"
+    CPubKey vchPubKey;
+    CKey key;
+
+    CWalletLoadRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), fDecoded(false), fDecodedOK(false), nDecodeMicros(0), fUpgraded(false) {}
+};
+
+/** Record count and time spent on the records of one type during LoadWallet */
+struct CWalletLoadTime {
+    unsigned int nRecords;
+    int64_t nDecodeMicros;
+    int64_t nMergeMicros;
+
+    CWalletLoadTime() : nRecords(0), nDecodeMicros(0), nMergeMicros(0) {}
+};
+
+/**
+ * Decode every nStride-th record of a chunk from nFirst on. Only the
+ * expensive types, transactions and private keys, are decoded here; of the
+ * other records just the type is read, without consuming the key stream.
+ */
+static void DecodeWalletRecords(std::vector<CWalletLoadRecord>* pvRecords, unsigned int nFirst, unsigned int nStride)
+{
+    for (unsigned int i = nFirst; i < pvRecords->size(); i += nStride) {
+        CWalletLoadRecord& record = (*pvRecords)[i];
+        int64_t nStart = GetTimeMicros();
+        try {
+            CDataStream ssKey(record.ssKey);
+            ssKey >> record.strType;
+            if (record.strType == "tx") {
+                record.fDecoded = true;
+                record.fDecodedOK = DecodeWalletTx(ssKey, record.ssValue, record.wtx, record.fUpgraded, record.strErr);
+            } else if (record.strType == "key" || record.strType == "wkey") {
+                record.fDecoded = true;
+                record.fDecodedOK = DecodeWalletKey(record.strType, ssKey, record.ssValue, record.vchPubKey, record.key, record.strErr);
+            }
+        } catch (...) {
+            record.fDecodedOK = false;
+        }
+        record.nDecodeMicros = GetTimeMicros() - nStart;
+    }
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -680,6 +779,15 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
 
+    // The cursor is read on this thread, a chunk at a time. While the next
+    // chunk is read, threads decode the last one, which is then merged into
+    // the wallet here in cursor order.
+    std::map<string, CWalletLoadTime> mapLoadTime;
+    int64_t nLoadStart = GetTimeMicros();
+    int64_t nReadMicros = 0, nIndexMicros = 0;
+    unsigned int nRecords = 0;
+    unsigned int nThreads = std::max(1U, std::min(WALLETLOAD_CHUNK_SIZE / WALLETLOAD_RECORDS_PER_THREAD, std::min(MAX_WALLETLOAD_THREADS, (unsigned int)boost::thread::hardware_concurrency())));
+
     try {
         LOCK(pwallet->cs_wallet);
         int nMinVersion = 0;
@@ -696,43 +804,114 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        std::vector<CWalletLoadRecord> vDecoding, vReading;
+        bool fCursorEnd = false;
         while (true) {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0) {
+            int ret = 0;
+            boost::thread_group threadGroup;
+            try {
+                if (!vDecoding.empty()) {
+                    unsigned int nChunkThreads = std::max(1U, std::min(nThreads, (unsigned int)vDecoding.size() / WALLETLOAD_RECORDS_PER_THREAD));
+                    for (unsigned int i = 0; i < nChunkThreads; i++)
+                        threadGroup.create_thread(boost::bind(&DecodeWalletRecords, &vDecoding, i, nChunkThreads));
+                }
+
+                // Read next chunk
+                int64_t nStart = GetTimeMicros();
+                vReading.reserve(WALLETLOAD_CHUNK_SIZE);
+                while (!fCursorEnd && vReading.size() < WALLETLOAD_CHUNK_SIZE) {
+                    vReading.push_back(CWalletLoadRecord());
+                    CWalletLoadRecord& record = vReading.back();
+                    ret = ReadAtCursor(pcursor, record.ssKey, record.ssValue);
+                    if (ret != 0) {
+                        vReading.pop_back();
+                        fCursorEnd = true;
+                    }
+                }
+                nReadMicros += GetTimeMicros() - nStart;
+
+                threadGroup.join_all();
+            } catch (...) {
+                // Never leave decoders running against vDecoding
+                threadGroup.interrupt_all();
+                threadGroup.join_all();
+                throw;
+            }
+            if (ret != 0 && ret != DB_NOTFOUND) {
                 LogPrintf("Error reading next record from wallet database\n");
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr)) {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+            // Merge the decoded chunk
+            BOOST_FOREACH (CWalletLoadRecord& record, vDecoding) {
+                int64_t nStart = GetTimeMicros();
+                bool fOK;
+                if (!record.fDecoded) {
+                    fOK = ReadKeyValue(pwallet, record.ssKey, record.ssValue, wss, record.strType, record.strErr);
+                } else if (!record.fDecodedOK) {
+                    fOK = false;
+                } else if (record.strType == "tx") {
+                    if (record.fUpgraded)
+                        wss.vWalletUpgrade.push_back(record.wtx.GetHash());
+                    if (record.wtx.nOrderPos == -1)
+                        wss.fAnyUnordered = true;
+                    pwallet->LoadToWallet(record.wtx);
+                    fOK = true;
+                } else {
+                    if (record.strType == "key")
+                        wss.nKeys++;
+                    fOK = pwallet->LoadKey(record.key, record.vchPubKey);
+                    if (!fOK)
+                        record.strErr = "Error reading wallet database: LoadKey failed";
+                }
+
+                // Try to be tolerant of single corrupt records:
+                if (!fOK) {
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(record.strType))
+                        result = DB_CORRUPT;
+                    else {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (record.strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!record.strErr.empty())
+                    LogPrintf("%s\n", record.strErr);
+
+                CWalletLoadTime& loadTime = mapLoadTime[record.strType];
+                loadTime.nRecords++;
+                loadTime.nDecodeMicros += record.nDecodeMicros;
+                loadTime.nMergeMicros += GetTimeMicros() - nStart;
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
+            nRecords += vDecoding.size();
+
+            if (vReading.empty())
+                break;
+            vDecoding.swap(vReading);
+            vReading.clear();
         }
         pcursor->close();
+
+        // Build the transaction indexes in one pass now that all are loaded
+        int64_t nStart = GetTimeMicros();
+        pwallet->BuildTxIndexes();
+        nIndexMicros = GetTimeMicros() - nStart;
     } catch (boost::thread_interrupted) {
         throw;
     } catch (...) {
         result = DB_CORRUPT;
     }
 
+    for (std::map<string, CWalletLoadTime>::const_iterator it = mapLoadTime.begin(); it != mapLoadTime.end(); ++it)
+        LogPrintf("LoadWallet() %s: %u records, decode %.2fms, merge %.2fms\n", it->first, it->second.nRecords,
+            it->second.nDecodeMicros * 0.001, it->second.nMergeMicros * 0.001);
+    LogPrintf("LoadWallet() %u records in %.2fms: read %.2fms, decoded on %u threads, indexes %.2fms\n", nRecords,
+        (GetTimeMicros() - nLoadStart) * 0.001, nReadMicros * 0.001, nThreads, nIndexMicros * 0.001);
+
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;
 
@@ -865,7 +1044,12 @@ void ThreadFlushWalletDB(const string& strFile)
     unsigned int nLastFlushed = nWalletDBUpdated;
     int64_t nLastWalletUpdate = GetTime();
     while (true) {
-        MilliSleep(500);
+        MilliSleep(bitdb.nWriteBehindMillis > 0 ? std::min(bitdb.nWriteBehindMillis, (int64_t)500) : 500);
+
+        // Commit the queued records once the oldest has waited long enough
+        int64_t nPendingTime = bitdb.GetPendingWriteTime(strFile);
+        if (nPendingTime && GetTimeMillis() - nPendingTime >= bitdb.nWriteBehindMillis)
+            CDB::FlushPendingWrites(strFile);
 
         if (nLastSeen != nWalletDBUpdated) {
             nLastSeen = nWalletDBUpdated;
@@ -934,6 +1118,12 @@ bool BackupWallet(const CWallet& wallet, const filesystem::path& strDest, bool f
         }
     }
 
+    // The copy must hold the records still queued
+    if (!CDB::FlushPendingWrites(wallet.strWalletFile)) {
+        NotifyBacked(wallet, false, strprintf("Failed to commit the queued records of %s\n", wallet.strWalletFile));
+        return false;
+    }
+
     while (true) {
         {
             LOCK(bitdb.cs_db);
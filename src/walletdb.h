@@ -36,6 +36,13 @@ class CZerocoinSpend;
 class uint160;
 class uint256;
 
+//! Wallet records read from the database before they are handed to the decoding threads
+static const unsigned int WALLETLOAD_CHUNK_SIZE = 10000;
+//! Maximum number of threads decoding wallet records during load
+static const unsigned int MAX_WALLETLOAD_THREADS = 8;
+//! Fewest records of a chunk worth a decoding thread of their own
+static const unsigned int WALLETLOAD_RECORDS_PER_THREAD = 500;
+
 /** Error statuses for the wallet database */
 enum DBErrors {
     DB_LOAD_OK,
@@ -80,11 +87,14 @@ public:
     }
 };
 
-/** Access to the wallet database (wallet.dat) */
+/**
+ * Access to the wallet database (wallet.dat). Handles opened with
+ * fWriteBehind queue their writes, see CDB.
+ */
 class CWalletDB : public CDB
 {
 public:
-    CWalletDB(const std::string& strFilename, const char* pszMode = "r+") : CDB(strFilename, pszMode)
+    CWalletDB(const std::string& strFilename, const char* pszMode = "r+", bool fWriteBehind = false) : CDB(strFilename, pszMode, fWriteBehind)
     {
     }
 
@@ -112,6 +122,10 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    bool WriteRescanProgress(const CBlockLocator& locator);
+    bool ReadRescanProgress(CBlockLocator& locator);
+    bool EraseRescanProgress();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     // presstab